@@ -8,4 +8,15 @@ srcdir="$depdir/source"
 mkdir -p $srcdir
 export PKG_CONFIG_PATH=$PKG_CONFIG_PATH:$depdir/lib/pkgconfig
 
+if test "x$URING" = "xyes" ; then
+  export CPPFLAGS="$CPPFLAGS -I$depdir/include"
+  export LDFLAGS="$LDFLAGS -L$depdir/lib"
+  export LD_LIBRARY_PATH="$LD_LIBRARY_PATH:$depdir/lib"
+fi
+
 ./bootstrap && ./configure && make && make check
+
+# make sure the io_uring path was really built
+if test "x$URING" = "xyes" ; then
+  grep -q "define HAVE_LIBURING 1" src/config.h
+fi
@@ -17,3 +17,15 @@ tar -xzvf lwes-${LWES_VERSION}.tar.gz
 cd lwes-${LWES_VERSION} \
   && ./configure --disable-hardcore --prefix=$depdir \
   && make install
+
+# liburing
+if test "x$URING" = "xyes" ; then
+  LIBURING_VERSION=2.3
+
+  cd $srcdir
+  wget https://github.com/axboe/liburing/archive/refs/tags/liburing-${LIBURING_VERSION}.tar.gz
+  tar -xzvf liburing-${LIBURING_VERSION}.tar.gz
+  cd liburing-liburing-${LIBURING_VERSION} \
+    && ./configure --prefix=$depdir \
+    && make install
+fi
@@ -0,0 +1,130 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "m_buffer.h"
+#include "m_mem.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* smallest allocation, enough for a few lines */
+#define M_BUFFER_MIN 256
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+int
+m_buffer_reserve (struct m_buffer *buffer, size_t bytes)
+{
+  size_t size = buffer->size > 0 ? buffer->size : M_BUFFER_MIN;
+  char *data = NULL;
+
+  if (buffer->failed)
+    {
+      return -1;
+    }
+  if (buffer->size - buffer->length >= bytes)
+    {
+      return 0;
+    }
+
+  while (size - buffer->length < bytes)
+    {
+      if (size > ((size_t) -1) / 2)
+        {
+          buffer->failed = 1;
+          return -1;
+        }
+      size *= 2;
+    }
+  data = (char *) m_try_realloc (buffer->data, size);
+  if (data == NULL)
+    {
+      buffer->failed = 1;
+      return -1;
+    }
+  buffer->data = data;
+  buffer->size = size;
+
+  return 0;
+}
+
+void
+m_buffer_append (struct m_buffer *buffer, const void *bytes, size_t length)
+{
+  if (m_buffer_reserve (buffer, length) == 0)
+    {
+      memcpy (buffer->data + buffer->length, bytes, length);
+      buffer->length += length;
+    }
+}
+
+void
+m_buffer_printf (struct m_buffer *buffer, const char *format, ...)
+{
+  va_list args;
+
+  va_start (args, format);
+  m_buffer_vprintf (buffer, format, args);
+  va_end (args);
+}
+
+void
+m_buffer_vprintf (struct m_buffer *buffer, const char *format, va_list args)
+{
+  va_list copy;
+  int n;
+
+  /* try in the space there is, and again once there's room for it all */
+  if (m_buffer_reserve (buffer, 1) != 0)
+    {
+      return;
+    }
+  va_copy (copy, args);
+  n = vsnprintf (buffer->data + buffer->length,
+                 buffer->size - buffer->length, format, copy);
+  va_end (copy);
+  if (n < 0)
+    {
+      buffer->failed = 1;
+      return;
+    }
+  if ((size_t) n >= buffer->size - buffer->length)
+    {
+      if (m_buffer_reserve (buffer, (size_t) n + 1) != 0)
+        {
+          return;
+        }
+      va_copy (copy, args);
+      vsnprintf (buffer->data + buffer->length,
+                 buffer->size - buffer->length, format, copy);
+      va_end (copy);
+    }
+  buffer->length += (size_t) n;
+}
+
+void
+m_buffer_clear (struct m_buffer *buffer)
+{
+  buffer->length = 0;
+  buffer->failed = 0;
+}
+
+void
+m_buffer_free (struct m_buffer *buffer)
+{
+  m_free (buffer->data);
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->size = 0;
+  buffer->failed = 0;
+}
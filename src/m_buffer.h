@@ -0,0 +1,72 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_BUFFER_H__
+#define __M_BUFFER_H__
+
+/*! \file m_buffer.h
+ *  \brief a growable byte buffer for formatting output.  The memory is
+ *         kept when the buffer is cleared, so once it has grown to the
+ *         size of a flush, formatting later flushes doesn't allocate.  If
+ *         growing fails the buffer is marked failed and later appends are
+ *         ignored until it is cleared.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/*! \struct m_buffer
+ *  \brief  the bytes so far, a zeroed struct is an empty buffer
+ */
+struct m_buffer
+{
+  char *data;
+  size_t length;
+  size_t size;
+  int failed;
+};
+
+/*!\fn int m_buffer_reserve (struct m_buffer *buffer, size_t bytes)
+ * \brief makes room for bytes more, returns 0 or -1 if it can't.
+ */
+int m_buffer_reserve (struct m_buffer *buffer, size_t bytes);
+
+/*!\fn void m_buffer_append (struct m_buffer *buffer, const void *bytes,
+ *                           size_t length)
+ * \brief appends length bytes.
+ */
+void m_buffer_append (struct m_buffer *buffer, const void *bytes,
+                      size_t length);
+
+/*!\fn void m_buffer_printf (struct m_buffer *buffer, const char *format,
+ *                           ...)
+ * \brief appends printf style formatted text, without a terminating nul.
+ */
+void m_buffer_printf (struct m_buffer *buffer, const char *format, ...);
+
+/*!\fn void m_buffer_vprintf (struct m_buffer *buffer, const char *format,
+ *                            va_list args)
+ * \brief m_buffer_printf taking a va_list.
+ */
+void m_buffer_vprintf (struct m_buffer *buffer, const char *format,
+                       va_list args);
+
+/*!\fn void m_buffer_clear (struct m_buffer *buffer)
+ * \brief empties the buffer and clears a failure, keeping its memory.
+ */
+void m_buffer_clear (struct m_buffer *buffer);
+
+/*!\fn void m_buffer_free (struct m_buffer *buffer)
+ * \brief frees the buffer's memory, leaving it empty.
+ */
+void m_buffer_free (struct m_buffer *buffer);
+
+#endif
@@ -0,0 +1,462 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "m_format.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* longest flags, width and precision we'll copy from a conversion */
+#define M_FORMAT_PREFIX_MAX 24
+
+/* length modifiers */
+enum m_format_length {
+  M_LENGTH_NONE = 0,
+  M_LENGTH_HH,
+  M_LENGTH_H,
+  M_LENGTH_L,
+  M_LENGTH_LL,
+  M_LENGTH_Z,
+  M_LENGTH_J,
+  M_LENGTH_T,
+  M_LENGTH_BIG_L
+};
+
+/* a single conversion from a format */
+struct m_format_spec
+{
+  /* the '%' along with flags, width and precision */
+  const char *prefix;
+  size_t prefix_len;
+  enum m_format_length length;
+  char conversion;
+  MondemandFieldType type;
+};
+
+/* forward declaration of private functions */
+static int m_format_next (const char **cursor, struct m_format_spec *spec,
+                          char *literal, size_t *literal_len);
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+int
+m_format_capture (const char *format, va_list *args,
+                  struct mondemand_log_field values[], int max_values)
+{
+  const char *cursor = format;
+  struct m_format_spec spec;
+  int count = 0;
+  int ret;
+  long long value = 0;
+
+  while ((ret = m_format_next (&cursor, &spec, NULL, NULL)) > 0)
+    {
+      if (count >= max_values)
+        {
+          return -1;
+        }
+      values[count].key = NULL;
+      values[count].type = spec.type;
+
+      switch (spec.conversion)
+        {
+          case 'd':
+          case 'i':
+            switch (spec.length)
+              {
+                case M_LENGTH_HH: value = (signed char) va_arg (*args, int);
+                                  break;
+                case M_LENGTH_H:  value = (short) va_arg (*args, int);
+                                  break;
+                case M_LENGTH_L:  value = va_arg (*args, long);
+                                  break;
+                case M_LENGTH_LL: value = va_arg (*args, long long);
+                                  break;
+                case M_LENGTH_Z:  value = (long long) va_arg (*args, size_t);
+                                  break;
+                case M_LENGTH_J:  value = va_arg (*args, intmax_t);
+                                  break;
+                case M_LENGTH_T:  value = va_arg (*args, ptrdiff_t);
+                                  break;
+                default:          value = va_arg (*args, int);
+                                  break;
+              }
+            values[count].value.i = value;
+            break;
+
+          case 'u':
+          case 'o':
+          case 'x':
+          case 'X':
+            switch (spec.length)
+              {
+                case M_LENGTH_HH:
+                  value = (unsigned char) va_arg (*args, unsigned int);
+                  break;
+                case M_LENGTH_H:
+                  value = (unsigned short) va_arg (*args, unsigned int);
+                  break;
+                case M_LENGTH_L:
+                  value = (long long) va_arg (*args, unsigned long);
+                  break;
+                case M_LENGTH_LL:
+                  value = (long long) va_arg (*args, unsigned long long);
+                  break;
+                case M_LENGTH_Z:
+                  value = (long long) va_arg (*args, size_t);
+                  break;
+                case M_LENGTH_J:
+                  value = (long long) va_arg (*args, uintmax_t);
+                  break;
+                case M_LENGTH_T:
+                  value = (long long) va_arg (*args, ptrdiff_t);
+                  break;
+                default:
+                  value = va_arg (*args, unsigned int);
+                  break;
+              }
+            values[count].value.i = value;
+            break;
+
+          case 'c':
+            values[count].value.i = va_arg (*args, int);
+            break;
+
+          case 'p':
+            values[count].value.i =
+              (long long) (uintptr_t) va_arg (*args, void *);
+            break;
+
+          case 's':
+            values[count].value.s = va_arg (*args, const char *);
+            if (values[count].value.s == NULL)
+              {
+                values[count].value.s = "(null)";
+              }
+            break;
+
+          default:
+            if (spec.length == M_LENGTH_BIG_L)
+              {
+                values[count].value.d = (double) va_arg (*args, long double);
+              }
+            else
+              {
+                values[count].value.d = va_arg (*args, double);
+              }
+            break;
+        }
+      ++count;
+    }
+
+  return ret < 0 ? -1 : count;
+}
+
+int
+m_format_arg_types (const char *format, MondemandFieldType types[],
+                    int max_types)
+{
+  const char *cursor = format;
+  struct m_format_spec spec;
+  int count = 0;
+  int ret;
+
+  while ((ret = m_format_next (&cursor, &spec, NULL, NULL)) > 0)
+    {
+      if (count >= max_types)
+        {
+          return -1;
+        }
+      types[count++] = spec.type;
+    }
+
+  return ret < 0 ? -1 : count;
+}
+
+int
+m_format_render (const char *format,
+                 const struct mondemand_log_field values[], int value_count,
+                 char *buffer, size_t size)
+{
+  const char *cursor = format;
+  struct m_format_spec spec;
+  char conversion[M_FORMAT_PREFIX_MAX + 4];
+  size_t used = 0;
+  size_t literal_len = 0;
+  int count = 0;
+  int ret;
+  int len = 0;
+
+  if (size == 0)
+    {
+      return -1;
+    }
+  buffer[0] = '\0';
+
+  for (;;)
+    {
+      /* literal text before the next conversion goes straight out */
+      literal_len = size - 1 - used;
+      ret = m_format_next (&cursor, &spec, buffer + used, &literal_len);
+      used += literal_len;
+      buffer[used] = '\0';
+      if (ret <= 0)
+        {
+          break;
+        }
+      if (count >= value_count || values[count].type != spec.type)
+        {
+          return -1;
+        }
+
+      /* rebuild the conversion with a length matching how it was stored */
+      memcpy (conversion, spec.prefix, spec.prefix_len);
+      len = (int) spec.prefix_len;
+      switch (spec.conversion)
+        {
+          case 'd':
+          case 'i':
+          case 'u':
+          case 'o':
+          case 'x':
+          case 'X':
+            conversion[len++] = 'l';
+            conversion[len++] = 'l';
+            break;
+          default:
+            break;
+        }
+      conversion[len++] = spec.conversion;
+      conversion[len] = '\0';
+
+      switch (spec.conversion)
+        {
+          case 'd':
+          case 'i':
+            len = snprintf (buffer + used, size - used, conversion,
+                            values[count].value.i);
+            break;
+          case 'u':
+          case 'o':
+          case 'x':
+          case 'X':
+            len = snprintf (buffer + used, size - used, conversion,
+                            (unsigned long long) values[count].value.i);
+            break;
+          case 'c':
+            len = snprintf (buffer + used, size - used, conversion,
+                            (int) values[count].value.i);
+            break;
+          case 'p':
+            len = snprintf (buffer + used, size - used, conversion,
+                            (void *) (uintptr_t) values[count].value.i);
+            break;
+          case 's':
+            len = snprintf (buffer + used, size - used, conversion,
+                            values[count].value.s);
+            break;
+          default:
+            len = snprintf (buffer + used, size - used, conversion,
+                            values[count].value.d);
+            break;
+        }
+      if (len > 0)
+        {
+          used += (size_t) len < size - used ? (size_t) len : size - 1 - used;
+        }
+      ++count;
+    }
+
+  if (ret < 0 || count != value_count)
+    {
+      return -1;
+    }
+  return 0;
+}
+
+unsigned int
+m_format_id (const char *filename, int line, const char *format)
+{
+  /* 32-bit FNV-1a over filename, line and format */
+  unsigned int hash = 2166136261U;
+  const unsigned char *p;
+  int i;
+
+  for (p = (const unsigned char *) filename; *p != '\0'; ++p)
+    {
+      hash = (hash ^ *p) * 16777619U;
+    }
+  for (i = 0; i < 4; ++i)
+    {
+      hash = (hash ^ ((unsigned int) line >> (i * 8) & 0xff)) * 16777619U;
+    }
+  for (p = (const unsigned char *) format; *p != '\0'; ++p)
+    {
+      hash = (hash ^ *p) * 16777619U;
+    }
+
+  return hash;
+}
+
+/* ======================================================================== */
+/* Private API functions                                                    */
+/* ======================================================================== */
+
+/* finds the next conversion in a format, moving the cursor past it.  Literal
+ * text on the way is copied to literal (if not NULL), up to *literal_len
+ * bytes, and *literal_len is set to the number copied.  Returns 1 if a
+ * conversion was found, 0 at the end of the format, and -1 if a conversion
+ * is not supported.
+ */
+static int
+m_format_next (const char **cursor, struct m_format_spec *spec,
+               char *literal, size_t *literal_len)
+{
+  const char *p = *cursor;
+  size_t copied = 0;
+  size_t room = literal_len != NULL ? *literal_len : 0;
+
+  for (;;)
+    {
+      if (*p == '\0')
+        {
+          *cursor = p;
+          if (literal_len != NULL)
+            {
+              *literal_len = copied;
+            }
+          return 0;
+        }
+      if (*p == '%' && p[1] != '%')
+        {
+          break;
+        }
+      if (literal != NULL && copied < room)
+        {
+          literal[copied++] = *p;
+        }
+      /* "%%" is a literal '%' */
+      p += (*p == '%') ? 2 : 1;
+    }
+  if (literal_len != NULL)
+    {
+      *literal_len = copied;
+    }
+
+  spec->prefix = p++;
+  while (*p != '\0' && strchr ("-+ #0'", *p) != NULL)
+    {
+      ++p;
+    }
+  while (*p >= '0' && *p <= '9')
+    {
+      ++p;
+    }
+  if (*p == '.')
+    {
+      ++p;
+      while (*p >= '0' && *p <= '9')
+        {
+          ++p;
+        }
+    }
+  spec->prefix_len = (size_t) (p - spec->prefix);
+  if (spec->prefix_len > M_FORMAT_PREFIX_MAX)
+    {
+      return -1;
+    }
+
+  spec->length = M_LENGTH_NONE;
+  switch (*p)
+    {
+      case 'h':
+        spec->length = (p[1] == 'h') ? M_LENGTH_HH : M_LENGTH_H;
+        p += (p[1] == 'h') ? 2 : 1;
+        break;
+      case 'l':
+        spec->length = (p[1] == 'l') ? M_LENGTH_LL : M_LENGTH_L;
+        p += (p[1] == 'l') ? 2 : 1;
+        break;
+      case 'q':
+        spec->length = M_LENGTH_LL;
+        ++p;
+        break;
+      case 'z':
+        spec->length = M_LENGTH_Z;
+        ++p;
+        break;
+      case 'j':
+        spec->length = M_LENGTH_J;
+        ++p;
+        break;
+      case 't':
+        spec->length = M_LENGTH_T;
+        ++p;
+        break;
+      case 'L':
+        spec->length = M_LENGTH_BIG_L;
+        ++p;
+        break;
+      default:
+        break;
+    }
+
+  spec->conversion = *p;
+  switch (*p)
+    {
+      case 'd':
+      case 'i':
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+        if (spec->length == M_LENGTH_BIG_L)
+          {
+            return -1;
+          }
+        spec->type = MONDEMAND_FIELD_INT64;
+        break;
+      case 'c':
+      case 'p':
+      case 's':
+        if (spec->length != M_LENGTH_NONE)
+          {
+            return -1;
+          }
+        spec->type = (*p == 's') ? MONDEMAND_FIELD_STRING
+                                 : MONDEMAND_FIELD_INT64;
+        break;
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+        if (spec->length != M_LENGTH_NONE && spec->length != M_LENGTH_L
+            && spec->length != M_LENGTH_BIG_L)
+          {
+            return -1;
+          }
+        spec->type = MONDEMAND_FIELD_DOUBLE;
+        break;
+      default:
+        /* %n, '*' widths, positional arguments and anything else */
+        return -1;
+    }
+
+  *cursor = p + 1;
+  return 1;
+}
@@ -0,0 +1,77 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_FORMAT_H__
+#define __M_FORMAT_H__
+
+/*! \file m_format.h
+ *  \brief printf format handling for dictionary encoded log messages.
+ *         Arguments are captured from a va_list as typed values so a
+ *         message can be sent as a format id plus its arguments, and the
+ *         text rebuilt by whoever receives it.  Only the common subset of
+ *         printf is supported, formats using '*' widths, positional
+ *         arguments, %n or wide characters are not captured.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "mondemand_types.h"
+
+/* the most arguments captured from a single format */
+#define M_FORMAT_MAX_ARGS 16
+
+/*! \fn int m_format_capture (const char *format, va_list *args,
+ *                            struct mondemand_log_field values[],
+ *                            int max_values)
+ *  \brief  walks a printf format and stores each argument as a typed value
+ *          with a NULL key.  Integers (including characters and pointers)
+ *          are stored as MONDEMAND_FIELD_INT64, floating point as
+ *          MONDEMAND_FIELD_DOUBLE and %s as MONDEMAND_FIELD_STRING pointing
+ *          at the caller's string.  args is consumed.
+ *  \return the number of values, or -1 if the format can not be captured
+ */
+int m_format_capture (const char *format, va_list *args,
+                      struct mondemand_log_field values[],
+                      int max_values);
+
+/*! \fn int m_format_arg_types (const char *format,
+ *                              MondemandFieldType types[],
+ *                              int max_types)
+ *  \brief  the types m_format_capture would produce for a format, used by
+ *          decoders to know which attributes to look for.
+ *  \return the number of arguments, or -1 if the format is not supported
+ */
+int m_format_arg_types (const char *format,
+                        MondemandFieldType types[],
+                        int max_types);
+
+/*! \fn int m_format_render (const char *format,
+ *                           const struct mondemand_log_field values[],
+ *                           int value_count, char *buffer, size_t size)
+ *  \brief  rebuilds the text of a message from its format and captured
+ *          values.  The output is truncated to fit in size bytes and is
+ *          always NUL terminated.
+ *  \return 0 on success, -1 if the values don't match the format
+ */
+int m_format_render (const char *format,
+                     const struct mondemand_log_field values[],
+                     int value_count, char *buffer, size_t size);
+
+/*! \fn unsigned int m_format_id (const char *filename, int line,
+ *                                const char *format)
+ *  \brief  a stable 32-bit identifier for a call site and its format, the
+ *          same across runs so decoders can keep dictionaries.
+ */
+unsigned int m_format_id (const char *filename, int line,
+                          const char *format);
+
+#endif
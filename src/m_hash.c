@@ -292,12 +292,60 @@ m_hash_table_keys(struct m_hash_table *hash_table)
   return NULL;
 }
 
+void
+m_hash_table_foreach(struct m_hash_table *hash_table,
+                     m_hash_table_callback_t callback, void *data)
+{
+  int i=0;
+  struct m_hash_node *iterator = NULL;
+
+  if( hash_table != NULL )
+    {
+      for( i=0; i<hash_table->size; ++i )
+        {
+          for( iterator = hash_table->nodes[i]; iterator != NULL;
+               iterator = iterator->next )
+            {
+              callback(iterator->key, iterator->value, data);
+            }
+        }
+    }
+}
+
 int
 m_hash_table_num (struct m_hash_table *hash_table)
 {
   return hash_table->num;
 }
 
+int
+m_hash_table_longest_chain (struct m_hash_table *hash_table)
+{
+  int i=0;
+  int length=0;
+  int longest=0;
+  struct m_hash_node *iterator = NULL;
+
+  if( hash_table != NULL )
+    {
+      for( i=0; i<hash_table->size; ++i )
+        {
+          length = 0;
+          for( iterator = hash_table->nodes[i]; iterator != NULL;
+               iterator = iterator->next )
+            {
+              ++length;
+            }
+          if( length > longest )
+            {
+              longest = length;
+            }
+        }
+    }
+
+  return longest;
+}
+
 /* ======================================================================== */
 /* Private API functions                                                     */
 /* ======================================================================== */
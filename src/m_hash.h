@@ -86,10 +86,31 @@ void m_hash_table_remove_all(struct m_hash_table *hash_table);
 const char **
 m_hash_table_keys(struct m_hash_table *hash_table);
 
+/* called by m_hash_table_foreach for each entry */
+typedef void (*m_hash_table_callback_t)(const char *key, void *value,
+                                        void *data);
+
+/*!\fn void m_hash_table_foreach(struct m_hash_table *hash_table,
+ *                               m_hash_table_callback_t callback,
+ *                               void *data)
+ * \brief calls callback for each entry, without allocating.  The table
+ *        must not be changed until it returns.
+ */
+void
+m_hash_table_foreach(struct m_hash_table *hash_table,
+                     m_hash_table_callback_t callback, void *data);
+
 /*!\fn int m_hash_num (struct m_hash_table *hash_table)
  * \brief return the number of entries currently in the table
  */
 int
 m_hash_table_num (struct m_hash_table *hash_table);
 
+/*!\fn int m_hash_table_longest_chain (struct m_hash_table *hash_table)
+ * \brief the most entries sharing one bucket, a measure of how well keys
+ *        are spread.  Walks every bucket.
+ */
+int
+m_hash_table_longest_chain (struct m_hash_table *hash_table);
+
 #endif
@@ -0,0 +1,324 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "m_mem.h"
+#include "m_httpd.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+/* how long a client gets to send its request and read the response */
+#define M_HTTPD_TIMEOUT_SECONDS 5
+
+/* forward declaration of private functions */
+static void *m_httpd_thread (void *arg);
+static void m_httpd_serve (struct m_httpd *httpd, int fd);
+static void m_httpd_respond (int fd, int status, const char *content_type,
+                             const struct m_buffer *body, int head);
+static const char *m_httpd_reason (int status);
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+struct m_httpd *
+m_httpd_create (const char *address, m_httpd_handler_t handler, void *data)
+{
+  struct m_httpd *httpd = NULL;
+  struct addrinfo hints;
+  struct addrinfo *result = NULL;
+  const char *colon = NULL;
+  char host[256];
+  int on = 1;
+
+  if (address == NULL || handler == NULL)
+    {
+      return NULL;
+    }
+  colon = strrchr (address, ':');
+  if (colon == NULL || colon == address || colon[1] == '\0'
+      || (size_t) (colon - address) >= sizeof (host))
+    {
+      return NULL;
+    }
+  memcpy (host, address, (size_t) (colon - address));
+  host[colon - address] = '\0';
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo (host, colon + 1, &hints, &result) != 0)
+    {
+      return NULL;
+    }
+
+  httpd = (struct m_httpd *) m_try_malloc0 (sizeof (struct m_httpd));
+  if (httpd == NULL)
+    {
+      freeaddrinfo (result);
+      return NULL;
+    }
+  httpd->handler = handler;
+  httpd->data = data;
+  httpd->wake[0] = httpd->wake[1] = -1;
+
+  httpd->fd = socket (result->ai_family, SOCK_STREAM, 0);
+  if (httpd->fd < 0
+      || setsockopt (httpd->fd, SOL_SOCKET, SO_REUSEADDR,
+                     &on, sizeof (on)) != 0
+      || bind (httpd->fd, result->ai_addr, result->ai_addrlen) != 0
+      || listen (httpd->fd, 16) != 0
+      || pipe (httpd->wake) != 0
+      || pthread_create (&httpd->thread, NULL, &m_httpd_thread, httpd) != 0)
+    {
+      freeaddrinfo (result);
+      if (httpd->fd >= 0)
+        {
+          close (httpd->fd);
+        }
+      if (httpd->wake[0] >= 0)
+        {
+          close (httpd->wake[0]);
+          close (httpd->wake[1]);
+        }
+      m_free (httpd);
+      return NULL;
+    }
+  freeaddrinfo (result);
+
+  return httpd;
+}
+
+int
+m_httpd_port (struct m_httpd *httpd)
+{
+  struct sockaddr_storage address;
+  socklen_t length = sizeof (address);
+
+  if (getsockname (httpd->fd, (struct sockaddr *) &address, &length) != 0)
+    {
+      return -1;
+    }
+  if (address.ss_family == AF_INET6)
+    {
+      return ntohs (((struct sockaddr_in6 *) &address)->sin6_port);
+    }
+  return ntohs (((struct sockaddr_in *) &address)->sin_port);
+}
+
+void
+m_httpd_destroy (struct m_httpd *httpd)
+{
+  char stop = 1;
+
+  if (httpd == NULL)
+    {
+      return;
+    }
+
+  while (write (httpd->wake[1], &stop, 1) < 0)
+    {
+    }
+  pthread_join (httpd->thread, NULL);
+  close (httpd->wake[0]);
+  close (httpd->wake[1]);
+  close (httpd->fd);
+  m_buffer_free (&httpd->body);
+  m_free (httpd);
+}
+
+/* ======================================================================== */
+/* Private API functions                                                    */
+/* ======================================================================== */
+
+/* accepts and serves connections until woken */
+static void *
+m_httpd_thread (void *arg)
+{
+  struct m_httpd *httpd = (struct m_httpd *) arg;
+  struct pollfd fds[2];
+  int fd;
+
+  fds[0].fd = httpd->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = httpd->wake[0];
+  fds[1].events = POLLIN;
+
+  for (;;)
+    {
+      if (poll (fds, 2, -1) < 0)
+        {
+          continue;
+        }
+      if (fds[1].revents != 0)
+        {
+          break;
+        }
+      if ((fds[0].revents & POLLIN) == 0)
+        {
+          continue;
+        }
+      fd = accept (httpd->fd, NULL, NULL);
+      if (fd >= 0)
+        {
+          m_httpd_serve (httpd, fd);
+          close (fd);
+        }
+    }
+
+  return NULL;
+}
+
+/* reads a request and answers it */
+static void
+m_httpd_serve (struct m_httpd *httpd, int fd)
+{
+  struct timeval timeout;
+  const char *content_type = "text/plain; charset=utf-8";
+  char *target = NULL;
+  char *end = NULL;
+  size_t used = 0;
+  ssize_t n;
+  int head = 0;
+  int status;
+
+  timeout.tv_sec = M_HTTPD_TIMEOUT_SECONDS;
+  timeout.tv_usec = 0;
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+  /* only the head matters, a body is never expected */
+  httpd->request[0] = '\0';
+  while (strstr (httpd->request, "\r\n\r\n") == NULL)
+    {
+      if (used == M_HTTPD_REQUEST_MAX)
+        {
+          m_httpd_respond (fd, 431, content_type, NULL, 0);
+          return;
+        }
+      n = read (fd, httpd->request + used, M_HTTPD_REQUEST_MAX - used);
+      if (n <= 0)
+        {
+          return;
+        }
+      used += (size_t) n;
+      httpd->request[used] = '\0';
+    }
+
+  if (strncmp (httpd->request, "GET ", 4) == 0)
+    {
+      target = httpd->request + 4;
+    }
+  else if (strncmp (httpd->request, "HEAD ", 5) == 0)
+    {
+      target = httpd->request + 5;
+      head = 1;
+    }
+  else
+    {
+      m_httpd_respond (fd, 405, content_type, NULL, 0);
+      return;
+    }
+  end = target + strcspn (target, " ?\r\n");
+  *end = '\0';
+
+  m_buffer_clear (&httpd->body);
+  status = httpd->handler (target, &httpd->body, &content_type, httpd->data);
+  if (httpd->body.failed)
+    {
+      m_httpd_respond (fd, 500, content_type, NULL, head);
+      return;
+    }
+  m_httpd_respond (fd, status, content_type, &httpd->body, head);
+}
+
+/* writes the status line, headers and body in one go */
+static void
+m_httpd_respond (int fd, int status, const char *content_type,
+                 const struct m_buffer *body, int head)
+{
+  char header[256];
+  struct iovec iov[2];
+  struct msghdr message;
+  size_t length = body != NULL ? body->length : 0;
+  ssize_t n;
+  int count;
+
+  count = snprintf (header, sizeof (header),
+                    "HTTP/1.1 %d %s\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Length: %lu\r\n"
+                    "Connection: close\r\n\r\n",
+                    status, m_httpd_reason (status), content_type,
+                    (unsigned long) length);
+  if (count < 0 || (size_t) count >= sizeof (header))
+    {
+      return;
+    }
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = (size_t) count;
+  iov[1].iov_base = length > 0 ? body->data : NULL;
+  iov[1].iov_len = head ? 0 : length;
+  memset (&message, 0, sizeof (message));
+  message.msg_iov = iov;
+  message.msg_iovlen = 2;
+
+  /* a client which went away mustn't raise SIGPIPE */
+  while (iov[0].iov_len + iov[1].iov_len > 0)
+    {
+      n = sendmsg (fd, &message, MSG_NOSIGNAL);
+      if (n <= 0)
+        {
+          return;
+        }
+      if ((size_t) n >= iov[0].iov_len)
+        {
+          n -= (ssize_t) iov[0].iov_len;
+          iov[0].iov_len = 0;
+          iov[1].iov_base = (char *) iov[1].iov_base + n;
+          iov[1].iov_len -= (size_t) n;
+        }
+      else
+        {
+          iov[0].iov_base = (char *) iov[0].iov_base + n;
+          iov[0].iov_len -= (size_t) n;
+        }
+    }
+}
+
+static const char *
+m_httpd_reason (int status)
+{
+  switch (status)
+    {
+    case 200:
+      return "OK";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Internal Server Error";
+    }
+}
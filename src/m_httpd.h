@@ -0,0 +1,73 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_HTTPD_H__
+#define __M_HTTPD_H__
+
+/*! \file m_httpd.h
+ *  \brief a minimal HTTP/1.1 server on a background thread, enough to be
+ *         scraped.  Connections are served one at a time: the request head
+ *         is read, GET and HEAD are answered by a handler which fills in
+ *         the body, and the connection is closed.  The body buffer is kept
+ *         between requests so once it has grown, serving doesn't allocate.
+ */
+
+#include <pthread.h>
+
+#include "m_buffer.h"
+
+/* largest request head read, anything longer is refused */
+#define M_HTTPD_REQUEST_MAX 4096
+
+/* called on the server's thread for each GET or HEAD, with the path
+   without any query string.  Appends the response to body, may point
+   *content_type elsewhere and returns the HTTP status */
+typedef int (*m_httpd_handler_t)(const char *path, struct m_buffer *body,
+                                 const char **content_type, void *data);
+
+/*! \struct m_httpd
+ *  \brief  the listening socket and the thread serving it
+ */
+struct m_httpd
+{
+  int fd;
+  /* written to stop the thread */
+  int wake[2];
+  pthread_t thread;
+  m_httpd_handler_t handler;
+  void *data;
+  /* only touched by the thread */
+  struct m_buffer body;
+  char request[M_HTTPD_REQUEST_MAX + 1];
+};
+
+/*!\fn struct m_httpd *m_httpd_create (const char *address,
+ *                                     m_httpd_handler_t handler,
+ *                                     void *data)
+ * \brief listens on address, "<host>:<port>" where port may be 0 for any,
+ *        and starts serving.  Returns NULL if the address can't be parsed
+ *        or bound, or the thread can't be started.
+ */
+struct m_httpd *m_httpd_create (const char *address,
+                                m_httpd_handler_t handler, void *data);
+
+/*!\fn int m_httpd_port (struct m_httpd *httpd)
+ * \brief the port the server is listening on.
+ */
+int m_httpd_port (struct m_httpd *httpd);
+
+/*!\fn void m_httpd_destroy (struct m_httpd *httpd)
+ * \brief stops the thread, after the request being served if there is
+ *        one, and closes the socket.
+ */
+void m_httpd_destroy (struct m_httpd *httpd);
+
+#endif
@@ -0,0 +1,274 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "m_lwes.h"
+
+#include <string.h>
+
+/* forward declaration of private functions */
+static int m_lwes_reserve (struct m_lwes_writer *writer, size_t bytes);
+static void m_lwes_put_be (struct m_lwes_writer *writer,
+                           unsigned long long value, int bytes);
+static void m_lwes_value (struct m_lwes_writer *writer, int type,
+                          unsigned long long value, int bytes);
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+void
+m_lwes_begin (struct m_lwes_writer *writer,
+              unsigned char *buffer, size_t size, const char *name)
+{
+  size_t length = strlen (name);
+
+  m_lwes_begin_attributes (writer, buffer, size);
+  writer->overflow = (length > 0xff);
+
+  if (m_lwes_reserve (writer, 1 + length + 2) == 0)
+    {
+      buffer[0] = (unsigned char) length;
+      memcpy (buffer + 1, name, length);
+      writer->count_offset = 1 + length;
+      writer->used = 1 + length + 2;
+    }
+}
+
+void
+m_lwes_begin_attributes (struct m_lwes_writer *writer,
+                         unsigned char *buffer, size_t size)
+{
+  writer->buffer = buffer;
+  writer->size = size;
+  writer->used = 0;
+  writer->count_offset = 0;
+  writer->count = 0;
+  writer->key_offset = 0;
+  writer->overflow = 0;
+}
+
+int
+m_lwes_end (struct m_lwes_writer *writer, size_t *length)
+{
+  if (writer->overflow || writer->count > 0xffff)
+    {
+      return -1;
+    }
+  if (writer->count_offset > 0)
+    {
+      writer->buffer[writer->count_offset] =
+        (unsigned char) (writer->count >> 8);
+      writer->buffer[writer->count_offset + 1] =
+        (unsigned char) writer->count;
+    }
+  *length = writer->used;
+
+  return 0;
+}
+
+void
+m_lwes_key (struct m_lwes_writer *writer, const char *prefix, int index)
+{
+  char digits[16];
+  size_t length = strlen (prefix);
+  int n = 0;
+
+  if (index >= 0)
+    {
+      /* digits come out backwards */
+      do
+        {
+          digits[n++] = (char) ('0' + index % 10);
+          index /= 10;
+        }
+      while (index > 0);
+    }
+  if (length + (size_t) n > 0xff)
+    {
+      writer->overflow = 1;
+    }
+  if (m_lwes_reserve (writer, 1 + length + (size_t) n) != 0)
+    {
+      return;
+    }
+
+  writer->key_offset = writer->used;
+  writer->buffer[writer->used++] = (unsigned char) (length + (size_t) n);
+  memcpy (writer->buffer + writer->used, prefix, length);
+  writer->used += length;
+  while (n > 0)
+    {
+      writer->buffer[writer->used++] = (unsigned char) digits[--n];
+    }
+}
+
+void
+m_lwes_key_suffix (struct m_lwes_writer *writer, const char *suffix)
+{
+  size_t length = strlen (suffix);
+  size_t key_length;
+
+  if (writer->overflow)
+    {
+      return;
+    }
+  key_length = writer->buffer[writer->key_offset] + length;
+  if (key_length > 0xff)
+    {
+      writer->overflow = 1;
+    }
+  if (m_lwes_reserve (writer, length) != 0)
+    {
+      return;
+    }
+  memcpy (writer->buffer + writer->used, suffix, length);
+  writer->used += length;
+  writer->buffer[writer->key_offset] = (unsigned char) key_length;
+}
+
+void
+m_lwes_string (struct m_lwes_writer *writer, const char *value)
+{
+  size_t length;
+
+  if (writer->overflow)
+    {
+      return;
+    }
+  if (value == NULL)
+    {
+      /* take the key back out */
+      writer->used = writer->key_offset;
+      return;
+    }
+  length = strlen (value);
+  if (length > 0xffff)
+    {
+      writer->overflow = 1;
+    }
+  if (m_lwes_reserve (writer, 1 + 2 + length) != 0)
+    {
+      return;
+    }
+  writer->buffer[writer->used++] = M_LWES_TYPE_STRING;
+  m_lwes_put_be (writer, length, 2);
+  memcpy (writer->buffer + writer->used, value, length);
+  writer->used += length;
+  ++writer->count;
+}
+
+void
+m_lwes_u_int_16 (struct m_lwes_writer *writer, unsigned int value)
+{
+  m_lwes_value (writer, M_LWES_TYPE_U_INT_16, value & 0xffff, 2);
+}
+
+void
+m_lwes_u_int_32 (struct m_lwes_writer *writer, unsigned long value)
+{
+  m_lwes_value (writer, M_LWES_TYPE_U_INT_32, value & 0xffffffffUL, 4);
+}
+
+void
+m_lwes_int_64 (struct m_lwes_writer *writer, long long value)
+{
+  m_lwes_value (writer, M_LWES_TYPE_INT_64, (unsigned long long) value, 8);
+}
+
+void
+m_lwes_u_int_64 (struct m_lwes_writer *writer, unsigned long long value)
+{
+  m_lwes_value (writer, M_LWES_TYPE_U_INT_64, value, 8);
+}
+
+void
+m_lwes_double (struct m_lwes_writer *writer, double value)
+{
+  unsigned long long bits = 0;
+
+  memcpy (&bits, &value, sizeof (bits));
+  m_lwes_value (writer, M_LWES_TYPE_DOUBLE, bits, 8);
+}
+
+void
+m_lwes_boolean (struct m_lwes_writer *writer, int value)
+{
+  m_lwes_value (writer, M_LWES_TYPE_BOOLEAN, value != 0, 1);
+}
+
+void
+m_lwes_append (struct m_lwes_writer *writer,
+               const unsigned char *attributes, size_t length, int count)
+{
+  if (m_lwes_reserve (writer, length) != 0)
+    {
+      return;
+    }
+  memcpy (writer->buffer + writer->used, attributes, length);
+  writer->used += length;
+  writer->count += (unsigned int) count;
+}
+
+void
+m_lwes_patch_u_int_16 (struct m_lwes_writer *writer, size_t offset,
+                       unsigned int value)
+{
+  if (offset + 2 <= writer->used)
+    {
+      writer->buffer[offset] = (unsigned char) (value >> 8);
+      writer->buffer[offset + 1] = (unsigned char) value;
+    }
+}
+
+/* ======================================================================== */
+/* Private API functions                                                    */
+/* ======================================================================== */
+
+/* checks there's room for bytes more, marking the writer overflowed if not */
+static int
+m_lwes_reserve (struct m_lwes_writer *writer, size_t bytes)
+{
+  if (writer->overflow || writer->size - writer->used < bytes)
+    {
+      writer->overflow = 1;
+      return -1;
+    }
+  return 0;
+}
+
+/* writes the low bytes of value, most significant first */
+static void
+m_lwes_put_be (struct m_lwes_writer *writer,
+               unsigned long long value, int bytes)
+{
+  int i;
+
+  for (i = bytes - 1; i >= 0; --i)
+    {
+      writer->buffer[writer->used + (size_t) i] = (unsigned char) value;
+      value >>= 8;
+    }
+  writer->used += (size_t) bytes;
+}
+
+/* finishes an attribute with a fixed size value */
+static void
+m_lwes_value (struct m_lwes_writer *writer, int type,
+              unsigned long long value, int bytes)
+{
+  if (m_lwes_reserve (writer, 1 + (size_t) bytes) != 0)
+    {
+      return;
+    }
+  writer->buffer[writer->used++] = (unsigned char) type;
+  m_lwes_put_be (writer, value, bytes);
+  ++writer->count;
+}
@@ -0,0 +1,154 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_LWES_H__
+#define __M_LWES_H__
+
+/*! \file m_lwes.h
+ *  \brief writes events in the LWES binary wire format straight into a
+ *         caller's buffer.  An event is its name as a length byte and
+ *         characters, a big-endian 16-bit attribute count, then each
+ *         attribute as a key (length byte and characters), a type byte and
+ *         the value in network byte order.  Nothing is allocated; keys are
+ *         written from a prefix and an optional decimal index so names like
+ *         k0, v0, k1, ... need no formatting.
+ *
+ *         Each attribute is a call to m_lwes_key (and optionally
+ *         m_lwes_key_suffix) followed by one of the value functions.  Once
+ *         anything doesn't fit the writer is marked overflowed, later calls
+ *         do nothing and m_lwes_end fails.
+ */
+
+#include <stddef.h>
+
+/* lwes type bytes, the same values as liblwes' LWES_TYPE */
+#define M_LWES_TYPE_U_INT_16 1
+#define M_LWES_TYPE_U_INT_32 3
+#define M_LWES_TYPE_STRING   5
+#define M_LWES_TYPE_INT_64   7
+#define M_LWES_TYPE_U_INT_64 8
+#define M_LWES_TYPE_BOOLEAN  9
+#define M_LWES_TYPE_DOUBLE   12
+
+/*! \struct m_lwes_writer
+ *  \brief  where the event being written is and how far it has got
+ */
+struct m_lwes_writer
+{
+  unsigned char *buffer;
+  size_t size;
+  size_t used;
+  /* where the attribute count is, it's filled in by m_lwes_end.  0 when
+     there's no event header */
+  size_t count_offset;
+  unsigned int count;
+  /* start of the attribute being written, its key length byte */
+  size_t key_offset;
+  int overflow;
+};
+
+/*!\fn void m_lwes_begin (struct m_lwes_writer *writer,
+ *                        unsigned char *buffer, size_t size,
+ *                        const char *name)
+ * \brief starts an event called name at the beginning of buffer.
+ */
+void m_lwes_begin (struct m_lwes_writer *writer,
+                   unsigned char *buffer, size_t size, const char *name);
+
+/*!\fn void m_lwes_begin_attributes (struct m_lwes_writer *writer,
+ *                                   unsigned char *buffer, size_t size)
+ * \brief starts a run of attributes without an event name or count, to be
+ *        copied into events later with m_lwes_append.
+ */
+void m_lwes_begin_attributes (struct m_lwes_writer *writer,
+                              unsigned char *buffer, size_t size);
+
+/*!\fn int m_lwes_end (struct m_lwes_writer *writer, size_t *length)
+ * \brief finishes the event, writing its attribute count.  For a run of
+ *        attributes the count is left in writer->count.
+ * \return 0 and sets *length to the event's size, or -1 if it didn't fit
+ */
+int m_lwes_end (struct m_lwes_writer *writer, size_t *length);
+
+/*!\fn void m_lwes_key (struct m_lwes_writer *writer, const char *prefix,
+ *                      int index)
+ * \brief starts an attribute whose key is prefix followed by index in
+ *        decimal, or just prefix if index is negative.
+ */
+void m_lwes_key (struct m_lwes_writer *writer, const char *prefix, int index);
+
+/*!\fn void m_lwes_key_suffix (struct m_lwes_writer *writer,
+ *                             const char *suffix)
+ * \brief appends to the key of the attribute being started.  Keys are
+ *        limited to 255 bytes.
+ */
+void m_lwes_key_suffix (struct m_lwes_writer *writer, const char *suffix);
+
+/*!\fn void m_lwes_string (struct m_lwes_writer *writer, const char *value)
+ * \brief finishes an attribute with a string value of up to 65535 bytes.
+ *        A NULL value drops the attribute, as liblwes refuses to set it.
+ */
+void m_lwes_string (struct m_lwes_writer *writer, const char *value);
+
+/*!\fn void m_lwes_u_int_16 (struct m_lwes_writer *writer,
+ *                           unsigned int value)
+ * \brief finishes an attribute with an unsigned 16-bit value.
+ */
+void m_lwes_u_int_16 (struct m_lwes_writer *writer, unsigned int value);
+
+/*!\fn void m_lwes_u_int_32 (struct m_lwes_writer *writer,
+ *                           unsigned long value)
+ * \brief finishes an attribute with an unsigned 32-bit value.
+ */
+void m_lwes_u_int_32 (struct m_lwes_writer *writer, unsigned long value);
+
+/*!\fn void m_lwes_int_64 (struct m_lwes_writer *writer, long long value)
+ * \brief finishes an attribute with a signed 64-bit value.
+ */
+void m_lwes_int_64 (struct m_lwes_writer *writer, long long value);
+
+/*!\fn void m_lwes_u_int_64 (struct m_lwes_writer *writer,
+ *                           unsigned long long value)
+ * \brief finishes an attribute with an unsigned 64-bit value.
+ */
+void m_lwes_u_int_64 (struct m_lwes_writer *writer,
+                      unsigned long long value);
+
+/*!\fn void m_lwes_double (struct m_lwes_writer *writer, double value)
+ * \brief finishes an attribute with an IEEE 754 double.
+ */
+void m_lwes_double (struct m_lwes_writer *writer, double value);
+
+/*!\fn void m_lwes_boolean (struct m_lwes_writer *writer, int value)
+ * \brief finishes an attribute with a boolean.
+ */
+void m_lwes_boolean (struct m_lwes_writer *writer, int value);
+
+/*!\fn void m_lwes_append (struct m_lwes_writer *writer,
+ *                         const unsigned char *attributes, size_t length,
+ *                         int count)
+ * \brief copies count attributes already in the wire format into the
+ *        event.
+ */
+void m_lwes_append (struct m_lwes_writer *writer,
+                    const unsigned char *attributes, size_t length,
+                    int count);
+
+/*!\fn void m_lwes_patch_u_int_16 (struct m_lwes_writer *writer,
+ *                                 size_t offset, unsigned int value)
+ * \brief overwrites the value of a 16-bit attribute already written, offset
+ *        being where its two value bytes are (writer->used - 2 right after
+ *        writing it).  Used for counts only known once the event is full.
+ */
+void m_lwes_patch_u_int_16 (struct m_lwes_writer *writer, size_t offset,
+                            unsigned int value);
+
+#endif
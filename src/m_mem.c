@@ -14,6 +14,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* allocations are counted while m_mem_counting is set */
+static int m_mem_counting = 0;
+static unsigned long long m_mem_allocated = 0;
+
 /* ======================================================================== */
 /* Public API functions                                                     */
 /* ======================================================================== */
@@ -21,6 +25,10 @@
 void *
 m_try_malloc(size_t size)
 {
+  if (__atomic_load_n (&m_mem_counting, __ATOMIC_RELAXED))
+    {
+      __atomic_fetch_add (&m_mem_allocated, 1, __ATOMIC_RELAXED);
+    }
   return malloc(size); 
 }
 
@@ -41,6 +49,10 @@ m_try_malloc0(size_t size)
 
 void *m_try_realloc(void *ptr, size_t size)
 {
+  if (__atomic_load_n (&m_mem_counting, __ATOMIC_RELAXED))
+    {
+      __atomic_fetch_add (&m_mem_allocated, 1, __ATOMIC_RELAXED);
+    }
   return realloc(ptr, size);
 }
 
@@ -54,3 +66,14 @@ m_free(void *ptr)
     }
 }
 
+void
+m_mem_count_allocations(int enable)
+{
+  __atomic_store_n (&m_mem_counting, enable != 0, __ATOMIC_RELAXED);
+}
+
+unsigned long long
+m_mem_allocations(void)
+{
+  return __atomic_load_n (&m_mem_allocated, __ATOMIC_RELAXED);
+}
@@ -48,5 +48,19 @@ void *m_try_realloc(void *ptr, size_t size);
  */
 void m_free(void *ptr);
 
+/*! \fn m_mem_count_allocations(int enable)
+ *  \brief Starts counting the allocations made through m_try_malloc,
+ *         m_try_malloc0 and m_try_realloc when enable is non-zero, and stops
+ *         when it is 0.  Meant for benchmarks, it costs a branch otherwise.
+ *  \param enable whether to count
+ */
+void m_mem_count_allocations(int enable);
+
+/*! \fn m_mem_allocations(void)
+ *  \brief The number of allocations counted so far.
+ *  \return the count
+ */
+unsigned long long m_mem_allocations(void);
+
 #endif
 
@@ -0,0 +1,203 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "m_protobuf.h"
+
+#include <string.h>
+
+/* forward declaration of private functions */
+static int m_protobuf_reserve (struct m_protobuf_writer *writer,
+                               size_t bytes);
+static void m_protobuf_put_varint (struct m_protobuf_writer *writer,
+                                   unsigned long long value);
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+void
+m_protobuf_begin (struct m_protobuf_writer *writer,
+                  unsigned char *buffer, size_t size)
+{
+  writer->buffer = buffer;
+  writer->size = size;
+  writer->used = 0;
+  writer->depth = 0;
+  writer->overflow = 0;
+}
+
+int
+m_protobuf_end (struct m_protobuf_writer *writer, size_t *length)
+{
+  if (writer->overflow || writer->depth != 0)
+    {
+      return -1;
+    }
+  *length = writer->used;
+
+  return 0;
+}
+
+void
+m_protobuf_varint (struct m_protobuf_writer *writer, unsigned char tag,
+                   unsigned long long value)
+{
+  if (m_protobuf_reserve (writer, 1 + m_protobuf_varint_size (value)) == 0)
+    {
+      writer->buffer[writer->used++] = tag;
+      m_protobuf_put_varint (writer, value);
+    }
+}
+
+void
+m_protobuf_fixed64 (struct m_protobuf_writer *writer, unsigned char tag,
+                    unsigned long long value)
+{
+  int i;
+
+  if (m_protobuf_reserve (writer, 1 + 8) == 0)
+    {
+      writer->buffer[writer->used++] = tag;
+      for (i = 0; i < 8; ++i)
+        {
+          writer->buffer[writer->used++] = (unsigned char) value;
+          value >>= 8;
+        }
+    }
+}
+
+void
+m_protobuf_bytes (struct m_protobuf_writer *writer, unsigned char tag,
+                  const void *bytes, size_t length)
+{
+  if (m_protobuf_reserve (writer, 1 + m_protobuf_varint_size (length)
+                                  + length) == 0)
+    {
+      writer->buffer[writer->used++] = tag;
+      m_protobuf_put_varint (writer, length);
+      memcpy (writer->buffer + writer->used, bytes, length);
+      writer->used += length;
+    }
+}
+
+void
+m_protobuf_string (struct m_protobuf_writer *writer, unsigned char tag,
+                   const char *value)
+{
+  if (value != NULL)
+    {
+      m_protobuf_bytes (writer, tag, value, strlen (value));
+    }
+}
+
+void
+m_protobuf_open (struct m_protobuf_writer *writer, unsigned char tag)
+{
+  if (writer->depth == M_PROTOBUF_DEPTH)
+    {
+      writer->overflow = 1;
+    }
+  if (m_protobuf_reserve (writer, 2) == 0)
+    {
+      writer->buffer[writer->used++] = tag;
+      writer->open[writer->depth++] = writer->used++;
+    }
+}
+
+void
+m_protobuf_close (struct m_protobuf_writer *writer)
+{
+  size_t start;
+  size_t length;
+  size_t extra;
+
+  if (writer->overflow || writer->depth == 0)
+    {
+      writer->overflow = 1;
+      return;
+    }
+  start = writer->open[--writer->depth];
+  length = writer->used - start - 1;
+  extra = m_protobuf_varint_size (length) - 1;
+  if (extra > 0)
+    {
+      /* the one byte left for the length isn't enough */
+      if (m_protobuf_reserve (writer, extra) != 0)
+        {
+          return;
+        }
+      memmove (writer->buffer + start + 1 + extra,
+               writer->buffer + start + 1, length);
+    }
+  writer->used = start;
+  m_protobuf_put_varint (writer, length);
+  writer->used += length;
+}
+
+void
+m_protobuf_mark (struct m_protobuf_writer *writer,
+                 struct m_protobuf_mark *mark)
+{
+  mark->used = writer->used;
+  mark->depth = writer->depth;
+}
+
+void
+m_protobuf_rewind (struct m_protobuf_writer *writer,
+                   const struct m_protobuf_mark *mark)
+{
+  writer->used = mark->used;
+  writer->depth = mark->depth;
+  writer->overflow = 0;
+}
+
+size_t
+m_protobuf_varint_size (unsigned long long value)
+{
+  size_t size = 1;
+
+  while (value >= 0x80)
+    {
+      value >>= 7;
+      ++size;
+    }
+  return size;
+}
+
+/* ======================================================================== */
+/* Private API functions                                                    */
+/* ======================================================================== */
+
+/* checks there's room for bytes more, marking the writer overflowed if not */
+static int
+m_protobuf_reserve (struct m_protobuf_writer *writer, size_t bytes)
+{
+  if (writer->overflow || writer->size - writer->used < bytes)
+    {
+      writer->overflow = 1;
+      return -1;
+    }
+  return 0;
+}
+
+/* writes value 7 bits at a time, least significant first, with the top bit
+   set on all but the last byte */
+static void
+m_protobuf_put_varint (struct m_protobuf_writer *writer,
+                       unsigned long long value)
+{
+  while (value >= 0x80)
+    {
+      writer->buffer[writer->used++] = (unsigned char) (value | 0x80);
+      value >>= 7;
+    }
+  writer->buffer[writer->used++] = (unsigned char) value;
+}
@@ -0,0 +1,148 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_PROTOBUF_H__
+#define __M_PROTOBUF_H__
+
+/*! \file m_protobuf.h
+ *  \brief writes protocol buffers in their wire format straight into a
+ *         caller's buffer, without a schema compiler or library.  Each
+ *         field is a tag, the field number shifted left 3 bits or'ed with
+ *         its wire type, followed by its value: varints for integers and
+ *         enums, 8 little-endian bytes for fixed64 and doubles, and a varint
+ *         length followed by the bytes for strings and embedded messages.
+ *
+ *         Tags of fields 1 to 15 are a single byte, so they're computed at
+ *         compile time with M_PROTOBUF_TAG.  An embedded message is started
+ *         with m_protobuf_open, which leaves a byte for its length, and
+ *         finished with m_protobuf_close, which fills it in and moves the
+ *         message along in the rare case the length needs more.  Like
+ *         m_lwes, once anything doesn't fit the writer is marked overflowed
+ *         and m_protobuf_end fails; m_protobuf_rewind takes it back to a
+ *         mark, so a message can be finished without what didn't fit.
+ */
+
+#include <stddef.h>
+
+/* wire types */
+#define M_PROTOBUF_VARINT  0
+#define M_PROTOBUF_FIXED64 1
+#define M_PROTOBUF_BYTES   2
+#define M_PROTOBUF_FIXED32 5
+
+/* the tag byte of a field numbered 1 to 15 */
+#define M_PROTOBUF_TAG(field, type) \
+  ((unsigned char) (((field) << 3) | (type)))
+
+/* most embedded messages open at once */
+#define M_PROTOBUF_DEPTH 8
+
+/*! \struct m_protobuf_writer
+ *  \brief  where the message being written is and which embedded messages
+ *          are open
+ */
+struct m_protobuf_writer
+{
+  unsigned char *buffer;
+  size_t size;
+  size_t used;
+  /* where the length byte of each open message is */
+  size_t open[M_PROTOBUF_DEPTH];
+  int depth;
+  int overflow;
+};
+
+/*! \struct m_protobuf_mark
+ *  \brief  a point m_protobuf_rewind can go back to
+ */
+struct m_protobuf_mark
+{
+  size_t used;
+  int depth;
+};
+
+/*!\fn void m_protobuf_begin (struct m_protobuf_writer *writer,
+ *                            unsigned char *buffer, size_t size)
+ * \brief starts a message at the beginning of buffer.
+ */
+void m_protobuf_begin (struct m_protobuf_writer *writer,
+                       unsigned char *buffer, size_t size);
+
+/*!\fn int m_protobuf_end (struct m_protobuf_writer *writer,
+ *                         size_t *length)
+ * \brief finishes the message.
+ * \return 0 and sets *length to its size, or -1 if it didn't fit or an
+ *         embedded message wasn't closed
+ */
+int m_protobuf_end (struct m_protobuf_writer *writer, size_t *length);
+
+/*!\fn void m_protobuf_varint (struct m_protobuf_writer *writer,
+ *                             unsigned char tag, unsigned long long value)
+ * \brief writes a varint field: uint32, uint64, bool, enums, and int32 or
+ *        int64 cast to unsigned.
+ */
+void m_protobuf_varint (struct m_protobuf_writer *writer, unsigned char tag,
+                        unsigned long long value);
+
+/*!\fn void m_protobuf_fixed64 (struct m_protobuf_writer *writer,
+ *                              unsigned char tag, unsigned long long value)
+ * \brief writes a fixed64 or sfixed64 field.
+ */
+void m_protobuf_fixed64 (struct m_protobuf_writer *writer, unsigned char tag,
+                         unsigned long long value);
+
+/*!\fn void m_protobuf_bytes (struct m_protobuf_writer *writer,
+ *                            unsigned char tag, const void *bytes,
+ *                            size_t length)
+ * \brief writes a bytes field.
+ */
+void m_protobuf_bytes (struct m_protobuf_writer *writer, unsigned char tag,
+                       const void *bytes, size_t length);
+
+/*!\fn void m_protobuf_string (struct m_protobuf_writer *writer,
+ *                             unsigned char tag, const char *value)
+ * \brief writes a string field, a NULL value is left out.
+ */
+void m_protobuf_string (struct m_protobuf_writer *writer, unsigned char tag,
+                        const char *value);
+
+/*!\fn void m_protobuf_open (struct m_protobuf_writer *writer,
+ *                           unsigned char tag)
+ * \brief starts an embedded message field, its fields follow until the
+ *        matching m_protobuf_close.
+ */
+void m_protobuf_open (struct m_protobuf_writer *writer, unsigned char tag);
+
+/*!\fn void m_protobuf_close (struct m_protobuf_writer *writer)
+ * \brief finishes the innermost open message.
+ */
+void m_protobuf_close (struct m_protobuf_writer *writer);
+
+/*!\fn void m_protobuf_mark (struct m_protobuf_writer *writer,
+ *                           struct m_protobuf_mark *mark)
+ * \brief remembers where the writer is.
+ */
+void m_protobuf_mark (struct m_protobuf_writer *writer,
+                      struct m_protobuf_mark *mark);
+
+/*!\fn void m_protobuf_rewind (struct m_protobuf_writer *writer,
+ *                             const struct m_protobuf_mark *mark)
+ * \brief drops everything written since mark, including an overflow.
+ */
+void m_protobuf_rewind (struct m_protobuf_writer *writer,
+                        const struct m_protobuf_mark *mark);
+
+/*!\fn size_t m_protobuf_varint_size (unsigned long long value)
+ * \brief the number of bytes value takes as a varint, 1 to 10.
+ */
+size_t m_protobuf_varint_size (unsigned long long value);
+
+#endif
@@ -0,0 +1,169 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "m_mem.h"
+#include "m_queue.h"
+
+/* This is Dmitry Vyukov's bounded MPMC queue.  Each cell has a sequence
+   number, a cell is free for the push at position p when its sequence is
+   p, and holds a value for the pop at position p when it is p + 1.  A pop
+   sets it to p + size, freeing it for the push one lap later. */
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+struct m_queue *
+m_queue_create (int size)
+{
+  struct m_queue *queue = NULL;
+  size_t capacity = 1;
+  size_t i;
+
+  if (size < 1)
+    {
+      return NULL;
+    }
+  while (capacity < (size_t) size)
+    {
+      capacity <<= 1;
+    }
+
+  queue = (struct m_queue *) m_try_malloc0 (sizeof (struct m_queue));
+  if (queue != NULL)
+    {
+      queue->cells = (struct m_queue_cell *)
+        m_try_malloc0 (sizeof (struct m_queue_cell) * capacity);
+      if (queue->cells == NULL)
+        {
+          m_free (queue);
+          return NULL;
+        }
+      for (i = 0; i < capacity; ++i)
+        {
+          queue->cells[i].sequence = i;
+        }
+      queue->mask = capacity - 1;
+    }
+
+  return queue;
+}
+
+void
+m_queue_destroy (struct m_queue *queue)
+{
+  if (queue != NULL)
+    {
+      m_free (queue->cells);
+      m_free (queue);
+    }
+}
+
+int
+m_queue_push (struct m_queue *queue, void *value)
+{
+  struct m_queue_cell *cell;
+  size_t position = __atomic_load_n (&queue->push_position, __ATOMIC_RELAXED);
+  size_t sequence;
+  long difference;
+
+  for (;;)
+    {
+      cell = &queue->cells[position & queue->mask];
+      sequence = __atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE);
+      difference = (long) sequence - (long) position;
+      if (difference == 0)
+        {
+          /* the cell is free, try to claim it */
+          if (__atomic_compare_exchange_n (&queue->push_position, &position,
+                                           position + 1, 1,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+            {
+              break;
+            }
+        }
+      else if (difference < 0)
+        {
+          /* the cell still holds a value from the last lap */
+          return -1;
+        }
+      else
+        {
+          /* another producer got here first */
+          position = __atomic_load_n (&queue->push_position,
+                                      __ATOMIC_RELAXED);
+        }
+    }
+
+  cell->value = value;
+  __atomic_store_n (&cell->sequence, position + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+void *
+m_queue_pop (struct m_queue *queue)
+{
+  struct m_queue_cell *cell;
+  size_t position = __atomic_load_n (&queue->pop_position, __ATOMIC_RELAXED);
+  size_t sequence;
+  long difference;
+  void *value;
+
+  for (;;)
+    {
+      cell = &queue->cells[position & queue->mask];
+      sequence = __atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE);
+      difference = (long) sequence - (long) (position + 1);
+      if (difference == 0)
+        {
+          if (__atomic_compare_exchange_n (&queue->pop_position, &position,
+                                           position + 1, 1,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+            {
+              break;
+            }
+        }
+      else if (difference < 0)
+        {
+          /* empty */
+          return NULL;
+        }
+      else
+        {
+          position = __atomic_load_n (&queue->pop_position,
+                                      __ATOMIC_RELAXED);
+        }
+    }
+
+  value = cell->value;
+  __atomic_store_n (&cell->sequence, position + queue->mask + 1,
+                    __ATOMIC_RELEASE);
+
+  return value;
+}
+
+int
+m_queue_capacity (struct m_queue *queue)
+{
+  return (int) (queue->mask + 1);
+}
+
+int
+m_queue_depth (struct m_queue *queue)
+{
+  size_t push = __atomic_load_n (&queue->push_position, __ATOMIC_RELAXED);
+  size_t pop = __atomic_load_n (&queue->pop_position, __ATOMIC_RELAXED);
+
+  return push > pop ? (int) (push - pop) : 0;
+}
@@ -0,0 +1,82 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_QUEUE_H__
+#define __M_QUEUE_H__
+
+/*! \file m_queue.h
+ *  \brief a bounded lock-free queue of pointers.  Any number of threads
+ *         may push and pop at the same time, each operation is a couple of
+ *         atomic instructions and never blocks; callers decide what to do
+ *         when the queue is full or empty.
+ */
+
+#include <stddef.h>
+
+/*! \struct m_queue_cell
+ *  \brief  a slot in the queue, the sequence says whether it is free
+ */
+struct m_queue_cell
+{
+  size_t sequence;
+  void *value;
+};
+
+/*! \struct m_queue
+ *  \brief  the queue, push and pop positions are kept on separate cache
+ *          lines so producers and the consumer don't contend
+ */
+struct m_queue
+{
+  struct m_queue_cell *cells;
+  size_t mask;
+  char pad0[64];
+  size_t push_position;
+  char pad1[64];
+  size_t pop_position;
+  char pad2[64];
+};
+
+/*!\fn struct m_queue *m_queue_create(int size)
+ * \brief creates a queue holding up to size values, rounded up to a power
+ *        of two.  Returns NULL if size is less than 1 or on allocation
+ *        failure.
+ */
+struct m_queue *m_queue_create (int size);
+
+/*!\fn void m_queue_destroy(struct m_queue *queue)
+ * \brief frees the queue, any values still in it are not freed.
+ */
+void m_queue_destroy (struct m_queue *queue);
+
+/*!\fn int m_queue_push(struct m_queue *queue, void *value)
+ * \brief adds value to the queue, returns 0 on success or -1 if it's full.
+ */
+int m_queue_push (struct m_queue *queue, void *value);
+
+/*!\fn void *m_queue_pop(struct m_queue *queue)
+ * \brief removes the oldest value from the queue, or returns NULL if it's
+ *        empty.
+ */
+void *m_queue_pop (struct m_queue *queue);
+
+/*!\fn int m_queue_capacity(struct m_queue *queue)
+ * \brief the number of values the queue can hold.
+ */
+int m_queue_capacity (struct m_queue *queue);
+
+/*!\fn int m_queue_depth(struct m_queue *queue)
+ * \brief an estimate of the number of values in the queue, exact when no
+ *        other thread is using it.
+ */
+int m_queue_depth (struct m_queue *queue);
+
+#endif
@@ -0,0 +1,340 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "config.h"
+
+#include "m_mem.h"
+#include "m_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/* each record starts with its length and its state, which a producer sets
+   last.  The reader zeroes what it releases, so space a producer claims
+   reads as not ready until it's written */
+#define M_RING_EMPTY   0
+#define M_RING_READY   1
+/* the rest of the ring is unused, the next record is at the start */
+#define M_RING_PADDING 2
+
+#define M_RING_PAD(n) (((n) + 7) & ~((size_t) 7))
+
+struct m_ring_record
+{
+  unsigned int length;
+  unsigned int state;
+};
+
+/* forward declaration of private functions */
+static struct m_ring_record *m_ring_record (struct m_ring *ring,
+                                           unsigned long long position);
+static void m_ring_wake (struct m_ring *ring);
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+struct m_ring *
+m_ring_open (const char *path, size_t capacity)
+{
+  struct m_ring *ring = NULL;
+  struct stat st;
+  size_t size = M_RING_MIN_CAPACITY;
+  void *map = MAP_FAILED;
+  int fd;
+
+  if (path == NULL)
+    {
+      return NULL;
+    }
+  if (capacity == 0)
+    {
+      capacity = M_RING_DEFAULT_CAPACITY;
+    }
+  while (size < capacity)
+    {
+      size <<= 1;
+    }
+
+  fd = open (path, O_RDWR | O_CREAT, 0660);
+  if (fd < 0)
+    {
+      return NULL;
+    }
+  /* whoever gets here first creates the ring, the others wait for it */
+  while (flock (fd, LOCK_EX) != 0)
+    {
+      if (errno != EINTR)
+        {
+          close (fd);
+          return NULL;
+        }
+    }
+  if (fstat (fd, &st) != 0)
+    {
+      goto FAIL;
+    }
+  if (st.st_size == 0)
+    {
+      if (ftruncate (fd, (off_t) (sizeof (struct m_ring_header) + size))
+          != 0)
+        {
+          goto FAIL;
+        }
+      map = mmap (NULL, sizeof (struct m_ring_header) + size,
+                  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED)
+        {
+          goto FAIL;
+        }
+      ((struct m_ring_header *) map)->capacity = size;
+      memcpy (((struct m_ring_header *) map)->magic, M_RING_MAGIC, 8);
+    }
+  else
+    {
+      if ((size_t) st.st_size < sizeof (struct m_ring_header))
+        {
+          goto FAIL;
+        }
+      map = mmap (NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED)
+        {
+          goto FAIL;
+        }
+      size = (size_t) ((struct m_ring_header *) map)->capacity;
+      if (memcmp (((struct m_ring_header *) map)->magic, M_RING_MAGIC, 8) != 0
+          || size < M_RING_MIN_CAPACITY || (size & (size - 1)) != 0
+          || sizeof (struct m_ring_header) + size != (size_t) st.st_size)
+        {
+          munmap (map, (size_t) st.st_size);
+          map = MAP_FAILED;
+          goto FAIL;
+        }
+    }
+
+  ring = (struct m_ring *) m_try_malloc0 (sizeof (struct m_ring));
+  if (ring == NULL)
+    {
+      munmap (map, sizeof (struct m_ring_header) + size);
+      goto FAIL;
+    }
+  flock (fd, LOCK_UN);
+  ring->fd = fd;
+  ring->header = (struct m_ring_header *) map;
+  ring->data = (unsigned char *) map + sizeof (struct m_ring_header);
+  ring->capacity = size;
+  ring->map_size = sizeof (struct m_ring_header) + size;
+
+  return ring;
+
+FAIL:
+  flock (fd, LOCK_UN);
+  close (fd);
+  return NULL;
+}
+
+void
+m_ring_close (struct m_ring *ring)
+{
+  if (ring != NULL)
+    {
+      munmap ((void *) ring->header, ring->map_size);
+      close (ring->fd);
+      m_free (ring);
+    }
+}
+
+int
+m_ring_push (struct m_ring *ring, const unsigned char *bytes, size_t length)
+{
+  struct m_ring_header *header = ring->header;
+  struct m_ring_record *record = NULL;
+  size_t size = sizeof (struct m_ring_record) + M_RING_PAD (length);
+  unsigned long long head;
+  unsigned long long tail;
+  size_t offset;
+  size_t total;
+
+  if (size > ring->capacity / 4)
+    {
+      return -2;
+    }
+
+  head = __atomic_load_n (&header->head, __ATOMIC_RELAXED);
+  for (;;)
+    {
+      tail = __atomic_load_n (&header->tail, __ATOMIC_ACQUIRE);
+      /* records don't wrap, one which would is put at the start */
+      offset = (size_t) (head & (ring->capacity - 1));
+      total = size;
+      if (offset + size > ring->capacity)
+        {
+          total += ring->capacity - offset;
+        }
+      if (head + total - tail > ring->capacity)
+        {
+          __atomic_add_fetch (&header->drops, 1, __ATOMIC_RELAXED);
+          return -1;
+        }
+      if (__atomic_compare_exchange_n (&header->head, &head, head + total,
+                                       1, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED))
+        {
+          break;
+        }
+    }
+
+  if (total != size)
+    {
+      record = m_ring_record (ring, head);
+      record->length = (unsigned int) (ring->capacity - offset);
+      __atomic_store_n (&record->state, M_RING_PADDING, __ATOMIC_RELEASE);
+      head += ring->capacity - offset;
+    }
+  record = m_ring_record (ring, head);
+  record->length = (unsigned int) length;
+  memcpy (record + 1, bytes, length);
+  __atomic_store_n (&record->state, M_RING_READY, __ATOMIC_RELEASE);
+
+  /* pairs with the fence in m_ring_wait, either the reader sees the record
+     or this sees it waiting */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&header->waiting, __ATOMIC_RELAXED))
+    {
+      m_ring_wake (ring);
+    }
+
+  return 0;
+}
+
+int
+m_ring_peek (struct m_ring *ring, const unsigned char **bytes,
+             size_t *length)
+{
+  struct m_ring_header *header = ring->header;
+  struct m_ring_record *record = NULL;
+  unsigned long long tail = __atomic_load_n (&header->tail, __ATOMIC_RELAXED);
+
+  for (;;)
+    {
+      ring->peeked = 0;
+      if (tail == __atomic_load_n (&header->head, __ATOMIC_ACQUIRE))
+        {
+          return 0;
+        }
+      record = m_ring_record (ring, tail);
+      switch (__atomic_load_n (&record->state, __ATOMIC_ACQUIRE))
+        {
+          case M_RING_READY:
+            *bytes = (const unsigned char *) (record + 1);
+            *length = record->length;
+            ring->peeked = sizeof (struct m_ring_record)
+                           + M_RING_PAD ((size_t) record->length);
+            return 1;
+
+          case M_RING_PADDING:
+            ring->peeked = record->length;
+            m_ring_release (ring);
+            tail = __atomic_load_n (&header->tail, __ATOMIC_RELAXED);
+            break;
+
+          default:
+            /* claimed but still being written */
+            return 0;
+        }
+    }
+}
+
+void
+m_ring_release (struct m_ring *ring)
+{
+  unsigned long long tail =
+    __atomic_load_n (&ring->header->tail, __ATOMIC_RELAXED);
+
+  if (ring->peeked > 0)
+    {
+      memset (m_ring_record (ring, tail), 0, ring->peeked);
+      __atomic_store_n (&ring->header->tail, tail + ring->peeked,
+                        __ATOMIC_RELEASE);
+      ring->peeked = 0;
+    }
+}
+
+int
+m_ring_wait (struct m_ring *ring, int timeout_ms)
+{
+  struct m_ring_header *header = ring->header;
+  const unsigned char *bytes = NULL;
+  struct timespec timeout;
+  unsigned int signal;
+  size_t length;
+
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (long) (timeout_ms % 1000) * 1000000L;
+
+  signal = __atomic_load_n (&header->signal, __ATOMIC_ACQUIRE);
+  __atomic_store_n (&header->waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (m_ring_peek (ring, &bytes, &length) == 0)
+    {
+#ifdef HAVE_LINUX_FUTEX_H
+      /* returns at once if a producer bumped signal since it was read */
+      syscall (SYS_futex, &header->signal, FUTEX_WAIT, signal, &timeout,
+               NULL, 0);
+#else
+      (void) signal;
+      nanosleep (&timeout, NULL);
+#endif
+    }
+  __atomic_store_n (&header->waiting, 0, __ATOMIC_RELAXED);
+
+  return m_ring_peek (ring, &bytes, &length);
+}
+
+long long
+m_ring_drops (struct m_ring *ring)
+{
+  return (long long) __atomic_load_n (&ring->header->drops,
+                                      __ATOMIC_RELAXED);
+}
+
+/* ======================================================================== */
+/* Private API functions                                                    */
+/* ======================================================================== */
+
+static struct m_ring_record *
+m_ring_record (struct m_ring *ring, unsigned long long position)
+{
+  return (struct m_ring_record *) (void *)
+    (ring->data + (size_t) (position & (ring->capacity - 1)));
+}
+
+/* wakes the reader sleeping in m_ring_wait */
+static void
+m_ring_wake (struct m_ring *ring)
+{
+  __atomic_add_fetch (&ring->header->signal, 1, __ATOMIC_RELEASE);
+#ifdef HAVE_LINUX_FUTEX_H
+  syscall (SYS_futex, &ring->header->signal, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
@@ -0,0 +1,122 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_RING_H__
+#define __M_RING_H__
+
+/*! \file m_ring.h
+ *  \brief a ring of variable length records in a shared memory file, so
+ *         processes on one host can hand each other bytes with a memcpy.
+ *         Any number of producers append, each claiming space with one
+ *         compare and swap; one reader at a time drains it.  Producers
+ *         never block, a record which doesn't fit is dropped and counted.
+ *
+ *         Everything the ring needs is in the file, so the reader may exit
+ *         and start again and carry on where it left off, records are only
+ *         gone once it releases them.  A reader waiting for records sleeps
+ *         on a futex in the file and producers wake it, costing them a
+ *         system call only when it's asleep.
+ */
+
+#include <stddef.h>
+
+#define M_RING_MAGIC "MDRING01"
+
+/* smallest and default sizes of the record area */
+#define M_RING_MIN_CAPACITY 4096
+#define M_RING_DEFAULT_CAPACITY (4 * 1024 * 1024)
+
+/*! \struct m_ring_header
+ *  \brief  the start of the file, positions only ever increase and are
+ *          taken modulo the capacity.  Each is on its own cache line
+ */
+struct m_ring_header
+{
+  char magic[8];
+  unsigned long long capacity;
+  char pad0[48];
+  /* space claimed by producers up to here */
+  unsigned long long head;
+  char pad1[56];
+  /* released by the reader up to here */
+  unsigned long long tail;
+  char pad2[56];
+  /* the futex a waiting reader sleeps on, and whether it is */
+  unsigned int signal;
+  unsigned int waiting;
+  /* records dropped because the ring was full */
+  unsigned long long drops;
+  char pad3[48];
+};
+
+/*! \struct m_ring
+ *  \brief  a process's mapping of a ring
+ */
+struct m_ring
+{
+  int fd;
+  struct m_ring_header *header;
+  unsigned char *data;
+  size_t capacity;
+  size_t map_size;
+  /* size of the record returned by m_ring_peek, 0 if there isn't one */
+  size_t peeked;
+};
+
+/*!\fn struct m_ring *m_ring_open (const char *path, size_t capacity)
+ * \brief maps the ring at path, creating it with room for capacity bytes
+ *        of records (rounded up to a power of two, 0 for the default) if
+ *        it doesn't exist yet.  An existing ring keeps its own capacity.
+ *        Returns NULL if it can't be created or isn't a ring.
+ */
+struct m_ring *m_ring_open (const char *path, size_t capacity);
+
+/*!\fn void m_ring_close (struct m_ring *ring)
+ * \brief unmaps the ring, leaving the file and the records in it.
+ */
+void m_ring_close (struct m_ring *ring);
+
+/*!\fn int m_ring_push (struct m_ring *ring, const unsigned char *bytes,
+ *                      size_t length)
+ * \brief appends a record, waking the reader if it's waiting.
+ * \return 0 on success, -1 if the ring is full or -2 if the record is
+ *         bigger than a quarter of the ring.
+ */
+int m_ring_push (struct m_ring *ring, const unsigned char *bytes,
+                 size_t length);
+
+/*!\fn int m_ring_peek (struct m_ring *ring, const unsigned char **bytes,
+ *                      size_t *length)
+ * \brief points bytes at the oldest record, which stays in the ring until
+ *        m_ring_release.  Only one process may read a ring at a time.
+ * \return 1 if there is a record, 0 if there isn't
+ */
+int m_ring_peek (struct m_ring *ring, const unsigned char **bytes,
+                 size_t *length);
+
+/*!\fn void m_ring_release (struct m_ring *ring)
+ * \brief removes the record returned by the last m_ring_peek.
+ */
+void m_ring_release (struct m_ring *ring);
+
+/*!\fn int m_ring_wait (struct m_ring *ring, int timeout_ms)
+ * \brief sleeps until a record is pushed or timeout_ms passes.
+ * \return 1 if there are records to read, 0 otherwise
+ */
+int m_ring_wait (struct m_ring *ring, int timeout_ms);
+
+/*!\fn long long m_ring_drops (struct m_ring *ring)
+ * \brief the number of records producers have dropped since the ring was
+ *        created.
+ */
+long long m_ring_drops (struct m_ring *ring);
+
+#endif
@@ -0,0 +1,281 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "config.h"
+
+#include "m_mem.h"
+#include "m_scheduler.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_SYS_EPOLL_H)
+#define M_HAVE_TIMERFD 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+#ifdef M_HAVE_TIMERFD
+/* forward declaration of private functions */
+static void *m_scheduler_thread (void *arg);
+static long long m_scheduler_now_ms (clockid_t clock);
+#endif
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+struct m_scheduler *
+m_scheduler_create (void)
+{
+#ifdef M_HAVE_TIMERFD
+  struct m_scheduler *scheduler = NULL;
+  struct epoll_event event;
+
+  scheduler = (struct m_scheduler *) m_try_malloc0 (sizeof (*scheduler));
+  if (scheduler == NULL)
+    {
+      return NULL;
+    }
+
+  scheduler->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  scheduler->stop_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  event.events = EPOLLIN;
+  event.data.u32 = M_SCHEDULER_MAX_TIMERS;
+  if (scheduler->epoll_fd < 0 || scheduler->stop_fd < 0
+      || epoll_ctl (scheduler->epoll_fd, EPOLL_CTL_ADD,
+                    scheduler->stop_fd, &event) != 0)
+    {
+      if (scheduler->epoll_fd >= 0)
+        {
+          close (scheduler->epoll_fd);
+        }
+      if (scheduler->stop_fd >= 0)
+        {
+          close (scheduler->stop_fd);
+        }
+      m_free (scheduler);
+      return NULL;
+    }
+
+  return scheduler;
+#else
+  return NULL;
+#endif
+}
+
+void
+m_scheduler_destroy (struct m_scheduler *scheduler)
+{
+#ifdef M_HAVE_TIMERFD
+  uint64_t one = 1;
+  int i;
+
+  if (scheduler != NULL)
+    {
+      if (scheduler->running)
+        {
+          while (write (scheduler->stop_fd, &one, sizeof (one)) < 0
+                 && errno == EINTR)
+            {
+            }
+          pthread_join (scheduler->thread, NULL);
+        }
+      for (i = 0; i < scheduler->num_timers; ++i)
+        {
+          close (scheduler->timers[i].fd);
+        }
+      close (scheduler->stop_fd);
+      close (scheduler->epoll_fd);
+      m_free (scheduler);
+    }
+#else
+  (void) scheduler;
+#endif
+}
+
+int
+m_scheduler_add (struct m_scheduler *scheduler,
+                 long long interval_ms, int align, long long offset_ms,
+                 m_scheduler_callback_t callback, void *data)
+{
+#ifdef M_HAVE_TIMERFD
+  struct m_scheduler_timer *timer = NULL;
+  struct itimerspec spec;
+  struct epoll_event event;
+  clockid_t clock = align ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+  long long first = 0;
+  int fd = -1;
+
+  if (scheduler == NULL || scheduler->running || callback == NULL
+      || interval_ms <= 0
+      || scheduler->num_timers >= M_SCHEDULER_MAX_TIMERS)
+    {
+      return -1;
+    }
+
+  fd = timerfd_create (clock, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd < 0)
+    {
+      return -1;
+    }
+
+  /* aligned timers are set to an absolute wall-clock time, the rest
+     relative to now */
+  first = align ? m_scheduler_first_deadline (m_scheduler_now_ms (clock),
+                                              interval_ms, 1, offset_ms)
+                : interval_ms;
+  spec.it_value.tv_sec = (time_t) (first / 1000);
+  spec.it_value.tv_nsec = (long) (first % 1000) * 1000000L;
+  spec.it_interval.tv_sec = (time_t) (interval_ms / 1000);
+  spec.it_interval.tv_nsec = (long) (interval_ms % 1000) * 1000000L;
+
+  event.events = EPOLLIN;
+  event.data.u32 = (uint32_t) scheduler->num_timers;
+  if (timerfd_settime (fd, align ? TFD_TIMER_ABSTIME : 0, &spec, NULL) != 0
+      || epoll_ctl (scheduler->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  timer = &scheduler->timers[scheduler->num_timers++];
+  timer->fd = fd;
+  timer->callback = callback;
+  timer->data = data;
+
+  return 0;
+#else
+  (void) scheduler;
+  (void) interval_ms;
+  (void) align;
+  (void) offset_ms;
+  (void) callback;
+  (void) data;
+  return -1;
+#endif
+}
+
+int
+m_scheduler_start (struct m_scheduler *scheduler)
+{
+#ifdef M_HAVE_TIMERFD
+  if (scheduler == NULL || scheduler->running)
+    {
+      return -1;
+    }
+  if (pthread_create (&scheduler->thread, NULL,
+                      m_scheduler_thread, scheduler) != 0)
+    {
+      return -1;
+    }
+  scheduler->running = 1;
+
+  return 0;
+#else
+  (void) scheduler;
+  return -1;
+#endif
+}
+
+long long
+m_scheduler_first_deadline (long long now_ms, long long interval_ms,
+                            int align, long long offset_ms)
+{
+  long long since = 0;
+
+  if (! align)
+    {
+      return now_ms + interval_ms;
+    }
+
+  /* the next boundary strictly after now */
+  since = (now_ms - offset_ms) % interval_ms;
+  if (since < 0)
+    {
+      since += interval_ms;
+    }
+  return now_ms - since + interval_ms;
+}
+
+long long
+m_scheduler_phase (const char *key, long long interval_ms)
+{
+  /* 64-bit FNV-1a */
+  unsigned long long hash = 14695981039346656037ULL;
+  const unsigned char *p = NULL;
+
+  if (key == NULL || interval_ms <= 0)
+    {
+      return 0;
+    }
+  for (p = (const unsigned char *) key; *p != '\0'; ++p)
+    {
+      hash = (hash ^ *p) * 1099511628211ULL;
+    }
+
+  return (long long) (hash % (unsigned long long) interval_ms);
+}
+
+/* ======================================================================== */
+/* Private API functions                                                    */
+/* ======================================================================== */
+
+#ifdef M_HAVE_TIMERFD
+/* waits for timers and calls their callbacks until the stop fd is written */
+static void *
+m_scheduler_thread (void *arg)
+{
+  struct m_scheduler *scheduler = (struct m_scheduler *) arg;
+  struct epoll_event events[M_SCHEDULER_MAX_TIMERS + 1];
+  struct m_scheduler_timer *timer = NULL;
+  uint64_t expirations = 0;
+  int count = 0;
+  int i;
+
+  for (;;)
+    {
+      count = epoll_wait (scheduler->epoll_fd, events,
+                          M_SCHEDULER_MAX_TIMERS + 1, -1);
+      for (i = 0; i < count; ++i)
+        {
+          if (events[i].data.u32 == M_SCHEDULER_MAX_TIMERS)
+            {
+              return NULL;
+            }
+        }
+      for (i = 0; i < count; ++i)
+        {
+          timer = &scheduler->timers[events[i].data.u32];
+          /* missed expirations are merged into a single call */
+          if (read (timer->fd, &expirations, sizeof (expirations))
+                == (ssize_t) sizeof (expirations))
+            {
+              timer->callback (timer->data);
+            }
+        }
+    }
+
+  return NULL;
+}
+
+static long long
+m_scheduler_now_ms (clockid_t clock)
+{
+  struct timespec now;
+
+  clock_gettime (clock, &now);
+  return (long long) now.tv_sec * 1000LL + now.tv_nsec / 1000000L;
+}
+#endif
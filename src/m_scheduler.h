@@ -0,0 +1,99 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_SCHEDULER_H__
+#define __M_SCHEDULER_H__
+
+/*! \file m_scheduler.h
+ *  \brief periodic timers run on a single background thread.  Each timer
+ *         is a timerfd and the thread waits on all of them with epoll, so
+ *         any number of intervals cost one thread and no polling.  Timers
+ *         may be aligned to wall-clock multiples of their interval, shifted
+ *         by a fixed offset so that many hosts don't fire together.
+ */
+
+#include <pthread.h>
+
+/* the most timers a scheduler can hold */
+#define M_SCHEDULER_MAX_TIMERS 8
+
+typedef void (*m_scheduler_callback_t) (void *data);
+
+/*! \struct m_scheduler_timer
+ *  \brief  a timer and what to call when it fires
+ */
+struct m_scheduler_timer
+{
+  int fd;
+  m_scheduler_callback_t callback;
+  void *data;
+};
+
+/*! \struct m_scheduler
+ *  \brief  the timers, the epoll instance waiting on them and the thread
+ */
+struct m_scheduler
+{
+  int epoll_fd;
+  /* an eventfd written to stop the thread */
+  int stop_fd;
+  int num_timers;
+  struct m_scheduler_timer timers[M_SCHEDULER_MAX_TIMERS];
+  pthread_t thread;
+  int running;
+};
+
+/*!\fn struct m_scheduler *m_scheduler_create(void)
+ * \brief creates a scheduler with no timers.  Returns NULL on failure or if
+ *        timerfd and epoll aren't available.
+ */
+struct m_scheduler *m_scheduler_create (void);
+
+/*!\fn void m_scheduler_destroy(struct m_scheduler *scheduler)
+ * \brief stops the thread, waiting for a running callback to return, and
+ *        frees the scheduler.
+ */
+void m_scheduler_destroy (struct m_scheduler *scheduler);
+
+/*!\fn int m_scheduler_add(struct m_scheduler *scheduler,
+ *                         long long interval_ms, int align,
+ *                         long long offset_ms,
+ *                         m_scheduler_callback_t callback, void *data)
+ * \brief adds a timer calling callback every interval_ms.  If align is
+ *        non-zero it fires when the wall-clock time in milliseconds minus
+ *        offset_ms is a multiple of interval_ms, otherwise interval_ms
+ *        after the call and offset_ms is ignored.  Timers can't be added
+ *        once started.  Returns 0 on success, -1 on failure.
+ */
+int m_scheduler_add (struct m_scheduler *scheduler,
+                     long long interval_ms, int align, long long offset_ms,
+                     m_scheduler_callback_t callback, void *data);
+
+/*!\fn int m_scheduler_start(struct m_scheduler *scheduler)
+ * \brief starts the thread, returns 0 on success or -1 on failure.
+ */
+int m_scheduler_start (struct m_scheduler *scheduler);
+
+/*!\fn long long m_scheduler_first_deadline(long long now_ms,
+ *                                          long long interval_ms,
+ *                                          int align, long long offset_ms)
+ * \brief when a timer added at now_ms first fires, see m_scheduler_add.
+ */
+long long m_scheduler_first_deadline (long long now_ms, long long interval_ms,
+                                      int align, long long offset_ms);
+
+/*!\fn long long m_scheduler_phase(const char *key, long long interval_ms)
+ * \brief a stable offset in [0, interval_ms) derived from key, for
+ *        spreading aligned timers across hosts.
+ */
+long long m_scheduler_phase (const char *key, long long interval_ms);
+
+#endif
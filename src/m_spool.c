@@ -0,0 +1,494 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "config.h"
+
+#include "m_mem.h"
+#include "m_spool.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* a segment header is the magic, a version, then where the records end */
+#define M_SPOOL_MAGIC "MDSPOOL1"
+#define M_SPOOL_VERSION 1
+#define M_SPOOL_END_OFFSET 16
+/* follows each record's length, so a bad offset is noticed */
+#define M_SPOOL_RECORD_MARKER 0x5244534dUL
+
+#define M_SPOOL_PAD(n) (((n) + 7) & ~((size_t) 7))
+
+/* forward declaration of private functions */
+static int m_spool_writer_start (struct m_spool_writer *writer);
+static void m_spool_writer_finish (struct m_spool_writer *writer);
+static int m_spool_path (char *path, size_t size, const char *base,
+                         unsigned int sequence);
+static int m_spool_sequence (const char *name, const char *prefix,
+                             unsigned int *sequence);
+static int m_spool_compare (const void *a, const void *b);
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+struct m_spool_writer *
+m_spool_writer_open (const char *base, size_t segment_size,
+                     long long rotate_seconds)
+{
+  struct m_spool_writer *writer = NULL;
+  char **paths = NULL;
+  const char *last = NULL;
+  int count = 0;
+
+  if (base == NULL || strlen (base) + 16 > M_SPOOL_PATH_MAX
+      || segment_size < M_SPOOL_HEADER_SIZE + M_SPOOL_RECORD_HEADER_SIZE
+      || rotate_seconds < 0)
+    {
+      return NULL;
+    }
+
+  writer = (struct m_spool_writer *) m_try_malloc0 (sizeof (*writer));
+  if (writer == NULL)
+    {
+      return NULL;
+    }
+  strcpy (writer->base, base);
+  writer->segment_size = segment_size;
+  writer->rotate_seconds = rotate_seconds;
+  writer->fd = -1;
+
+  /* carry on from the newest segment left by an earlier writer */
+  if (m_spool_segments (base, &paths, &count) == 0)
+    {
+      if (count > 0)
+        {
+          last = strrchr (paths[count - 1], '.');
+          writer->sequence = (unsigned int) strtoul (last + 1, NULL, 10);
+        }
+      m_spool_segments_free (paths, count);
+    }
+
+  if (m_spool_writer_rotate (writer) != 0)
+    {
+      m_free (writer);
+      return NULL;
+    }
+
+  return writer;
+}
+
+int
+m_spool_writer_append (struct m_spool_writer *writer,
+                       const unsigned char *bytes, size_t length,
+                       long long timestamp)
+{
+  unsigned char *record = NULL;
+  size_t size = M_SPOOL_RECORD_HEADER_SIZE + M_SPOOL_PAD (length);
+  unsigned int header[2];
+  unsigned long long end;
+
+  if (writer == NULL || (bytes == NULL && length > 0) || length > 0xffffffffUL
+      || size > writer->segment_size - M_SPOOL_HEADER_SIZE)
+    {
+      return -2;
+    }
+
+  if (writer->map == NULL
+      || writer->used + size > writer->segment_size
+      || (writer->rotate_seconds > 0 && writer->used > M_SPOOL_HEADER_SIZE
+          && timestamp - writer->started
+               >= writer->rotate_seconds * 1000000LL))
+    {
+      if (m_spool_writer_rotate (writer) != 0)
+        {
+          return -1;
+        }
+    }
+  if (writer->used == M_SPOOL_HEADER_SIZE)
+    {
+      writer->started = timestamp;
+    }
+
+  record = writer->map + writer->used;
+  header[0] = (unsigned int) length;
+  header[1] = (unsigned int) M_SPOOL_RECORD_MARKER;
+  memcpy (record, header, sizeof (header));
+  memcpy (record + 8, &timestamp, 8);
+  memcpy (record + M_SPOOL_RECORD_HEADER_SIZE, bytes, length);
+  writer->used += size;
+  writer->records++;
+
+  /* the record is only part of the segment once the end covers it */
+  end = writer->used;
+  memcpy (writer->map + M_SPOOL_END_OFFSET, &end, sizeof (end));
+
+  return 0;
+}
+
+int
+m_spool_writer_rotate (struct m_spool_writer *writer)
+{
+  m_spool_writer_finish (writer);
+  writer->sequence++;
+
+  return m_spool_writer_start (writer);
+}
+
+void
+m_spool_writer_close (struct m_spool_writer *writer)
+{
+  if (writer != NULL)
+    {
+      m_spool_writer_finish (writer);
+      m_free (writer);
+    }
+}
+
+int
+m_spool_segments (const char *base, char ***paths, int *count)
+{
+  char directory[M_SPOOL_PATH_MAX];
+  const char *prefix = NULL;
+  const char *slash = strrchr (base, '/');
+  DIR *dir = NULL;
+  struct dirent *entry = NULL;
+  unsigned int *sequences = NULL;
+  unsigned int *grown = NULL;
+  unsigned int sequence = 0;
+  int size = 0;
+  int n = 0;
+  int i;
+
+  *paths = NULL;
+  *count = 0;
+
+  if (slash == NULL)
+    {
+      strcpy (directory, ".");
+      prefix = base;
+    }
+  else if ((size_t) (slash - base) + 1 < sizeof (directory))
+    {
+      memcpy (directory, base, (size_t) (slash - base) + 1);
+      directory[slash - base + 1] = '\0';
+      prefix = slash + 1;
+    }
+  else
+    {
+      return -1;
+    }
+
+  dir = opendir (directory);
+  if (dir == NULL)
+    {
+      return -1;
+    }
+  while ((entry = readdir (dir)) != NULL)
+    {
+      if (m_spool_sequence (entry->d_name, prefix, &sequence) != 0)
+        {
+          continue;
+        }
+      if (n == size)
+        {
+          size = size > 0 ? size * 2 : 16;
+          grown = (unsigned int *)
+            m_try_realloc (sequences, sizeof (unsigned int) * (size_t) size);
+          if (grown == NULL)
+            {
+              m_free (sequences);
+              closedir (dir);
+              return -3;
+            }
+          sequences = grown;
+        }
+      sequences[n++] = sequence;
+    }
+  closedir (dir);
+
+  if (n == 0)
+    {
+      return 0;
+    }
+  qsort (sequences, (size_t) n, sizeof (unsigned int), &m_spool_compare);
+
+  *paths = (char **) m_try_malloc0 (sizeof (char *) * (size_t) n);
+  if (*paths == NULL)
+    {
+      m_free (sequences);
+      return -3;
+    }
+  for (i = 0; i < n; ++i)
+    {
+      (*paths)[i] = (char *) m_try_malloc (strlen (base) + 16);
+      if ((*paths)[i] == NULL)
+        {
+          m_spool_segments_free (*paths, i);
+          *paths = NULL;
+          m_free (sequences);
+          return -3;
+        }
+      m_spool_path ((*paths)[i], strlen (base) + 16, base, sequences[i]);
+    }
+  *count = n;
+  m_free (sequences);
+
+  return 0;
+}
+
+void
+m_spool_segments_free (char **paths, int count)
+{
+  int i;
+
+  if (paths != NULL)
+    {
+      for (i = 0; i < count; ++i)
+        {
+          m_free (paths[i]);
+        }
+      m_free (paths);
+    }
+}
+
+int
+m_spool_reader_open (struct m_spool_reader *reader, const char *path)
+{
+  struct stat st;
+  unsigned long long end = 0;
+  unsigned int version = 0;
+  void *map = NULL;
+
+  memset (reader, 0, sizeof (*reader));
+  reader->fd = open (path, O_RDONLY);
+  if (reader->fd < 0)
+    {
+      return -1;
+    }
+  if (fstat (reader->fd, &st) != 0 || st.st_size < M_SPOOL_HEADER_SIZE)
+    {
+      close (reader->fd);
+      return -1;
+    }
+  map = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED,
+              reader->fd, 0);
+  if (map == MAP_FAILED)
+    {
+      close (reader->fd);
+      return -1;
+    }
+  reader->map = (const unsigned char *) map;
+  reader->size = (size_t) st.st_size;
+  madvise (map, reader->size, MADV_SEQUENTIAL);
+
+  memcpy (&version, reader->map + 8, sizeof (version));
+  memcpy (&end, reader->map + M_SPOOL_END_OFFSET, sizeof (end));
+  if (memcmp (reader->map, M_SPOOL_MAGIC, 8) != 0
+      || version != M_SPOOL_VERSION
+      || end < M_SPOOL_HEADER_SIZE || end > reader->size)
+    {
+      m_spool_reader_close (reader);
+      return -1;
+    }
+  reader->end = (size_t) end;
+  reader->offset = M_SPOOL_HEADER_SIZE;
+
+  return 0;
+}
+
+int
+m_spool_reader_next (struct m_spool_reader *reader,
+                     const unsigned char **bytes, size_t *length,
+                     long long *timestamp)
+{
+  unsigned int header[2];
+  size_t size;
+
+  if (reader->offset == reader->end)
+    {
+      return 0;
+    }
+  if (reader->end - reader->offset < M_SPOOL_RECORD_HEADER_SIZE)
+    {
+      return -1;
+    }
+  memcpy (header, reader->map + reader->offset, sizeof (header));
+  size = M_SPOOL_RECORD_HEADER_SIZE + M_SPOOL_PAD ((size_t) header[0]);
+  if (header[1] != M_SPOOL_RECORD_MARKER
+      || size > reader->end - reader->offset)
+    {
+      return -1;
+    }
+
+  memcpy (timestamp, reader->map + reader->offset + 8, 8);
+  *bytes = reader->map + reader->offset + M_SPOOL_RECORD_HEADER_SIZE;
+  *length = (size_t) header[0];
+  reader->offset += size;
+
+  return 1;
+}
+
+void
+m_spool_reader_close (struct m_spool_reader *reader)
+{
+  if (reader->map != NULL)
+    {
+      munmap ((void *) reader->map, reader->size);
+      reader->map = NULL;
+    }
+  if (reader->fd >= 0)
+    {
+      close (reader->fd);
+      reader->fd = -1;
+    }
+}
+
+/* ======================================================================== */
+/* Private API functions                                                    */
+/* ======================================================================== */
+
+/* creates, sizes and maps the writer's next segment */
+static int
+m_spool_writer_start (struct m_spool_writer *writer)
+{
+  char path[M_SPOOL_PATH_MAX];
+  unsigned long long end = M_SPOOL_HEADER_SIZE;
+  unsigned int version = M_SPOOL_VERSION;
+  void *map = NULL;
+  int fd;
+
+  if (m_spool_path (path, sizeof (path), writer->base, writer->sequence) != 0)
+    {
+      return -1;
+    }
+  fd = open (path, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    {
+      return -1;
+    }
+
+  /* allocate the blocks now so running out of disk is seen here and not
+     as a SIGBUS on a later memcpy */
+#ifdef HAVE_POSIX_FALLOCATE
+  if (posix_fallocate (fd, 0, (off_t) writer->segment_size) != 0
+      && ftruncate (fd, (off_t) writer->segment_size) != 0)
+#else
+  if (ftruncate (fd, (off_t) writer->segment_size) != 0)
+#endif
+    {
+      close (fd);
+      unlink (path);
+      return -1;
+    }
+  map = mmap (NULL, writer->segment_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      close (fd);
+      unlink (path);
+      return -1;
+    }
+
+  writer->fd = fd;
+  writer->map = (unsigned char *) map;
+  memcpy (writer->map, M_SPOOL_MAGIC, 8);
+  memcpy (writer->map + 8, &version, sizeof (version));
+  memcpy (writer->map + M_SPOOL_END_OFFSET, &end, sizeof (end));
+  writer->used = M_SPOOL_HEADER_SIZE;
+  writer->started = 0;
+  writer->segments++;
+
+  return 0;
+}
+
+/* unmaps the current segment and truncates it to the records in it, a
+   segment nothing was written to is removed */
+static void
+m_spool_writer_finish (struct m_spool_writer *writer)
+{
+  char path[M_SPOOL_PATH_MAX];
+
+  if (writer->map == NULL)
+    {
+      return;
+    }
+  munmap (writer->map, writer->segment_size);
+  writer->map = NULL;
+  if (writer->used == M_SPOOL_HEADER_SIZE)
+    {
+      m_spool_path (path, sizeof (path), writer->base, writer->sequence);
+      unlink (path);
+    }
+  else if (ftruncate (writer->fd, (off_t) writer->used) != 0)
+    {
+      /* the header still says where the records end */
+    }
+  close (writer->fd);
+  writer->fd = -1;
+}
+
+/* the name of a segment, base and a zero padded sequence number so that
+   segments sort by name */
+static int
+m_spool_path (char *path, size_t size, const char *base,
+              unsigned int sequence)
+{
+  size_t length = strlen (base);
+
+  /* a dot, up to 10 digits and the terminator */
+  if (length + 12 > size)
+    {
+      return -1;
+    }
+  memcpy (path, base, length);
+  sprintf (path + length, ".%06u", sequence);
+
+  return 0;
+}
+
+/* returns 0 and the sequence number if name is a segment of prefix */
+static int
+m_spool_sequence (const char *name, const char *prefix,
+                  unsigned int *sequence)
+{
+  size_t length = strlen (prefix);
+  const char *digits = NULL;
+  char *end = NULL;
+
+  if (strncmp (name, prefix, length) != 0 || name[length] != '.')
+    {
+      return -1;
+    }
+  digits = name + length + 1;
+  if (*digits < '0' || *digits > '9')
+    {
+      return -1;
+    }
+  *sequence = (unsigned int) strtoul (digits, &end, 10);
+
+  return *end == '\0' ? 0 : -1;
+}
+
+static int
+m_spool_compare (const void *a, const void *b)
+{
+  unsigned int x = *(const unsigned int *) a;
+  unsigned int y = *(const unsigned int *) b;
+
+  return x < y ? -1 : x > y;
+}
@@ -0,0 +1,143 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_SPOOL_H__
+#define __M_SPOOL_H__
+
+/*! \file m_spool.h
+ *  \brief append-only spool files of length-prefixed records.  A spool is a
+ *         series of segment files named base.000001, base.000002, ...  Each
+ *         segment is preallocated to its full size and mapped, so appending
+ *         a record is a memcpy and no system call.  A segment starts with a
+ *         header saying how much of it holds records, written after each
+ *         record, and is truncated to that when it's closed.
+ *
+ *         Records are a 32-bit length, a 32-bit marker and a 64-bit
+ *         timestamp in microseconds, all in host byte order as spools are
+ *         read on the host which wrote them, then the bytes padded to 8.
+ */
+
+#include <stddef.h>
+
+/* the size of a segment header, and of a record header */
+#define M_SPOOL_HEADER_SIZE 64
+#define M_SPOOL_RECORD_HEADER_SIZE 16
+
+/* longest segment file name, base included */
+#define M_SPOOL_PATH_MAX 4096
+
+/*! \struct m_spool_writer
+ *  \brief  the segment being appended to and when to move to the next one
+ */
+struct m_spool_writer
+{
+  char base[M_SPOOL_PATH_MAX];
+  size_t segment_size;
+  /* seconds after which a segment is closed, 0 to only rotate when full */
+  long long rotate_seconds;
+  unsigned int sequence;
+  int fd;
+  unsigned char *map;
+  /* where the next record goes */
+  size_t used;
+  /* when the current segment was started, microseconds */
+  long long started;
+  /* records and segments written since the writer was opened */
+  long long records;
+  long long segments;
+};
+
+/*! \struct m_spool_reader
+ *  \brief  a mapped segment and how far through it reading has got
+ */
+struct m_spool_reader
+{
+  int fd;
+  const unsigned char *map;
+  size_t size;
+  /* where the records end, and where the next one starts */
+  size_t end;
+  size_t offset;
+};
+
+/*!\fn struct m_spool_writer *m_spool_writer_open (const char *base,
+ *                                                size_t segment_size,
+ *                                                long long rotate_seconds)
+ * \brief starts a new segment after any already written for base.  Returns
+ *        NULL if segment_size is too small to hold a header and a record,
+ *        the name is too long, or the segment can't be created and mapped.
+ */
+struct m_spool_writer *m_spool_writer_open (const char *base,
+                                            size_t segment_size,
+                                            long long rotate_seconds);
+
+/*!\fn int m_spool_writer_append (struct m_spool_writer *writer,
+ *                                const unsigned char *bytes, size_t length,
+ *                                long long timestamp)
+ * \brief appends a record stamped with timestamp in microseconds, starting
+ *        a new segment first if this one is full or old enough.
+ * \return 0 on success, -2 if the record can never fit in a segment or -1
+ *         if the next segment couldn't be created.
+ */
+int m_spool_writer_append (struct m_spool_writer *writer,
+                           const unsigned char *bytes, size_t length,
+                           long long timestamp);
+
+/*!\fn int m_spool_writer_rotate (struct m_spool_writer *writer)
+ * \brief closes the current segment and starts the next, returns 0 on
+ *        success or -1 on failure, leaving the writer without a segment.
+ */
+int m_spool_writer_rotate (struct m_spool_writer *writer);
+
+/*!\fn void m_spool_writer_close (struct m_spool_writer *writer)
+ * \brief truncates the current segment to the records in it and frees the
+ *        writer.
+ */
+void m_spool_writer_close (struct m_spool_writer *writer);
+
+/*!\fn int m_spool_segments (const char *base, char ***paths, int *count)
+ * \brief finds the segments written for base, oldest first.  The paths are
+ *        freed with m_spool_segments_free.
+ * \return 0 on success, -1 if the directory can't be read or -3 on
+ *         allocation failure.
+ */
+int m_spool_segments (const char *base, char ***paths, int *count);
+
+/*!\fn void m_spool_segments_free (char **paths, int count)
+ * \brief frees what m_spool_segments returned.
+ */
+void m_spool_segments_free (char **paths, int count);
+
+/*!\fn int m_spool_reader_open (struct m_spool_reader *reader,
+ *                              const char *path)
+ * \brief maps a segment for reading, returns 0 on success or -1 if it
+ *        can't be opened or isn't a spool segment.
+ */
+int m_spool_reader_open (struct m_spool_reader *reader, const char *path);
+
+/*!\fn int m_spool_reader_next (struct m_spool_reader *reader,
+ *                              const unsigned char **bytes, size_t *length,
+ *                              long long *timestamp)
+ * \brief points bytes at the next record, which stays valid until the
+ *        reader is closed.
+ * \return 1 if there was a record, 0 at the end of the segment or -1 if
+ *         the segment is corrupt.
+ */
+int m_spool_reader_next (struct m_spool_reader *reader,
+                         const unsigned char **bytes, size_t *length,
+                         long long *timestamp);
+
+/*!\fn void m_spool_reader_close (struct m_spool_reader *reader)
+ * \brief unmaps the segment.
+ */
+void m_spool_reader_close (struct m_spool_reader *reader);
+
+#endif
@@ -0,0 +1,148 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "m_statsd.h"
+
+#include <string.h>
+
+/* forward declaration of private functions */
+static int m_statsd_reserve (struct m_statsd_writer *writer, size_t bytes);
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+void
+m_statsd_begin (struct m_statsd_writer *writer, char *buffer, size_t size)
+{
+  writer->buffer = buffer;
+  writer->size = size;
+  writer->used = 0;
+  writer->overflow = 0;
+}
+
+int
+m_statsd_end (struct m_statsd_writer *writer, size_t *length)
+{
+  if (writer->overflow)
+    {
+      return -1;
+    }
+  *length = writer->used;
+
+  return 0;
+}
+
+void
+m_statsd_bytes (struct m_statsd_writer *writer, const char *bytes,
+                size_t length)
+{
+  if (m_statsd_reserve (writer, length) != 0)
+    {
+      return;
+    }
+  memcpy (writer->buffer + writer->used, bytes, length);
+  writer->used += length;
+}
+
+void
+m_statsd_name (struct m_statsd_writer *writer, const char *name,
+               const char *reserved)
+{
+  size_t length = strlen (name);
+  size_t clean;
+  char *out = NULL;
+
+  if (m_statsd_reserve (writer, length) != 0)
+    {
+      return;
+    }
+  out = writer->buffer + writer->used;
+  memcpy (out, name, length);
+  writer->used += length;
+
+  /* names rarely need fixing, so only look closer when one does */
+  clean = strcspn (name, reserved);
+  while (clean < length)
+    {
+      out[clean] = '_';
+      clean += 1 + strcspn (name + clean + 1, reserved);
+    }
+}
+
+void
+m_statsd_integer (struct m_statsd_writer *writer, long long value)
+{
+  char digits[M_STATSD_INTEGER_MAX];
+
+  if (writer->overflow)
+    {
+      return;
+    }
+  if (writer->size - writer->used >= M_STATSD_INTEGER_MAX)
+    {
+      writer->used += m_statsd_format_integer (writer->buffer + writer->used,
+                                               value);
+      return;
+    }
+  /* near the end of the buffer it may still fit once its length is known */
+  m_statsd_bytes (writer, digits, m_statsd_format_integer (digits, value));
+}
+
+size_t
+m_statsd_format_integer (char *out, long long value)
+{
+  char digits[M_STATSD_INTEGER_MAX];
+  unsigned long long magnitude;
+  size_t length = 0;
+  int n = 0;
+
+  if (value < 0)
+    {
+      out[length++] = '-';
+      /* negating as unsigned handles the most negative value */
+      magnitude = 0ULL - (unsigned long long) value;
+    }
+  else
+    {
+      magnitude = (unsigned long long) value;
+    }
+
+  /* digits come out backwards */
+  do
+    {
+      digits[n++] = (char) ('0' + magnitude % 10);
+      magnitude /= 10;
+    }
+  while (magnitude > 0);
+  while (n > 0)
+    {
+      out[length++] = digits[--n];
+    }
+
+  return length;
+}
+
+/* ======================================================================== */
+/* Private API functions                                                    */
+/* ======================================================================== */
+
+/* checks there's room for bytes more, marking the writer overflowed if not */
+static int
+m_statsd_reserve (struct m_statsd_writer *writer, size_t bytes)
+{
+  if (writer->overflow || writer->size - writer->used < bytes)
+    {
+      writer->overflow = 1;
+      return -1;
+    }
+  return 0;
+}
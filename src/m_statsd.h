@@ -0,0 +1,86 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_STATSD_H__
+#define __M_STATSD_H__
+
+/*! \file m_statsd.h
+ *  \brief writes StatsD lines, such as "key:42|c" or with DogStatsD tags
+ *         "key:42|g|#host:h1,dc:east", straight into a caller's buffer.
+ *         Lines in a datagram are separated by newlines.  Integers are
+ *         formatted by hand rather than with printf, and names have the
+ *         characters the protocol reserves replaced with '_'.
+ *
+ *         Like m_lwes.h, once anything doesn't fit the writer is marked
+ *         overflowed, later calls do nothing and m_statsd_end fails.
+ */
+
+#include <stddef.h>
+
+/* characters replaced in metric names and in tags */
+#define M_STATSD_NAME_RESERVED ":|@\n"
+#define M_STATSD_TAG_RESERVED ",|#\n"
+
+/* longest formatted integer, a sign and 19 digits */
+#define M_STATSD_INTEGER_MAX 20
+
+/*! \struct m_statsd_writer
+ *  \brief  where the datagram being written is and how far it has got
+ */
+struct m_statsd_writer
+{
+  char *buffer;
+  size_t size;
+  size_t used;
+  int overflow;
+};
+
+/*!\fn void m_statsd_begin (struct m_statsd_writer *writer, char *buffer,
+ *                          size_t size)
+ * \brief starts writing at the beginning of buffer.
+ */
+void m_statsd_begin (struct m_statsd_writer *writer, char *buffer,
+                     size_t size);
+
+/*!\fn int m_statsd_end (struct m_statsd_writer *writer, size_t *length)
+ * \return 0 and sets *length to the bytes written, or -1 if they didn't fit
+ */
+int m_statsd_end (struct m_statsd_writer *writer, size_t *length);
+
+/*!\fn void m_statsd_bytes (struct m_statsd_writer *writer,
+ *                          const char *bytes, size_t length)
+ * \brief appends bytes as they are.
+ */
+void m_statsd_bytes (struct m_statsd_writer *writer, const char *bytes,
+                     size_t length);
+
+/*!\fn void m_statsd_name (struct m_statsd_writer *writer, const char *name,
+ *                         const char *reserved)
+ * \brief appends name, with any of the characters in reserved replaced
+ *        with '_'.
+ */
+void m_statsd_name (struct m_statsd_writer *writer, const char *name,
+                    const char *reserved);
+
+/*!\fn void m_statsd_integer (struct m_statsd_writer *writer,
+ *                            long long value)
+ * \brief appends value in decimal.
+ */
+void m_statsd_integer (struct m_statsd_writer *writer, long long value);
+
+/*!\fn size_t m_statsd_format_integer (char *out, long long value)
+ * \brief writes value in decimal to out, which holds at least
+ *        M_STATSD_INTEGER_MAX bytes, without a terminating NUL.
+ * \return the number of characters written
+ */
+size_t m_statsd_format_integer (char *out, long long value);
+
+#endif
@@ -0,0 +1,622 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#include "config.h"
+
+#include "m_mem.h"
+#include "m_stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/un.h>
+
+/* forward declaration of private functions */
+static int m_stream_address (struct m_stream *stream, const char *address);
+static void *m_stream_thread (void *arg);
+static int m_stream_connect (struct m_stream *stream);
+static int m_stream_write (struct m_stream *stream, int *first, int count,
+                           size_t *offset);
+static void m_stream_backoff (struct m_stream *stream, int ms);
+static int m_stream_wait (struct m_stream *stream, int fd, int ms);
+static long long m_stream_now_ms (void);
+
+/* ======================================================================== */
+/* Public API functions                                                     */
+/* ======================================================================== */
+
+struct m_stream *
+m_stream_create (const char *address, size_t limit, int policy,
+                 int backoff_min_ms, int backoff_max_ms)
+{
+  struct m_stream *stream = NULL;
+  pthread_condattr_t attributes;
+
+  if (address == NULL || limit == 0
+      || policy < M_STREAM_BLOCK || policy > M_STREAM_DROP_OLDEST
+      || backoff_min_ms < 1 || backoff_max_ms < backoff_min_ms)
+    {
+      return NULL;
+    }
+
+  stream = (struct m_stream *) m_try_malloc0 (sizeof (struct m_stream));
+  if (stream == NULL)
+    {
+      return NULL;
+    }
+  if (m_stream_address (stream, address) != 0)
+    {
+      m_free (stream);
+      return NULL;
+    }
+  stream->limit = limit;
+  stream->policy = policy;
+  stream->backoff_min_ms = backoff_min_ms;
+  stream->backoff_max_ms = backoff_max_ms;
+  stream->fd = -1;
+  stream->stop_ms = -1;
+  if (pipe (stream->wake) != 0)
+    {
+      m_free (stream);
+      return NULL;
+    }
+
+  pthread_mutex_init (&stream->lock, NULL);
+  /* backoff waits are timed against the monotonic clock */
+  pthread_condattr_init (&attributes);
+  pthread_condattr_setclock (&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init (&stream->ready, &attributes);
+  pthread_condattr_destroy (&attributes);
+  pthread_cond_init (&stream->space, NULL);
+
+  if (pthread_create (&stream->thread, NULL, &m_stream_thread, stream) != 0)
+    {
+      pthread_cond_destroy (&stream->space);
+      pthread_cond_destroy (&stream->ready);
+      pthread_mutex_destroy (&stream->lock);
+      close (stream->wake[0]);
+      close (stream->wake[1]);
+      m_free (stream);
+      return NULL;
+    }
+
+  return stream;
+}
+
+int
+m_stream_send (struct m_stream *stream, const struct iovec events[],
+               int count, size_t *queued_bytes)
+{
+  struct m_stream_frame *frames = NULL;
+  struct m_stream_frame *frame = NULL;
+  struct m_stream_frame *last = NULL;
+  struct m_stream_frame *oldest = NULL;
+  size_t length;
+  size_t queued = 0;
+  int dropped = 0;
+  int i;
+
+  if (queued_bytes != NULL)
+    {
+      *queued_bytes = 0;
+    }
+  /* copy everything before taking the lock */
+  for (i = 0; i < count; ++i)
+    {
+      length = events[i].iov_len;
+      frame = (struct m_stream_frame *)
+        m_try_malloc (sizeof (struct m_stream_frame) + length);
+      if (frame == NULL)
+        {
+          while (frames != NULL)
+            {
+              frame = frames->next;
+              m_free (frames);
+              frames = frame;
+            }
+          return -3;
+        }
+      frame->next = NULL;
+      frame->length = 4 + length;
+      frame->bytes[0] = (unsigned char) (length >> 24);
+      frame->bytes[1] = (unsigned char) (length >> 16);
+      frame->bytes[2] = (unsigned char) (length >> 8);
+      frame->bytes[3] = (unsigned char) length;
+      memcpy (frame->bytes + 4, events[i].iov_base, length);
+      if (last == NULL)
+        {
+          frames = frame;
+        }
+      else
+        {
+          last->next = frame;
+        }
+      last = frame;
+    }
+
+  pthread_mutex_lock (&stream->lock);
+  while ((frame = frames) != NULL)
+    {
+      frames = frame->next;
+      frame->next = NULL;
+      while (frame != NULL
+             && (size_t) stream->stats.depth_bytes + frame->length
+                  > stream->limit)
+        {
+          if (frame->length > stream->limit
+              || stream->policy == M_STREAM_DROP_NEWEST
+              || (stream->policy == M_STREAM_BLOCK && stream->stopping))
+            {
+              m_free (frame);
+              frame = NULL;
+              stream->stats.dropped_newest++;
+              ++dropped;
+            }
+          else if (stream->policy == M_STREAM_DROP_OLDEST)
+            {
+              oldest = stream->head;
+              stream->head = oldest->next;
+              if (stream->head == NULL)
+                {
+                  stream->tail = NULL;
+                }
+              stream->stats.depth--;
+              stream->stats.depth_bytes -= (long long) oldest->length;
+              stream->stats.dropped_oldest++;
+              m_free (oldest);
+            }
+          else
+            {
+              pthread_cond_wait (&stream->space, &stream->lock);
+            }
+        }
+      if (frame == NULL)
+        {
+          continue;
+        }
+      if (stream->tail == NULL)
+        {
+          stream->head = frame;
+        }
+      else
+        {
+          stream->tail->next = frame;
+        }
+      stream->tail = frame;
+      stream->stats.depth++;
+      stream->stats.depth_bytes += (long long) frame->length;
+      stream->stats.queued_frames++;
+      stream->stats.queued_bytes += (long long) frame->length;
+      queued += frame->length - 4;
+    }
+  pthread_cond_signal (&stream->ready);
+  pthread_mutex_unlock (&stream->lock);
+
+  if (queued_bytes != NULL)
+    {
+      *queued_bytes = queued;
+    }
+  return dropped;
+}
+
+void
+m_stream_get_stats (struct m_stream *stream, struct m_stream_stats *stats)
+{
+  pthread_mutex_lock (&stream->lock);
+  *stats = stream->stats;
+  pthread_mutex_unlock (&stream->lock);
+}
+
+void
+m_stream_destroy (struct m_stream *stream)
+{
+  struct m_stream_frame *frame = NULL;
+  char stop = 1;
+
+  if (stream == NULL)
+    {
+      return;
+    }
+
+  pthread_mutex_lock (&stream->lock);
+  stream->stopping = 1;
+  pthread_cond_broadcast (&stream->ready);
+  pthread_cond_broadcast (&stream->space);
+  pthread_mutex_unlock (&stream->lock);
+  /* the thread may be waiting in poll for a connect or a write */
+  while (write (stream->wake[1], &stop, 1) < 0 && errno == EINTR)
+    {
+    }
+  pthread_join (stream->thread, NULL);
+
+  while ((frame = stream->head) != NULL)
+    {
+      stream->head = frame->next;
+      m_free (frame);
+    }
+  if (stream->fd >= 0)
+    {
+      close (stream->fd);
+    }
+  close (stream->wake[0]);
+  close (stream->wake[1]);
+  pthread_cond_destroy (&stream->space);
+  pthread_cond_destroy (&stream->ready);
+  pthread_mutex_destroy (&stream->lock);
+  m_free (stream);
+}
+
+/* ======================================================================== */
+/* Private API functions                                                    */
+/* ======================================================================== */
+
+/* parses unix:<path> or tcp:<host>:<port> into the stream's address */
+static int
+m_stream_address (struct m_stream *stream, const char *address)
+{
+  struct sockaddr_un *un = (struct sockaddr_un *) &stream->address;
+  struct addrinfo hints;
+  struct addrinfo *result = NULL;
+  const char *colon = NULL;
+  char host[256];
+  size_t length;
+
+  if (strncmp (address, "unix:", 5) == 0)
+    {
+      length = strlen (address + 5);
+      if (length == 0 || length >= sizeof (un->sun_path))
+        {
+          return -1;
+        }
+      un->sun_family = AF_UNIX;
+      memcpy (un->sun_path, address + 5, length + 1);
+      stream->address_length = (socklen_t) sizeof (struct sockaddr_un);
+      return 0;
+    }
+
+  if (strncmp (address, "tcp:", 4) != 0)
+    {
+      return -1;
+    }
+  colon = strrchr (address + 4, ':');
+  if (colon == NULL || colon == address + 4 || colon[1] == '\0'
+      || (size_t) (colon - (address + 4)) >= sizeof (host))
+    {
+      return -1;
+    }
+  memcpy (host, address + 4, (size_t) (colon - (address + 4)));
+  host[colon - (address + 4)] = '\0';
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo (host, colon + 1, &hints, &result) != 0)
+    {
+      return -1;
+    }
+  if (result->ai_addrlen > sizeof (stream->address))
+    {
+      freeaddrinfo (result);
+      return -1;
+    }
+  memcpy (&stream->address, result->ai_addr, result->ai_addrlen);
+  stream->address_length = result->ai_addrlen;
+  freeaddrinfo (result);
+
+  return 0;
+}
+
+/* takes frames off the queue and writes them, connecting as needed, until
+   stopped */
+static void *
+m_stream_thread (void *arg)
+{
+  struct m_stream *stream = (struct m_stream *) arg;
+  sigset_t signals;
+  size_t offset = 0;
+  int backoff = stream->backoff_min_ms;
+  int stopping = 0;
+  int empty = 0;
+  int first = 0;
+  int count = 0;
+
+  /* a write to a closed connection fails with EPIPE rather than killing
+     the process with SIGPIPE */
+  sigfillset (&signals);
+  pthread_sigmask (SIG_BLOCK, &signals, NULL);
+
+  for (;;)
+    {
+      pthread_mutex_lock (&stream->lock);
+      while (count == 0 && stream->head == NULL && ! stream->stopping)
+        {
+          pthread_cond_wait (&stream->ready, &stream->lock);
+        }
+      stopping = stream->stopping;
+      empty = (count == 0 && stream->head == NULL);
+      pthread_mutex_unlock (&stream->lock);
+      if (empty)
+        {
+          /* stopping with nothing left */
+          break;
+        }
+
+      /* frames stay queued, and count against the limit, until there's a
+         connection to write them to */
+      if (stream->fd < 0)
+        {
+          if (m_stream_connect (stream) != 0)
+            {
+              if (stopping)
+                {
+                  break;
+                }
+              m_stream_backoff (stream, backoff);
+              backoff = backoff * 2 < stream->backoff_max_ms
+                        ? backoff * 2 : stream->backoff_max_ms;
+              continue;
+            }
+          backoff = stream->backoff_min_ms;
+        }
+
+      if (count == 0)
+        {
+          pthread_mutex_lock (&stream->lock);
+          while (stream->head != NULL && count < M_STREAM_BATCH)
+            {
+              stream->batch[count] = stream->head;
+              stream->head = stream->head->next;
+              stream->stats.depth--;
+              stream->stats.depth_bytes -=
+                (long long) stream->batch[count]->length;
+              ++count;
+            }
+          if (stream->head == NULL)
+            {
+              stream->tail = NULL;
+            }
+          first = 0;
+          offset = 0;
+          pthread_cond_broadcast (&stream->space);
+          pthread_mutex_unlock (&stream->lock);
+        }
+
+      if (m_stream_write (stream, &first, count, &offset) != 0)
+        {
+          /* the frame being written goes again in full on the next
+             connection */
+          close (stream->fd);
+          stream->fd = -1;
+          offset = 0;
+          pthread_mutex_lock (&stream->lock);
+          stream->stats.connected = 0;
+          pthread_mutex_unlock (&stream->lock);
+          if (stopping)
+            {
+              break;
+            }
+        }
+      if (first == count)
+        {
+          count = 0;
+        }
+    }
+
+  /* whatever couldn't be sent when stopping */
+  while (first < count)
+    {
+      m_free (stream->batch[first++]);
+    }
+
+  return NULL;
+}
+
+/* opens a non-blocking connection, returning 0 once connected, -1 if it
+   failed or didn't finish within M_STREAM_CONNECT_MS */
+static int
+m_stream_connect (struct m_stream *stream)
+{
+  int fd = socket (stream->address.ss_family, SOCK_STREAM, 0);
+  socklen_t length = sizeof (int);
+  int flags;
+  int error = 0;
+
+  if (fd < 0)
+    {
+      return -1;
+    }
+  flags = fcntl (fd, F_GETFL, 0);
+  if (flags < 0 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+  if (connect (fd, (struct sockaddr *) &stream->address,
+               stream->address_length) != 0)
+    {
+      /* an interrupted connect carries on in the background */
+      if ((errno != EINPROGRESS && errno != EINTR)
+          || m_stream_wait (stream, fd, M_STREAM_CONNECT_MS) != 0
+          || getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0
+          || error != 0)
+        {
+          close (fd);
+          return -1;
+        }
+    }
+
+  stream->fd = fd;
+  pthread_mutex_lock (&stream->lock);
+  stream->stats.connects++;
+  stream->stats.connected = 1;
+  pthread_mutex_unlock (&stream->lock);
+
+  return 0;
+}
+
+/* writes the batch from frame *first, *offset bytes into it, with one
+   writev, freeing the frames which were written completely.  Returns -1 if
+   the connection failed */
+static int
+m_stream_write (struct m_stream *stream, int *first, int count,
+                size_t *offset)
+{
+  struct m_stream_frame *frame = NULL;
+  long long frames = 0;
+  long long bytes = 0;
+  ssize_t written;
+  size_t rest;
+  int n = 0;
+  int i;
+
+  for (i = *first; i < count; ++i)
+    {
+      stream->iov[n].iov_base = stream->batch[i]->bytes
+                                + (i == *first ? *offset : 0);
+      stream->iov[n].iov_len = stream->batch[i]->length
+                               - (i == *first ? *offset : 0);
+      ++n;
+    }
+  written = writev (stream->fd, stream->iov, n);
+  if (written < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          /* the peer isn't keeping up, try again once there's room */
+          return m_stream_wait (stream, stream->fd, -1);
+        }
+      return errno == EINTR ? 0 : -1;
+    }
+
+  while (written > 0)
+    {
+      frame = stream->batch[*first];
+      rest = frame->length - *offset;
+      if ((size_t) written < rest)
+        {
+          *offset += (size_t) written;
+          break;
+        }
+      written -= (ssize_t) rest;
+      bytes += (long long) frame->length;
+      ++frames;
+      m_free (frame);
+      (*first)++;
+      *offset = 0;
+    }
+
+  pthread_mutex_lock (&stream->lock);
+  stream->stats.writes++;
+  stream->stats.sent_frames += frames;
+  stream->stats.sent_bytes += bytes;
+  pthread_mutex_unlock (&stream->lock);
+
+  return 0;
+}
+
+/* waits ms before the next connection attempt, or until stopped */
+static void
+m_stream_backoff (struct m_stream *stream, int ms)
+{
+  struct timespec deadline;
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (long) (ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+  pthread_mutex_lock (&stream->lock);
+  while (! stream->stopping)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > deadline.tv_sec
+          || (now.tv_sec == deadline.tv_sec
+              && now.tv_nsec >= deadline.tv_nsec))
+        {
+          break;
+        }
+      pthread_cond_timedwait (&stream->ready, &stream->lock, &deadline);
+    }
+  pthread_mutex_unlock (&stream->lock);
+}
+
+/* waits until fd is writable, or has failed, and returns 0, or returns -1
+   once ms have passed, if ms isn't negative.  Being woken to stop leaves
+   the thread M_STREAM_STOP_MS to finish in, after that every wait fails */
+static int
+m_stream_wait (struct m_stream *stream, int fd, int ms)
+{
+  struct pollfd fds[2];
+  long long until = ms < 0 ? -1 : m_stream_now_ms () + ms;
+  long long now;
+  long long timeout;
+
+  fds[0].fd = fd;
+  fds[0].events = POLLOUT;
+  fds[1].fd = stream->wake[0];
+  fds[1].events = POLLIN;
+
+  for (;;)
+    {
+      now = m_stream_now_ms ();
+      timeout = -1;
+      if (until >= 0)
+        {
+          timeout = until - now;
+        }
+      if (stream->stop_ms >= 0
+          && (timeout < 0 || stream->stop_ms - now < timeout))
+        {
+          timeout = stream->stop_ms - now;
+        }
+      if ((until >= 0 || stream->stop_ms >= 0) && timeout <= 0)
+        {
+          return -1;
+        }
+      /* the wake pipe stays readable, so stop polling it once woken */
+      if (poll (fds, stream->stop_ms < 0 ? 2 : 1, (int) timeout) < 0)
+        {
+          if (errno != EINTR)
+            {
+              return -1;
+            }
+          continue;
+        }
+      if (fds[0].revents != 0)
+        {
+          return 0;
+        }
+      if (stream->stop_ms < 0 && fds[1].revents != 0)
+        {
+          stream->stop_ms = now + M_STREAM_STOP_MS;
+        }
+    }
+}
+
+static long long
+m_stream_now_ms (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,155 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#ifndef __M_STREAM_H__
+#define __M_STREAM_H__
+
+/*! \file m_stream.h
+ *  \brief sends frames over a unix or tcp stream socket from a background
+ *         thread.  Frames are a 4 byte big-endian length and the bytes.
+ *         Callers queue frames, copying them, and never wait for the
+ *         network; the thread takes everything queued and writes it with
+ *         one writev, so frames queued while a write is in progress go out
+ *         together in the next.  The queue is bounded in bytes, when it's
+ *         full frames are dropped or the caller waits, as chosen.
+ *
+ *         The thread connects, and when the connection fails reconnects,
+ *         waiting between attempts from backoff_min_ms doubling up to
+ *         backoff_max_ms.  Frames are kept while it isn't connected, and a
+ *         batch which was only partly written is sent again from the first
+ *         frame not written completely.
+ *
+ *         The socket is non-blocking.  A connect which hasn't finished
+ *         after M_STREAM_CONNECT_MS fails like any other, and destroying
+ *         the stream wakes the thread, which then has M_STREAM_STOP_MS to
+ *         write what's queued before giving up on a peer which isn't
+ *         reading.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* what to do with a frame which doesn't fit in the queue, the same values
+   as MondemandQueuePolicy */
+#define M_STREAM_BLOCK       0
+#define M_STREAM_DROP_NEWEST 1
+#define M_STREAM_DROP_OLDEST 2
+
+/* most frames written with one writev */
+#define M_STREAM_BATCH 64
+
+/* longest a connect may take, and how long the thread keeps writing what's
+   queued once the stream is destroyed */
+#define M_STREAM_CONNECT_MS 5000
+#define M_STREAM_STOP_MS    1000
+
+/*! \struct m_stream_frame
+ *  \brief  a queued frame, its header and bytes allocated together
+ */
+struct m_stream_frame
+{
+  struct m_stream_frame *next;
+  size_t length;
+  unsigned char bytes[4];
+};
+
+/*! \struct m_stream_stats
+ *  \brief  what the stream has done, frames and bytes include headers
+ */
+struct m_stream_stats
+{
+  long long queued_frames;
+  long long queued_bytes;
+  long long sent_frames;
+  long long sent_bytes;
+  long long dropped_newest;
+  long long dropped_oldest;
+  /* writev calls made and connections made */
+  long long writes;
+  long long connects;
+  /* frames and bytes waiting, and whether the thread is connected now */
+  int depth;
+  long long depth_bytes;
+  int connected;
+};
+
+/*! \struct m_stream
+ *  \brief  where to connect, the queue and the thread's state
+ */
+struct m_stream
+{
+  struct sockaddr_storage address;
+  socklen_t address_length;
+  size_t limit;
+  int policy;
+  int backoff_min_ms;
+  int backoff_max_ms;
+
+  pthread_mutex_t lock;
+  /* signalled when frames are queued or the stream is stopping, and when
+     the thread takes frames off the queue */
+  pthread_cond_t ready;
+  pthread_cond_t space;
+  struct m_stream_frame *head;
+  struct m_stream_frame *tail;
+  int stopping;
+  struct m_stream_stats stats;
+  /* written to by destroy to wake the thread out of poll */
+  int wake[2];
+
+  /* only touched by the thread */
+  pthread_t thread;
+  int fd;
+  /* monotonic ms the thread gives up at once woken to stop, -1 until */
+  long long stop_ms;
+  struct m_stream_frame *batch[M_STREAM_BATCH];
+  struct iovec iov[M_STREAM_BATCH];
+};
+
+/*!\fn struct m_stream *m_stream_create (const char *address, size_t limit,
+ *                                       int policy, int backoff_min_ms,
+ *                                       int backoff_max_ms)
+ * \brief starts a stream to address, "unix:<path>" or "tcp:<host>:<port>",
+ *        queueing up to limit bytes.  Returns NULL if the address can't be
+ *        parsed or resolved, the arguments are out of range or the thread
+ *        can't be started; not being able to connect yet is not an error.
+ */
+struct m_stream *m_stream_create (const char *address, size_t limit,
+                                  int policy, int backoff_min_ms,
+                                  int backoff_max_ms);
+
+/*!\fn int m_stream_send (struct m_stream *stream, const struct iovec
+ *                        events[], int count, size_t *queued_bytes)
+ * \brief queues each event as a frame, and if queued_bytes isn't NULL sets
+ *        it to the length of the events which were queued.
+ * \return the number of frames dropped because they didn't fit, with
+ *         M_STREAM_DROP_NEWEST or if a frame is bigger than the limit, or
+ *         -3 on allocation failure
+ */
+int m_stream_send (struct m_stream *stream, const struct iovec events[],
+                   int count, size_t *queued_bytes);
+
+/*!\fn void m_stream_get_stats (struct m_stream *stream,
+ *                              struct m_stream_stats *stats)
+ * \brief copies the stream's counters.
+ */
+void m_stream_get_stats (struct m_stream *stream,
+                         struct m_stream_stats *stats);
+
+/*!\fn void m_stream_destroy (struct m_stream *stream)
+ * \brief stops the thread, which first writes what's queued if it's
+ *        connected, and frees the stream and anything left.
+ */
+void m_stream_destroy (struct m_stream *stream);
+
+#endif
@@ -11,13 +11,22 @@
  * limitations under the License. See accompanying LICENSE file.        *
  *======================================================================*/
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "lwes.h"
+#include "m_format.h"
+#include "m_hash.h"
+#include "m_mem.h"
+#include "m_ring.h"
+#include "m_spool.h"
 #include "mondemandlib.h"
 
 static const char help[] =
@@ -44,7 +53,27 @@ static const char help[] =
   "           if ip is a multicast ip, then datagrams are sent via"    "\n"
   "           multicast, otherwise they are sent via UDP."             "\n"
   ""                                                                   "\n"
+  "         lwes-native - the same as lwes, but events are written"   "\n"
+  "                   without liblwes and heartbeats aren't sent"      "\n"
+  "           max datagram - optional 6th part, the largest datagram" "\n"
+  "                   to send, bigger flushes are split (1472 fits"    "\n"
+  "                   an ethernet MTU)"                                "\n"
   "         stderr - send messages to stderr"                          "\n"
+  "         file:<path> - append messages to the file at path"         "\n"
+  "         spool:<path> - write lwes events to spool segments"        "\n"
+  "                   path.000001, path.000002, ... for --replay"      "\n"
+  "         shm:<path> - copy lwes events into the shared memory ring" "\n"
+  "                   at path, normally under /dev/shm, for --ring"    "\n"
+  "         stream:unix:<path> or stream:tcp:<host>:<port> - send lwes"  "\n"
+  "                   events as length prefixed frames over a stream"  "\n"
+  "                   socket, reconnecting when the connection fails"  "\n"
+  "         statsd:<ip>:<port> - send stats as DogStatsD lines, tagged"  "\n"
+  "                   with the contexts"                               "\n"
+  "         statsd-plain:<ip>:<port> - send stats as StatsD lines"     "\n"
+  "         otlp:unix:<path> or otlp:tcp:<host>:<port> - send stats"  "\n"
+  "                   and perf timings as OTLP requests in length"     "\n"
+  "                   prefixed frames over a stream socket"            "\n"
+  "         otlp-file:<path> - append OTLP frames to the file at path" "\n"
   ""                                                                   "\n"
   "    -o may be specified multiple times"                             "\n"
   ""                                                                   "\n"
@@ -121,6 +150,32 @@ static const char help[] =
   "       For annotations, -A is separate as it may contain various"   "\n"
   "       characters not allowed in -a."                               "\n"
   ""                                                                   "\n"
+  "  Decoding Options:"                                                "\n"
+  ""                                                                   "\n"
+  "    -d lwes:<iface>:<ip>:<port>"                                    "\n"
+  "       Instead of sending, listen for log messages and print them"  "\n"
+  "       to stdout, rebuilding the text of dictionary encoded"        "\n"
+  "       messages (see mondemand_transport_lwes_dictionary_create)."  "\n"
+  "       Runs until interrupted."                                     "\n"
+  ""                                                                   "\n"
+  "  Replay Options:"                                                  "\n"
+  ""                                                                   "\n"
+  "    --replay <path>"                                                "\n"
+  "       Instead of sending, send the events in the spool written"    "\n"
+  "       to <path> (or the single segment <path>) through each -o"    "\n"
+  "       transport, which must be lwes or lwes-native without a max"  "\n"
+  "       datagram."                                                   "\n"
+  ""                                                                   "\n"
+  "    --speed <multiplier>"                                           "\n"
+  "       Replay at <multiplier> times the rate events were spooled,"  "\n"
+  "       1 by default, 0 for as fast as possible."                    "\n"
+  ""                                                                   "\n"
+  "    --ring <path>"                                                  "\n"
+  "       Instead of sending, forward the events written to the"      "\n"
+  "       shared memory ring at <path> through each -o transport, as"  "\n"
+  "       for --replay.  Runs until interrupted, a restarted reader"   "\n"
+  "       carries on with the events still in the ring."               "\n"
+  ""                                                                   "\n"
   "  Other Options:"                                                   "\n"
   ""                                                                   "\n"
   "    -h"                                                             "\n"
@@ -170,15 +225,116 @@ handle_transport_arg (const char *arg)
     {
       transport = mondemand_transport_stderr_create ();
     }
+  else if (strcmp (words[0], "spool") == 0)
+    {
+      if (count != 2 || strcmp (words[1], "") == 0)
+        {
+          fprintf (stderr, "ERROR: spool transport requires a path\n");
+          fprintf (stderr, "       spool:<path>\n");
+        }
+      else
+        {
+          transport = mondemand_transport_spool_create (words[1], NULL);
+        }
+    }
+  else if (strcmp (words[0], "shm") == 0)
+    {
+      if (count != 2 || strcmp (words[1], "") == 0)
+        {
+          fprintf (stderr, "ERROR: shm transport requires a path\n");
+          fprintf (stderr, "       shm:<path>\n");
+        }
+      else
+        {
+          transport = mondemand_transport_shm_create (words[1], 0);
+        }
+    }
+  else if (strcmp (words[0], "stream") == 0)
+    {
+      /* the address keeps its own ':'s */
+      if (count < 3 || strcmp (words[2], "") == 0)
+        {
+          fprintf (stderr, "ERROR: stream transport requires an address\n");
+          fprintf (stderr, "       stream:unix:<path>\n");
+          fprintf (stderr, "       stream:tcp:<host>:<port>\n");
+        }
+      else
+        {
+          transport = mondemand_transport_stream_create (arg + 7);
+        }
+    }
+  else if (strcmp (words[0], "otlp") == 0)
+    {
+      /* the address keeps its own ':'s */
+      if (count < 3 || strcmp (words[2], "") == 0)
+        {
+          fprintf (stderr, "ERROR: otlp transport requires an address\n");
+          fprintf (stderr, "       otlp:unix:<path>\n");
+          fprintf (stderr, "       otlp:tcp:<host>:<port>\n");
+        }
+      else
+        {
+          transport = mondemand_transport_otlp_create (arg + 5, NULL);
+        }
+    }
+  else if (strcmp (words[0], "otlp-file") == 0)
+    {
+      if (count != 2 || strcmp (words[1], "") == 0)
+        {
+          fprintf (stderr, "ERROR: otlp-file transport requires a path\n");
+          fprintf (stderr, "       otlp-file:<path>\n");
+        }
+      else
+        {
+          transport = mondemand_transport_otlp_file_create (words[1]);
+        }
+    }
+  else if (strcmp (words[0], "statsd") == 0
+           || strcmp (words[0], "statsd-plain") == 0)
+    {
+      if (count != 3 || strcmp (words[1], "") == 0
+          || strcmp (words[2], "") == 0)
+        {
+          fprintf (stderr, "ERROR: statsd transport requires an address\n");
+          fprintf (stderr, "       statsd:<ip>:<port>\n");
+          fprintf (stderr, "       statsd-plain:<ip>:<port>\n");
+        }
+      else
+        {
+          struct mondemand_statsd_options opts;
+          memset (&opts, 0, sizeof (opts));
+          opts.plain = (strcmp (words[0], "statsd-plain") == 0);
+          transport = mondemand_transport_statsd_create (words[1],
+                                                         atoi (words[2]),
+                                                         &opts);
+        }
+    }
+  else if (strcmp (words[0], "file") == 0)
+    {
+      if (count != 2 || strcmp (words[1], "") == 0)
+        {
+          fprintf (stderr, "ERROR: file transport requires a path\n");
+          fprintf (stderr, "       file:<path>\n");
+        }
+      else
+        {
+          transport = mondemand_transport_file_create (words[1],
+                                                       MONDEMAND_FD_LINE, 0);
+        }
+    }
   else
     {
-      if (strcmp (words[0], "lwes") == 0)
+      if (strcmp (words[0], "lwes") == 0
+          || strcmp (words[0], "lwes-native") == 0)
         {
-          if (count < 4 || count > 5)
+          if (count < 4 || count > 6
+              || (count == 6 && strcmp (words[0], "lwes-native") != 0))
             {
               fprintf (stderr, "ERROR: lwes transport requires 3 or 4 parts\n");
               fprintf (stderr, "       lwes:<iface>:<ip>:<port>\n");
               fprintf (stderr, "       lwes:<iface>:<ip>:<port>:<ttl>\n");
+              fprintf (stderr, "       lwes-native:<iface>:<ip>:<port>:"
+                               "<ttl>:<max datagram>\n");
             }
           else
             {
@@ -206,9 +362,22 @@ handle_transport_arg (const char *arg)
                               ttl = 3;
                             }
                         }
-                      transport =
-                        mondemand_transport_lwes_create_with_ttl
-                          (ip, port, iface, 0, 60, ttl);
+                      if (strcmp (words[0], "lwes-native") == 0)
+                        {
+                          struct mondemand_native_options opts;
+                          memset (&opts, 0, sizeof (opts));
+                          opts.ttl = ttl;
+                          opts.max_datagram = atoi (words[5]);
+                          transport =
+                            mondemand_transport_lwes_native_create_with_options
+                              (ip, port, iface, &opts);
+                        }
+                      else
+                        {
+                          transport =
+                            mondemand_transport_lwes_create_with_ttl
+                              (ip, port, iface, 0, 60, ttl);
+                        }
                     }
                   else
                     {
@@ -665,11 +834,545 @@ handle_annotation_arg (const char *arg,
   return ret;
 }
 
+/* a decoded dictionary entry */
+struct decode_entry
+{
+  char *filename;
+  int line;
+  char *format;
+};
+
+/* remembers the call sites sent in a MonDemand::LogDict event, keyed by
+ * program id and hex id
+ */
+static void
+decode_dictionary_event (struct lwes_event *event,
+                         struct m_hash_table *dictionary)
+{
+  char name[32];
+  char key[512];
+  char *prog_id = NULL;
+  char *filename = NULL;
+  char *format = NULL;
+  LWES_U_INT_16 num = 0;
+  LWES_U_INT_32 id = 0;
+  LWES_U_INT_32 line = 0;
+  struct decode_entry *entry = NULL;
+  char *hash_key = NULL;
+  int i;
+
+  if (lwes_event_get_STRING (event, "prog_id", &prog_id) != 0
+      || lwes_event_get_U_INT_16 (event, "num", &num) != 0)
+    {
+      return;
+    }
+
+  for (i = 0; i < num; ++i)
+    {
+      snprintf (name, sizeof (name), "id%d", i);
+      if (lwes_event_get_U_INT_32 (event, name, &id) != 0)
+        {
+          continue;
+        }
+      snprintf (name, sizeof (name), "f%d", i);
+      if (lwes_event_get_STRING (event, name, &filename) != 0)
+        {
+          continue;
+        }
+      snprintf (name, sizeof (name), "l%d", i);
+      if (lwes_event_get_U_INT_32 (event, name, &line) != 0)
+        {
+          continue;
+        }
+      snprintf (name, sizeof (name), "t%d", i);
+      if (lwes_event_get_STRING (event, name, &format) != 0)
+        {
+          continue;
+        }
+
+      snprintf (key, sizeof (key), "%s:%08x", prog_id, id);
+      entry = malloc (sizeof (struct decode_entry)
+                      + strlen (filename) + 1 + strlen (format) + 1);
+      hash_key = strdup (key);
+      if (entry == NULL || hash_key == NULL)
+        {
+          free (entry);
+          free (hash_key);
+          return;
+        }
+      entry->filename = (char *) (entry + 1);
+      strcpy (entry->filename, filename);
+      entry->line = (int) line;
+      entry->format = entry->filename + strlen (filename) + 1;
+      strcpy (entry->format, format);
+
+      /* a resent entry replaces the old one */
+      m_hash_table_set (dictionary, hash_key, entry);
+    }
+}
+
+/* rebuilds the text of a dictionary encoded message from the format and
+ * a<i>.<j> attributes, returns 0 on success
+ */
+static int
+decode_message_text (struct lwes_event *event, int i, const char *format,
+                     char *buffer, size_t size)
+{
+  MondemandFieldType types[M_FORMAT_MAX_ARGS];
+  struct mondemand_log_field values[M_FORMAT_MAX_ARGS];
+  char name[32];
+  LWES_INT_64 int_value;
+  LWES_DOUBLE double_value;
+  LWES_LONG_STRING string_value;
+  int count;
+  int j;
+  int ret = 0;
+
+  count = m_format_arg_types (format, types, M_FORMAT_MAX_ARGS);
+  if (count < 0)
+    {
+      return -1;
+    }
+  for (j = 0; j < count && ret == 0; ++j)
+    {
+      snprintf (name, sizeof (name), "a%d.%d", i, j);
+      values[j].key = NULL;
+      values[j].type = types[j];
+      switch (types[j])
+        {
+          case MONDEMAND_FIELD_INT64:
+            ret = lwes_event_get_INT_64 (event, name, &int_value);
+            values[j].value.i = int_value;
+            break;
+          case MONDEMAND_FIELD_DOUBLE:
+            ret = lwes_event_get_DOUBLE (event, name, &double_value);
+            values[j].value.d = double_value;
+            break;
+          default:
+            ret = lwes_event_get_STRING (event, name, &string_value);
+            values[j].value.s = string_value;
+            break;
+        }
+    }
+  if (ret != 0)
+    {
+      return -1;
+    }
+
+  return m_format_render (format, values, count, buffer, size);
+}
+
+/* prints the messages in a MonDemand::LogMsg or MonDemand::DictLogMsg
+ * event in the same form as the stderr transport
+ */
+static void
+decode_log_event (struct lwes_event *event,
+                  struct m_hash_table *dictionary)
+{
+  char name[32];
+  char key[512];
+  char text[4096];
+  char unknown[] = "?";
+  char *prog_id = NULL;
+  char *filename = NULL;
+  char *message = NULL;
+  LWES_U_INT_16 num = 0;
+  LWES_U_INT_16 repeat = 0;
+  LWES_U_INT_32 id = 0;
+  LWES_U_INT_32 line = 0;
+  LWES_U_INT_32 level = 0;
+  const struct decode_entry *entry = NULL;
+  int i;
+
+  if (lwes_event_get_STRING (event, "prog_id", &prog_id) != 0
+      || lwes_event_get_U_INT_16 (event, "num", &num) != 0)
+    {
+      return;
+    }
+
+  for (i = 0; i < num; ++i)
+    {
+      snprintf (name, sizeof (name), "p%d", i);
+      if (lwes_event_get_U_INT_32 (event, name, &level) != 0
+          || level > M_LOG_ALL)
+        {
+          continue;
+        }
+
+      snprintf (name, sizeof (name), "d%d", i);
+      if (lwes_event_get_U_INT_32 (event, name, &id) == 0)
+        {
+          snprintf (key, sizeof (key), "%s:%08x", prog_id, id);
+          entry = m_hash_table_get (dictionary, key);
+          if (entry == NULL)
+            {
+              /* the dictionary will arrive when it's next resent */
+              filename = unknown;
+              line = 0;
+              snprintf (text, sizeof (text), "<unknown id %08x>", id);
+            }
+          else
+            {
+              filename = entry->filename;
+              line = (LWES_U_INT_32) entry->line;
+              if (decode_message_text (event, i, entry->format,
+                                       text, sizeof (text)) != 0)
+                {
+                  snprintf (text, sizeof (text), "<undecodable> %s",
+                            entry->format);
+                }
+            }
+          message = text;
+        }
+      else
+        {
+          snprintf (name, sizeof (name), "f%d", i);
+          lwes_event_get_STRING (event, name, &filename);
+          snprintf (name, sizeof (name), "l%d", i);
+          lwes_event_get_U_INT_32 (event, name, &line);
+          snprintf (name, sizeof (name), "m%d", i);
+          lwes_event_get_STRING (event, name, &message);
+        }
+
+      printf ("[%s] : %s:%u : %s : %s", prog_id,
+              filename != NULL ? filename : unknown, line,
+              MonDemandLogLevelStrings[level],
+              message != NULL ? message : "");
+      snprintf (name, sizeof (name), "r%d", i);
+      if (lwes_event_get_U_INT_16 (event, name, &repeat) == 0 && repeat > 1)
+        {
+          printf (" ... repeats %d times", repeat);
+        }
+      printf ("\n");
+      filename = NULL;
+      message = NULL;
+      line = 0;
+    }
+  fflush (stdout);
+}
+
+/* listens for log events and prints them until interrupted */
+static int
+decode_logs (const char *arg)
+{
+  const char *sep  = ":";
+  const char *empty = "";
+  char *word;
+  const char *words[MAX_WORDS];
+  int count = 0;
+  char *buffer;
+  char *tofree;
+  struct lwes_listener *listener = NULL;
+  struct lwes_event *event = NULL;
+  struct m_hash_table *dictionary = NULL;
+  char *event_name = NULL;
+  int ret = 1;
+  int i;
+
+  for (i = 0 ; i < MAX_WORDS; i++)
+    {
+      words[i] = empty;
+    }
+
+  tofree = buffer = strdup (arg);
+  if (buffer == NULL)
+    {
+      return 1;
+    }
+
+  while ((word = strsep (&buffer, sep)) && count < MAX_WORDS)
+    {
+      words[count++]=word;
+    }
+
+  if (count != 4 || strcmp (words[0], "lwes") != 0
+      || strcmp (words[2], "") == 0 || strcmp (words[3], "") == 0)
+    {
+      fprintf (stderr, "ERROR: decoding requires lwes:<iface>:<ip>:<port>\n");
+      goto END;
+    }
+
+  listener = lwes_listener_create ((LWES_SHORT_STRING) words[2],
+                                   strcmp (words[1], "") != 0
+                                     ? (LWES_SHORT_STRING) words[1] : NULL,
+                                   (LWES_U_INT_32) atoi (words[3]));
+  dictionary = m_hash_table_create ();
+  if (listener == NULL || dictionary == NULL)
+    {
+      fprintf (stderr, "ERROR: unable to listen on %s\n", arg);
+      goto END;
+    }
+
+  ret = 0;
+  while (1)
+    {
+      event = lwes_event_create_no_name (NULL);
+      if (event == NULL)
+        {
+          ret = 1;
+          break;
+        }
+      if (lwes_listener_recv (listener, event) > 0
+          && lwes_event_get_name (event, &event_name) == 0
+          && event_name != NULL)
+        {
+          if (strcmp (event_name, "MonDemand::LogDict") == 0)
+            {
+              decode_dictionary_event (event, dictionary);
+            }
+          else if (strcmp (event_name, "MonDemand::LogMsg") == 0
+                   || strcmp (event_name, "MonDemand::DictLogMsg") == 0)
+            {
+              decode_log_event (event, dictionary);
+            }
+        }
+      lwes_event_destroy (event);
+    }
+
+END:
+  if (listener != NULL)
+    {
+      lwes_listener_destroy (listener);
+    }
+  m_hash_table_destroy (dictionary);
+  free (tofree);
+  return ret;
+}
+
+/* sends each record in one spool segment through the transports, waiting
+   between them as the timestamps say divided by speed.  *first and *start
+   are the first record's timestamp and when it was sent, -1 before then */
+static int
+replay_segment (const char *path, double speed,
+                struct mondemand_transport *transports[], int count,
+                long long *first, long long *start, long long *records)
+{
+  struct m_spool_reader reader;
+  struct timespec now;
+  struct timespec wait;
+  const unsigned char *bytes = NULL;
+  size_t length = 0;
+  long long timestamp = 0;
+  long long delay = 0;
+  int errors = 0;
+  int ret;
+  int i;
+
+  if (m_spool_reader_open (&reader, path) != 0)
+    {
+      fprintf (stderr, "ERROR: %s is not a spool segment\n", path);
+      return -1;
+    }
+
+  while ((ret = m_spool_reader_next (&reader, &bytes, &length,
+                                     &timestamp)) == 1)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      if (*first < 0)
+        {
+          *first = timestamp;
+          *start = (long long) now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+        }
+      else if (speed > 0.0)
+        {
+          delay = *start + (long long) ((double) (timestamp - *first) / speed)
+                  - ((long long) now.tv_sec * 1000000LL + now.tv_nsec / 1000);
+          if (delay > 0)
+            {
+              wait.tv_sec = (time_t) (delay / 1000000LL);
+              wait.tv_nsec = (long) (delay % 1000000LL) * 1000L;
+              while (nanosleep (&wait, &wait) != 0 && errno == EINTR)
+                {
+                }
+            }
+        }
+      for (i = 0; i < count; ++i)
+        {
+          if (transports[i]->bytes_sender_function (bytes, length,
+                                                    transports[i]->userdata)
+              != 0)
+            {
+              errors++;
+            }
+        }
+      (*records)++;
+    }
+  m_spool_reader_close (&reader);
+
+  if (ret < 0)
+    {
+      fprintf (stderr, "ERROR: %s is corrupt after %lld records\n",
+               path, *records);
+      return -1;
+    }
+  return errors;
+}
+
+/* replays a spool, or a single segment, through the transports */
+static int
+replay_spool (const char *path, double speed,
+              struct mondemand_transport *transports[], int count)
+{
+  char **paths = NULL;
+  long long first = -1;
+  long long start = -1;
+  long long records = 0;
+  int segments = 0;
+  int errors = 0;
+  int ret = 0;
+  int i;
+
+  /* without segments of its own, path should be a segment */
+  if (m_spool_segments (path, &paths, &segments) != 0)
+    {
+      segments = 0;
+    }
+  for (i = 0; i < (segments > 0 ? segments : 1); ++i)
+    {
+      ret = replay_segment (segments > 0 ? paths[i] : path, speed,
+                            transports, count, &first, &start, &records);
+      if (ret < 0)
+        {
+          break;
+        }
+      errors += ret;
+    }
+  m_spool_segments_free (paths, segments);
+
+  if (errors > 0)
+    {
+      fprintf (stderr, "ERROR: %d of %lld records failed to send\n",
+               errors, records);
+    }
+  return (ret < 0 || errors > 0) ? 1 : 0;
+}
+
+/* forwards what's written to a shared memory ring through the transports
+   until interrupted */
+static int
+drain_ring (const char *path, struct mondemand_transport *transports[],
+            int count)
+{
+  struct m_ring *ring = NULL;
+  const unsigned char *bytes = NULL;
+  size_t length = 0;
+  long long drops = 0;
+  int i;
+
+  ring = m_ring_open (path, 0);
+  if (ring == NULL)
+    {
+      fprintf (stderr, "ERROR: unable to open ring %s\n", path);
+      return 1;
+    }
+  /* anything left by an earlier reader is still there to be sent */
+  drops = m_ring_drops (ring);
+  while (1)
+    {
+      if (m_ring_peek (ring, &bytes, &length) == 0)
+        {
+          if (m_ring_drops (ring) != drops)
+            {
+              fprintf (stderr, "WARNING: %lld events dropped while the ring "
+                               "was full\n", m_ring_drops (ring) - drops);
+              drops = m_ring_drops (ring);
+            }
+          m_ring_wait (ring, 1000);
+          continue;
+        }
+      for (i = 0; i < count; ++i)
+        {
+          transports[i]->bytes_sender_function (bytes, length,
+                                                transports[i]->userdata);
+        }
+      m_ring_release (ring);
+    }
+
+  m_ring_close (ring);
+  return 0;
+}
+
+/* options with no short form */
+static const struct option long_options[] =
+{
+  { "replay", required_argument, NULL, 'R' },
+  { "speed",  required_argument, NULL, 'S' },
+  { "ring",   required_argument, NULL, 'r' },
+  { "help",   no_argument,       NULL, 'h' },
+  { NULL,     0,                 NULL, 0   }
+};
+
+/* most transports --replay and --ring forward to */
+#define MAX_FORWARD_TRANSPORTS 16
+
+/* creates the -o transports for modes which hand them encoded bytes.
+   Returns how many there are, or -1 if any can't take them */
+static int
+forward_transports (int argc, char *argv[], const char *args,
+                    struct mondemand_transport *transports[])
+{
+  struct mondemand_transport *transport = NULL;
+  int count = 0;
+  int ret = 0;
+
+  optind = 1;
+  while (1)
+    {
+      int c = getopt_long (argc, argv, args, long_options, NULL);
+
+      if (c == -1)
+        {
+          break;
+        }
+      if (c != 'o')
+        {
+          continue;
+        }
+      transport = handle_transport_arg (optarg);
+      if (transport == NULL)
+        {
+          fprintf (stderr, "WARNING: unable to add transport %s\n", optarg);
+        }
+      else if (transport->bytes_sender_function == NULL
+               || count == MAX_FORWARD_TRANSPORTS)
+        {
+          fprintf (stderr, "ERROR: can't forward through transport %s\n",
+                   optarg);
+          transport->destroy_function (transport);
+          ret = -1;
+        }
+      else
+        {
+          transports[count++] = transport;
+        }
+    }
+  if (count == 0 && ret == 0)
+    {
+      fprintf (stderr,
+               "ERROR: must specify at least one transport with '-o'\n");
+    }
+  if (ret != 0)
+    {
+      while (count > 0)
+        {
+          transport = transports[--count];
+          transport->destroy_function (transport);
+        }
+      return -1;
+    }
+  return count;
+}
+
 int main (int   argc,
           char *argv[])
 {
   const char *prog_id = "mondemand-tool";
-  const char *args = "p:T:o:c:l:s:t:X:x:A:a:h";
+  const char *args = "p:T:o:c:l:s:t:X:x:A:a:d:h";
+  const char *decode_arg = NULL;
+  const char *replay_arg = NULL;
+  const char *ring_arg = NULL;
+  double speed = 1.0;
+  struct mondemand_transport *forward[MAX_FORWARD_TRANSPORTS];
 
   struct mondemand_client *client = NULL;
   struct mondemand_transport *transport = NULL;
@@ -695,7 +1398,7 @@ int main (int   argc,
   /* get the program id */
   while (1)
     {
-      char c = getopt (argc, argv, args);
+      int c = getopt_long (argc, argv, args, long_options, NULL);
 
       if (c == -1)
         {
@@ -718,6 +1421,27 @@ int main (int   argc,
             annotation_text_count++;
             break;
 
+          case 'd':
+            decode_arg = optarg;
+            break;
+
+          case 'R':
+            replay_arg = optarg;
+            break;
+
+          case 'r':
+            ring_arg = optarg;
+            break;
+
+          case 'S':
+            speed = atof (optarg);
+            if (speed < 0.0)
+              {
+                fprintf (stderr, "ERROR: --speed can't be negative\n");
+                return 1;
+              }
+            break;
+
           /* deal with these below */
           case 'T':
           case 'o':
@@ -751,6 +1475,34 @@ int main (int   argc,
                "ERROR: can't specify '-A' more than once\n");
       exit (1);
     }
+  if (decode_arg != NULL)
+    {
+      return decode_logs (decode_arg);
+    }
+  if (replay_arg != NULL || ring_arg != NULL)
+    {
+      /* these only need the transports, which are handed the spooled or
+         shared bytes directly */
+      transport_count = forward_transports (argc, argv, args, forward);
+      if (transport_count <= 0)
+        {
+          return 1;
+        }
+      if (replay_arg != NULL)
+        {
+          ret = replay_spool (replay_arg, speed, forward, transport_count);
+        }
+      else
+        {
+          ret = drain_ring (ring_arg, forward, transport_count);
+        }
+      while (transport_count > 0)
+        {
+          transport = forward[--transport_count];
+          transport->destroy_function (transport);
+        }
+      return ret;
+    }
 
   /* create the client */
   client = mondemand_client_create (prog_id);
@@ -766,7 +1518,7 @@ int main (int   argc,
   optind = 1;
   while (1)
     {
-      char c = getopt (argc, argv, args);
+      int c = getopt_long (argc, argv, args, long_options, NULL);
 
       if (c == -1)
         {
@@ -833,7 +1585,7 @@ int main (int   argc,
   optind = 1;
   while (1)
     {
-      char c = getopt (argc, argv, args);
+      int c = getopt_long (argc, argv, args, long_options, NULL);
 
       if (c == -1)
         {
@@ -874,7 +1626,7 @@ int main (int   argc,
   optind = 1;
   while (1)
     {
-      char c = getopt (argc, argv, args);
+      int c = getopt_long (argc, argv, args, long_options, NULL);
 
       if (c == -1)
         {
@@ -9,12 +9,42 @@
  * See the License for the specific language governing permissions and  *
  * limitations under the License. See accompanying LICENSE file.        *
  *======================================================================*/
+#include "config.h"
+
+#ifdef HAVE_SENDMMSG
+/* sendmmsg is a GNU extension */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(HAVE_LIBURING) && defined(HAVE_SENDMMSG)
+/* io_uring sends reuse the msghdrs set up for sendmmsg */
+#define M_HAVE_URING 1
+#include <liburing.h>
+#endif
 
 #include "lwes.h"
+#include "m_buffer.h"
 #include "m_mem.h"
+#include "m_hash.h"
+#include "m_format.h"
+#include "m_lwes.h"
+#include "m_protobuf.h"
+#include "m_ring.h"
+#include "m_spool.h"
+#include "m_statsd.h"
+#include "m_stream.h"
 #include "mondemandlib.h"
 #include "mondemand_trace.h"
 #include "mondemand_transport.h"
@@ -24,8 +54,497 @@
 #define LWES_TRACE_MSG "MonDemand::TraceMsg"
 #define LWES_PERF_MSG "MonDemand::PerfMsg"
 #define LWES_ANNOTATION_MSG "MonDemand::AnnotationMsg"
+#define LWES_LOG_DICT "MonDemand::LogDict"
+#define LWES_DICT_LOG_MSG "MonDemand::DictLogMsg"
+
+/* most dictionary entries sent in a single event */
+#define M_DICTIONARY_BATCH 16
+
+/* most datagrams a native transport hands to the kernel in one call */
+#define M_NATIVE_BATCH 64
+
+/* segment size of spool transports unless they're given one */
+#define M_SPOOL_SEGMENT_SIZE (64LL * 1024 * 1024)
+
+/* stream transport defaults */
+#define M_STREAM_BUFFER_SIZE (1024 * 1024)
+#define M_STREAM_BACKOFF_MIN_MS 100
+#define M_STREAM_BACKOFF_MAX_MS 10000
+
+/* statsd datagrams unless they're given a size, what statsd suggests for
+   ethernet, and the room for a flush's tags */
+#define M_STATSD_DATAGRAM 1432
+#define M_STATSD_TAGS_MAX 4096
+
+/* OTLP protobuf tags, fields of opentelemetry/proto/{collector,common,
+   resource,metrics,trace}/v1.  Export*ServiceRequest, Resource* and
+   Scope* messages for metrics and spans share their field numbers */
+#define M_OTLP_REQUEST_RESOURCE     M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_RESOURCE             M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_RESOURCE_SCOPE       M_PROTOBUF_TAG(2, M_PROTOBUF_BYTES)
+#define M_OTLP_SCOPE                M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_SCOPE_ITEM           M_PROTOBUF_TAG(2, M_PROTOBUF_BYTES)
+#define M_OTLP_ATTRIBUTES           M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_SCOPE_NAME           M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_SCOPE_VERSION        M_PROTOBUF_TAG(2, M_PROTOBUF_BYTES)
+#define M_OTLP_KEY                  M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_VALUE                M_PROTOBUF_TAG(2, M_PROTOBUF_BYTES)
+#define M_OTLP_STRING_VALUE         M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_METRIC_NAME          M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_METRIC_GAUGE         M_PROTOBUF_TAG(5, M_PROTOBUF_BYTES)
+#define M_OTLP_METRIC_SUM           M_PROTOBUF_TAG(7, M_PROTOBUF_BYTES)
+#define M_OTLP_DATA_POINT           M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_SUM_TEMPORALITY      M_PROTOBUF_TAG(2, M_PROTOBUF_VARINT)
+#define M_OTLP_SUM_MONOTONIC        M_PROTOBUF_TAG(3, M_PROTOBUF_VARINT)
+#define M_OTLP_POINT_START          M_PROTOBUF_TAG(2, M_PROTOBUF_FIXED64)
+#define M_OTLP_POINT_TIME           M_PROTOBUF_TAG(3, M_PROTOBUF_FIXED64)
+#define M_OTLP_POINT_INT            M_PROTOBUF_TAG(6, M_PROTOBUF_FIXED64)
+#define M_OTLP_SPAN_TRACE_ID        M_PROTOBUF_TAG(1, M_PROTOBUF_BYTES)
+#define M_OTLP_SPAN_ID              M_PROTOBUF_TAG(2, M_PROTOBUF_BYTES)
+#define M_OTLP_SPAN_PARENT_ID       M_PROTOBUF_TAG(4, M_PROTOBUF_BYTES)
+#define M_OTLP_SPAN_NAME            M_PROTOBUF_TAG(5, M_PROTOBUF_BYTES)
+#define M_OTLP_SPAN_KIND            M_PROTOBUF_TAG(6, M_PROTOBUF_VARINT)
+#define M_OTLP_SPAN_START           M_PROTOBUF_TAG(7, M_PROTOBUF_FIXED64)
+#define M_OTLP_SPAN_END             M_PROTOBUF_TAG(8, M_PROTOBUF_FIXED64)
+#define M_OTLP_SPAN_ATTRIBUTES      M_PROTOBUF_TAG(9, M_PROTOBUF_BYTES)
+/* room kept while writing items for the lengths of the two messages left
+   open around them to grow when they're closed */
+#define M_OTLP_CLOSE_ROOM 8
+/* AGGREGATION_TEMPORALITY_CUMULATIVE and SPAN_KIND_INTERNAL */
+#define M_OTLP_CUMULATIVE 2
+#define M_OTLP_INTERNAL 1
+
+/* state kept by lwes transports */
+struct m_lwes_transport
+{
+  struct lwes_emitter *emitter;
+  /* call sites sent in the dictionary, NULL if log messages are sent as
+     text, otherwise a map from the hex id to a m_lwes_dictionary_entry */
+  struct m_hash_table *dictionary;
+  /* seconds between sending the whole dictionary again */
+  int dictionary_interval;
+  time_t dictionary_sent;
+};
+
+/* state kept by file descriptor transports, what they format goes in
+   buffer until it's written */
+struct m_fd_transport
+{
+  int fd;
+  /* non-zero if the transport opened fd, so closes it */
+  int close_fd;
+  MondemandFdMode mode;
+  size_t block_size;
+  struct m_buffer buffer;
+};
+
+/* state kept by native lwes transports, events are written into buffer
+   and sent without going through liblwes */
+struct m_native_transport
+{
+  int fd;
+  struct sockaddr_in address;
+  /* largest datagram sent, flushes are split to fit */
+  size_t max_datagram;
+  /* most datagrams sent with one sendmmsg, 1 to use sendto */
+  int batch;
+  struct mondemand_native_stats stats;
+  /* datagrams written but not sent yet, most of them in buffer which is
+     used up to used */
+  struct iovec pending[M_NATIVE_BATCH];
+  int pending_count;
+  size_t used;
+  /* set once sending part of the current flush fails */
+  int failed;
+  /* for spool, shared memory and stream transports, where datagrams are
+     written instead of to fd */
+  struct m_spool_writer *spool;
+  struct m_ring *shm_ring;
+  struct m_stream *stream;
+  /* non-zero if fd is a file, datagrams are appended to it as frames like
+     the stream's */
+  int file;
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr messages[M_NATIVE_BATCH];
+#endif
+#ifdef M_HAVE_URING
+  /* non-zero to send through ring instead */
+  int uring;
+  struct io_uring ring;
+  /* submissions left in ring by a failed flush, still to complete */
+  int uring_stale;
+#endif
+  unsigned char buffer[MONDEMAND_ENCODED_MAX];
+};
+
+/* state kept by statsd transports, lines are written into the native
+   transport's buffer and sent by it, so native has to come first */
+struct m_statsd_transport
+{
+  struct m_native_transport native;
+  /* non-zero for plain StatsD, with the program identifier in the name
+     rather than in tags */
+  int plain;
+  /* the last total sent for each counter, StatsD counters are deltas */
+  struct m_hash_table *counters;
+  /* the tags every line of the current flush ends with */
+  char tags[M_STATSD_TAGS_MAX];
+  size_t tags_length;
+};
+
+/* state kept by otlp transports, requests are written into the native
+   transport's buffer and framed by it, so native has to come first */
+struct m_otlp_transport
+{
+  struct m_native_transport native;
+  /* when the transport was created, the start of its cumulative sums */
+  unsigned long long start_ns;
+};
+
+/* what the otlp packer needs to know about a stats or perf flush: the
+   service and contexts every request's resource has, and how to write
+   item i into the request's scope.  Items of a perf flush are the span of
+   the whole trace then a span for each timing */
+struct m_otlp_flush
+{
+  int kind;
+  const char *service;
+  const struct mondemand_context *contexts;
+  int context_count;
+  int count;
+  void (*item) (struct m_protobuf_writer *writer,
+                const struct m_otlp_flush *flush, int i);
+  const void *items;
+  const char *id;
+  unsigned long long start_ns;
+  unsigned long long time_ns;
+  unsigned char trace_id[16];
+  unsigned char span_id[8];
+};
+
+/* what the native packer needs to know about a log, stats or perf event:
+   the header attributes before num, and how to write item i with the
+   index it gets in the datagram it lands in */
+struct m_native_event
+{
+  const char *name;
+  void (*header) (struct m_lwes_writer *writer,
+                  const struct m_native_event *event);
+  void (*item) (struct m_lwes_writer *writer,
+                const struct m_native_event *event, int i, int index);
+  const char *strings[2];
+  const void *items;
+  int count;
+  const struct mondemand_context *contexts;
+  int context_count;
+  const struct mondemand_context_block *block;
+};
+
+/* a call site and format in the dictionary, allocated with its strings */
+struct m_lwes_dictionary_entry
+{
+  unsigned int id;
+  int line;
+  char *filename;
+  char *format;
+};
 
 /* private method forward declarations */
+static struct mondemand_transport *mondemand_transport_lwes_create_real(
+                      const char *address, const int port,
+                      const char *interface, int emit_heartbeat,
+                      int heartbeat_frequency, int ttl,
+                      int dictionary_interval);
+static struct lwes_event *mondemand_transport_lwes_log_event(
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      struct m_lwes_transport *lwes,
+                      struct lwes_event **dictionary_event,
+                      int *dictionary_count);
+static struct lwes_event *mondemand_transport_lwes_stats_event(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count);
+static struct lwes_event *mondemand_transport_lwes_perf_event(
+                      const char *id,
+                      const char *caller_label,
+                      const struct mondemand_timing timings[],
+                      const int timings_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count);
+static void mondemand_transport_lwes_set_contexts(
+                      struct lwes_event *event,
+                      const struct mondemand_context contexts[],
+                      const int context_count);
+static int mondemand_transport_lwes_encode(
+                      struct lwes_event *event,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length);
+static int mondemand_transport_lwes_log_encoder(
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length);
+static int mondemand_transport_lwes_stats_encoder(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length);
+static int mondemand_transport_lwes_perf_encoder(
+                      const char *id,
+                      const char *caller_label,
+                      const struct mondemand_timing timings[],
+                      const int timings_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length);
+static int mondemand_transport_lwes_context_encoder(
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      unsigned char *buffer, size_t size, size_t *length,
+                      int *count);
+static struct m_fd_transport *mondemand_transport_fd_begin(
+                      void *userdata,
+                      struct m_fd_transport *local);
+static int mondemand_transport_fd_end(
+                      struct m_fd_transport *fd,
+                      struct m_fd_transport *local);
+static int mondemand_transport_fd_write(
+                      struct m_fd_transport *fd);
+static int mondemand_transport_native_socket(
+                      struct m_native_transport *native,
+                      const char *address, const int port,
+                      const char *interface,
+                      const struct mondemand_native_options *opts);
+static void mondemand_transport_native_contexts(
+                      struct m_lwes_writer *writer,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block);
+static void mondemand_transport_native_typed(
+                      struct m_lwes_writer *writer,
+                      const struct mondemand_log_field *field);
+static void mondemand_transport_native_prog_id(
+                      struct m_lwes_writer *writer,
+                      const struct m_native_event *event);
+static void mondemand_transport_native_log_item(
+                      struct m_lwes_writer *writer,
+                      const struct m_native_event *event,
+                      int i, int index);
+static void mondemand_transport_native_stats_item(
+                      struct m_lwes_writer *writer,
+                      const struct m_native_event *event,
+                      int i, int index);
+static void mondemand_transport_native_perf_header(
+                      struct m_lwes_writer *writer,
+                      const struct m_native_event *event);
+static void mondemand_transport_native_perf_item(
+                      struct m_lwes_writer *writer,
+                      const struct m_native_event *event,
+                      int i, int index);
+static int mondemand_transport_native_pack(
+                      const struct m_native_event *event,
+                      unsigned char *buffer, size_t size,
+                      struct m_native_transport *native,
+                      size_t *length);
+static void mondemand_transport_native_log_event(
+                      struct m_native_event *event,
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block);
+static void mondemand_transport_native_stats_event(
+                      struct m_native_event *event,
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block);
+static void mondemand_transport_native_perf_event(
+                      struct m_native_event *event,
+                      const char *id,
+                      const char *caller_label,
+                      const struct mondemand_timing timings[],
+                      const int timings_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block);
+static unsigned char *mondemand_transport_native_slot(
+                      struct m_native_transport *native);
+static void mondemand_transport_native_queue(
+                      struct m_native_transport *native,
+                      const unsigned char *bytes,
+                      const size_t length);
+static int mondemand_transport_native_send(
+                      struct m_native_transport *native);
+static void mondemand_transport_native_send_spool(
+                      struct m_native_transport *native);
+static void mondemand_transport_native_send_ring(
+                      struct m_native_transport *native);
+static void mondemand_transport_native_send_stream(
+                      struct m_native_transport *native);
+static void mondemand_transport_native_send_file(
+                      struct m_native_transport *native);
+static int mondemand_transport_statsd_tags(
+                      struct m_statsd_transport *statsd,
+                      const char *program_identifier,
+                      const struct mondemand_context contexts[],
+                      const int context_count);
+static int mondemand_transport_statsd_value(
+                      struct m_statsd_transport *statsd,
+                      const struct mondemand_stats_message *stat,
+                      long long *value);
+static void mondemand_transport_statsd_line(
+                      struct m_statsd_transport *statsd,
+                      struct m_statsd_writer *writer,
+                      const char *program_identifier,
+                      const struct mondemand_stats_message *stat,
+                      long long value);
+static struct mondemand_transport *mondemand_transport_otlp_local(
+                      struct m_otlp_transport *otlp);
+static int mondemand_transport_otlp_send(
+                      struct m_otlp_transport *otlp,
+                      const struct m_otlp_flush *flush);
+static void mondemand_transport_otlp_attribute(
+                      struct m_protobuf_writer *writer,
+                      unsigned char tag, const char *key,
+                      const char *value);
+static void mondemand_transport_otlp_metric(
+                      struct m_protobuf_writer *writer,
+                      const struct m_otlp_flush *flush, int i);
+static void mondemand_transport_otlp_span(
+                      struct m_protobuf_writer *writer,
+                      const struct m_otlp_flush *flush, int i);
+static void mondemand_transport_otlp_id(
+                      const char *id, unsigned long long salt,
+                      unsigned char bytes[8]);
+static unsigned long long mondemand_transport_otlp_now(void);
+static int mondemand_transport_otlp_stats_sender(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      void *userdata);
+static int mondemand_transport_otlp_perf_sender(
+                      const char *id,
+                      const char *caller_label,
+                      const struct mondemand_timing timings[],
+                      const int timings_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      void *userdata);
+static int mondemand_transport_native_stream(
+                      struct m_native_transport *native,
+                      const char *address,
+                      const struct mondemand_stream_options *opts);
+static struct mondemand_transport *mondemand_transport_native_local(
+                      struct m_native_transport *native,
+                      mondemand_transport_destroy_t destroy);
+#ifdef M_HAVE_URING
+static int mondemand_transport_native_drain_uring(
+                      struct m_native_transport *native);
+static void mondemand_transport_native_send_uring(
+                      struct m_native_transport *native);
+#endif
+static void mondemand_transport_native_flush(
+                      struct m_native_transport *native);
+static int mondemand_transport_native_log_encoder(
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length);
+static int mondemand_transport_native_stats_encoder(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length);
+static int mondemand_transport_native_perf_encoder(
+                      const char *id,
+                      const char *caller_label,
+                      const struct mondemand_timing timings[],
+                      const int timings_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length);
+static int mondemand_transport_native_bytes_sender(
+                      const unsigned char *bytes,
+                      const size_t length,
+                      void *userdata);
+static int mondemand_transport_native_log_sender(
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      void *userdata);
+static int mondemand_transport_native_stats_sender(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      void *userdata);
+static int mondemand_transport_native_trace_sender(
+                      const char *program_identifier,
+                      const char *owner,
+                      const char *trace_id,
+                      const char *message,
+                      const struct mondemand_trace traces[],
+                      const int trace_count,
+                      void *userdata);
+static int mondemand_transport_native_perf_sender(
+               const char *id,
+               const char *caller_label,
+               const struct mondemand_timing timings[],
+               const int timings_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               void *userdata);
+static int mondemand_transport_native_annotation_sender(
+               const char *id,
+               const long long int timestamp,
+               const char *description,
+               const char *text,
+               const char *tags[],
+               const int tag_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               void *userdata);
+static int mondemand_transport_statsd_stats_sender(
+               const char *program_identifier,
+               const struct mondemand_stats_message stats[],
+               const int message_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               void *userdata);
+static int mondemand_transport_lwes_bytes_sender(
+                      const unsigned char *bytes,
+                      const size_t length,
+                      void *userdata);
+
 int mondemand_transport_stderr_log_sender(
                       const char *program_identifier,
                       const struct mondemand_log_message messages[],
@@ -116,20 +635,90 @@ int mondemand_transport_lwes_annotation_sender(
                const int context_count,
                void *userdata);
 
+/* every lwes transport with the same encoding sends identical events, so
+   they are encoded once for all of them */
+const struct mondemand_encoding mondemand_encoding_lwes =
+{
+  "lwes",
+  &mondemand_transport_lwes_log_encoder,
+  &mondemand_transport_lwes_stats_encoder,
+  &mondemand_transport_lwes_perf_encoder,
+  &mondemand_transport_lwes_context_encoder
+};
+
+const struct mondemand_encoding mondemand_encoding_lwes_dictionary =
+{
+  "lwes-dictionary",
+  NULL,
+  &mondemand_transport_lwes_stats_encoder,
+  &mondemand_transport_lwes_perf_encoder,
+  &mondemand_transport_lwes_context_encoder
+};
+
+/* native transports put the same bytes on the wire, but write them
+   directly rather than building liblwes events */
+const struct mondemand_encoding mondemand_encoding_lwes_native =
+{
+  "lwes-native",
+  &mondemand_transport_native_log_encoder,
+  &mondemand_transport_native_stats_encoder,
+  &mondemand_transport_native_perf_encoder,
+  &mondemand_transport_lwes_context_encoder
+};
+
 /*=========================================================================*/
 /* Pubilc API Methods                                                      */
 /*=========================================================================*/
 
+int
+mondemand_transport_init(struct mondemand_transport *transport, int version)
+{
+  if( transport == NULL || version < 0
+      || version > MONDEMAND_TRANSPORT_VERSION )
+    {
+      return -2;
+    }
+
+  memset(transport, 0, sizeof(*transport));
+  transport->version = version;
+
+  return 0;
+}
+
 struct mondemand_transport *
 mondemand_transport_stderr_create(void)
+{
+  return mondemand_transport_fd_create(STDERR_FILENO, MONDEMAND_FD_LINE, 0);
+}
+
+void
+mondemand_transport_stderr_destroy(struct mondemand_transport *transport)
+{
+  mondemand_transport_fd_destroy(transport);
+}
+
+struct mondemand_transport *
+mondemand_transport_fd_create(int fd, MondemandFdMode mode, int block_size)
 {
   struct mondemand_transport *transport = NULL;
+  struct m_fd_transport *out = NULL;
+
+  if( fd < 0 || block_size < 0
+      || (mode != MONDEMAND_FD_LINE && mode != MONDEMAND_FD_BLOCK) )
+    {
+      return NULL;
+    }
 
   transport = (struct mondemand_transport *)
     m_try_malloc0(sizeof(struct mondemand_transport));
+  out = (struct m_fd_transport *)
+    m_try_malloc0(sizeof(struct m_fd_transport));
 
-  if( transport != NULL )
+  if( transport != NULL && out != NULL )
     {
+      out->fd = fd;
+      out->mode = mode;
+      out->block_size = block_size > 0 ? (size_t) block_size : 65536;
       transport->log_sender_function =
         &mondemand_transport_stderr_log_sender;
       transport->stats_sender_function =
@@ -141,16 +730,65 @@ mondemand_transport_stderr_create(void)
       transport->annotation_sender_function =
         &mondemand_transport_stderr_annotation_sender;
       transport->destroy_function =
-        &mondemand_transport_stderr_destroy;
-      transport->userdata = NULL; /* not used */
+        &mondemand_transport_fd_destroy;
+      transport->userdata =
+        out;
+      return transport;
+    }
+
+  m_free(out);
+  m_free(transport);
+  return NULL;
+}
+
+struct mondemand_transport *
+mondemand_transport_file_create(const char *path, MondemandFdMode mode,
+                                int block_size)
+{
+  struct mondemand_transport *transport = NULL;
+  int fd = -1;
+
+  if( path == NULL )
+    {
+      return NULL;
+    }
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if( fd < 0 )
+    {
+      return NULL;
+    }
+  transport = mondemand_transport_fd_create(fd, mode, block_size);
+  if( transport == NULL )
+    {
+      close(fd);
+      return NULL;
     }
+  ((struct m_fd_transport *) transport->userdata)->close_fd = 1;
 
   return transport;
 }
 
 void
-mondemand_transport_stderr_destroy(struct mondemand_transport *transport)
+mondemand_transport_fd_destroy(struct mondemand_transport *transport)
 {
+  struct m_fd_transport *out = NULL;
+
+  if( transport != NULL )
+    {
+      out = (struct m_fd_transport *) transport->userdata;
+      if( out != NULL )
+        {
+          /* anything still held in block mode */
+          mondemand_transport_fd_write(out);
+          if( out->close_fd )
+            {
+              close(out->fd);
+            }
+          m_buffer_free(&out->buffer);
+          m_free(out);
+        }
+    }
+
   m_free(transport);
 }
 
@@ -168,68 +806,564 @@ struct mondemand_transport *mondemand_transport_lwes_create_with_ttl(
                                const char *address, const int port,
                                const char *interface, int emit_heartbeat,
                                int heartbeat_frequency, int ttl)
+{
+  return mondemand_transport_lwes_create_real(address, port, interface,
+                                              emit_heartbeat,
+                                              heartbeat_frequency, ttl, -1);
+}
+
+struct mondemand_transport *mondemand_transport_lwes_dictionary_create(
+                               const char *address, const int port,
+                               const char *interface, int emit_heartbeat,
+                               int heartbeat_frequency, int ttl,
+                               int dictionary_interval)
+{
+  if( dictionary_interval < 0 )
+    {
+      return NULL;
+    }
+  return mondemand_transport_lwes_create_real(address, port, interface,
+                                              emit_heartbeat,
+                                              heartbeat_frequency, ttl,
+                                              dictionary_interval);
+}
+
+void mondemand_transport_lwes_destroy(struct mondemand_transport *transport)
+{
+  struct m_lwes_transport *lwes = NULL;
+
+  if( transport != NULL )
+    {
+      lwes = (struct m_lwes_transport *) transport->userdata;
+      if( lwes != NULL )
+        {
+          lwes_emitter_destroy(lwes->emitter);
+          m_hash_table_destroy(lwes->dictionary);
+          m_free(lwes);
+        }
+    }
+
+  m_free(transport);
+}
+
+struct mondemand_transport *mondemand_transport_lwes_native_create(
+                               const char *address, const int port,
+                               const char *interface, int ttl)
+{
+  struct mondemand_native_options opts;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.ttl = ttl;
+
+  return mondemand_transport_lwes_native_create_with_options(address, port,
+                                                             interface,
+                                                             &opts);
+}
+
+struct mondemand_transport *mondemand_transport_lwes_native_create_with_options(
+                               const char *address, const int port,
+                               const char *interface,
+                               const struct mondemand_native_options *opts)
 {
   struct mondemand_transport *transport = NULL;
-  struct lwes_emitter *emitter = NULL;
+  struct m_native_transport *native = NULL;
+
+  if( opts == NULL || opts->max_datagram < 0 || opts->sndbuf < 0
+      || opts->batch < 0 )
+    {
+      return NULL;
+    }
 
   transport = (struct mondemand_transport *)
     m_try_malloc0(sizeof(struct mondemand_transport));
+  native = (struct m_native_transport *)
+    m_try_malloc0(sizeof(struct m_native_transport));
 
-  if( transport != NULL )
+  if( transport != NULL && native != NULL )
     {
-      emitter =
-        lwes_emitter_create_with_ttl ((LWES_SHORT_STRING) address,
-                                      (LWES_SHORT_STRING) interface,
-                                      (LWES_U_INT_32) port,
-                                      emit_heartbeat,
-                                      heartbeat_frequency,
-                                      ttl);
-      if (emitter != NULL)
+      if( mondemand_transport_native_socket(native, address, port,
+                                            interface, opts) == 0 )
         {
+          native->batch = M_NATIVE_BATCH;
+          if( opts->batch > 0 && opts->batch < M_NATIVE_BATCH )
+            {
+              native->batch = opts->batch;
+            }
+          native->max_datagram = MONDEMAND_ENCODED_MAX;
+          if( opts->max_datagram > 0
+              && opts->max_datagram < MONDEMAND_ENCODED_MAX )
+            {
+              native->max_datagram = (size_t) opts->max_datagram;
+            }
           transport->log_sender_function =
-            &mondemand_transport_lwes_log_sender;
+            &mondemand_transport_native_log_sender;
           transport->stats_sender_function =
-            &mondemand_transport_lwes_stats_sender;
+            &mondemand_transport_native_stats_sender;
           transport->trace_sender_function =
-            &mondemand_transport_lwes_trace_sender;
+            &mondemand_transport_native_trace_sender;
           transport->perf_sender_function =
-            &mondemand_transport_lwes_perf_sender;
+            &mondemand_transport_native_perf_sender;
           transport->annotation_sender_function =
-            &mondemand_transport_lwes_annotation_sender;
+            &mondemand_transport_native_annotation_sender;
           transport->destroy_function =
-            &mondemand_transport_lwes_destroy;
+            &mondemand_transport_lwes_native_destroy;
           transport->userdata =
-            emitter;
+            native;
+          /* the shared encoding fills whole 64K datagrams, smaller ones
+             are packed by the transport's own senders */
+          if( native->max_datagram == MONDEMAND_ENCODED_MAX )
+            {
+              transport->version =
+                MONDEMAND_TRANSPORT_VERSION_ENCODING;
+              transport->encoding =
+                &mondemand_encoding_lwes_native;
+              transport->bytes_sender_function =
+                &mondemand_transport_native_bytes_sender;
+            }
+          return transport;
         }
-      else
+      if( native->fd >= 0 )
         {
-          m_free (transport);
-          transport = NULL;
+          close(native->fd);
         }
     }
 
-  return transport;
+  m_free(native);
+  m_free(transport);
+  return NULL;
+}
+
+int
+mondemand_transport_lwes_native_get_stats(
+                               struct mondemand_transport *transport,
+                               struct mondemand_native_stats *stats)
+{
+  /* spool, shared memory, stream, statsd and otlp transports are native
+     ones underneath */
+  if( transport == NULL || stats == NULL || transport->userdata == NULL
+      || (transport->log_sender_function
+            != &mondemand_transport_native_log_sender
+          && transport->destroy_function
+               != &mondemand_transport_statsd_destroy
+          && transport->destroy_function
+               != &mondemand_transport_otlp_destroy) )
+    {
+      return -2;
+    }
+  *stats = ((struct m_native_transport *) transport->userdata)->stats;
 
+  return 0;
 }
 
-void mondemand_transport_lwes_destroy(struct mondemand_transport *transport)
+void
+mondemand_transport_lwes_native_destroy(struct mondemand_transport *transport)
 {
+  struct m_native_transport *native = NULL;
+
   if( transport != NULL )
     {
-      if(transport->userdata != NULL )
+      native = (struct m_native_transport *) transport->userdata;
+      if( native != NULL )
         {
-          lwes_emitter_destroy(transport->userdata);
+#ifdef M_HAVE_URING
+          if( native->uring )
+            {
+              io_uring_queue_exit(&native->ring);
+            }
+#endif
+          if( native->fd >= 0 )
+            {
+              close(native->fd);
+            }
+          m_spool_writer_close(native->spool);
+          m_ring_close(native->shm_ring);
+          m_stream_destroy(native->stream);
+          m_free(native);
         }
     }
 
   m_free(transport);
 }
 
-/*==========================================================================*/
-/* Private API methods                                                      */
-/*==========================================================================*/
+struct mondemand_transport *
+mondemand_transport_spool_create(const char *path,
+                                 const struct mondemand_spool_options *opts)
+{
+  struct mondemand_transport *transport = NULL;
+  struct m_native_transport *native = NULL;
+  long long segment_size = M_SPOOL_SEGMENT_SIZE;
+  int rotate_seconds = 0;
 
-int
+  if( path == NULL
+      || (opts != NULL && (opts->segment_size < 0
+                           || opts->rotate_seconds < 0)) )
+    {
+      return NULL;
+    }
+  if( opts != NULL && opts->segment_size > 0 )
+    {
+      segment_size = opts->segment_size;
+    }
+  if( opts != NULL )
+    {
+      rotate_seconds = opts->rotate_seconds;
+    }
+
+  native = (struct m_native_transport *)
+    m_try_malloc0(sizeof(struct m_native_transport));
+  if( native != NULL )
+    {
+      native->spool = m_spool_writer_open(path, (size_t) segment_size,
+                                          rotate_seconds);
+      if( native->spool != NULL )
+        {
+          transport = mondemand_transport_native_local(
+                        native, &mondemand_transport_spool_destroy);
+          if( transport != NULL )
+            {
+              return transport;
+            }
+          m_spool_writer_close(native->spool);
+        }
+    }
+
+  m_free(native);
+  return NULL;
+}
+
+void
+mondemand_transport_spool_destroy(struct mondemand_transport *transport)
+{
+  mondemand_transport_lwes_native_destroy(transport);
+}
+
+struct mondemand_transport *
+mondemand_transport_shm_create(const char *path, long long capacity)
+{
+  struct mondemand_transport *transport = NULL;
+  struct m_native_transport *native = NULL;
+
+  if( path == NULL || capacity < 0 )
+    {
+      return NULL;
+    }
+
+  native = (struct m_native_transport *)
+    m_try_malloc0(sizeof(struct m_native_transport));
+  if( native != NULL )
+    {
+      native->shm_ring = m_ring_open(path, (size_t) capacity);
+      if( native->shm_ring != NULL )
+        {
+          transport = mondemand_transport_native_local(
+                        native, &mondemand_transport_shm_destroy);
+          if( transport != NULL )
+            {
+              return transport;
+            }
+          m_ring_close(native->shm_ring);
+        }
+    }
+
+  m_free(native);
+  return NULL;
+}
+
+void
+mondemand_transport_shm_destroy(struct mondemand_transport *transport)
+{
+  mondemand_transport_lwes_native_destroy(transport);
+}
+
+struct mondemand_transport *
+mondemand_transport_stream_create(const char *address)
+{
+  return mondemand_transport_stream_create_with_options(address, NULL);
+}
+
+struct mondemand_transport *
+mondemand_transport_stream_create_with_options(
+                               const char *address,
+                               const struct mondemand_stream_options *opts)
+{
+  struct mondemand_transport *transport = NULL;
+  struct m_native_transport *native = NULL;
+
+  native = (struct m_native_transport *)
+    m_try_malloc0(sizeof(struct m_native_transport));
+  if( native != NULL
+      && mondemand_transport_native_stream(native, address, opts) == 0 )
+    {
+      transport = mondemand_transport_native_local(
+                    native, &mondemand_transport_stream_destroy);
+      if( transport != NULL )
+        {
+          return transport;
+        }
+      m_stream_destroy(native->stream);
+    }
+
+  m_free(native);
+  return NULL;
+}
+
+int
+mondemand_transport_stream_get_stats(struct mondemand_transport *transport,
+                                     struct mondemand_stream_stats *stats)
+{
+  struct m_native_transport *native = NULL;
+  struct m_stream_stats counters;
+
+  if( transport == NULL || stats == NULL || transport->userdata == NULL
+      || transport->destroy_function != &mondemand_transport_stream_destroy )
+    {
+      return -2;
+    }
+  native = (struct m_native_transport *) transport->userdata;
+  m_stream_get_stats(native->stream, &counters);
+
+  stats->queued = counters.queued_frames;
+  stats->queued_bytes = counters.queued_bytes;
+  stats->sent = counters.sent_frames;
+  stats->sent_bytes = counters.sent_bytes;
+  stats->dropped_newest = counters.dropped_newest;
+  stats->dropped_oldest = counters.dropped_oldest;
+  stats->writes = counters.writes;
+  stats->connects = counters.connects;
+  stats->depth = counters.depth;
+  stats->depth_bytes = counters.depth_bytes;
+  stats->connected = counters.connected;
+
+  return 0;
+}
+
+void
+mondemand_transport_stream_destroy(struct mondemand_transport *transport)
+{
+  mondemand_transport_lwes_native_destroy(transport);
+}
+
+struct mondemand_transport *
+mondemand_transport_statsd_create(const char *address, const int port,
+                                  const struct mondemand_statsd_options *opts)
+{
+  struct mondemand_transport *transport = NULL;
+  struct m_statsd_transport *statsd = NULL;
+  struct mondemand_native_options native_opts;
+
+  if( opts != NULL && opts->max_datagram < 0 )
+    {
+      return NULL;
+    }
+  memset(&native_opts, 0, sizeof(native_opts));
+  native_opts.ttl = 1;
+  native_opts.batch = M_NATIVE_BATCH;
+  if( opts != NULL )
+    {
+      native_opts.nonblocking = opts->nonblocking;
+    }
+
+  transport = (struct mondemand_transport *)
+    m_try_malloc0(sizeof(struct mondemand_transport));
+  statsd = (struct m_statsd_transport *)
+    m_try_malloc0(sizeof(struct m_statsd_transport));
+  if( transport != NULL && statsd != NULL )
+    {
+      statsd->counters = m_hash_table_create();
+      if( statsd->counters != NULL
+          && mondemand_transport_native_socket(&statsd->native, address, port,
+                                               NULL, &native_opts) == 0 )
+        {
+          statsd->native.batch = M_NATIVE_BATCH;
+          statsd->native.max_datagram = M_STATSD_DATAGRAM;
+          if( opts != NULL && opts->max_datagram > 0 )
+            {
+              statsd->native.max_datagram =
+                opts->max_datagram < MONDEMAND_ENCODED_MAX
+                  ? (size_t) opts->max_datagram : MONDEMAND_ENCODED_MAX;
+            }
+          statsd->plain = (opts != NULL && opts->plain);
+          /* only stats are sent, the client doesn't build anything else */
+          transport->version =
+            MONDEMAND_TRANSPORT_VERSION;
+          transport->capabilities =
+            MONDEMAND_TRANSPORT_STATS | MONDEMAND_TRANSPORT_CONTEXTS;
+          transport->stats_sender_function =
+            &mondemand_transport_statsd_stats_sender;
+          transport->destroy_function =
+            &mondemand_transport_statsd_destroy;
+          transport->userdata =
+            statsd;
+          return transport;
+        }
+      if( statsd->native.fd >= 0 )
+        {
+          close(statsd->native.fd);
+        }
+      m_hash_table_destroy(statsd->counters);
+    }
+
+  m_free(statsd);
+  m_free(transport);
+  return NULL;
+}
+
+void
+mondemand_transport_statsd_destroy(struct mondemand_transport *transport)
+{
+  struct m_statsd_transport *statsd = NULL;
+
+  if( transport != NULL && transport->userdata != NULL )
+    {
+      statsd = (struct m_statsd_transport *) transport->userdata;
+      m_hash_table_destroy(statsd->counters);
+    }
+  mondemand_transport_lwes_native_destroy(transport);
+}
+
+struct mondemand_transport *
+mondemand_transport_otlp_create(const char *address,
+                                const struct mondemand_stream_options *opts)
+{
+  struct mondemand_transport *transport = NULL;
+  struct m_otlp_transport *otlp = NULL;
+
+  otlp = (struct m_otlp_transport *)
+    m_try_malloc0(sizeof(struct m_otlp_transport));
+  if( otlp != NULL
+      && mondemand_transport_native_stream(&otlp->native, address,
+                                           opts) == 0 )
+    {
+      transport = mondemand_transport_otlp_local(otlp);
+      if( transport != NULL )
+        {
+          return transport;
+        }
+      m_stream_destroy(otlp->native.stream);
+    }
+
+  m_free(otlp);
+  return NULL;
+}
+
+struct mondemand_transport *
+mondemand_transport_otlp_file_create(const char *path)
+{
+  struct mondemand_transport *transport = NULL;
+  struct m_otlp_transport *otlp = NULL;
+  int fd;
+
+  if( path == NULL )
+    {
+      return NULL;
+    }
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if( fd < 0 )
+    {
+      return NULL;
+    }
+
+  otlp = (struct m_otlp_transport *)
+    m_try_malloc0(sizeof(struct m_otlp_transport));
+  if( otlp != NULL )
+    {
+      transport = mondemand_transport_otlp_local(otlp);
+      if( transport != NULL )
+        {
+          otlp->native.fd = fd;
+          otlp->native.file = 1;
+          return transport;
+        }
+    }
+
+  close(fd);
+  m_free(otlp);
+  return NULL;
+}
+
+void
+mondemand_transport_otlp_destroy(struct mondemand_transport *transport)
+{
+  mondemand_transport_lwes_native_destroy(transport);
+}
+
+/*==========================================================================*/
+/* Private API methods                                                      */
+/*==========================================================================*/
+
+/* creates an lwes transport, dictionary_interval < 0 sends log messages as
+   text, otherwise it's how often in seconds the dictionary is resent */
+static struct mondemand_transport *
+mondemand_transport_lwes_create_real(const char *address, const int port,
+                                     const char *interface,
+                                     int emit_heartbeat,
+                                     int heartbeat_frequency, int ttl,
+                                     int dictionary_interval)
+{
+  struct mondemand_transport *transport = NULL;
+  struct m_lwes_transport *lwes = NULL;
+
+  transport = (struct mondemand_transport *)
+    m_try_malloc0(sizeof(struct mondemand_transport));
+  lwes = (struct m_lwes_transport *)
+    m_try_malloc0(sizeof(struct m_lwes_transport));
+
+  if( transport != NULL && lwes != NULL )
+    {
+      lwes->emitter =
+        lwes_emitter_create_with_ttl ((LWES_SHORT_STRING) address,
+                                      (LWES_SHORT_STRING) interface,
+                                      (LWES_U_INT_32) port,
+                                      emit_heartbeat,
+                                      heartbeat_frequency,
+                                      ttl);
+      if( dictionary_interval >= 0 )
+        {
+          lwes->dictionary = m_hash_table_create();
+          lwes->dictionary_interval = dictionary_interval;
+          lwes->dictionary_sent = time(NULL);
+        }
+
+      if( lwes->emitter != NULL
+          && (dictionary_interval < 0 || lwes->dictionary != NULL) )
+        {
+          transport->log_sender_function =
+            &mondemand_transport_lwes_log_sender;
+          transport->stats_sender_function =
+            &mondemand_transport_lwes_stats_sender;
+          transport->trace_sender_function =
+            &mondemand_transport_lwes_trace_sender;
+          transport->perf_sender_function =
+            &mondemand_transport_lwes_perf_sender;
+          transport->annotation_sender_function =
+            &mondemand_transport_lwes_annotation_sender;
+          transport->destroy_function =
+            &mondemand_transport_lwes_destroy;
+          transport->userdata =
+            lwes;
+          transport->version =
+            MONDEMAND_TRANSPORT_VERSION_ENCODING;
+          transport->encoding =
+            dictionary_interval < 0 ? &mondemand_encoding_lwes
+                                    : &mondemand_encoding_lwes_dictionary;
+          transport->bytes_sender_function =
+            &mondemand_transport_lwes_bytes_sender;
+          return transport;
+        }
+
+      if( lwes->emitter != NULL )
+        {
+          lwes_emitter_destroy(lwes->emitter);
+        }
+      m_hash_table_destroy(lwes->dictionary);
+    }
+
+  m_free(lwes);
+  m_free(transport);
+  return NULL;
+}
+
+int
 mondemand_transport_stderr_log_sender(
                       const char *program_identifier,
                       const struct mondemand_log_message messages[],
@@ -238,6 +1372,10 @@ mondemand_transport_stderr_log_sender(
                       const int context_count,
                       void *userdata)
 {
+  struct m_fd_transport local;
+  struct m_fd_transport *fd = mondemand_transport_fd_begin(userdata, &local);
+  struct m_buffer *out = &fd->buffer;
+  const struct mondemand_log_field *field = NULL;
   int i=0;
   int j=0;
 
@@ -246,40 +1384,63 @@ mondemand_transport_stderr_log_sender(
       if (messages[i].level >= M_LOG_EMERG
           && messages[i].level <= M_LOG_ALL)
         {
-          fprintf (stderr, "[%s]", program_identifier);
+          m_buffer_printf (out, "[%s]", program_identifier);
           if (mondemand_trace_id_compare (&messages[i].trace_id,
                                           &MONDEMAND_NULL_TRACE_ID) != 0 )
             {
-              fprintf (stderr, " : %ld", messages[i].trace_id._id);
+              m_buffer_printf (out, " : %ld", messages[i].trace_id._id);
             }
-          fprintf (stderr, " : %s:%d",
-                   messages[i].filename, messages[i].line);
-          fprintf (stderr, " : %s : %s",
-                   MonDemandLogLevelStrings[messages[i].level],
-                   messages[i].message );
+          m_buffer_printf (out, " : %s:%d",
+                           messages[i].filename, messages[i].line);
+          m_buffer_printf (out, " : %s : %s",
+                           MonDemandLogLevelStrings[messages[i].level],
+                           messages[i].message );
 
-          if (context_count > 0)
+          for (j = 0; j < messages[i].field_count; ++j)
             {
-              for(j = 0; j < context_count; ++j )
+              field = &messages[i].fields[j];
+              switch (field->type)
                 {
-                  fprintf ( stderr, " : %s=%s", contexts[j].key,
-                            contexts[j].value );
+                  case MONDEMAND_FIELD_INT64:
+                    m_buffer_printf (out, " %s=%lld", field->key,
+                                     field->value.i);
+                    break;
+                  case MONDEMAND_FIELD_DOUBLE:
+                    m_buffer_printf (out, " %s=%g", field->key,
+                                     field->value.d);
+                    break;
+                  case MONDEMAND_FIELD_STRING:
+                    m_buffer_printf (out, " %s=\"%s\"", field->key,
+                                     field->value.s);
+                    break;
+                  case MONDEMAND_FIELD_BOOL:
+                    m_buffer_printf (out, " %s=%s", field->key,
+                                     field->value.b ? "true" : "false");
+                    break;
                 }
             }
 
+          for(j = 0; j < context_count; ++j )
+            {
+              m_buffer_printf (out, " : %s=%s", contexts[j].key,
+                               contexts[j].value );
+            }
+
           if (messages[i].repeat_count > 1)
             {
-              fprintf (stderr, " ... repeats %d times",
-                       messages[i].repeat_count);
+              m_buffer_printf (out, " ... repeats %d times",
+                               messages[i].repeat_count);
             }
-          fprintf (stderr, "\n");
+          if (messages[i].sample_rate < 1.0)
+            {
+              m_buffer_printf (out, " ... sampled at %g",
+                               messages[i].sample_rate);
+            }
+          m_buffer_printf (out, "\n");
         } /* if( messages[i].level ... ) */
     } /* for(i=0; i<message_count; ++i) */
 
-  /* we don't need userdata so just satisfy -Wall */
-  (void) userdata;
-
-  return 0;
+  return mondemand_transport_fd_end(fd, &local);
 }
 
 int
@@ -291,32 +1452,30 @@ mondemand_transport_stderr_stats_sender(
                       const int context_count,
                       void *userdata)
 {
+  struct m_fd_transport local;
+  struct m_fd_transport *fd = mondemand_transport_fd_begin(userdata, &local);
+  struct m_buffer *out = &fd->buffer;
   int i=0;
   int j=0;
 
   for(i=0; i<message_count; ++i)
     {
-      fprintf( stderr, "[%s]", program_identifier );
-      fprintf( stderr, " %s : %s : %lld",
-               MondemandStatTypeString[stats[i].type],
-               stats[i].key,
-               stats[i].value);
+      m_buffer_printf( out, "[%s]", program_identifier );
+      m_buffer_printf( out, " %s : %s : %lld",
+                       MondemandStatTypeString[stats[i].type],
+                       stats[i].key,
+                       stats[i].value);
 
-      if( context_count > 0 )
+      for( j=0; j<context_count; ++j )
         {
-          for( j=0; j<context_count; ++j )
-            {
-              fprintf( stderr, " : %s=%s", contexts[j].key, contexts[j].value );
-            }
+          m_buffer_printf( out, " : %s=%s",
+                           contexts[j].key, contexts[j].value );
         }
 
-      fprintf( stderr, "\n" );
+      m_buffer_printf( out, "\n" );
     } /* for(i=0; i<message_count; ++i) */
 
-  /* we don't need userdata so just satisfy -Wall */
-  (void) userdata;
-
-  return 0;
+  return mondemand_transport_fd_end(fd, &local);
 }
 
 int
@@ -329,23 +1488,20 @@ mondemand_transport_stderr_trace_sender
    const int trace_count,
    void *userdata)
 {
+  struct m_fd_transport local;
+  struct m_fd_transport *fd = mondemand_transport_fd_begin(userdata, &local);
+  struct m_buffer *out = &fd->buffer;
   int j;
 
-  fprintf (stderr, "[%s] %s:%s : %s", program_identifier, owner, trace_id,
-           message);
-  if (trace_count > 0)
+  m_buffer_printf (out, "[%s] %s:%s : %s", program_identifier, owner, trace_id,
+                   message);
+  for (j=0; j < trace_count ; ++j)
     {
-      for (j=0; j < trace_count ; ++j)
-        {
-          fprintf (stderr, " : %s=%s", traces[j].key, traces[j].value);
-        }
+      m_buffer_printf (out, " : %s=%s", traces[j].key, traces[j].value);
     }
-  fprintf (stderr, "\n");
-
-  /* we don't need userdata so just satisfy -Wall */
-  (void) userdata;
+  m_buffer_printf (out, "\n");
 
-  return 0;
+  return mondemand_transport_fd_end(fd, &local);
 }
 
 int mondemand_transport_stderr_perf_sender(
@@ -357,28 +1513,25 @@ int mondemand_transport_stderr_perf_sender(
                const int context_count,
                void *userdata)
 {
+  struct m_fd_transport local;
+  struct m_fd_transport *fd = mondemand_transport_fd_begin(userdata, &local);
+  struct m_buffer *out = &fd->buffer;
   int t = 0;
   int c = 0;
 
   for (t = 0; t < timings_count; ++t)
     {
-      fprintf (stderr, "[%s]", id);
-      if (context_count > 0)
+      m_buffer_printf (out, "[%s]", id);
+      for(c = 0; c < context_count; ++c )
         {
-          for(c = 0; c < context_count; ++c )
-            {
-              fprintf (stderr, " : %s=%s", contexts[c].key,
-                        contexts[c].value );
-            }
+          m_buffer_printf (out, " : %s=%s", contexts[c].key,
+                           contexts[c].value );
         }
-      fprintf (stderr, " : %s -> %s : %lld -> %lld\n", caller_label,
-               timings[t].label, timings[t].start, timings[t].end);
+      m_buffer_printf (out, " : %s -> %s : %lld -> %lld\n", caller_label,
+                       timings[t].label, timings[t].start, timings[t].end);
     }
 
-  /* we don't need userdata so just satisfy -Wall */
-  (void) userdata;
-
-  return 0;
+  return mondemand_transport_fd_end(fd, &local);
 }
 
 int mondemand_transport_stderr_annotation_sender(
@@ -392,131 +1545,497 @@ int mondemand_transport_stderr_annotation_sender(
                const int context_count,
                void *userdata)
 {
+  struct m_fd_transport local;
+  struct m_fd_transport *fd = mondemand_transport_fd_begin(userdata, &local);
+  struct m_buffer *out = &fd->buffer;
   int t = 0;
   int c = 0;
 
-  fprintf (stderr, "[%s]", id);
-  if (context_count > 0)
+  m_buffer_printf (out, "[%s]", id);
+  for(c = 0; c < context_count; ++c )
     {
-      for(c = 0; c < context_count; ++c )
-        {
-          fprintf (stderr, " : %s=%s", contexts[c].key,
-                    contexts[c].value );
-        }
+      m_buffer_printf (out, " : %s=%s", contexts[c].key,
+                       contexts[c].value );
     }
-  fprintf (stderr, " : %lld", timestamp);
+  m_buffer_printf (out, " : %lld", timestamp);
   if (tag_count > 0)
     {
-      fprintf (stderr, " : ");
+      m_buffer_printf (out, " : ");
       for (t = 0 ; t < tag_count - 1; ++t)
         {
-          fprintf (stderr, "%s,", tags[t]);
+          m_buffer_printf (out, "%s,", tags[t]);
         }
-      fprintf (stderr, "%s", tags[t]);
+      m_buffer_printf (out, "%s", tags[t]);
     }
-  fprintf (stderr, " : %s", description);
+  m_buffer_printf (out, " : %s", description);
   if (text != NULL)
     {
-      fprintf (stderr, " : %s", text);
+      m_buffer_printf (out, " : %s", text);
     }
-  fprintf (stderr, "\n");
+  m_buffer_printf (out, "\n");
 
-  /* we don't need userdata so just satisfy -Wall */
-  (void) userdata;
+  return mondemand_transport_fd_end(fd, &local);
+}
 
-  return 0;
+/* the file descriptor transport a sender writes to.  The senders are also
+   public, called directly with a NULL userdata they write to stderr
+   through local */
+static struct m_fd_transport *
+mondemand_transport_fd_begin(void *userdata, struct m_fd_transport *local)
+{
+  if( userdata != NULL )
+    {
+      return (struct m_fd_transport *) userdata;
+    }
+  memset(local, 0, sizeof(*local));
+  local->fd = STDERR_FILENO;
+  local->mode = MONDEMAND_FD_LINE;
 
+  return local;
 }
 
-int
-mondemand_transport_lwes_log_sender(
-                      const char *program_identifier,
-                      const struct mondemand_log_message messages[], 
-                      const int message_count,
-                      const struct mondemand_context contexts[],
-                      const int context_count,
-                      void *userdata)
+/* finishes a flush, writing what's buffered unless block mode is holding
+   on to it */
+static int
+mondemand_transport_fd_end(struct m_fd_transport *fd,
+                           struct m_fd_transport *local)
 {
-  int i=0;
-  int j=0;
-  struct lwes_emitter *emitter = userdata;
-  struct lwes_event *event = NULL;
-  char key_buffer[31];
+  int ret = 0;
 
-  if( message_count > 0 )
+  if( fd->buffer.failed )
     {
-      event = lwes_event_create(NULL, (LWES_SHORT_STRING) LWES_LOG_MSG);
-      lwes_event_set_STRING(event, "prog_id", program_identifier);
-      lwes_event_set_U_INT_16(event, "num", message_count);
-
-      for(i=0; i<message_count; ++i)
-        {
-          if( messages[i].level >= M_LOG_EMERG 
-              && messages[i].level <= M_LOG_ALL )
-            {
-              if( mondemand_trace_id_compare(&messages[i].trace_id,
-                                             &MONDEMAND_NULL_TRACE_ID) != 0 )
-                {
-                  snprintf(key_buffer, sizeof(key_buffer), "trace_id%d", i);
-                  lwes_event_set_U_INT_64(event, key_buffer,
-                                          messages[i].trace_id._id);
-                }
+      /* ran out of memory, what there is may be missing lines */
+      m_buffer_clear(&fd->buffer);
+      ret = -3;
+    }
+  else if( fd->mode == MONDEMAND_FD_LINE
+           || fd->buffer.length >= fd->block_size )
+    {
+      ret = mondemand_transport_fd_write(fd);
+    }
+  if( fd == local )
+    {
+      m_buffer_free(&local->buffer);
+    }
 
-              snprintf(key_buffer, sizeof(key_buffer), "f%d", i);
-              lwes_event_set_STRING(event, key_buffer, messages[i].filename);
-              snprintf(key_buffer, sizeof(key_buffer), "l%d", i);
-              lwes_event_set_U_INT_32(event, key_buffer, messages[i].line);
-              snprintf(key_buffer, sizeof(key_buffer), "p%d", i);
-              lwes_event_set_U_INT_32(event, key_buffer, messages[i].level);
-              snprintf(key_buffer, sizeof(key_buffer), "m%d", i);
-              lwes_event_set_STRING(event, key_buffer, messages[i].message);
+  return ret;
+}
 
-              if( messages[i].repeat_count > 1 )
-                {
-                  snprintf(key_buffer, sizeof(key_buffer), "r%d", i);
-                  lwes_event_set_U_INT_16(event, key_buffer,
-                                          messages[i].repeat_count);
-                }
-            }
-        } /* for(i=0; i<message_count; ++i) */
+/* writes out the buffer, returns -1 if it couldn't all be written */
+static int
+mondemand_transport_fd_write(struct m_fd_transport *fd)
+{
+  size_t written = 0;
+  ssize_t n = 0;
+  int ret = 0;
 
-      if( context_count > 0 )
+  while( written < fd->buffer.length )
+    {
+      n = write(fd->fd, fd->buffer.data + written,
+                fd->buffer.length - written);
+      if( n < 0 )
         {
-          lwes_event_set_U_INT_16(event, "ctxt_num", context_count);
-          for( j=0; j<context_count; ++j )
+          if( errno == EINTR )
             {
-              snprintf(key_buffer, sizeof(key_buffer), "ctxt_k%d", j);
-              lwes_event_set_STRING(event, key_buffer, contexts[j].key);
-              snprintf(key_buffer, sizeof(key_buffer), "ctxt_v%d", j);
-              lwes_event_set_STRING(event, key_buffer, contexts[j].value);
+              continue;
             }
+          ret = -1;
+          break;
         }
+      written += (size_t) n;
+    }
+  m_buffer_clear(&fd->buffer);
 
-      lwes_emitter_emit(emitter, event);
-      lwes_event_destroy(event);
-    } /* if( message_count > 0 ) */
-
-  return 0;
+  return ret;
 }
 
-int
-mondemand_transport_lwes_stats_sender(
-                      const char *program_identifier,
-                      const struct mondemand_stats_message stats[],
-                      const int message_count,
-                      const struct mondemand_context contexts[],
-                      const int context_count,
-                      void *userdata)
+/* sets a typed value as an attribute */
+static void
+mondemand_transport_lwes_set_typed(struct lwes_event *event, const char *name,
+                                   const struct mondemand_log_field *field)
 {
-  int i=0;
+  switch( field->type )
+    {
+      case MONDEMAND_FIELD_INT64:
+        lwes_event_set_INT_64(event, name, field->value.i);
+        break;
+      case MONDEMAND_FIELD_DOUBLE:
+        lwes_event_set_DOUBLE(event, name, field->value.d);
+        break;
+      case MONDEMAND_FIELD_STRING:
+        lwes_event_set_STRING(event, name, field->value.s);
+        break;
+      case MONDEMAND_FIELD_BOOL:
+        lwes_event_set_BOOLEAN(event, name, field->value.b != 0);
+        break;
+    }
+}
+
+/* sets a structured log field as a typed attribute named kv<i>.<key>,
+   fields whose name would be too long for LWES are skipped */
+static void
+mondemand_transport_lwes_set_field(struct lwes_event *event, int i,
+                                   const struct mondemand_log_field *field)
+{
+  char name[256];
+  int len = snprintf(name, sizeof(name), "kv%d.%s", i, field->key);
+
+  if( len < 0 || len >= (int) sizeof(name) )
+    {
+      return;
+    }
+  mondemand_transport_lwes_set_typed(event, name, field);
+}
+
+/* adds a dictionary entry to a dictionary event, sending the event and
+   starting another when it is full */
+static struct lwes_event *
+mondemand_transport_lwes_dictionary_add(
+                      struct lwes_emitter *emitter,
+                      struct lwes_event *event,
+                      int *count,
+                      const char *program_identifier,
+                      const struct m_lwes_dictionary_entry *entry)
+{
+  char key_buffer[31];
+
+  if( event != NULL && *count >= M_DICTIONARY_BATCH )
+    {
+      lwes_event_set_U_INT_16(event, "num", *count);
+      lwes_emitter_emit(emitter, event);
+      lwes_event_destroy(event);
+      event = NULL;
+    }
+  if( event == NULL )
+    {
+      event = lwes_event_create(NULL, (LWES_SHORT_STRING) LWES_LOG_DICT);
+      if( event == NULL )
+        {
+          return NULL;
+        }
+      lwes_event_set_STRING(event, "prog_id", program_identifier);
+      *count = 0;
+    }
+
+  snprintf(key_buffer, sizeof(key_buffer), "id%d", *count);
+  lwes_event_set_U_INT_32(event, key_buffer, entry->id);
+  snprintf(key_buffer, sizeof(key_buffer), "f%d", *count);
+  lwes_event_set_STRING(event, key_buffer, entry->filename);
+  snprintf(key_buffer, sizeof(key_buffer), "l%d", *count);
+  lwes_event_set_U_INT_32(event, key_buffer, entry->line);
+  snprintf(key_buffer, sizeof(key_buffer), "t%d", *count);
+  lwes_event_set_STRING(event, key_buffer, entry->format);
+  (*count)++;
+
+  return event;
+}
+
+/* sends the last dictionary event started by
+   mondemand_transport_lwes_dictionary_add */
+static void
+mondemand_transport_lwes_dictionary_emit(struct lwes_emitter *emitter,
+                                         struct lwes_event *event,
+                                         int count)
+{
+  if( event != NULL )
+    {
+      lwes_event_set_U_INT_16(event, "num", count);
+      lwes_emitter_emit(emitter, event);
+      lwes_event_destroy(event);
+    }
+}
+
+/* sends every entry in the dictionary, so listeners which started after an
+   entry was first sent can decode it */
+static void
+mondemand_transport_lwes_dictionary_resend(const char *program_identifier,
+                                           struct m_lwes_transport *lwes)
+{
+  const char **keys = NULL;
+  const struct m_lwes_dictionary_entry *entry = NULL;
+  struct lwes_event *event = NULL;
+  int count = 0;
+  int i;
+
+  keys = m_hash_table_keys(lwes->dictionary);
+  if( keys != NULL )
+    {
+      for( i=0; keys[i] != NULL; ++i )
+        {
+          entry = m_hash_table_get(lwes->dictionary, keys[i]);
+          event = mondemand_transport_lwes_dictionary_add(lwes->emitter,
+                                                          event, &count,
+                                                          program_identifier,
+                                                          entry);
+        }
+      mondemand_transport_lwes_dictionary_emit(lwes->emitter, event, count);
+      m_free(keys);
+    }
+}
+
+/* finds or adds the dictionary entry for a message.  Returns NULL if the
+   message has to be sent as text, either because its id collides with
+   another call site or there is no memory for a new entry. */
+static const struct m_lwes_dictionary_entry *
+mondemand_transport_lwes_dictionary_lookup(
+                      struct m_lwes_transport *lwes,
+                      const struct mondemand_log_message *message,
+                      int *is_new)
+{
+  static const char hex[] = "0123456789abcdef";
+  struct m_lwes_dictionary_entry *entry = NULL;
+  unsigned int id = m_format_id(message->filename, message->line,
+                                message->format);
+  size_t filename_len = strlen(message->filename);
+  size_t format_len = strlen(message->format);
+  char key[9];
+  char *hash_key = NULL;
+  int i;
+
+  *is_new = 0;
+  for( i=0; i<8; ++i )
+    {
+      key[i] = hex[(id >> (28 - i * 4)) & 0xf];
+    }
+  key[8] = '\0';
+
+  entry = m_hash_table_get(lwes->dictionary, key);
+  if( entry != NULL )
+    {
+      if( entry->line == message->line
+          && strcmp(entry->filename, message->filename) == 0
+          && strcmp(entry->format, message->format) == 0 )
+        {
+          return entry;
+        }
+      return NULL;
+    }
+
+  entry = m_try_malloc0(sizeof(struct m_lwes_dictionary_entry)
+                        + filename_len + 1 + format_len + 1);
+  hash_key = strdup(key);
+  if( entry == NULL || hash_key == NULL
+      || m_hash_table_set(lwes->dictionary, hash_key, entry) != 0 )
+    {
+      m_free(entry);
+      m_free(hash_key);
+      return NULL;
+    }
+
+  entry->id = id;
+  entry->line = message->line;
+  entry->filename = (char *) (entry + 1);
+  memcpy(entry->filename, message->filename, filename_len + 1);
+  entry->format = entry->filename + filename_len + 1;
+  memcpy(entry->format, message->format, format_len + 1);
+  *is_new = 1;
+
+  return entry;
+}
+
+int
+mondemand_transport_lwes_log_sender(
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[], 
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      void *userdata)
+{
+  struct m_lwes_transport *lwes = userdata;
+  struct lwes_emitter *emitter = lwes->emitter;
+  struct lwes_event *event = NULL;
+  struct lwes_event *dictionary_event = NULL;
+  int dictionary_count = 0;
+  time_t now;
+
+  if( message_count > 0 )
+    {
+      if( lwes->dictionary != NULL && lwes->dictionary_interval > 0 )
+        {
+          now = time(NULL);
+          if( now - lwes->dictionary_sent >= lwes->dictionary_interval )
+            {
+              mondemand_transport_lwes_dictionary_resend(program_identifier,
+                                                         lwes);
+              lwes->dictionary_sent = now;
+            }
+        }
+
+      event = mondemand_transport_lwes_log_event(program_identifier,
+                                                 messages, message_count,
+                                                 contexts, context_count,
+                                                 lwes, &dictionary_event,
+                                                 &dictionary_count);
+
+      /* new entries have to arrive before the messages using them */
+      mondemand_transport_lwes_dictionary_emit(emitter, dictionary_event,
+                                               dictionary_count);
+      lwes_emitter_emit(emitter, event);
+      lwes_event_destroy(event);
+    } /* if( message_count > 0 ) */
+
+  return 0;
+}
+
+/* builds a log event.  If lwes has a dictionary, messages are sent by id
+   and new dictionary entries are added to *dictionary_event, which the
+   caller sends first.  With lwes NULL all messages are sent as text */
+static struct lwes_event *
+mondemand_transport_lwes_log_event(
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      struct m_lwes_transport *lwes,
+                      struct lwes_event **dictionary_event,
+                      int *dictionary_count)
+{
+  int i=0;
   int j=0;
-  struct lwes_emitter *emitter = userdata;
+  struct lwes_event *event = NULL;
+  const struct m_lwes_dictionary_entry *entry = NULL;
+  int dictionary = (lwes != NULL && lwes->dictionary != NULL);
+  int is_new = 0;
+  char key_buffer[31];
+
+  event = lwes_event_create(NULL, (LWES_SHORT_STRING)
+                                    (dictionary ? LWES_DICT_LOG_MSG
+                                                : LWES_LOG_MSG));
+  if( event == NULL )
+    {
+      return NULL;
+    }
+  lwes_event_set_STRING(event, "prog_id", program_identifier);
+  lwes_event_set_U_INT_16(event, "num", message_count);
+
+  for(i=0; i<message_count; ++i)
+    {
+      if( messages[i].level >= M_LOG_EMERG 
+          && messages[i].level <= M_LOG_ALL )
+        {
+          if( mondemand_trace_id_compare(&messages[i].trace_id,
+                                         &MONDEMAND_NULL_TRACE_ID) != 0 )
+            {
+              snprintf(key_buffer, sizeof(key_buffer), "trace_id%d", i);
+              lwes_event_set_U_INT_64(event, key_buffer,
+                                      messages[i].trace_id._id);
+            }
+
+          entry = NULL;
+          if( dictionary && messages[i].format != NULL )
+            {
+              entry = mondemand_transport_lwes_dictionary_lookup
+                        (lwes, &messages[i], &is_new);
+              if( is_new )
+                {
+                  *dictionary_event =
+                    mondemand_transport_lwes_dictionary_add
+                      (lwes->emitter, *dictionary_event, dictionary_count,
+                       program_identifier, entry);
+                }
+            }
+
+          if( entry != NULL )
+            {
+              /* the listener rebuilds the text from the dictionary */
+              snprintf(key_buffer, sizeof(key_buffer), "d%d", i);
+              lwes_event_set_U_INT_32(event, key_buffer, entry->id);
+              for( j=0; j<messages[i].arg_count; ++j )
+                {
+                  snprintf(key_buffer, sizeof(key_buffer), "a%d.%d", i, j);
+                  mondemand_transport_lwes_set_typed(event, key_buffer,
+                                                     &messages[i].args[j]);
+                }
+            }
+          else
+            {
+              snprintf(key_buffer, sizeof(key_buffer), "f%d", i);
+              lwes_event_set_STRING(event, key_buffer,
+                                    messages[i].filename);
+              snprintf(key_buffer, sizeof(key_buffer), "l%d", i);
+              lwes_event_set_U_INT_32(event, key_buffer,
+                                      messages[i].line);
+              snprintf(key_buffer, sizeof(key_buffer), "m%d", i);
+              lwes_event_set_STRING(event, key_buffer,
+                                    messages[i].message);
+            }
+          snprintf(key_buffer, sizeof(key_buffer), "p%d", i);
+          lwes_event_set_U_INT_32(event, key_buffer, messages[i].level);
+
+          if( messages[i].repeat_count > 1 )
+            {
+              snprintf(key_buffer, sizeof(key_buffer), "r%d", i);
+              lwes_event_set_U_INT_16(event, key_buffer,
+                                      messages[i].repeat_count);
+            }
+
+          if( messages[i].sample_rate < 1.0 )
+            {
+              snprintf(key_buffer, sizeof(key_buffer), "s%d", i);
+              lwes_event_set_DOUBLE(event, key_buffer,
+                                    messages[i].sample_rate);
+            }
+
+          for( j=0; j<messages[i].field_count; ++j )
+            {
+              mondemand_transport_lwes_set_field(event, i,
+                                                 &messages[i].fields[j]);
+            }
+        }
+    } /* for(i=0; i<message_count; ++i) */
+
+  mondemand_transport_lwes_set_contexts(event, contexts, context_count);
+
+  return event;
+}
+
+int
+mondemand_transport_lwes_stats_sender(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      void *userdata)
+{
+  struct lwes_emitter *emitter =
+    ((struct m_lwes_transport *) userdata)->emitter;
+  struct lwes_event *event = NULL;
+
+  event = mondemand_transport_lwes_stats_event(program_identifier,
+                                               stats, message_count,
+                                               contexts, context_count);
+  if( event != NULL )
+    {
+      lwes_emitter_emit(emitter, event);
+      lwes_event_destroy(event);
+    }
+
+  return 0;
+}
+
+/* builds a stats event, NULL if there are no stats */
+static struct lwes_event *
+mondemand_transport_lwes_stats_event(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count)
+{
+  int i=0;
   struct lwes_event *event = NULL;
   char key_buffer[31];
 
   if( message_count > 0 )
     {
       event = lwes_event_create(NULL, (LWES_SHORT_STRING) LWES_STATS_MSG);
+      if( event == NULL )
+        {
+          return NULL;
+        }
       lwes_event_set_STRING(event, "prog_id", program_identifier);
       lwes_event_set_U_INT_16(event, "num", message_count);
 
@@ -531,23 +2050,10 @@ mondemand_transport_lwes_stats_sender(
           lwes_event_set_INT_64 (event, key_buffer, stats[i].value);
         }
 
-      if( context_count > 0 )
-        {
-          lwes_event_set_U_INT_16(event, "ctxt_num", context_count);
-          for( j=0; j<context_count; ++j )
-            {
-              snprintf(key_buffer, sizeof(key_buffer), "ctxt_k%d", j);
-              lwes_event_set_STRING(event, key_buffer, contexts[j].key);
-              snprintf(key_buffer, sizeof(key_buffer), "ctxt_v%d", j);
-              lwes_event_set_STRING(event, key_buffer, contexts[j].value);
-            }
-        }
-
-      lwes_emitter_emit(emitter, event);
-      lwes_event_destroy(event);
+      mondemand_transport_lwes_set_contexts(event, contexts, context_count);
     }
 
-  return 0;
+  return event;
 }
 
 int
@@ -560,7 +2066,8 @@ mondemand_transport_lwes_trace_sender
    const int trace_count,
    void *userdata)
 {
-  struct lwes_emitter *emitter = userdata;
+  struct lwes_emitter *emitter =
+    ((struct m_lwes_transport *) userdata)->emitter;
   struct lwes_event *event = NULL;
   char hostname[1024];
   int j;
@@ -597,15 +2104,43 @@ int mondemand_transport_lwes_perf_sender(
                const int context_count,
                void *userdata)
 {
-  struct lwes_emitter *emitter = userdata;
+  struct lwes_emitter *emitter =
+    ((struct m_lwes_transport *) userdata)->emitter;
+  struct lwes_event *event = NULL;
+
+  event = mondemand_transport_lwes_perf_event(id, caller_label,
+                                              timings, timings_count,
+                                              contexts, context_count);
+  if (event != NULL)
+    {
+      lwes_emitter_emit(emitter, event);
+      lwes_event_destroy(event);
+    }
+
+  return 0;
+}
+
+/* builds a performance trace event, NULL if there are no timings */
+static struct lwes_event *
+mondemand_transport_lwes_perf_event(
+               const char *id,
+               const char *caller_label,
+               const struct mondemand_timing timings[],
+               const int timings_count,
+               const struct mondemand_context contexts[],
+               const int context_count)
+{
   struct lwes_event *event = NULL;
   char key_buffer[31];
   int t = 0;
-  int c = 0;
 
   if (timings_count > 0)
     {
       event = lwes_event_create (NULL, (LWES_SHORT_STRING) LWES_PERF_MSG);
+      if (event == NULL)
+        {
+          return NULL;
+        }
       lwes_event_set_STRING(event, "id", id);
       lwes_event_set_STRING(event, "caller_label", caller_label);
       lwes_event_set_U_INT_16(event, "num", timings_count);
@@ -618,23 +2153,10 @@ int mondemand_transport_lwes_perf_sender(
           snprintf (key_buffer, sizeof(key_buffer), "end%d", t);
           lwes_event_set_INT_64 (event, key_buffer, timings[t].end);
         }
-      if( context_count > 0 )
-        {
-          lwes_event_set_U_INT_16(event, "ctxt_num", context_count);
-          for(c = 0; c < context_count; ++c )
-            {
-              snprintf(key_buffer, sizeof(key_buffer), "ctxt_k%d", c);
-              lwes_event_set_STRING(event, key_buffer, contexts[c].key);
-              snprintf(key_buffer, sizeof(key_buffer), "ctxt_v%d", c);
-              lwes_event_set_STRING(event, key_buffer, contexts[c].value);
-            }
-        }
-
-      lwes_emitter_emit(emitter, event);
-      lwes_event_destroy(event);
-  }
+      mondemand_transport_lwes_set_contexts(event, contexts, context_count);
+    }
 
-  return 0;
+  return event;
 }
 
 int mondemand_transport_lwes_annotation_sender(
@@ -648,11 +2170,11 @@ int mondemand_transport_lwes_annotation_sender(
                const int context_count,
                void *userdata)
 {
-  struct lwes_emitter *emitter = userdata;
+  struct lwes_emitter *emitter =
+    ((struct m_lwes_transport *) userdata)->emitter;
   struct lwes_event *event = NULL;
   char key_buffer[31];
   int t = 0;
-  int c = 0;
 
   event = lwes_event_create (NULL, (LWES_SHORT_STRING) LWES_ANNOTATION_MSG);
   lwes_event_set_STRING(event, "id", id);
@@ -673,6 +2195,24 @@ int mondemand_transport_lwes_annotation_sender(
         }
     }
 
+  mondemand_transport_lwes_set_contexts(event, contexts, context_count);
+
+  lwes_emitter_emit(emitter, event);
+  lwes_event_destroy(event);
+
+  return 0;
+}
+
+/* adds the contexts to an event */
+static void
+mondemand_transport_lwes_set_contexts(
+                      struct lwes_event *event,
+                      const struct mondemand_context contexts[],
+                      const int context_count)
+{
+  char key_buffer[31];
+  int c = 0;
+
   if( context_count > 0 )
     {
       lwes_event_set_U_INT_16(event, "ctxt_num", context_count);
@@ -684,13 +2224,1877 @@ int mondemand_transport_lwes_annotation_sender(
           lwes_event_set_STRING(event, key_buffer, contexts[c].value);
         }
     }
+}
 
-  lwes_emitter_emit(emitter, event);
+/* serializes and destroys an event for the shared lwes encoding, a NULL
+   event means there was nothing to send.  Encoded contexts in block are
+   appended as attributes, the count after the event name is bumped to
+   include them */
+static int
+mondemand_transport_lwes_encode(
+                      struct lwes_event *event,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length)
+{
+  int bytes = 0;
+  size_t offset = 0;
+  unsigned int attributes = 0;
+
+  *length = 0;
+  if( event == NULL )
+    {
+      return 0;
+    }
+  bytes = lwes_event_to_bytes(event, (LWES_BYTE_P) buffer, size, 0);
   lwes_event_destroy(event);
+  if( bytes < 0 )
+    {
+      return -1;
+    }
+  *length = (size_t) bytes;
+
+  if( block != NULL && block->count > 0 )
+    {
+      if( *length + block->length > size )
+        {
+          return -1;
+        }
+      memcpy(buffer + *length, block->bytes, block->length);
+      *length += block->length;
+
+      /* the name is a length byte and its characters */
+      offset = 1 + buffer[0];
+      attributes = (buffer[offset] << 8 | buffer[offset + 1])
+                   + (unsigned int) block->count;
+      if( attributes > 0xffff )
+        {
+          return -1;
+        }
+      buffer[offset] = (unsigned char) (attributes >> 8);
+      buffer[offset + 1] = (unsigned char) attributes;
+    }
+
+  return 0;
+}
+
+/* encodes ctxt_num, ctxt_kN and ctxt_vN attributes as
+   mondemand_transport_lwes_set_contexts would add them to an event */
+static int
+mondemand_transport_lwes_context_encoder(
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      unsigned char *buffer, size_t size, size_t *length,
+                      int *count)
+{
+  struct m_lwes_writer writer;
+
+  *count = 0;
+  m_lwes_begin_attributes(&writer, buffer, size);
+  mondemand_transport_native_contexts(&writer, contexts, context_count, NULL);
+  if( m_lwes_end(&writer, length) != 0 )
+    {
+      return -1;
+    }
+  *count = (int) writer.count;
 
   return 0;
 }
 
+static int
+mondemand_transport_lwes_log_encoder(
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length)
+{
+  struct lwes_event *event = NULL;
+
+  if( message_count > 0 )
+    {
+      event = mondemand_transport_lwes_log_event(program_identifier,
+                                                 messages, message_count,
+                                                 block ? NULL : contexts,
+                                                 block ? 0 : context_count,
+                                                 NULL, NULL, NULL);
+      if( event == NULL )
+        {
+          return -1;
+        }
+    }
 
+  return mondemand_transport_lwes_encode(event, block, buffer, size, length);
+}
 
+static int
+mondemand_transport_lwes_stats_encoder(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length)
+{
+  struct lwes_event *event = NULL;
 
+  event = mondemand_transport_lwes_stats_event(program_identifier,
+                                               stats, message_count,
+                                               block ? NULL : contexts,
+                                               block ? 0 : context_count);
+  if( event == NULL && message_count > 0 )
+    {
+      return -1;
+    }
+
+  return mondemand_transport_lwes_encode(event, block, buffer, size, length);
+}
+
+static int
+mondemand_transport_lwes_perf_encoder(
+                      const char *id,
+                      const char *caller_label,
+                      const struct mondemand_timing timings[],
+                      const int timings_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length)
+{
+  struct lwes_event *event = NULL;
+
+  event = mondemand_transport_lwes_perf_event(id, caller_label,
+                                              timings, timings_count,
+                                              block ? NULL : contexts,
+                                              block ? 0 : context_count);
+  if( event == NULL && timings_count > 0 )
+    {
+      return -1;
+    }
+
+  return mondemand_transport_lwes_encode(event, block, buffer, size, length);
+}
+
+/* sends bytes from the shared lwes encoding */
+static int
+mondemand_transport_lwes_bytes_sender(
+                      const unsigned char *bytes,
+                      const size_t length,
+                      void *userdata)
+{
+  struct lwes_emitter *emitter =
+    ((struct m_lwes_transport *) userdata)->emitter;
+
+  if( lwes_emitter_emit_bytes(emitter, (LWES_BYTE_P) bytes, length) < 0 )
+    {
+      return -1;
+    }
+
+  return 0;
+}
+
+/* creates the socket for a native lwes transport, multicast addresses get
+   the ttl and, if given, the interface to send from */
+static int
+mondemand_transport_native_socket(struct m_native_transport *native,
+                                  const char *address, const int port,
+                                  const char *interface,
+                                  const struct mondemand_native_options *opts)
+{
+  struct in_addr interface_address;
+  unsigned char multicast_ttl = (unsigned char) opts->ttl;
+  int flags = 0;
+#ifdef HAVE_SENDMMSG
+  int i;
+#endif
+
+  native->fd = -1;
+  memset(&native->address, 0, sizeof(native->address));
+  native->address.sin_family = AF_INET;
+  native->address.sin_port = htons((unsigned short) port);
+  if( address == NULL
+      || inet_aton(address, &native->address.sin_addr) == 0 )
+    {
+      return -1;
+    }
+
+  native->fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if( native->fd < 0 )
+    {
+      return -1;
+    }
+
+  if( opts->sndbuf > 0
+      && setsockopt(native->fd, SOL_SOCKET, SO_SNDBUF,
+                    &opts->sndbuf, sizeof(opts->sndbuf)) != 0 )
+    {
+      return -1;
+    }
+  if( opts->nonblocking )
+    {
+      flags = fcntl(native->fd, F_GETFL, 0);
+      if( flags < 0 || fcntl(native->fd, F_SETFL, flags | O_NONBLOCK) != 0 )
+        {
+          return -1;
+        }
+    }
+
+#ifdef HAVE_SENDMMSG
+  /* every message goes to the same place, only the iovec changes */
+  for( i=0; i<M_NATIVE_BATCH; ++i )
+    {
+      native->messages[i].msg_hdr.msg_name = &native->address;
+      native->messages[i].msg_hdr.msg_namelen = sizeof(native->address);
+      native->messages[i].msg_hdr.msg_iov = &native->pending[i];
+      native->messages[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+
+  if( IN_MULTICAST(ntohl(native->address.sin_addr.s_addr)) )
+    {
+      if( setsockopt(native->fd, IPPROTO_IP, IP_MULTICAST_TTL,
+                     &multicast_ttl, sizeof(multicast_ttl)) != 0 )
+        {
+          return -1;
+        }
+      if( interface != NULL && interface[0] != '\0' )
+        {
+          if( inet_aton(interface, &interface_address) == 0
+              || setsockopt(native->fd, IPPROTO_IP, IP_MULTICAST_IF,
+                            &interface_address,
+                            sizeof(interface_address)) != 0 )
+            {
+              return -1;
+            }
+        }
+    }
+
+  if( opts->uring )
+    {
+#ifdef M_HAVE_URING
+      if( io_uring_queue_init(M_NATIVE_BATCH, &native->ring, 0) != 0 )
+        {
+          return -1;
+        }
+      native->uring = 1;
+#else
+      /* built without liburing */
+      return -1;
+#endif
+    }
+
+  return 0;
+}
+
+/* adds the contexts to an event being written, from the encoded block if
+   there is one */
+static void
+mondemand_transport_native_contexts(
+                      struct m_lwes_writer *writer,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block)
+{
+  int c = 0;
+
+  if( block != NULL )
+    {
+      m_lwes_append(writer, block->bytes, block->length, block->count);
+    }
+  else if( context_count > 0 )
+    {
+      m_lwes_key(writer, "ctxt_num", -1);
+      m_lwes_u_int_16(writer, (unsigned int) context_count);
+      for(c = 0; c < context_count; ++c )
+        {
+          m_lwes_key(writer, "ctxt_k", c);
+          m_lwes_string(writer, contexts[c].key);
+          m_lwes_key(writer, "ctxt_v", c);
+          m_lwes_string(writer, contexts[c].value);
+        }
+    }
+}
+
+/* adds a typed value to an event being written, its key already started */
+static void
+mondemand_transport_native_typed(struct m_lwes_writer *writer,
+                                 const struct mondemand_log_field *field)
+{
+  switch( field->type )
+    {
+      case MONDEMAND_FIELD_INT64:
+        m_lwes_int_64(writer, field->value.i);
+        break;
+      case MONDEMAND_FIELD_DOUBLE:
+        m_lwes_double(writer, field->value.d);
+        break;
+      case MONDEMAND_FIELD_STRING:
+        m_lwes_string(writer, field->value.s);
+        break;
+      case MONDEMAND_FIELD_BOOL:
+        m_lwes_boolean(writer, field->value.b != 0);
+        break;
+    }
+}
+
+/* the native encoders write the same attributes as the liblwes event
+   builders above.  Each kind of event is a header, a num attribute, the
+   items numbered from 0 and the contexts, so a flush too big for one
+   datagram can be split into several complete events */
+
+static void
+mondemand_transport_native_prog_id(struct m_lwes_writer *writer,
+                                   const struct m_native_event *event)
+{
+  m_lwes_key(writer, "prog_id", -1);
+  m_lwes_string(writer, event->strings[0]);
+}
+
+static void
+mondemand_transport_native_log_item(struct m_lwes_writer *writer,
+                                    const struct m_native_event *event,
+                                    int i, int index)
+{
+  const struct mondemand_log_message *message =
+    &((const struct mondemand_log_message *) event->items)[i];
+  const struct mondemand_log_field *field = NULL;
+  int j=0;
+  int k=0;
+
+  if( message->level < M_LOG_EMERG || message->level > M_LOG_ALL )
+    {
+      return;
+    }
+  if( mondemand_trace_id_compare(&message->trace_id,
+                                 &MONDEMAND_NULL_TRACE_ID) != 0 )
+    {
+      m_lwes_key(writer, "trace_id", index);
+      m_lwes_u_int_64(writer, message->trace_id._id);
+    }
+  m_lwes_key(writer, "f", index);
+  m_lwes_string(writer, message->filename);
+  m_lwes_key(writer, "l", index);
+  m_lwes_u_int_32(writer, (unsigned long) message->line);
+  m_lwes_key(writer, "m", index);
+  m_lwes_string(writer, message->message);
+  m_lwes_key(writer, "p", index);
+  m_lwes_u_int_32(writer, (unsigned long) message->level);
+  if( message->repeat_count > 1 )
+    {
+      m_lwes_key(writer, "r", index);
+      m_lwes_u_int_16(writer, (unsigned int) message->repeat_count);
+    }
+  if( message->sample_rate < 1.0 )
+    {
+      m_lwes_key(writer, "s", index);
+      m_lwes_double(writer, message->sample_rate);
+    }
+
+  for( j=0; j<message->field_count; ++j )
+    {
+      field = &message->fields[j];
+      /* liblwes keeps the last value of a repeated key, so skip any set
+         again later, and names too long to send */
+      for( k=j+1; k<message->field_count; ++k )
+        {
+          if( strcmp(field->key, message->fields[k].key) == 0 )
+            {
+              break;
+            }
+        }
+      if( k < message->field_count || strlen(field->key) > 240 )
+        {
+          continue;
+        }
+      m_lwes_key(writer, "kv", index);
+      m_lwes_key_suffix(writer, ".");
+      m_lwes_key_suffix(writer, field->key);
+      mondemand_transport_native_typed(writer, field);
+    }
+}
+
+static void
+mondemand_transport_native_stats_item(struct m_lwes_writer *writer,
+                                      const struct m_native_event *event,
+                                      int i, int index)
+{
+  const struct mondemand_stats_message *stat =
+    &((const struct mondemand_stats_message *) event->items)[i];
+
+  m_lwes_key(writer, "t", index);
+  m_lwes_string(writer, MondemandStatTypeString[stat->type]);
+  m_lwes_key(writer, "k", index);
+  m_lwes_string(writer, stat->key);
+  m_lwes_key(writer, "v", index);
+  m_lwes_int_64(writer, stat->value);
+}
+
+static void
+mondemand_transport_native_perf_header(struct m_lwes_writer *writer,
+                                       const struct m_native_event *event)
+{
+  m_lwes_key(writer, "id", -1);
+  m_lwes_string(writer, event->strings[0]);
+  m_lwes_key(writer, "caller_label", -1);
+  m_lwes_string(writer, event->strings[1]);
+}
+
+static void
+mondemand_transport_native_perf_item(struct m_lwes_writer *writer,
+                                     const struct m_native_event *event,
+                                     int i, int index)
+{
+  const struct mondemand_timing *timing =
+    &((const struct mondemand_timing *) event->items)[i];
+
+  m_lwes_key(writer, "label", index);
+  m_lwes_string(writer, timing->label);
+  m_lwes_key(writer, "start", index);
+  m_lwes_int_64(writer, timing->start);
+  m_lwes_key(writer, "end", index);
+  m_lwes_int_64(writer, timing->end);
+}
+
+/* writes an event into buffer, filling each datagram with as many items as
+   fit in size bytes along with the contexts.  With native NULL the event
+   has to fit in one datagram, whose size is put in *length.  Otherwise each
+   datagram is written into the transport's buffer and queued to be sent,
+   items too big to go in a datagram on their own are dropped and counted */
+static int
+mondemand_transport_native_pack(const struct m_native_event *event,
+                                unsigned char *buffer, size_t size,
+                                struct m_native_transport *native,
+                                size_t *length)
+{
+  struct m_lwes_writer writer;
+  struct m_lwes_writer saved;
+  size_t context_size = 0;
+  size_t num_offset = 0;
+  int retval = 0;
+  int first = 0;
+  int i = 0;
+
+  *length = 0;
+  if( event->count <= 0 )
+    {
+      return 0;
+    }
+
+  if( native != NULL )
+    {
+      buffer = mondemand_transport_native_slot(native);
+    }
+
+  /* measure the contexts by writing them where the event will go */
+  if( event->block != NULL )
+    {
+      context_size = event->block->length;
+    }
+  else
+    {
+      m_lwes_begin_attributes(&writer, buffer, size);
+      mondemand_transport_native_contexts(&writer, event->contexts,
+                                          event->context_count, NULL);
+      if( m_lwes_end(&writer, &context_size) != 0 )
+        {
+          context_size = size;
+        }
+    }
+
+  while( i < event->count )
+    {
+      if( native != NULL )
+        {
+          buffer = mondemand_transport_native_slot(native);
+        }
+      /* items get the space left after the contexts */
+      m_lwes_begin(&writer, buffer,
+                   context_size < size ? size - context_size : 0,
+                   event->name);
+      event->header(&writer, event);
+      m_lwes_key(&writer, "num", -1);
+      m_lwes_u_int_16(&writer, 0);
+      num_offset = writer.used - 2;
+      if( writer.overflow )
+        {
+          /* not even the header and contexts fit */
+          if( native != NULL )
+            {
+              native->stats.dropped += event->count - i;
+            }
+          return -1;
+        }
+
+      for( first = i; i < event->count && i - first < 0xffff; ++i )
+        {
+          saved = writer;
+          event->item(&writer, event, i, i - first);
+          if( writer.overflow )
+            {
+              writer = saved;
+              break;
+            }
+        }
+      if( i == first )
+        {
+          if( native == NULL )
+            {
+              return -1;
+            }
+          native->stats.dropped++;
+          retval = -1;
+          ++i;
+          continue;
+        }
+      if( i < event->count && native == NULL )
+        {
+          /* doesn't fit in a single datagram */
+          return -1;
+        }
+
+      m_lwes_patch_u_int_16(&writer, num_offset, (unsigned int) (i - first));
+      writer.size = size;
+      mondemand_transport_native_contexts(&writer, event->contexts,
+                                          event->context_count, event->block);
+      if( m_lwes_end(&writer, length) != 0 )
+        {
+          return -1;
+        }
+      if( native != NULL )
+        {
+          mondemand_transport_native_queue(native, buffer, *length);
+        }
+    }
+
+  return retval;
+}
+
+static int
+mondemand_transport_native_log_encoder(
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length)
+{
+  struct m_native_event event;
+
+  mondemand_transport_native_log_event(&event, program_identifier,
+                                       messages, message_count,
+                                       contexts, context_count, block);
+  return mondemand_transport_native_pack(&event, buffer, size, NULL, length);
+}
+
+static int
+mondemand_transport_native_stats_encoder(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length)
+{
+  struct m_native_event event;
+
+  mondemand_transport_native_stats_event(&event, program_identifier,
+                                         stats, message_count,
+                                         contexts, context_count, block);
+  return mondemand_transport_native_pack(&event, buffer, size, NULL, length);
+}
+
+static int
+mondemand_transport_native_perf_encoder(
+                      const char *id,
+                      const char *caller_label,
+                      const struct mondemand_timing timings[],
+                      const int timings_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block,
+                      unsigned char *buffer, size_t size, size_t *length)
+{
+  struct m_native_event event;
+
+  mondemand_transport_native_perf_event(&event, id, caller_label,
+                                        timings, timings_count,
+                                        contexts, context_count, block);
+  return mondemand_transport_native_pack(&event, buffer, size, NULL, length);
+}
+
+/* fill in the description of each kind of event for the packer */
+static void
+mondemand_transport_native_log_event(
+                      struct m_native_event *event,
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block)
+{
+  memset(event, 0, sizeof(*event));
+  event->name = LWES_LOG_MSG;
+  event->header = &mondemand_transport_native_prog_id;
+  event->item = &mondemand_transport_native_log_item;
+  event->strings[0] = program_identifier;
+  event->items = messages;
+  event->count = message_count;
+  event->contexts = contexts;
+  event->context_count = context_count;
+  event->block = block;
+}
+
+static void
+mondemand_transport_native_stats_event(
+                      struct m_native_event *event,
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block)
+{
+  memset(event, 0, sizeof(*event));
+  event->name = LWES_STATS_MSG;
+  event->header = &mondemand_transport_native_prog_id;
+  event->item = &mondemand_transport_native_stats_item;
+  event->strings[0] = program_identifier;
+  event->items = stats;
+  event->count = message_count;
+  event->contexts = contexts;
+  event->context_count = context_count;
+  event->block = block;
+}
+
+static void
+mondemand_transport_native_perf_event(
+                      struct m_native_event *event,
+                      const char *id,
+                      const char *caller_label,
+                      const struct mondemand_timing timings[],
+                      const int timings_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      const struct mondemand_context_block *block)
+{
+  memset(event, 0, sizeof(*event));
+  event->name = LWES_PERF_MSG;
+  event->header = &mondemand_transport_native_perf_header;
+  event->item = &mondemand_transport_native_perf_item;
+  event->strings[0] = id;
+  event->strings[1] = caller_label;
+  event->items = timings;
+  event->count = timings_count;
+  event->contexts = contexts;
+  event->context_count = context_count;
+  event->block = block;
+}
+
+/* where the next datagram should be written, sending what's queued first
+   if there isn't room for it */
+static unsigned char *
+mondemand_transport_native_slot(struct m_native_transport *native)
+{
+  if( native->pending_count >= native->batch
+      || sizeof(native->buffer) - native->used < native->max_datagram )
+    {
+      mondemand_transport_native_send(native);
+    }
+
+  return native->buffer + native->used;
+}
+
+/* queues a datagram to be sent, bytes are either the next slot in the
+   transport's buffer or an encoding's buffer which outlives the flush */
+static void
+mondemand_transport_native_queue(struct m_native_transport *native,
+                                 const unsigned char *bytes,
+                                 const size_t length)
+{
+  if( native->pending_count >= native->batch )
+    {
+      mondemand_transport_native_send(native);
+    }
+  native->pending[native->pending_count].iov_base = (void *) bytes;
+  native->pending[native->pending_count].iov_len = length;
+  native->pending_count++;
+  if( bytes == native->buffer + native->used )
+    {
+      native->used += length;
+    }
+}
+
+/* sends the queued datagrams, all at once with sendmmsg where there is
+   one.  When a non-blocking socket's buffer fills the rest are dropped
+   and counted.  Returns -1 if anything in the current flush wasn't sent */
+static int
+mondemand_transport_native_send(struct m_native_transport *native)
+{
+  int sent = 0;
+  int ret = 0;
+  int i;
+
+  if( native->spool != NULL )
+    {
+      mondemand_transport_native_send_spool(native);
+      sent = native->pending_count;
+    }
+#ifdef M_HAVE_URING
+  else if( native->uring )
+    {
+      mondemand_transport_native_send_uring(native);
+      sent = native->pending_count;
+    }
+#endif
+  else if( native->shm_ring != NULL )
+    {
+      mondemand_transport_native_send_ring(native);
+      sent = native->pending_count;
+    }
+  else if( native->stream != NULL )
+    {
+      mondemand_transport_native_send_stream(native);
+      sent = native->pending_count;
+    }
+  else if( native->file )
+    {
+      mondemand_transport_native_send_file(native);
+      sent = native->pending_count;
+    }
+
+  while( sent < native->pending_count )
+    {
+#ifdef HAVE_SENDMMSG
+      if( native->batch > 1 )
+        {
+          ret = sendmmsg(native->fd, native->messages + sent,
+                         (unsigned int) (native->pending_count - sent), 0);
+        }
+      else
+#endif
+        {
+          ret = sendto(native->fd, native->pending[sent].iov_base,
+                       native->pending[sent].iov_len, 0,
+                       (const struct sockaddr *) &native->address,
+                       sizeof(native->address)) < 0 ? -1 : 1;
+        }
+      native->stats.syscalls++;
+      native->stats.last_syscalls++;
+
+      if( ret < 0 )
+        {
+          if( errno == EINTR )
+            {
+              continue;
+            }
+          native->failed = 1;
+          if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+              /* the socket buffer is full, and will be for the rest */
+              native->stats.would_block += native->pending_count - sent;
+              break;
+            }
+          /* skip the one which failed */
+          native->stats.errors++;
+          ++sent;
+          continue;
+        }
+
+      for( i=sent; i<sent+ret; ++i )
+        {
+          native->stats.last_datagrams++;
+          native->stats.last_bytes += (long long) native->pending[i].iov_len;
+          native->stats.datagrams++;
+          native->stats.bytes += (long long) native->pending[i].iov_len;
+        }
+      sent += ret;
+    }
+
+  native->pending_count = 0;
+  native->used = 0;
+
+  return native->failed ? -1 : 0;
+}
+
+/* appends the queued datagrams to the spool, each a record stamped with
+   the current time */
+static void
+mondemand_transport_native_send_spool(struct m_native_transport *native)
+{
+  struct timespec now;
+  long long timestamp;
+  int i;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  timestamp = (long long) now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+
+  for( i=0; i<native->pending_count; ++i )
+    {
+      if( m_spool_writer_append(native->spool,
+                                (const unsigned char *)
+                                  native->pending[i].iov_base,
+                                native->pending[i].iov_len, timestamp) != 0 )
+        {
+          native->failed = 1;
+          native->stats.errors++;
+          continue;
+        }
+      native->stats.last_datagrams++;
+      native->stats.last_bytes += (long long) native->pending[i].iov_len;
+      native->stats.datagrams++;
+      native->stats.bytes += (long long) native->pending[i].iov_len;
+    }
+}
+
+/* copies the queued datagrams into the shared memory ring, each a record.
+   Those which don't fit because the reader is behind or gone are dropped
+   like a non-blocking socket's */
+static void
+mondemand_transport_native_send_ring(struct m_native_transport *native)
+{
+  int ret;
+  int i;
+
+  for( i=0; i<native->pending_count; ++i )
+    {
+      ret = m_ring_push(native->shm_ring,
+                        (const unsigned char *) native->pending[i].iov_base,
+                        native->pending[i].iov_len);
+      if( ret != 0 )
+        {
+          native->failed = 1;
+          if( ret == -1 )
+            {
+              native->stats.would_block++;
+            }
+          else
+            {
+              native->stats.errors++;
+            }
+          continue;
+        }
+      native->stats.last_datagrams++;
+      native->stats.last_bytes += (long long) native->pending[i].iov_len;
+      native->stats.datagrams++;
+      native->stats.bytes += (long long) native->pending[i].iov_len;
+    }
+}
+
+/* queues the datagrams as frames on the stream in one go, the stream's
+   thread writes them.  Frames the stream had no room for are counted in
+   would_block */
+static void
+mondemand_transport_native_send_stream(struct m_native_transport *native)
+{
+  size_t queued = 0;
+  int dropped;
+
+  dropped = m_stream_send(native->stream, native->pending,
+                          native->pending_count, &queued);
+  if( dropped < 0 )
+    {
+      native->failed = 1;
+      native->stats.errors += native->pending_count;
+      return;
+    }
+  if( dropped > 0 )
+    {
+      native->failed = 1;
+      native->stats.would_block += dropped;
+    }
+  /* only the frames the stream took were sent */
+  native->stats.last_datagrams += native->pending_count - dropped;
+  native->stats.last_bytes += (long long) queued;
+  native->stats.datagrams += native->pending_count - dropped;
+  native->stats.bytes += (long long) queued;
+}
+
+/* appends the queued datagrams to the file as frames, each after its
+   length as 4 big-endian bytes, in one writev */
+static void
+mondemand_transport_native_send_file(struct m_native_transport *native)
+{
+  unsigned char headers[M_NATIVE_BATCH][4];
+  struct iovec iov[2 * M_NATIVE_BATCH];
+  size_t length;
+  size_t total = 0;
+  ssize_t ret;
+  int i;
+
+  if( native->pending_count == 0 )
+    {
+      return;
+    }
+  for( i=0; i<native->pending_count; ++i )
+    {
+      length = native->pending[i].iov_len;
+      headers[i][0] = (unsigned char) (length >> 24);
+      headers[i][1] = (unsigned char) (length >> 16);
+      headers[i][2] = (unsigned char) (length >> 8);
+      headers[i][3] = (unsigned char) length;
+      iov[2 * i].iov_base = headers[i];
+      iov[2 * i].iov_len = 4;
+      iov[2 * i + 1] = native->pending[i];
+      total += 4 + length;
+    }
+
+  do
+    {
+      ret = writev(native->fd, iov, 2 * native->pending_count);
+    }
+  while( ret < 0 && errno == EINTR );
+  native->stats.syscalls++;
+  native->stats.last_syscalls++;
+  if( ret != (ssize_t) total )
+    {
+      native->failed = 1;
+      native->stats.errors += native->pending_count;
+      return;
+    }
+  for( i=0; i<native->pending_count; ++i )
+    {
+      native->stats.last_datagrams++;
+      native->stats.last_bytes += (long long) native->pending[i].iov_len;
+      native->stats.datagrams++;
+      native->stats.bytes += (long long) native->pending[i].iov_len;
+    }
+}
+
+/* starts the stream a native transport writes frames to, returns -1 if the
+   address or options are bad or it can't be started */
+static int
+mondemand_transport_native_stream(struct m_native_transport *native,
+                                  const char *address,
+                                  const struct mondemand_stream_options *opts)
+{
+  int buffer_size = M_STREAM_BUFFER_SIZE;
+  int policy = MONDEMAND_QUEUE_DROP_OLDEST;
+  int backoff_min_ms = M_STREAM_BACKOFF_MIN_MS;
+  int backoff_max_ms = M_STREAM_BACKOFF_MAX_MS;
+
+  if( address == NULL )
+    {
+      return -1;
+    }
+  if( opts != NULL )
+    {
+      if( opts->buffer_size < 0
+          || opts->policy < MONDEMAND_QUEUE_BLOCK
+          || opts->policy > MONDEMAND_QUEUE_DROP_OLDEST
+          || opts->backoff_min_ms < 0 || opts->backoff_max_ms < 0 )
+        {
+          return -1;
+        }
+      if( opts->buffer_size > 0 )
+        {
+          buffer_size = opts->buffer_size;
+        }
+      policy = (int) opts->policy;
+      if( opts->backoff_min_ms > 0 )
+        {
+          backoff_min_ms = opts->backoff_min_ms;
+        }
+      if( opts->backoff_max_ms > 0 )
+        {
+          backoff_max_ms = opts->backoff_max_ms;
+        }
+      if( backoff_max_ms < backoff_min_ms )
+        {
+          backoff_max_ms = backoff_min_ms;
+        }
+    }
+
+  native->stream = m_stream_create(address, (size_t) buffer_size, policy,
+                                   backoff_min_ms, backoff_max_ms);
+
+  return native->stream != NULL ? 0 : -1;
+}
+
+/* makes a transport around a native one which writes datagrams locally
+   rather than to a socket */
+static struct mondemand_transport *
+mondemand_transport_native_local(struct m_native_transport *native,
+                                 mondemand_transport_destroy_t destroy)
+{
+  struct mondemand_transport *transport = NULL;
+
+  transport = (struct mondemand_transport *)
+    m_try_malloc0(sizeof(struct mondemand_transport));
+  if( transport == NULL )
+    {
+      return NULL;
+    }
+
+  /* everything goes through the native senders, only the last step
+     differs */
+  native->fd = -1;
+  native->batch = M_NATIVE_BATCH;
+  native->max_datagram = MONDEMAND_ENCODED_MAX;
+  transport->log_sender_function =
+    &mondemand_transport_native_log_sender;
+  transport->stats_sender_function =
+    &mondemand_transport_native_stats_sender;
+  transport->trace_sender_function =
+    &mondemand_transport_native_trace_sender;
+  transport->perf_sender_function =
+    &mondemand_transport_native_perf_sender;
+  transport->annotation_sender_function =
+    &mondemand_transport_native_annotation_sender;
+  transport->destroy_function =
+    destroy;
+  transport->userdata =
+    native;
+  transport->version =
+    MONDEMAND_TRANSPORT_VERSION_ENCODING;
+  transport->encoding =
+    &mondemand_encoding_lwes_native;
+  transport->bytes_sender_function =
+    &mondemand_transport_native_bytes_sender;
+
+  return transport;
+}
+
+#ifdef M_HAVE_URING
+/* completes the submissions a failed flush left in the ring, so they don't
+   use up its slots or reach the kernel pointing at datagrams of a later
+   flush.  Returns -1 if they can't be completed */
+static int
+mondemand_transport_native_drain_uring(struct m_native_transport *native)
+{
+  struct io_uring_cqe *cqe = NULL;
+  int ret = 0;
+
+  while( native->uring_stale > 0 )
+    {
+      ret = io_uring_submit_and_wait(&native->ring, 1);
+      native->stats.syscalls++;
+      native->stats.last_syscalls++;
+      if( ret < 0 && ret != -EINTR )
+        {
+          return -1;
+        }
+      while( native->uring_stale > 0
+             && io_uring_peek_cqe(&native->ring, &cqe) == 0 )
+        {
+          io_uring_cqe_seen(&native->ring, cqe);
+          native->uring_stale--;
+        }
+    }
+
+  return 0;
+}
+
+/* sends the queued datagrams as one sendmsg submission each, submitting
+   them and waiting for them all to complete in one io_uring_enter */
+static void
+mondemand_transport_native_send_uring(struct m_native_transport *native)
+{
+  struct io_uring_sqe *sqes[M_NATIVE_BATCH];
+  struct io_uring_cqe *cqe = NULL;
+  const struct iovec *iov = NULL;
+  int prepared = 0;
+  int submitted = 0;
+  int reaped = 0;
+  int ret = 0;
+  int i;
+
+  if( native->pending_count == 0 )
+    {
+      return;
+    }
+  if( mondemand_transport_native_drain_uring(native) != 0 )
+    {
+      native->failed = 1;
+      native->stats.errors += native->pending_count;
+      return;
+    }
+
+  /* the ring has a submission for every datagram which can be queued */
+  for( i=0; i<native->pending_count; ++i )
+    {
+      sqes[i] = io_uring_get_sqe(&native->ring);
+      if( sqes[i] == NULL )
+        {
+          break;
+        }
+      io_uring_prep_sendmsg(sqes[i], native->fd,
+                            &native->messages[i].msg_hdr, 0);
+      io_uring_sqe_set_data(sqes[i], &native->pending[i]);
+      ++prepared;
+    }
+  if( prepared < native->pending_count )
+    {
+      native->failed = 1;
+      native->stats.errors += native->pending_count - prepared;
+    }
+  if( prepared == 0 )
+    {
+      return;
+    }
+
+  do
+    {
+      ret = io_uring_submit_and_wait(&native->ring, (unsigned int) prepared);
+      native->stats.syscalls++;
+      native->stats.last_syscalls++;
+    }
+  while( ret == -EINTR );
+  submitted = ret > 0 ? ret : 0;
+  if( submitted < prepared )
+    {
+      /* the kernel didn't take them all, the rest stay in the ring and
+         would go out with the next submission, so they are made no-ops
+         and completed before the ring is used again */
+      native->failed = 1;
+      native->stats.errors += prepared - submitted;
+      for( i=submitted; i<prepared; ++i )
+        {
+          io_uring_prep_nop(sqes[i]);
+          io_uring_sqe_set_data(sqes[i], NULL);
+        }
+      native->uring_stale += prepared - submitted;
+    }
+
+  while( reaped < submitted )
+    {
+      ret = io_uring_wait_cqe(&native->ring, &cqe);
+      if( ret == -EINTR )
+        {
+          continue;
+        }
+      if( ret < 0 )
+        {
+          /* whatever is still to complete is waited for next time */
+          native->failed = 1;
+          native->stats.errors += submitted - reaped;
+          native->uring_stale += submitted - reaped;
+          break;
+        }
+      iov = (const struct iovec *) io_uring_cqe_get_data(cqe);
+      if( cqe->res < 0 )
+        {
+          native->failed = 1;
+          if( cqe->res == -EAGAIN || cqe->res == -EWOULDBLOCK )
+            {
+              native->stats.would_block++;
+            }
+          else
+            {
+              native->stats.errors++;
+            }
+        }
+      else
+        {
+          native->stats.last_datagrams++;
+          native->stats.last_bytes += (long long) iov->iov_len;
+          native->stats.datagrams++;
+          native->stats.bytes += (long long) iov->iov_len;
+        }
+      io_uring_cqe_seen(&native->ring, cqe);
+      ++reaped;
+    }
+}
+#endif
+
+/* starts counting what a flush sends */
+static void
+mondemand_transport_native_flush(struct m_native_transport *native)
+{
+  native->stats.flushes++;
+  native->stats.last_datagrams = 0;
+  native->stats.last_bytes = 0;
+  native->stats.last_syscalls = 0;
+  native->failed = 0;
+}
+
+/* sends a flush from the shared encoding */
+static int
+mondemand_transport_native_bytes_sender(
+                      const unsigned char *bytes,
+                      const size_t length,
+                      void *userdata)
+{
+  struct m_native_transport *native = (struct m_native_transport *) userdata;
+
+  mondemand_transport_native_flush(native);
+  if( length == 0 )
+    {
+      return 0;
+    }
+  mondemand_transport_native_queue(native, bytes, length);
+
+  return mondemand_transport_native_send(native);
+}
+
+static int
+mondemand_transport_native_log_sender(
+                      const char *program_identifier,
+                      const struct mondemand_log_message messages[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      void *userdata)
+{
+  struct m_native_transport *native = (struct m_native_transport *) userdata;
+  struct m_native_event event;
+  size_t length = 0;
+
+  mondemand_transport_native_flush(native);
+  mondemand_transport_native_log_event(&event, program_identifier,
+                                       messages, message_count,
+                                       contexts, context_count, NULL);
+  if( mondemand_transport_native_pack(&event, NULL, native->max_datagram,
+                                      native, &length) != 0 )
+    {
+      native->failed = 1;
+    }
+
+  return mondemand_transport_native_send(native);
+}
+
+static int
+mondemand_transport_native_stats_sender(
+                      const char *program_identifier,
+                      const struct mondemand_stats_message stats[],
+                      const int message_count,
+                      const struct mondemand_context contexts[],
+                      const int context_count,
+                      void *userdata)
+{
+  struct m_native_transport *native = (struct m_native_transport *) userdata;
+  struct m_native_event event;
+  size_t length = 0;
+
+  mondemand_transport_native_flush(native);
+  mondemand_transport_native_stats_event(&event, program_identifier,
+                                         stats, message_count,
+                                         contexts, context_count, NULL);
+  if( mondemand_transport_native_pack(&event, NULL, native->max_datagram,
+                                      native, &length) != 0 )
+    {
+      native->failed = 1;
+    }
+
+  return mondemand_transport_native_send(native);
+}
+
+static int
+mondemand_transport_native_trace_sender(
+                      const char *program_identifier,
+                      const char *owner,
+                      const char *trace_id,
+                      const char *message,
+                      const struct mondemand_trace traces[],
+                      const int trace_count,
+                      void *userdata)
+{
+  struct m_native_transport *native = (struct m_native_transport *) userdata;
+  struct m_lwes_writer writer;
+  unsigned char *buffer = NULL;
+  char hostname[1024];
+  size_t length = 0;
+  int j;
+
+  hostname[1023] = '\0';
+  gethostname (hostname, 1023);
+
+  mondemand_transport_native_flush(native);
+  buffer = mondemand_transport_native_slot(native);
+  m_lwes_begin(&writer, buffer, native->max_datagram, LWES_TRACE_MSG);
+  m_lwes_key(&writer, "mondemand.prog_id", -1);
+  m_lwes_string(&writer, program_identifier);
+  m_lwes_key(&writer, "mondemand.trace_id", -1);
+  m_lwes_string(&writer, trace_id);
+  m_lwes_key(&writer, "mondemand.owner", -1);
+  m_lwes_string(&writer, owner);
+  m_lwes_key(&writer, "mondemand.src_host", -1);
+  m_lwes_string(&writer, hostname);
+  m_lwes_key(&writer, "mondemand.message", -1);
+  m_lwes_string(&writer, message);
+  for (j=0; j < trace_count; ++j)
+    {
+      m_lwes_key(&writer, traces[j].key, -1);
+      m_lwes_string(&writer, traces[j].value);
+    }
+  if( m_lwes_end(&writer, &length) != 0 )
+    {
+      native->stats.dropped++;
+      return -1;
+    }
+
+  mondemand_transport_native_queue(native, buffer, length);
+
+  return mondemand_transport_native_send(native);
+}
+
+static int
+mondemand_transport_native_perf_sender(
+               const char *id,
+               const char *caller_label,
+               const struct mondemand_timing timings[],
+               const int timings_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               void *userdata)
+{
+  struct m_native_transport *native = (struct m_native_transport *) userdata;
+  struct m_native_event event;
+  size_t length = 0;
+
+  mondemand_transport_native_flush(native);
+  mondemand_transport_native_perf_event(&event, id, caller_label,
+                                        timings, timings_count,
+                                        contexts, context_count, NULL);
+  if( mondemand_transport_native_pack(&event, NULL, native->max_datagram,
+                                      native, &length) != 0 )
+    {
+      native->failed = 1;
+    }
+
+  return mondemand_transport_native_send(native);
+}
+
+static int
+mondemand_transport_native_annotation_sender(
+               const char *id,
+               const long long int timestamp,
+               const char *description,
+               const char *text,
+               const char *tags[],
+               const int tag_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               void *userdata)
+{
+  struct m_native_transport *native = (struct m_native_transport *) userdata;
+  struct m_lwes_writer writer;
+  unsigned char *buffer = NULL;
+  size_t length = 0;
+  int t = 0;
+
+  mondemand_transport_native_flush(native);
+  buffer = mondemand_transport_native_slot(native);
+  m_lwes_begin(&writer, buffer, native->max_datagram, LWES_ANNOTATION_MSG);
+  m_lwes_key(&writer, "id", -1);
+  m_lwes_string(&writer, id);
+  m_lwes_key(&writer, "timestamp", -1);
+  m_lwes_int_64(&writer, timestamp);
+  m_lwes_key(&writer, "description", -1);
+  m_lwes_string(&writer, description);
+  m_lwes_key(&writer, "text", -1);
+  m_lwes_string(&writer, text);
+  if (tag_count > 0)
+    {
+      m_lwes_key(&writer, "tag_num", -1);
+      m_lwes_u_int_16(&writer, (unsigned int) tag_count);
+      for (t = 0; t < tag_count; ++t)
+        {
+          m_lwes_key(&writer, "tag", t);
+          m_lwes_string(&writer, tags[t]);
+        }
+    }
+  mondemand_transport_native_contexts(&writer, contexts, context_count, NULL);
+  if( m_lwes_end(&writer, &length) != 0 )
+    {
+      native->stats.dropped++;
+      return -1;
+    }
+
+  mondemand_transport_native_queue(native, buffer, length);
+
+  return mondemand_transport_native_send(native);
+}
+
+/* writes the tags every line of a flush ends with, the program identifier
+   and the contexts, or nothing for plain StatsD */
+static int
+mondemand_transport_statsd_tags(struct m_statsd_transport *statsd,
+                                const char *program_identifier,
+                                const struct mondemand_context contexts[],
+                                const int context_count)
+{
+  struct m_statsd_writer writer;
+  int i;
+
+  statsd->tags_length = 0;
+  if( statsd->plain )
+    {
+      return 0;
+    }
+
+  m_statsd_begin(&writer, statsd->tags, sizeof(statsd->tags));
+  m_statsd_bytes(&writer, "|#prog_id:", 10);
+  m_statsd_name(&writer, program_identifier, M_STATSD_TAG_RESERVED);
+  for( i=0; i<context_count; ++i )
+    {
+      m_statsd_bytes(&writer, ",", 1);
+      m_statsd_name(&writer, contexts[i].key, M_STATSD_TAG_RESERVED);
+      m_statsd_bytes(&writer, ":", 1);
+      m_statsd_name(&writer, contexts[i].value, M_STATSD_TAG_RESERVED);
+    }
+
+  return m_statsd_end(&writer, &statsd->tags_length);
+}
+
+/* the value to send for a stat.  Gauges are sent as they are; counters
+   are totals, StatsD wants what was added since the last flush.  Returns
+   1 for a counter which hasn't changed, -1 if its total can't be kept */
+static int
+mondemand_transport_statsd_value(struct m_statsd_transport *statsd,
+                                 const struct mondemand_stats_message *stat,
+                                 long long *value)
+{
+  long long *last = NULL;
+  char *key = NULL;
+
+  *value = stat->value;
+  if( stat->type != MONDEMAND_COUNTER )
+    {
+      return 0;
+    }
+
+  last = (long long *) m_hash_table_get(statsd->counters, stat->key);
+  if( last == NULL )
+    {
+      last = (long long *) m_try_malloc0(sizeof(long long));
+      key = strdup(stat->key);
+      if( last == NULL || key == NULL
+          || m_hash_table_set(statsd->counters, key, last) != 0 )
+        {
+          m_free(last);
+          m_free(key);
+          return -1;
+        }
+    }
+  else if( stat->value >= *last )
+    {
+      /* a total which went down was reset, so everything in it is new */
+      *value = stat->value - *last;
+    }
+  *last = stat->value;
+
+  return *value == 0 ? 1 : 0;
+}
+
+/* writes a stat's line, after a newline if it isn't the first in the
+   datagram.  A negative gauge is two lines, StatsD reads a signed gauge
+   as a change, so it's set to 0 first */
+static void
+mondemand_transport_statsd_line(struct m_statsd_transport *statsd,
+                                struct m_statsd_writer *writer,
+                                const char *program_identifier,
+                                const struct mondemand_stats_message *stat,
+                                long long value)
+{
+  int counter = (stat->type == MONDEMAND_COUNTER);
+  int lines = (! counter && value < 0) ? 2 : 1;
+  int i;
+
+  for( i=0; i<lines; ++i )
+    {
+      if( writer->used > 0 )
+        {
+          m_statsd_bytes(writer, "\n", 1);
+        }
+      if( statsd->plain )
+        {
+          m_statsd_name(writer, program_identifier, M_STATSD_NAME_RESERVED);
+          m_statsd_bytes(writer, ".", 1);
+        }
+      m_statsd_name(writer, stat->key, M_STATSD_NAME_RESERVED);
+      m_statsd_bytes(writer, ":", 1);
+      m_statsd_integer(writer, (lines == 2 && i == 0) ? 0 : value);
+      m_statsd_bytes(writer, counter ? "|c" : "|g", 2);
+      m_statsd_bytes(writer, statsd->tags, statsd->tags_length);
+    }
+}
+
+/* StatsD only has metrics, everything else is dropped.  OTLP transports
+   drop log messages, traces and annotations with these too */
+/* sends the stats as lines, as many to a datagram as fit */
+static int
+mondemand_transport_statsd_stats_sender(
+               const char *program_identifier,
+               const struct mondemand_stats_message stats[],
+               const int message_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               void *userdata)
+{
+  struct m_statsd_transport *statsd = (struct m_statsd_transport *) userdata;
+  struct m_native_transport *native = &statsd->native;
+  struct m_statsd_writer writer;
+  char *buffer = NULL;
+  size_t line_start = 0;
+  long long value = 0;
+  int ret;
+  int i;
+
+  mondemand_transport_native_flush(native);
+  if( mondemand_transport_statsd_tags(statsd, program_identifier,
+                                      contexts, context_count) != 0 )
+    {
+      native->stats.dropped += message_count;
+      return -1;
+    }
+
+  buffer = (char *) mondemand_transport_native_slot(native);
+  m_statsd_begin(&writer, buffer, native->max_datagram);
+  for( i=0; i<message_count; ++i )
+    {
+      ret = mondemand_transport_statsd_value(statsd, &stats[i], &value);
+      if( ret != 0 )
+        {
+          if( ret < 0 )
+            {
+              native->stats.dropped++;
+              native->failed = 1;
+            }
+          continue;
+        }
+
+      line_start = writer.used;
+      mondemand_transport_statsd_line(statsd, &writer, program_identifier,
+                                      &stats[i], value);
+      if( writer.overflow && line_start > 0 )
+        {
+          /* the datagram is full, send it and start the next with this
+             line */
+          mondemand_transport_native_queue(native,
+                                           (unsigned char *) buffer,
+                                           line_start);
+          buffer = (char *) mondemand_transport_native_slot(native);
+          m_statsd_begin(&writer, buffer, native->max_datagram);
+          mondemand_transport_statsd_line(statsd, &writer,
+                                          program_identifier,
+                                          &stats[i], value);
+        }
+      if( writer.overflow )
+        {
+          /* too big for a datagram of its own */
+          native->stats.dropped++;
+          native->failed = 1;
+          m_statsd_begin(&writer, buffer, native->max_datagram);
+        }
+    }
+  if( writer.used > 0 )
+    {
+      mondemand_transport_native_queue(native, (unsigned char *) buffer,
+                                       writer.used);
+    }
+
+  return mondemand_transport_native_send(native);
+}
+
+/* makes a transport around an otlp one whose stream or file is set up by
+   the caller */
+static struct mondemand_transport *
+mondemand_transport_otlp_local(struct m_otlp_transport *otlp)
+{
+  struct mondemand_transport *transport = NULL;
+
+  transport = mondemand_transport_native_local(
+                &otlp->native, &mondemand_transport_otlp_destroy);
+  if( transport != NULL )
+    {
+      otlp->start_ns = mondemand_transport_otlp_now();
+      transport->log_sender_function = NULL;
+      transport->stats_sender_function =
+        &mondemand_transport_otlp_stats_sender;
+      transport->trace_sender_function = NULL;
+      transport->perf_sender_function =
+        &mondemand_transport_otlp_perf_sender;
+      transport->annotation_sender_function = NULL;
+      transport->version =
+        MONDEMAND_TRANSPORT_VERSION;
+      transport->capabilities = MONDEMAND_TRANSPORT_STATS
+                                | MONDEMAND_TRANSPORT_PERF
+                                | MONDEMAND_TRANSPORT_CONTEXTS;
+      transport->encoding = NULL;
+      transport->bytes_sender_function = NULL;
+    }
+
+  return transport;
+}
+
+/* writes the flush as requests, each the resource, the scope and as many
+   items as fit in a frame, repeating the resource and scope in the next
+   request for those which didn't */
+static int
+mondemand_transport_otlp_send(struct m_otlp_transport *otlp,
+                              const struct m_otlp_flush *flush)
+{
+  struct m_native_transport *native = &otlp->native;
+  struct m_protobuf_writer writer;
+  struct m_protobuf_mark mark;
+  unsigned char *buffer = NULL;
+  size_t length = 0;
+  int first;
+  int c;
+  int i = 0;
+
+  mondemand_transport_native_flush(native);
+  while( i < flush->count )
+    {
+      buffer = mondemand_transport_native_slot(native);
+      buffer[0] = (unsigned char) flush->kind;
+      m_protobuf_begin(&writer, buffer + 1, native->max_datagram - 1);
+      m_protobuf_open(&writer, M_OTLP_REQUEST_RESOURCE);
+      m_protobuf_open(&writer, M_OTLP_RESOURCE);
+      mondemand_transport_otlp_attribute(&writer, M_OTLP_ATTRIBUTES,
+                                         "service.name", flush->service);
+      for( c=0; c<flush->context_count; ++c )
+        {
+          mondemand_transport_otlp_attribute(&writer, M_OTLP_ATTRIBUTES,
+                                             flush->contexts[c].key,
+                                             flush->contexts[c].value);
+        }
+      m_protobuf_close(&writer);
+      m_protobuf_open(&writer, M_OTLP_RESOURCE_SCOPE);
+      m_protobuf_open(&writer, M_OTLP_SCOPE);
+      m_protobuf_string(&writer, M_OTLP_SCOPE_NAME, PACKAGE);
+      m_protobuf_string(&writer, M_OTLP_SCOPE_VERSION, VERSION);
+      m_protobuf_close(&writer);
+
+      writer.size -= M_OTLP_CLOSE_ROOM;
+      for( first=i; i<flush->count; ++i )
+        {
+          m_protobuf_mark(&writer, &mark);
+          flush->item(&writer, flush, i);
+          if( writer.overflow )
+            {
+              m_protobuf_rewind(&writer, &mark);
+              break;
+            }
+        }
+      writer.size += M_OTLP_CLOSE_ROOM;
+      if( i == first )
+        {
+          /* too big for a request of its own */
+          native->stats.dropped++;
+          native->failed = 1;
+          ++i;
+          continue;
+        }
+
+      m_protobuf_close(&writer);
+      m_protobuf_close(&writer);
+      if( m_protobuf_end(&writer, &length) != 0 )
+        {
+          native->stats.dropped += i - first;
+          native->failed = 1;
+          continue;
+        }
+      mondemand_transport_native_queue(native, buffer, 1 + length);
+    }
+
+  return mondemand_transport_native_send(native);
+}
+
+/* writes a KeyValue with a string value */
+static void
+mondemand_transport_otlp_attribute(struct m_protobuf_writer *writer,
+                                   unsigned char tag, const char *key,
+                                   const char *value)
+{
+  m_protobuf_open(writer, tag);
+  m_protobuf_string(writer, M_OTLP_KEY, key);
+  m_protobuf_open(writer, M_OTLP_VALUE);
+  m_protobuf_string(writer, M_OTLP_STRING_VALUE, value);
+  m_protobuf_close(writer);
+  m_protobuf_close(writer);
+}
+
+/* writes stat i as a Metric, counters are cumulative monotonic sums since
+   the transport was created and gauges gauges */
+static void
+mondemand_transport_otlp_metric(struct m_protobuf_writer *writer,
+                                const struct m_otlp_flush *flush, int i)
+{
+  const struct mondemand_stats_message *stat =
+    &((const struct mondemand_stats_message *) flush->items)[i];
+  int counter = (stat->type == MONDEMAND_COUNTER);
+
+  m_protobuf_open(writer, M_OTLP_SCOPE_ITEM);
+  m_protobuf_string(writer, M_OTLP_METRIC_NAME, stat->key);
+  m_protobuf_open(writer, counter ? M_OTLP_METRIC_SUM : M_OTLP_METRIC_GAUGE);
+  m_protobuf_open(writer, M_OTLP_DATA_POINT);
+  if( counter )
+    {
+      m_protobuf_fixed64(writer, M_OTLP_POINT_START, flush->start_ns);
+    }
+  m_protobuf_fixed64(writer, M_OTLP_POINT_TIME, flush->time_ns);
+  m_protobuf_fixed64(writer, M_OTLP_POINT_INT,
+                     (unsigned long long) stat->value);
+  m_protobuf_close(writer);
+  if( counter )
+    {
+      m_protobuf_varint(writer, M_OTLP_SUM_TEMPORALITY, M_OTLP_CUMULATIVE);
+      m_protobuf_varint(writer, M_OTLP_SUM_MONOTONIC, 1);
+    }
+  m_protobuf_close(writer);
+  m_protobuf_close(writer);
+}
+
+/* writes item i of a perf flush as a Span, 0 is the whole trace and the
+   rest its timings as children.  Timings are in milliseconds */
+static void
+mondemand_transport_otlp_span(struct m_protobuf_writer *writer,
+                              const struct m_otlp_flush *flush, int i)
+{
+  const struct mondemand_timing *timings =
+    (const struct mondemand_timing *) flush->items;
+  unsigned char span_id[8];
+
+  m_protobuf_open(writer, M_OTLP_SCOPE_ITEM);
+  m_protobuf_bytes(writer, M_OTLP_SPAN_TRACE_ID, flush->trace_id, 16);
+  if( i == 0 )
+    {
+      m_protobuf_bytes(writer, M_OTLP_SPAN_ID, flush->span_id, 8);
+      m_protobuf_string(writer, M_OTLP_SPAN_NAME, flush->service);
+      m_protobuf_varint(writer, M_OTLP_SPAN_KIND, M_OTLP_INTERNAL);
+      m_protobuf_fixed64(writer, M_OTLP_SPAN_START, flush->start_ns);
+      m_protobuf_fixed64(writer, M_OTLP_SPAN_END, flush->time_ns);
+      mondemand_transport_otlp_attribute(writer, M_OTLP_SPAN_ATTRIBUTES,
+                                         "mondemand.perf_id", flush->id);
+    }
+  else
+    {
+      mondemand_transport_otlp_id(flush->id, (unsigned long long) i,
+                                  span_id);
+      m_protobuf_bytes(writer, M_OTLP_SPAN_ID, span_id, 8);
+      m_protobuf_bytes(writer, M_OTLP_SPAN_PARENT_ID, flush->span_id, 8);
+      m_protobuf_string(writer, M_OTLP_SPAN_NAME, timings[i - 1].label);
+      m_protobuf_varint(writer, M_OTLP_SPAN_KIND, M_OTLP_INTERNAL);
+      m_protobuf_fixed64(writer, M_OTLP_SPAN_START,
+                         (unsigned long long) timings[i - 1].start * 1000000ULL);
+      m_protobuf_fixed64(writer, M_OTLP_SPAN_END,
+                         (unsigned long long) timings[i - 1].end * 1000000ULL);
+    }
+  m_protobuf_close(writer);
+}
+
+/* derives 8 id bytes from a perf id and salt with 64-bit FNV-1a, so every
+   flush of a trace gets the same trace id and its spans the same ids.  An
+   all zero id is invalid, so it's never produced */
+static void
+mondemand_transport_otlp_id(const char *id, unsigned long long salt,
+                            unsigned char bytes[8])
+{
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  int i;
+
+  for( ; *id != '\0'; ++id )
+    {
+      hash = (hash ^ (unsigned char) *id) * 0x100000001b3ULL;
+    }
+  for( i=0; i<8; ++i )
+    {
+      hash = (hash ^ (salt & 0xff)) * 0x100000001b3ULL;
+      salt >>= 8;
+    }
+  if( hash == 0 )
+    {
+      hash = 1;
+    }
+  for( i=7; i>=0; --i )
+    {
+      bytes[i] = (unsigned char) hash;
+      hash >>= 8;
+    }
+}
+
+static unsigned long long
+mondemand_transport_otlp_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (unsigned long long) now.tv_sec * 1000000000ULL
+         + (unsigned long long) now.tv_nsec;
+}
+
+/* sends the stats as metrics of a resource named after the program */
+static int
+mondemand_transport_otlp_stats_sender(
+               const char *program_identifier,
+               const struct mondemand_stats_message stats[],
+               const int message_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               void *userdata)
+{
+  struct m_otlp_transport *otlp = (struct m_otlp_transport *) userdata;
+  struct m_otlp_flush flush;
+
+  memset(&flush, 0, sizeof(flush));
+  flush.kind = MONDEMAND_OTLP_METRICS;
+  flush.service = program_identifier;
+  flush.contexts = contexts;
+  flush.context_count = context_count;
+  flush.count = message_count;
+  flush.item = &mondemand_transport_otlp_metric;
+  flush.items = stats;
+  flush.start_ns = otlp->start_ns;
+  flush.time_ns = mondemand_transport_otlp_now();
+
+  return mondemand_transport_otlp_send(otlp, &flush);
+}
+
+/* sends the timings as spans under one covering them all, of a resource
+   named after the caller label */
+static int
+mondemand_transport_otlp_perf_sender(
+               const char *id,
+               const char *caller_label,
+               const struct mondemand_timing timings[],
+               const int timings_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               void *userdata)
+{
+  struct m_otlp_transport *otlp = (struct m_otlp_transport *) userdata;
+  struct m_otlp_flush flush;
+  long long start = 0;
+  long long end = 0;
+  int i;
+
+  if( timings_count <= 0 || id == NULL )
+    {
+      return 0;
+    }
+
+  memset(&flush, 0, sizeof(flush));
+  flush.kind = MONDEMAND_OTLP_TRACES;
+  flush.service = caller_label;
+  flush.contexts = contexts;
+  flush.context_count = context_count;
+  flush.count = timings_count + 1;
+  flush.item = &mondemand_transport_otlp_span;
+  flush.items = timings;
+  flush.id = id;
+  /* span ids are salted with the item, the trace id with what no item is */
+  mondemand_transport_otlp_id(id, ~0ULL, flush.trace_id);
+  mondemand_transport_otlp_id(id, ~1ULL, flush.trace_id + 8);
+  mondemand_transport_otlp_id(id, 0, flush.span_id);
+  for( i=0; i<timings_count; ++i )
+    {
+      if( i == 0 || timings[i].start < start )
+        {
+          start = timings[i].start;
+        }
+      if( i == 0 || timings[i].end > end )
+        {
+          end = timings[i].end;
+        }
+    }
+  flush.start_ns = (unsigned long long) start * 1000000ULL;
+  flush.time_ns = (unsigned long long) end * 1000000ULL;
+
+  return mondemand_transport_otlp_send(otlp, &flush);
+}
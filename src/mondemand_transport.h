@@ -12,9 +12,14 @@
 #ifndef __M_TRANSPORT_H__
 #define __M_TRANSPORT_H__
 
+#include <stddef.h>
+
 #include "mondemand_types.h"
 #include "mondemand_trace.h"
 
+/* the most bytes a shared encoding may produce for a single flush */
+#define MONDEMAND_ENCODED_MAX 65535
+
 /* external structs that callback implementers would use */
 
 /* represents a contextual data pair */
@@ -39,6 +44,17 @@ struct mondemand_log_message
   int repeat_count;
   const char *message;
   struct mondemand_trace_id trace_id;
+  /* fraction of messages at this level which were kept, 1.0 if unsampled */
+  double sample_rate;
+  /* structured key/value fields, NULL if there are none */
+  const struct mondemand_log_field *fields;
+  int field_count;
+  /* the printf format and its arguments as typed values (with NULL keys),
+     format is NULL if the message wasn't formatted or the arguments could
+     not be captured */
+  const char *format;
+  const struct mondemand_log_field *args;
+  int arg_count;
 };
 
 /* represents a single statistic */
@@ -62,6 +78,21 @@ struct mondemand_timing
 struct mondemand_transport *mondemand_transport_stderr_create(void);
 void mondemand_transport_stderr_destroy(struct mondemand_transport *transport);
 
+/* transport writing what the stderr transport does to a file descriptor,
+   which is left open.  Each flush is formatted into a buffer kept by the
+   transport.  In MONDEMAND_FD_LINE mode (stderr's) the flush is written
+   with a single write, so lines from different threads don't interleave.
+   In MONDEMAND_FD_BLOCK mode flushes are held until block_size bytes (0
+   for 64K) are buffered and written together, anything left when the
+   transport is destroyed is written then */
+struct mondemand_transport *mondemand_transport_fd_create(
+                               int fd, MondemandFdMode mode, int block_size);
+/* the same appending to the file at path, created if it doesn't exist */
+struct mondemand_transport *mondemand_transport_file_create(
+                               const char *path, MondemandFdMode mode,
+                               int block_size);
+void mondemand_transport_fd_destroy(struct mondemand_transport *transport);
+
 /* lwes transport */
 struct mondemand_transport *mondemand_transport_lwes_create(
                                const char *address, const int port,
@@ -71,8 +102,229 @@ struct mondemand_transport *mondemand_transport_lwes_create_with_ttl(
                                const char *address, const int port,
                                const char *interface, int emit_heartbeat,
                                int heartbeat_frequency, int ttl);
+/* lwes transport which sends log messages as a call site id plus the typed
+   format arguments.  The call site's filename, line and format are sent
+   in a MonDemand::LogDict event the first time it is used and then again
+   every dictionary_interval seconds (0 for never) */
+struct mondemand_transport *mondemand_transport_lwes_dictionary_create(
+                               const char *address, const int port,
+                               const char *interface, int emit_heartbeat,
+                               int heartbeat_frequency, int ttl,
+                               int dictionary_interval);
 void mondemand_transport_lwes_destroy(struct mondemand_transport *transport);
 
+/* lwes compatible transport which writes events in the lwes wire format
+   itself into a preallocated buffer and sends them with sendto, so sending
+   doesn't allocate.  Heartbeats are not sent */
+struct mondemand_transport *mondemand_transport_lwes_native_create(
+                               const char *address, const int port,
+                               const char *interface, int ttl);
+
+/* options for native lwes transports */
+struct mondemand_native_options
+{
+  /* ttl for multicast datagrams */
+  int ttl;
+  /* largest datagram to send, 0 for 65535.  Log, stats and perf flushes
+     which don't fit are split into several events, each with its own num
+     and the contexts; something too big to fit on its own is dropped.
+     1472 keeps datagrams inside a 1500 byte ethernet MTU */
+  int max_datagram;
+  /* SO_SNDBUF for the socket, 0 for the system default */
+  int sndbuf;
+  /* non-zero to never block sending.  Datagrams which don't fit in the
+     socket buffer are dropped and counted in would_block */
+  int nonblocking;
+  /* most datagrams of a flush given to the kernel in one sendmmsg call,
+     0 for 64.  1 sends each datagram with its own sendto */
+  int batch;
+  /* non-zero to send through io_uring, submitting a flush's datagrams and
+     reaping their completions in one system call.  Creating the transport
+     fails if mondemand was built without liburing */
+  int uring;
+};
+
+/* what a native lwes transport has sent.  last_* describe the most recent
+   flush, the rest are totals since the transport was created */
+struct mondemand_native_stats
+{
+  int last_datagrams;
+  long long last_bytes;
+  int last_syscalls;
+  long long flushes;
+  long long datagrams;
+  long long bytes;
+  /* messages, stats or timings which didn't fit in a datagram */
+  long long dropped;
+  /* datagrams which couldn't be sent */
+  long long errors;
+  /* datagrams dropped because a non-blocking socket's buffer, a shared
+     memory ring or a stream's queue was full */
+  long long would_block;
+  /* sendto or sendmmsg calls made */
+  long long syscalls;
+};
+
+struct mondemand_transport *mondemand_transport_lwes_native_create_with_options(
+                               const char *address, const int port,
+                               const char *interface,
+                               const struct mondemand_native_options *opts);
+/* copies the transport's counters into stats, returns -2 if it isn't a
+   native lwes transport or one built on it */
+int mondemand_transport_lwes_native_get_stats(
+                               struct mondemand_transport *transport,
+                               struct mondemand_native_stats *stats);
+void mondemand_transport_lwes_native_destroy(
+                               struct mondemand_transport *transport);
+
+/* spool transports write each datagram a native lwes transport would send
+   as a record in a spool (see m_spool.h), for when collectors are down or
+   events should be kept and replayed later with mondemand-tool --replay.
+   Records are stamped with the time they were written */
+struct mondemand_spool_options
+{
+  /* bytes in each segment file, 0 for 64MB */
+  long long segment_size;
+  /* seconds before moving to a new segment, 0 to only move when full */
+  int rotate_seconds;
+};
+
+/* spools to path.000001, path.000002, ... carrying on after any segments
+   already there.  opts may be NULL for the defaults.  Counters are read
+   with mondemand_transport_lwes_native_get_stats, where errors are records
+   which couldn't be written */
+struct mondemand_transport *mondemand_transport_spool_create(
+                               const char *path,
+                               const struct mondemand_spool_options *opts);
+void mondemand_transport_spool_destroy(
+                               struct mondemand_transport *transport);
+
+/* shared memory transports hand each datagram a native lwes transport would
+   send to a reader on the same host, such as mondemand-tool --ring, by
+   copying it into a ring in a file under /dev/shm (see m_ring.h).  The
+   ring is created with room for capacity bytes, 0 for 4MB, unless it
+   exists.  Flushing never blocks, when the reader is behind or not running
+   and the ring is full datagrams are dropped and counted in would_block */
+struct mondemand_transport *mondemand_transport_shm_create(
+                               const char *path, long long capacity);
+void mondemand_transport_shm_destroy(
+                               struct mondemand_transport *transport);
+
+/* stream transports send each datagram a native lwes transport would send
+   as a frame, a 4 byte big-endian length and the event, over a unix or tcp
+   stream socket to address, "unix:<path>" or "tcp:<host>:<port>" (see
+   m_stream.h).  A background thread connects, coalesces queued frames into
+   as few writes as it can and reconnects with backoff when the connection
+   fails or a connect takes over 5 seconds, so flushing never waits for the
+   network.  Frames queued while it
+   isn't connected are kept up to buffer_size bytes, then dropped or waited
+   for by policy */
+struct mondemand_stream_options
+{
+  /* bytes of frames queued before the policy applies, 0 for 1MB */
+  int buffer_size;
+  /* MONDEMAND_QUEUE_BLOCK makes flushes wait until the thread has written
+     enough, possibly until it reconnects; DROP_NEWEST drops the frames
+     being flushed and counts them in would_block; DROP_OLDEST, the default
+     with no options, drops queued frames to make room */
+  MondemandQueuePolicy policy;
+  /* first wait before reconnecting, doubling up to backoff_max_ms, 0 for
+     100ms and 10s */
+  int backoff_min_ms;
+  int backoff_max_ms;
+};
+
+/* what a stream transport's thread has done.  Frames and bytes include
+   each frame's length header */
+struct mondemand_stream_stats
+{
+  long long queued;
+  long long queued_bytes;
+  long long sent;
+  long long sent_bytes;
+  long long dropped_newest;
+  long long dropped_oldest;
+  /* writev calls and connections made */
+  long long writes;
+  long long connects;
+  /* frames and bytes waiting to be written */
+  int depth;
+  long long depth_bytes;
+  /* non-zero while connected */
+  int connected;
+};
+
+/* creates a stream transport, NULL if the address can't be parsed or
+   resolved.  Not being able to connect yet isn't an error.  The native
+   counters from mondemand_transport_lwes_native_get_stats count datagrams
+   handed to the stream */
+struct mondemand_transport *mondemand_transport_stream_create(
+                               const char *address);
+struct mondemand_transport *mondemand_transport_stream_create_with_options(
+                               const char *address,
+                               const struct mondemand_stream_options *opts);
+/* copies the stream's counters into stats, returns -2 if it isn't a stream
+   transport */
+int mondemand_transport_stream_get_stats(
+                               struct mondemand_transport *transport,
+                               struct mondemand_stream_stats *stats);
+/* writes what's queued if connected, then closes the connection.  A peer
+   which isn't reading gets a second before what's left is dropped, and a
+   connect in progress is abandoned, so this never hangs on the network */
+void mondemand_transport_stream_destroy(
+                               struct mondemand_transport *transport);
+
+/* statsd transports send stats to a StatsD or DogStatsD aggregator as
+   lines like "key:42|c", packing as many lines into each datagram as fit.
+   Counters are sent as what they went up by since the last flush, gauges
+   as their value.  By default lines carry DogStatsD tags, the program
+   identifier as prog_id and each context, "key:42|c|#prog_id:app,host:h1".
+   Log messages, traces, timings and annotations aren't sent */
+struct mondemand_statsd_options
+{
+  /* largest datagram to send, 0 for 1432 */
+  int max_datagram;
+  /* non-zero for plain StatsD without tags, names are the program
+     identifier, a '.' and the key, and contexts are left out */
+  int plain;
+  /* non-zero to never block sending, see mondemand_native_options */
+  int nonblocking;
+};
+
+/* sends to address:port over udp, opts may be NULL for the defaults.
+   Counters are read with mondemand_transport_lwes_native_get_stats */
+struct mondemand_transport *mondemand_transport_statsd_create(
+                               const char *address, const int port,
+                               const struct mondemand_statsd_options *opts);
+void mondemand_transport_statsd_destroy(
+                               struct mondemand_transport *transport);
+
+/* OpenTelemetry transports hand encode stats as OTLP metrics, counters as
+   cumulative monotonic sums and gauges as gauges, and performance trace
+   timings as spans, one covering the whole trace with each timing a child
+   of it.  The resource is named after the program identifier for stats
+   and the caller label for timings, with the contexts as attributes.
+   Each request is a frame, a 4 byte big-endian length, a byte saying which
+   request follows and the ExportMetricsServiceRequest or
+   ExportTraceServiceRequest, for a local agent to forward to a collector.
+   Flushes bigger than 64K are split into several requests.  Log messages,
+   traces and annotations aren't sent */
+#define MONDEMAND_OTLP_TRACES 1
+#define MONDEMAND_OTLP_METRICS 2
+
+/* sends frames over a unix or tcp stream socket like
+   mondemand_transport_stream_create, opts may be NULL for its defaults.
+   Counters are read with mondemand_transport_lwes_native_get_stats, where
+   datagrams are requests */
+struct mondemand_transport *mondemand_transport_otlp_create(
+                               const char *address,
+                               const struct mondemand_stream_options *opts);
+/* appends frames to the file at path, created if it doesn't exist */
+struct mondemand_transport *mondemand_transport_otlp_file_create(
+                               const char *path);
+void mondemand_transport_otlp_destroy(
+                               struct mondemand_transport *transport);
+
 /* method called when trying to log messages */
 typedef int (*mondemand_transport_log_sender_t)
               (const char *program_identifier,
@@ -127,6 +379,139 @@ typedef int (*mondemand_transport_annotation_sender_t)
 typedef void (*mondemand_transport_destroy_t)
                (struct mondemand_transport *transport);
 
+/* contexts already encoded by an encoding's context_encoder, count is the
+   number of entries (for lwes, attributes) held in bytes */
+struct mondemand_context_block
+{
+  const unsigned char *bytes;
+  size_t length;
+  int count;
+};
+
+/* encoders for a wire format several transports can share.  Each writes a
+   flush into buffer, which holds size bytes, sets *length to the number
+   written (0 for nothing to send) and returns 0, or returns -1 if the flush
+   can't be encoded, in which case each transport's sender is used.  When
+   block is not NULL the contexts are already encoded and should be copied
+   from it rather than from contexts */
+typedef int (*mondemand_encoding_log_t)
+              (const char *program_identifier,
+               const struct mondemand_log_message messages[],
+               const int message_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               const struct mondemand_context_block *block,
+               unsigned char *buffer, size_t size, size_t *length);
+
+typedef int (*mondemand_encoding_stats_t)
+              (const char *program_identifier,
+               const struct mondemand_stats_message stats[],
+               const int message_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               const struct mondemand_context_block *block,
+               unsigned char *buffer, size_t size, size_t *length);
+
+typedef int (*mondemand_encoding_perf_t)
+              (const char *id,
+               const char *caller_label,
+               const struct mondemand_timing timings[],
+               const int timings_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               const struct mondemand_context_block *block,
+               unsigned char *buffer, size_t size, size_t *length);
+
+/* encodes the contexts on their own, setting *count to the number of
+   entries written.  The client keeps the result and only calls this again
+   once the contexts change */
+typedef int (*mondemand_encoding_context_t)
+              (const struct mondemand_context contexts[],
+               const int context_count,
+               unsigned char *buffer, size_t size, size_t *length,
+               int *count);
+
+/* a shared wire encoding, an encoder left NULL means transports encode
+   that kind of flush themselves.  Without a context_encoder the other
+   encoders are always handed the contexts */
+struct mondemand_encoding
+{
+  const char *name;
+  mondemand_encoding_log_t     log_encoder;
+  mondemand_encoding_stats_t   stats_encoder;
+  mondemand_encoding_perf_t    perf_encoder;
+  mondemand_encoding_context_t context_encoder;
+};
+
+/* method called to send bytes produced by the transport's encoding */
+typedef int (*mondemand_transport_bytes_sender_t)
+              (const unsigned char *bytes,
+               const size_t length,
+               void *userdata);
+
+/* lwes encodings, the dictionary one leaves log messages to each transport
+   since the dictionary is kept per transport */
+extern const struct mondemand_encoding mondemand_encoding_lwes;
+extern const struct mondemand_encoding mondemand_encoding_lwes_dictionary;
+extern const struct mondemand_encoding mondemand_encoding_lwes_native;
+
+/* what a version 2 transport consumes, set in its capabilities.  Kinds of
+   flush no transport consumes aren't built, and contexts are only gathered
+   when some transport asks for them */
+#define MONDEMAND_TRANSPORT_LOGS        0x01
+#define MONDEMAND_TRANSPORT_STATS       0x02
+#define MONDEMAND_TRANSPORT_TRACES      0x04
+#define MONDEMAND_TRANSPORT_PERF        0x08
+#define MONDEMAND_TRANSPORT_ANNOTATIONS 0x10
+#define MONDEMAND_TRANSPORT_CONTEXTS    0x20
+#define MONDEMAND_TRANSPORT_ALL         0x3f
+
+/* the transport struct version with capabilities and batch sending, a
+   transport with a version of 0 or 1 consumes everything and must set all
+   of the sender functions.  Every transport made by hand must be set up
+   with mondemand_transport_init, or otherwise zeroed, before its fields
+   are filled in, since the client reads version whatever it holds */
+#define MONDEMAND_TRANSPORT_VERSION 2
+
+/* the transport struct version with encoding and bytes_sender_function */
+#define MONDEMAND_TRANSPORT_VERSION_ENCODING 1
+
+/* the kinds of record handed to a batch sender */
+typedef enum {
+  MONDEMAND_RECORD_LOGS = 0,
+  MONDEMAND_RECORD_STATS,
+  MONDEMAND_RECORD_TRACE,
+  MONDEMAND_RECORD_PERF,
+  MONDEMAND_RECORD_ANNOTATION
+} MondemandRecordType;
+
+/* one kind of flush in a batch, only the array for its type is set.  The
+   strings are the trace's owner, id and message, the performance trace's
+   id and caller label, or the annotation's id, description and text */
+struct mondemand_record
+{
+  MondemandRecordType type;
+  int count;
+  const struct mondemand_log_message *logs;
+  const struct mondemand_stats_message *stats;
+  const struct mondemand_trace *traces;
+  const struct mondemand_timing *timings;
+  const char * const *tags;
+  const char *strings[3];
+  long long timestamp;
+};
+
+/* method called with everything a mondemand_flush sends, at most one
+   record of each type, or with a single record for kinds of flush the
+   transport has no sender function for */
+typedef int (*mondemand_transport_batch_sender_t)
+              (const char *program_identifier,
+               const struct mondemand_record records[],
+               const int record_count,
+               const struct mondemand_context contexts[],
+               const int context_count,
+               void *userdata);
+
 /* a transport struct to encapsulate the data */
 struct mondemand_transport
 {
@@ -137,6 +522,28 @@ struct mondemand_transport
   mondemand_transport_annotation_sender_t annotation_sender_function;
   mondemand_transport_destroy_t           destroy_function;
   void *userdata;
+  /* optional, for transports of MONDEMAND_TRANSPORT_VERSION_ENCODING or
+     later.  Transports with the same encoder have a flush encoded once by
+     the client and are each handed the bytes through
+     bytes_sender_function */
+  const struct mondemand_encoding        *encoding;
+  mondemand_transport_bytes_sender_t      bytes_sender_function;
+  /* set by mondemand_transport_init, MONDEMAND_TRANSPORT_VERSION to use
+     the fields below, in which case sender functions for kinds of flush
+     missing from capabilities may be NULL.  A transport with a
+     batch_sender_function gets a whole mondemand_flush in one call, and
+     anything else it consumes without a sender function through it one
+     record at a time */
+  int                                     version;
+  unsigned int                            capabilities;
+  mondemand_transport_batch_sender_t      batch_sender_function;
 };
 
+/* zeroes a transport created by hand and sets it to the given version of
+   the struct, so the client reads the fields of that version.  A version
+   of 0 leaves a plain transport which is sent everything through its
+   callbacks.  Returns 0, or -2 for an unknown version */
+int mondemand_transport_init(struct mondemand_transport *transport,
+                             int version);
+
 #endif
@@ -36,4 +36,38 @@ typedef enum {
   MONDEMAND_SET = 2
 } MondemandOp;
 
+/* what to do when the asynchronous send queue is full */
+typedef enum {
+  MONDEMAND_QUEUE_BLOCK = 0,
+  MONDEMAND_QUEUE_DROP_NEWEST = 1,
+  MONDEMAND_QUEUE_DROP_OLDEST = 2
+} MondemandQueuePolicy;
+
+/* when file descriptor transports write what they have formatted */
+typedef enum {
+  MONDEMAND_FD_LINE = 0,
+  MONDEMAND_FD_BLOCK = 1
+} MondemandFdMode;
+
+/* structured log field types */
+typedef enum {
+  MONDEMAND_FIELD_INT64 = 0,
+  MONDEMAND_FIELD_DOUBLE = 1,
+  MONDEMAND_FIELD_STRING = 2,
+  MONDEMAND_FIELD_BOOL = 3
+} MondemandFieldType;
+
+/* a typed key/value pair attached to a log message */
+struct mondemand_log_field
+{
+  const char *key;
+  MondemandFieldType type;
+  union {
+    long long i;
+    double d;
+    const char *s;
+    int b;
+  } value;
+};
+
 #endif /* __MONDEMAND_TYPES_H__ */
@@ -13,16 +13,84 @@
 
 #include "m_mem.h"
 #include "m_hash.h"
+#include "m_buffer.h"
+#include "m_httpd.h"
+#include "m_format.h"
+#include "m_queue.h"
+#include "m_scheduler.h"
+#include "m_statsd.h"
 #include "mondemand_trace.h"
 #include "mondemand_transport.h"
 #include "mondemandlib.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #define M_MESSAGE_MAX 2048
+/* default number of distinct messages bundled into one event */
 #define M_MAX_MESSAGES 10
+/* messages and filenames captured by the debug ring are truncated to these */
+#define M_RING_MESSAGE_MAX 256
+#define M_RING_FILENAME_MAX 128
+/* default number of flushes the async queue holds */
+#define M_ASYNC_QUEUE_SIZE 1024
+/* alignment of everything copied into a queued flush */
+#define M_ARENA_ALIGN ((size_t) 8)
+/* number of encodings whose encoded contexts are kept */
+#define M_CONTEXT_BLOCKS 4
+/* most flushes collected into one batch, one of each kind */
+#define M_BATCH_MAX 5
+/* longest name of a mondemand.internal stat */
+#define M_INTERNAL_NAME_MAX 64
+/* stats added to each stats flush by the internal counters, and for each
+   transport */
+#define M_INTERNAL_STATS (2 * MONDEMAND_INTERNAL_TYPES + 11)
+#define M_INTERNAL_TRANSPORT_STATS 3
+
+/* adds to one of the internal counters, if they're enabled */
+#define M_INTERNAL_ADD(client, counter, n)                                 \
+  do                                                                      \
+    {                                                                     \
+      if ((client)->internal != NULL)                                     \
+        {                                                                 \
+          __atomic_fetch_add (&(client)->internal->counter, (n),          \
+                              __ATOMIC_RELAXED);                          \
+        }                                                                 \
+    }                                                                     \
+  while (0)
+
+/* token bucket configuration, a rate of zero means unlimited */
+struct m_rate_limit
+{
+  /* tokens added per second */
+  double rate;
+  /* maximum number of tokens which can accumulate */
+  double burst;
+};
+
+/* token bucket state */
+struct m_token_bucket
+{
+  double tokens;
+  /* time of the last refill in microseconds */
+  long long last;
+};
+
+/* define an internal structure for contexts kept encoded by an encoding,
+   version is 0 when the bytes are not valid */
+struct m_context_cache
+{
+  mondemand_encoding_context_t encoder;
+  unsigned int version;
+  unsigned char *bytes;
+  struct mondemand_context_block block;
+};
 
 /* client structure */
 struct mondemand_client
@@ -31,6 +99,16 @@ struct mondemand_client
   char *prog_id;
   /* hashtable of contextual data */
   struct m_hash_table *contexts;
+  /* bumped whenever the contexts change, never 0 */
+  unsigned int context_version;
+  /* the contexts as passed to the transports, rebuilt from the hashtable
+     when context_list_version falls behind */
+  struct mondemand_context *context_list;
+  int context_list_count;
+  unsigned int context_list_version;
+  /* contexts encoded by the shared encodings, only touched while sending */
+  struct m_context_cache context_caches[M_CONTEXT_BLOCKS];
+  int context_cache_next;
 
   /* trace id for trace messages only */
   char *trace_id;
@@ -45,11 +123,50 @@ struct mondemand_client
   int immediate_send_level;
   /* minimum log level at which to send events at all */
   int no_send_level;
+  /* fraction of messages kept at each level, indexed by log level */
+  double sample_rates[M_LOG_ALL+1];
   /* hashtable of log messages, keyed by 'filename:line' */
   struct m_hash_table *messages;
 
+  /* flush the log batch once it has this many distinct messages */
+  int batch_max_messages;
+  /* flush the log batch before its encoding grows past this, 0 for no limit */
+  int batch_max_bytes;
+  /* flush the log batch once its oldest message is this old (microseconds),
+     0 for no limit */
+  long long batch_max_linger;
+  /* estimated encoded size of the current log batch */
+  int batch_bytes;
+  /* time the first message of the current log batch was logged */
+  long long batch_started;
+
+  /* ring of recent messages below the no send level, sent when a message
+     at or above the trigger level is logged */
+  struct m_ring_record *ring;
+  /* array used to pass the ring to the transports */
+  struct mondemand_log_message *ring_messages;
+  int ring_size;
+  /* total number of records ever written to the ring */
+  unsigned long ring_written;
+  int ring_trigger_level;
+  /* if non-zero, traced triggers only send records with their trace id */
+  int ring_match_trace;
+
+  /* non-zero if any rate limit is set, so unlimited logging stays cheap */
+  int rate_limited;
+  /* per call site rate limits, indexed by log level */
+  struct m_rate_limit call_site_limits[M_LOG_ALL+1];
+  /* aggregate rate limits and their buckets, indexed by log level */
+  struct m_rate_limit level_limits[M_LOG_ALL+1];
+  struct m_token_bucket level_buckets[M_LOG_ALL+1];
+  /* hashtable of per call site rate limit state, keyed by 'filename:line' */
+  struct m_hash_table *log_limits;
+
   /* stats fields */
   struct m_hash_table *stats;
+  /* every stat in the table, newest first.  Stats are never removed, so
+     the metrics endpoint walks this without the lock */
+  struct m_stat_message *stat_list;
 
   /* performance trace fields */
   char *perf_id;
@@ -61,6 +178,40 @@ struct mondemand_client
   /* array of transports */
   int num_transports;
   struct mondemand_transport **transports;
+  /* the library's own counters, NULL unless
+     mondemand_enable_internal_stats was called */
+  struct m_internal *internal;
+
+  /* MONDEMAND_TRANSPORT_* flags of everything some transport consumes */
+  unsigned int consumes;
+  /* transports with a batch sender, while collecting mondemand_flush keeps
+     a copy of each kind of flush for them in pending */
+  int batch_transports;
+  int collecting;
+  struct m_job *pending[M_BATCH_MAX];
+  int pending_count;
+  /* flushes for transports sharing an encoding are encoded once into this,
+     allocated on first use */
+  unsigned char *encode_buffer;
+
+  /* I/O thread state, NULL unless mondemand_client_start_async or
+     mondemand_client_start_isolated was called */
+  struct m_async *async;
+  int async_count;
+
+  /* periodic flushes, NULL unless mondemand_client_start_scheduler was
+     called.  While it is set the lock is held by the entry points which
+     touch what the scheduler flushes */
+  struct m_scheduler *scheduler;
+
+  /* the metrics endpoint, NULL unless mondemand_prometheus_start was
+     called */
+  struct m_prometheus *prometheus;
+
+  /* set once a thread other than the caller's may use the client, the lock
+     is held by the entry points which touch what the threads read */
+  int locking;
+  pthread_mutex_t lock;
 };
 
 /* define an internal structure for keeping log messages */
@@ -72,13 +223,168 @@ struct m_log_message
   int repeat_count;
   char message[M_MESSAGE_MAX+1];
   struct mondemand_trace_id trace_id;
+  double sample_rate;
+  /* structured fields, format and format arguments, all stored in the same
+     allocation after this struct.  format is NULL if the message was not
+     formatted or its arguments couldn't be captured */
+  int field_count;
+  struct mondemand_log_field *fields;
+  char *format;
+  int arg_count;
+  struct mondemand_log_field *args;
+};
+
+/* define an internal structure for messages kept in the debug ring */
+struct m_ring_record
+{
+  char filename[M_RING_FILENAME_MAX+1];
+  int line;
+  int level;
+  char message[M_RING_MESSAGE_MAX+1];
+  struct mondemand_trace_id trace_id;
+};
+
+/* define an internal structure for rate limiting a single call site */
+struct m_log_limit
+{
+  /* a last of 0 means the bucket starts full on its next use */
+  struct m_token_bucket bucket;
+  /* messages dropped since the last one which was kept */
+  int suppressed;
 };
 
 /* define an internal structure for keeping stats messages */
 struct m_stat_message
 {
+  /* type and value are stored atomically, the metrics endpoint reads them
+     without the lock */
   MondemandStatType type;
   MondemandStatValue value;
+  /* the key in the table, and the next older stat in stat_list */
+  const char *key;
+  struct m_stat_message *next;
+};
+
+/* the kinds of flush passed to the transports */
+enum m_job_type
+{
+  M_JOB_LOGS,
+  M_JOB_STATS,
+  M_JOB_TRACE,
+  M_JOB_PERF,
+  M_JOB_ANNOTATION,
+  M_JOB_BATCH
+};
+
+/* define an internal structure describing a flush to the transports, items
+   points at an array of the type's messages, or for a batch of jobs.
+   strings holds the owner, trace id and message of a trace, the id and
+   caller label of a performance trace or the id, description and text of
+   an annotation */
+struct m_job
+{
+  enum m_job_type type;
+  int count;
+  /* non-zero when transports with a batch sender get this in a batch */
+  int batched;
+  const void *items;
+  const struct mondemand_context *contexts;
+  int context_count;
+  /* the client's context_version when the contexts were taken */
+  unsigned int context_version;
+  const char *strings[3];
+  long long timestamp;
+  /* for a queued copy, the workers still to send it and when it was
+     queued */
+  int references;
+  long long queued_us;
+};
+
+/* define an internal structure for copying a job into one allocation, when
+   base is NULL only the size is measured */
+struct m_arena
+{
+  char *base;
+  size_t used;
+};
+
+/* define an internal structure for an I/O thread and its queue.  There is
+   one sending to every transport, or with isolation one per transport */
+struct m_async
+{
+  struct mondemand_client *client;
+  /* the transport this thread sends to, NULL for all of them */
+  struct mondemand_transport *transport;
+  struct m_queue *queue;
+  MondemandQueuePolicy policy;
+  pthread_t thread;
+  /* counts queued jobs, the thread sleeps on it */
+  sem_t items;
+  /* counts free cells, only used with MONDEMAND_QUEUE_BLOCK */
+  sem_t slots;
+  int stopping;
+  long long queued;
+  long long sent;
+  long long dropped_newest;
+  long long dropped_oldest;
+  long long latency_us_total;
+  long long latency_us_max;
+};
+
+/* define an internal structure for the counters of one transport */
+struct m_internal_transport
+{
+  long long sends;
+  long long send_ns;
+  long long errors;
+  /* datagrams handed over encoded, and their bytes */
+  long long datagrams;
+  long long bytes;
+};
+
+/* define an internal structure for the library's own counters.  They are
+   only ever added to atomically, so neither the caller nor the I/O threads
+   take a lock to update them */
+struct m_internal
+{
+  /* indexed by job type, which follows MONDEMAND_INTERNAL_* */
+  long long flushes[MONDEMAND_INTERNAL_TYPES];
+  long long flush_ns[MONDEMAND_INTERNAL_TYPES];
+  long long encodes;
+  long long encode_ns;
+  long long log_repeats;
+  long long log_suppressed;
+  /* one for each of the client's transports, in the same order */
+  int transport_count;
+  struct m_internal_transport *transports;
+};
+
+/* define an internal structure for the metrics endpoint.  A scrape never
+   takes the client's lock: it walks stat_list and copies each value with an
+   atomic load.  The labels are rendered by whoever changes the contexts and
+   copied by the scrape under the endpoint's own lock.  The snapshot, the
+   scrape's copy of the labels and the server's body buffer are kept between
+   scrapes so they only allocate while growing */
+struct m_prometheus
+{
+  struct mondemand_client *client;
+  struct m_httpd *httpd;
+  struct mondemand_stats_message *snapshot;
+  int snapshot_size;
+  int snapshot_count;
+  /* the series name of each stat in snapshot order, only touched by
+     scrapes.  Keys like a.b and a_b sanitize to the same name, so a later
+     one gets _2, _3 and so on; stats are never removed and keep their
+     place, so a stat keeps its name for as long as the endpoint runs */
+  char **names;
+  int names_size;
+  int names_count;
+  struct m_hash_table *used_names;
+  struct m_buffer name;
+  struct m_buffer scrape_labels;
+  /* the rendered prog_id and context labels */
+  pthread_mutex_t lock;
+  struct m_buffer labels;
 };
 
 /* private forward declarations */
@@ -93,7 +399,163 @@ static int mondemand_dispatch_annotation (const char* id,
                                           const char** tags,
                                           const int num_tags,
                                           struct mondemand_client *client);
-static struct mondemand_context * context_array (struct mondemand_client *client);
+static const struct mondemand_context *mondemand_context_list
+                (struct mondemand_client *client, int *count);
+static void mondemand_context_changed (struct mondemand_client *client);
+static int mondemand_send_logs (struct mondemand_client *client,
+                                const struct mondemand_log_message messages[],
+                                const int message_count);
+static void mondemand_ring_capture (struct mondemand_client *client,
+                                    const char *filename, const int line,
+                                    const int level,
+                                    const struct mondemand_trace_id trace_id,
+                                    const char *text, va_list *args);
+static int mondemand_ring_dump (struct mondemand_client *client,
+                                const struct mondemand_trace_id trace_id);
+static int mondemand_log_internal (struct mondemand_client *client,
+                                   const char *filename,
+                                   const int line,
+                                   const int level,
+                                   const struct mondemand_trace_id trace_id,
+                                   const char *text,
+                                   va_list *args,
+                                   const struct mondemand_log_field fields[],
+                                   const int field_count);
+static void mondemand_call_site_key (char *key, const size_t size,
+                                     const char *filename, const int line);
+static size_t mondemand_log_fields_size
+                (const struct mondemand_log_field fields[],
+                 const int field_count);
+static char *mondemand_log_fields_copy
+                (struct mondemand_log_field dest[],
+                 const struct mondemand_log_field fields[],
+                 const int field_count, char *strings);
+static size_t mondemand_log_extras_size
+                (const struct mondemand_log_field fields[],
+                 const int field_count,
+                 const char *format,
+                 const struct mondemand_log_field args[],
+                 const int arg_count);
+static void mondemand_log_extras_copy
+                (struct m_log_message *message,
+                 const struct mondemand_log_field fields[],
+                 const int field_count,
+                 const char *format,
+                 const struct mondemand_log_field args[],
+                 const int arg_count);
+static int mondemand_job_run (struct mondemand_client *client,
+                              const struct m_job *job);
+static int mondemand_job_deliver (struct mondemand_client *client,
+                                  const struct m_job *job);
+static int mondemand_job_send (struct mondemand_client *client,
+                               struct mondemand_transport *transport,
+                               const struct m_job *job);
+static int mondemand_job_send_to (struct mondemand_client *client,
+                                  int index, const struct m_job *job,
+                                  const unsigned char *bytes, size_t length);
+static int mondemand_internal_messages
+                (struct mondemand_client *client,
+                 struct mondemand_stats_message messages[],
+                 char names[][M_INTERNAL_NAME_MAX]);
+static void mondemand_internal_message
+                (struct mondemand_stats_message *message, char *name,
+                 const char *prefix, int index, const char *suffix,
+                 MondemandStatType type, long long value);
+static long long mondemand_now_ns (void);
+static int mondemand_job_send_records (struct mondemand_client *client,
+                                       struct mondemand_transport *transport,
+                                       const struct m_job *job);
+static void mondemand_job_record (const struct m_job *job,
+                                  struct mondemand_record *record);
+static void mondemand_job_contexts (struct mondemand_client *client,
+                                    struct m_job *job);
+static int mondemand_job_batch (struct mondemand_client *client);
+static int mondemand_transport_version
+                (const struct mondemand_transport *transport);
+static int mondemand_transport_valid
+                (const struct mondemand_transport *transport);
+static unsigned int mondemand_transport_capabilities
+                (const struct mondemand_transport *transport);
+static int mondemand_transport_has_batch
+                (const struct mondemand_transport *transport);
+static int mondemand_transport_wants
+                (const struct mondemand_transport *transport,
+                 const struct m_job *job);
+static int mondemand_job_encodable
+                (const struct mondemand_transport *transport,
+                 const struct m_job *job);
+static int mondemand_job_same_encoder (const struct mondemand_transport *a,
+                                       const struct mondemand_transport *b,
+                                       const struct m_job *job);
+static int mondemand_job_encode (struct mondemand_client *client,
+                                 const struct mondemand_encoding *encoding,
+                                 const struct m_job *job,
+                                 size_t *length);
+static const struct mondemand_context_block *mondemand_job_context_block
+                (struct mondemand_client *client,
+                 const struct mondemand_encoding *encoding,
+                 const struct m_job *job);
+static void *m_arena_alloc (struct m_arena *arena, size_t size);
+static char *m_arena_strdup (struct m_arena *arena, const char *string);
+static struct mondemand_log_field *m_arena_copy_fields
+                (struct m_arena *arena,
+                 const struct mondemand_log_field fields[],
+                 const int count);
+static struct m_job *mondemand_job_copy_into (struct m_arena *arena,
+                                              const struct m_job *job);
+static struct m_job *mondemand_job_copy (const struct m_job *job);
+static void mondemand_job_release (struct m_job *job);
+static int mondemand_async_start (struct mondemand_client *client,
+                                  const struct mondemand_async_options *opts,
+                                  int isolate);
+static void mondemand_async_destroy (struct m_async *async);
+static int mondemand_async_push (struct m_async *async, struct m_job *job);
+static void *mondemand_async_thread (void *arg);
+static void mondemand_async_read (struct m_async *async,
+                                  struct mondemand_async_stats *stats);
+static void mondemand_job_isolated (struct m_async *async,
+                                    const struct m_job *job);
+static void mondemand_async_stop (struct mondemand_client *client);
+static void mondemand_start_locking (struct mondemand_client *client);
+static void mondemand_lock (struct mondemand_client *client);
+static void mondemand_unlock (struct mondemand_client *client);
+static int mondemand_log_unlocked (struct mondemand_client *client,
+                                   const char *filename,
+                                   const int line,
+                                   const int level,
+                                   const struct mondemand_trace_id trace_id,
+                                   const char *text,
+                                   va_list *args,
+                                   const struct mondemand_log_field fields[],
+                                   const int field_count);
+static void mondemand_scheduled_stats (void *data);
+static void mondemand_scheduled_logs (void *data);
+static void mondemand_scheduled_linger (void *data);
+static void mondemand_scheduled_perf (void *data);
+static int mondemand_prometheus_scrape (const char *path,
+                                        struct m_buffer *body,
+                                        const char **content_type,
+                                        void *data);
+static int mondemand_prometheus_unique (struct m_prometheus *prometheus,
+                                        const char *key);
+static void mondemand_prometheus_copy (struct m_stat_message *stat,
+                                       struct mondemand_stats_message *copy);
+static void mondemand_prometheus_labels (struct m_prometheus *prometheus);
+static void mondemand_prometheus_name (struct m_buffer *body,
+                                       const char *key);
+static void mondemand_prometheus_escape (struct m_buffer *buffer,
+                                         const char *value);
+static long long mondemand_now_us (void);
+static int mondemand_log_batch_size (struct mondemand_client *client);
+static int mondemand_log_message_size (const struct m_log_message *message);
+static void mondemand_check_log_linger (struct mondemand_client *client);
+static int mondemand_log_sampled (const struct mondemand_trace_id *trace_id,
+                                  const double rate);
+static int mondemand_log_allowed (struct mondemand_client *client,
+                                  const char *key, const int level,
+                                  int *suppressed);
+static void mondemand_log_limit_restart (const char *key, void *value,
+                                         void *data);
 
 /* ======================================================================== */
 /* Public API functions                                                     */
@@ -103,6 +565,7 @@ struct mondemand_client *
 mondemand_client_create(const char *program_identifier)
 {
   struct mondemand_client *client = NULL;
+  int i=0;
 
   /* if the prog_id is null, don't continue. */
   if( program_identifier == NULL )
@@ -121,8 +584,20 @@ mondemand_client_create(const char *program_identifier)
       client->trace_message = NULL;
       client->immediate_send_level = M_LOG_CRIT;
       client->no_send_level = M_LOG_NOTICE;
+      for (i = M_LOG_EMERG; i <= M_LOG_ALL; ++i)
+        {
+          client->sample_rates[i] = 1.0;
+        }
       client->contexts = m_hash_table_create();
+      client->context_version = 1;
       client->messages = m_hash_table_create();
+      client->batch_max_messages = M_MAX_MESSAGES;
+      client->batch_max_bytes = 0;
+      client->batch_max_linger = 0;
+      client->batch_bytes = 0;
+      client->batch_started = 0;
+      client->log_limits = m_hash_table_create();
+      client->rate_limited = 0;
       client->stats = m_hash_table_create();
       client->trace = m_hash_table_create();
       client->num_transports = 0;
@@ -133,7 +608,7 @@ mondemand_client_create(const char *program_identifier)
       /* if any of the memory allocation has failed, bail out */
       if( client->prog_id == NULL || client->contexts == NULL 
           || client->messages == NULL || client->stats == NULL
-          || client->trace == NULL )
+          || client->trace == NULL || client->log_limits == NULL )
         {
           mondemand_client_destroy(client);
           return NULL;
@@ -151,7 +626,16 @@ mondemand_client_destroy (struct mondemand_client *client)
 
   if (client != NULL)
     {
+      /* stop the threads first so nothing else is using the client */
+      mondemand_prometheus_stop (client);
+      if (client->scheduler != NULL)
+        {
+          m_scheduler_destroy (client->scheduler);
+          client->scheduler = NULL;
+        }
       mondemand_flush (client);
+      /* send everything still queued before the transports go away */
+      mondemand_async_stop (client);
       mondemand_clear_performance_trace (client);
       mondemand_clear_trace (client);
       m_hash_table_destroy (client->trace);
@@ -160,7 +644,7 @@ mondemand_client_destroy (struct mondemand_client *client)
       for(i=0; i < client->num_transports; ++i)
         {
           transport = client->transports[i];
-          if( transport != NULL )
+          if( transport != NULL && transport->destroy_function != NULL )
             {
               transport->destroy_function (transport);
             }
@@ -168,501 +652,1191 @@ mondemand_client_destroy (struct mondemand_client *client)
 
       m_free(client->prog_id);
       m_hash_table_destroy(client->contexts);
+      m_free(client->context_list);
+      for(i=0; i < M_CONTEXT_BLOCKS; ++i)
+        {
+          m_free(client->context_caches[i].bytes);
+        }
       m_hash_table_destroy(client->messages);
+      m_hash_table_destroy(client->log_limits);
+      m_free(client->ring);
+      m_free(client->ring_messages);
       m_hash_table_destroy(client->stats);
       m_free(client->transports);
+      m_free(client->encode_buffer);
+      if( client->internal != NULL )
+        {
+          m_free(client->internal->transports);
+          m_free(client->internal);
+        }
       client->num_transports = 0;
+      if (client->locking)
+        {
+          pthread_mutex_destroy (&client->lock);
+        }
       m_free(client);
     }
 }
 
-void
-mondemand_set_immediate_send_level(struct mondemand_client *client,
-                                   const int level)
+int
+mondemand_client_start_async (struct mondemand_client *client,
+                              const struct mondemand_async_options *opts)
 {
-  if( client != NULL )
-    {
-      if( level >= M_LOG_EMERG && level <= M_LOG_ALL )
-        {
-          client->immediate_send_level = level;
-        }
-    }
+  return mondemand_async_start (client, opts, 0);
 }
 
-void
-mondemand_set_no_send_level(struct mondemand_client *client, const int level)
+int
+mondemand_client_start_isolated (struct mondemand_client *client,
+                                 const struct mondemand_async_options *opts)
 {
-  if( client != NULL )
-    {
-      if( level >= M_LOG_EMERG && level <= M_LOG_ALL )
-        {
-          client->no_send_level = level;
-        }
-    }
+  return mondemand_async_start (client, opts, 1);
 }
 
-/* returns the value for a given key */
-const char *
-mondemand_get_context (struct mondemand_client *client, const char *key)
+int
+mondemand_get_async_stats (struct mondemand_client *client,
+                           struct mondemand_async_stats *stats)
 {
-  const char *ret = NULL;
+  struct mondemand_async_stats one;
+  int i;
 
-  if (client != NULL)
+  if (client == NULL || client->async == NULL || stats == NULL)
     {
-      ret = m_hash_table_get (client->contexts, key);
+      return -2;
     }
 
-  return ret;
-}
-
-const char **
-mondemand_get_context_keys(struct mondemand_client *client)
-{
-  const char **ret = NULL;
-
-  if (client != NULL)
+  memset (stats, 0, sizeof (*stats));
+  for (i = 0; i < client->async_count; ++i)
     {
-      ret = m_hash_table_keys (client->contexts);
+      mondemand_async_read (&client->async[i], &one);
+      stats->queued += one.queued;
+      stats->sent += one.sent;
+      stats->dropped_newest += one.dropped_newest;
+      stats->dropped_oldest += one.dropped_oldest;
+      stats->latency_us_total += one.latency_us_total;
+      if (one.latency_us_max > stats->latency_us_max)
+        {
+          stats->latency_us_max = one.latency_us_max;
+        }
+      stats->depth += one.depth;
     }
 
-  return ret;
+  return 0;
 }
 
-/* sets a context, overwriting it if it is already set */
 int
-mondemand_set_context (struct mondemand_client *client,
-                       const char *key, const char *value)
+mondemand_get_transport_async_stats (struct mondemand_client *client,
+                                     struct mondemand_transport *transport,
+                                     struct mondemand_async_stats *stats)
 {
-  char *k = NULL;
-  char *v = NULL;
+  int i;
 
-  if (client != NULL && key != NULL && value != NULL)
+  if (client == NULL || client->async == NULL || transport == NULL
+      || stats == NULL)
     {
-      if (client->contexts != NULL)
-        {
-          k = strdup (key);
-          v = strdup (value);
-
-          /* if we can't allocate memory for the values, bail out */
-          if (k == NULL || v == NULL)
-            {
-              return -3;
-            }
+      return -2;
+    }
 
-          if (m_hash_table_set (client->contexts, k, v) != 0)
+  for (i = 0; i < client->async_count; ++i)
+    {
+      if (client->async[i].transport == transport
+          || client->async[i].transport == NULL)
+        {
+          break;
+        }
+    }
+  if (i == client->async_count)
+    {
+      return -2;
+    }
+  if (client->async[i].transport == NULL)
+    {
+      /* one thread sends to everything, it has to be one of the client's */
+      for (i = 0; i < client->num_transports; ++i)
+        {
+          if (client->transports[i] == transport)
             {
-              m_free (k);
-              m_free (v);
-              return -3;
+              break;
             }
         }
+      if (i == client->num_transports)
+        {
+          return -2;
+        }
+      i = 0;
     }
+  mondemand_async_read (&client->async[i], stats);
 
   return 0;
 }
 
-/* remove a context */
-void
-mondemand_remove_context (struct mondemand_client *client, const char *key)
+int
+mondemand_enable_internal_stats (struct mondemand_client *client)
 {
-  if (client != NULL)
+  struct m_internal *internal = NULL;
+
+  if (client == NULL || client->internal != NULL || client->async != NULL)
     {
-      m_hash_table_remove (client->contexts, key);
+      return -2;
     }
-}
 
-/* remove all contexts */
-void
-mondemand_remove_all_contexts (struct mondemand_client *client)
-{
-  if( client != NULL )
+  internal = (struct m_internal *) m_try_malloc0 (sizeof (struct m_internal));
+  if (internal == NULL)
     {
-      m_hash_table_remove_all (client->contexts);
+      return -3;
     }
-}
-
-/* returns the value for a given key */
-const char *
-mondemand_get_trace (struct mondemand_client *client, const char *key)
-{
-  const char *ret = NULL;
-
-  if( client != NULL)
+  if (client->num_transports > 0)
     {
-      ret = m_hash_table_get (client->trace, key);
+      internal->transports = (struct m_internal_transport *)
+        m_try_malloc0 (sizeof (struct m_internal_transport)
+                       * client->num_transports);
+      if (internal->transports == NULL)
+        {
+          m_free (internal);
+          return -3;
+        }
+      internal->transport_count = client->num_transports;
     }
+  client->internal = internal;
 
-  return ret;
+  return 0;
 }
 
-const char **
-mondemand_get_trace_keys (struct mondemand_client *client)
+int
+mondemand_get_internal_stats (struct mondemand_client *client,
+                              struct mondemand_internal_stats *stats)
 {
-  const char **ret = NULL;
+  struct m_internal *internal = NULL;
+  int i;
 
-  if (client != NULL)
+  if (client == NULL || client->internal == NULL || stats == NULL)
     {
-      ret = m_hash_table_keys (client->trace);
+      return -2;
     }
 
-  return ret;
+  internal = client->internal;
+  memset (stats, 0, sizeof (*stats));
+  for (i = 0; i < MONDEMAND_INTERNAL_TYPES; ++i)
+    {
+      stats->flushes[i] = __atomic_load_n (&internal->flushes[i],
+                                           __ATOMIC_RELAXED);
+      stats->flush_ns[i] = __atomic_load_n (&internal->flush_ns[i],
+                                            __ATOMIC_RELAXED);
+    }
+  stats->encodes = __atomic_load_n (&internal->encodes, __ATOMIC_RELAXED);
+  stats->encode_ns = __atomic_load_n (&internal->encode_ns, __ATOMIC_RELAXED);
+  stats->log_repeats = __atomic_load_n (&internal->log_repeats,
+                                        __ATOMIC_RELAXED);
+  stats->log_suppressed = __atomic_load_n (&internal->log_suppressed,
+                                           __ATOMIC_RELAXED);
+
+  /* the transports and the tables are only walked here, under the lock */
+  mondemand_lock (client);
+  for (i = 0; i < internal->transport_count; ++i)
+    {
+      stats->sender_errors +=
+        __atomic_load_n (&internal->transports[i].errors, __ATOMIC_RELAXED);
+      stats->datagrams +=
+        __atomic_load_n (&internal->transports[i].datagrams,
+                         __ATOMIC_RELAXED);
+      stats->bytes +=
+        __atomic_load_n (&internal->transports[i].bytes, __ATOMIC_RELAXED);
+    }
+  stats->stats_entries = m_hash_table_num (client->stats);
+  stats->stats_longest_chain = m_hash_table_longest_chain (client->stats);
+  stats->log_entries = m_hash_table_num (client->messages);
+  stats->log_longest_chain = m_hash_table_longest_chain (client->messages);
+  mondemand_unlock (client);
+
+  return 0;
 }
 
-/* sets a trace item, overwriting it if it is already set */
 int
-mondemand_set_trace (struct mondemand_client *client,
-                     const char *key, const char *value)
+mondemand_get_internal_transport_stats
+  (struct mondemand_client *client,
+   struct mondemand_transport *transport,
+   struct mondemand_internal_transport_stats *stats)
 {
-  char *k = NULL;
-  char *v = NULL;
+  struct m_internal_transport *counters = NULL;
+  int retval = -2;
+  int i;
 
-  if (client != NULL && key != NULL && value != NULL)
+  if (client == NULL || client->internal == NULL || transport == NULL
+      || stats == NULL)
     {
-      k = strdup (key);
-      if( k == NULL)
-        {
-          return -3;
-        }
-
-      v = strdup (value);
-      if (v == NULL)
-        {
-          m_free (k);
-          return -3;
-        }
+      return -2;
+    }
 
-      if (m_hash_table_set (client->trace, k, v) != 0)
+  mondemand_lock (client);
+  for (i = 0; i < client->internal->transport_count; ++i)
+    {
+      if (client->transports[i] == transport)
         {
-          m_free (k);
-          m_free (v);
-          return -3;
+          counters = &client->internal->transports[i];
+          stats->sends = __atomic_load_n (&counters->sends, __ATOMIC_RELAXED);
+          stats->send_ns = __atomic_load_n (&counters->send_ns,
+                                            __ATOMIC_RELAXED);
+          stats->errors = __atomic_load_n (&counters->errors,
+                                           __ATOMIC_RELAXED);
+          retval = 0;
+          break;
         }
     }
+  mondemand_unlock (client);
 
-  return 0;
+  return retval;
 }
 
-/* remove a trace item */
-void
-mondemand_remove_trace (struct mondemand_client *client, const char *key)
+int
+mondemand_client_start_scheduler
+  (struct mondemand_client *client,
+   const struct mondemand_schedule_options *opts)
 {
-  if (client != NULL)
+  struct m_scheduler *scheduler = NULL;
+  char key[1024];
+  const char *phase_key = NULL;
+  const int intervals[3] = {
+    opts != NULL ? opts->stats_interval_ms : 0,
+    opts != NULL ? opts->logs_interval_ms : 0,
+    opts != NULL ? opts->perf_interval_ms : 0
+  };
+  const m_scheduler_callback_t callbacks[3] = {
+    mondemand_scheduled_stats,
+    mondemand_scheduled_logs,
+    mondemand_scheduled_perf
+  };
+  long long offset = 0;
+  long long linger_ms = 0;
+  int i;
+
+  if (client == NULL || opts == NULL || client->scheduler != NULL
+      || intervals[0] < 0 || intervals[1] < 0 || intervals[2] < 0
+      || (intervals[0] + intervals[1] + intervals[2] == 0
+          && client->batch_max_linger == 0))
     {
-      m_hash_table_remove (client->trace, key);
+      return -2;
     }
-}
 
-/* remove all trace items */
-void
-mondemand_remove_all_traces (struct mondemand_client *client)
-{
-  if (client != NULL)
+  /* by default the offset depends on the host and program */
+  phase_key = opts->phase_key;
+  if (phase_key == NULL)
     {
-      m_hash_table_remove_all (client->trace);
+      memset (key, 0, sizeof (key));
+      gethostname (key, sizeof (key) / 2);
+      strncat (key, client->prog_id, sizeof (key) - strlen (key) - 1);
+      phase_key = key;
     }
-}
-
-/* add a transport, by storing a reference to it */
-int
-mondemand_add_transport(struct mondemand_client *client,
-                        struct mondemand_transport *transport)
-{
-  struct mondemand_transport **data = NULL;
 
-  if( client != NULL && transport != NULL )
+  scheduler = m_scheduler_create ();
+  if (scheduler == NULL)
     {
-      data = (struct mondemand_transport **)
-        m_try_realloc(client->transports,
-                      (client->num_transports + 1) *
-                      sizeof(struct mondemand_transport *));
-
-      if( data == NULL )
+      return -3;
+    }
+  for (i = 0; i < 3; ++i)
+    {
+      if (intervals[i] > 0)
+        {
+          offset = opts->spread ? m_scheduler_phase (phase_key, intervals[i])
+                                : 0;
+          if (m_scheduler_add (scheduler, intervals[i], opts->align, offset,
+                               callbacks[i], client) != 0)
+            {
+              m_scheduler_destroy (scheduler);
+              return -3;
+            }
+        }
+    }
+  /* a batch is sent at most half the linger limit late, even when the
+     client isn't used again */
+  if (client->batch_max_linger > 0)
+    {
+      linger_ms = client->batch_max_linger / 2000;
+      if (m_scheduler_add (scheduler, linger_ms < 1 ? 1 : linger_ms, 0, 0,
+                           mondemand_scheduled_linger, client) != 0)
         {
+          m_scheduler_destroy (scheduler);
           return -3;
         }
+    }
 
-      data[client->num_transports] = transport;
-      client->num_transports++;
-      client->transports = data;
+  mondemand_start_locking (client);
+  client->scheduler = scheduler;
+  if (m_scheduler_start (scheduler) != 0)
+    {
+      client->scheduler = NULL;
+      m_scheduler_destroy (scheduler);
+      return -3;
     }
 
   return 0;
 }
 
-/* check if a level is enabled */
 int
-mondemand_level_is_enabled(struct mondemand_client *client,
-                           const int log_level)
+mondemand_prometheus_start (struct mondemand_client *client,
+                            const char *address)
 {
-  if( client != NULL )
+  struct m_prometheus *prometheus = NULL;
+
+  if (client == NULL || address == NULL || client->prometheus != NULL)
     {
-      return log_level < client->no_send_level;
+      return -2;
     }
-  else
+
+  prometheus = (struct m_prometheus *)
+    m_try_malloc0 (sizeof (struct m_prometheus));
+  if (prometheus == NULL)
     {
-      return 0;
+      return -3;
+    }
+  prometheus->client = client;
+  prometheus->used_names = m_hash_table_create ();
+  if (prometheus->used_names == NULL)
+    {
+      m_free (prometheus);
+      return -3;
     }
+  pthread_mutex_init (&prometheus->lock, NULL);
+  mondemand_lock (client);
+  mondemand_prometheus_labels (prometheus);
+  mondemand_unlock (client);
+
+  prometheus->httpd = m_httpd_create (address, mondemand_prometheus_scrape,
+                                      prometheus);
+  if (prometheus->httpd == NULL)
+    {
+      pthread_mutex_destroy (&prometheus->lock);
+      m_hash_table_destroy (prometheus->used_names);
+      m_buffer_free (&prometheus->labels);
+      m_free (prometheus);
+      return -1;
+    }
+  mondemand_lock (client);
+  client->prometheus = prometheus;
+  mondemand_unlock (client);
+
+  return 0;
 }
 
-/* flush the logs to the transports */
 int
-mondemand_flush_logs (struct mondemand_client *client)
+mondemand_prometheus_port (struct mondemand_client *client)
 {
-  int retval = 0;
-
-  if( client != NULL )
+  if (client == NULL || client->prometheus == NULL)
     {
-      if( (retval = mondemand_dispatch_logs (client)) != 0 )
-        {
-          return -1;
-        }
-
-      m_hash_table_remove_all ( client->messages );
+      return -1;
     }
+  return m_httpd_port (client->prometheus->httpd);
+}
 
-  return 0;
+void
+mondemand_prometheus_stop (struct mondemand_client *client)
+{
+  struct m_prometheus *prometheus = NULL;
+
+  if (client == NULL || client->prometheus == NULL)
+    {
+      return;
+    }
+  prometheus = client->prometheus;
+  m_httpd_destroy (prometheus->httpd);
+  mondemand_lock (client);
+  client->prometheus = NULL;
+  mondemand_unlock (client);
+  m_free (prometheus->snapshot);
+  /* the names themselves are the table's values */
+  m_free (prometheus->names);
+  m_hash_table_destroy (prometheus->used_names);
+  m_buffer_free (&prometheus->name);
+  m_buffer_free (&prometheus->scrape_labels);
+  m_buffer_free (&prometheus->labels);
+  pthread_mutex_destroy (&prometheus->lock);
+  m_free (prometheus);
 }
 
-/* flush the stats to the transports */
-int
-mondemand_flush_stats (struct mondemand_client *client)
+void
+mondemand_set_immediate_send_level(struct mondemand_client *client,
+                                   const int level)
 {
   if( client != NULL )
     {
-      if( mondemand_dispatch_stats (client) != 0 )
+      if( level >= M_LOG_EMERG && level <= M_LOG_ALL )
         {
-          return -1;
+          client->immediate_send_level = level;
         }
     }
+}
 
-  return 0;
+void
+mondemand_set_no_send_level(struct mondemand_client *client, const int level)
+{
+  if( client != NULL )
+    {
+      if( level >= M_LOG_EMERG && level <= M_LOG_ALL )
+        {
+          client->no_send_level = level;
+        }
+    }
 }
 
 int
-mondemand_reset_stats (struct mondemand_client *client)
+mondemand_set_log_ring (struct mondemand_client *client,
+                        const int size,
+                        const int trigger_level,
+                        const int match_trace)
 {
-  int i=0;
-  const char **keys = NULL;
-  struct m_stat_message *stat = NULL;
+  struct m_ring_record *ring = NULL;
+  struct mondemand_log_message *ring_messages = NULL;
 
-  if (client != NULL)
+  if (client == NULL || size < 0
+      || trigger_level < M_LOG_EMERG || trigger_level > M_LOG_ALL)
     {
-      /* reset all the stats */
-      keys = m_hash_table_keys (client->stats);
-      if (keys != NULL)
+      return -2;
+    }
+
+  if (size > 0)
+    {
+      ring = (struct m_ring_record *)
+        m_try_malloc0 (sizeof (struct m_ring_record) * size);
+      ring_messages = (struct mondemand_log_message *)
+        m_try_malloc0 (sizeof (struct mondemand_log_message) * size);
+      if (ring == NULL || ring_messages == NULL)
         {
-          for (i=0; keys[i] != NULL; ++i)
-            {
-              stat =
-                (struct m_stat_message *)
-                  m_hash_table_get (client->stats, keys[i]);
-              if (stat != NULL)
-                {
-                  stat->value = 0;
-                }
-            }
-          m_free (keys);
+          m_free (ring);
+          m_free (ring_messages);
+          return -3;
         }
     }
 
+  m_free (client->ring);
+  m_free (client->ring_messages);
+  client->ring = ring;
+  client->ring_messages = ring_messages;
+  client->ring_size = size;
+  client->ring_written = 0;
+  client->ring_trigger_level = trigger_level;
+  client->ring_match_trace = match_trace;
+
   return 0;
 }
 
-/* flush everything */
 int
-mondemand_flush (struct mondemand_client *client)
+mondemand_set_log_batching (struct mondemand_client *client,
+                            const int max_messages,
+                            const int max_bytes,
+                            const int max_linger_ms)
 {
-  int retval = 0;
+  if (client == NULL || max_messages < 1 || max_bytes < 0
+      || max_linger_ms < 0)
+    {
+      return -2;
+    }
 
-  retval += mondemand_flush_logs (client);
-  retval += mondemand_flush_stats (client);
-  retval += mondemand_flush_trace (client);
-  retval += mondemand_flush_performance_trace (client);
+  mondemand_lock (client);
+  client->batch_max_messages = max_messages;
+  client->batch_max_bytes = max_bytes;
+  client->batch_max_linger = (long long) max_linger_ms * 1000LL;
+  mondemand_unlock (client);
 
-  return retval;
+  return 0;
 }
 
 int
-mondemand_initialize_trace (struct mondemand_client *client,
-                            const char *owner,
-                            const char *trace_id,
-                            const char *message)
+mondemand_set_log_sample_rate (struct mondemand_client *client,
+                               const int level,
+                               const double rate)
 {
-  mondemand_clear_trace (client);
-
-  if( client != NULL )
+  if (client == NULL || level < M_LOG_EMERG || level > M_LOG_ALL
+      || rate < 0.0 || rate > 1.0)
     {
-      client->trace_id = strdup (trace_id);
-      client->owner = strdup (owner);
-      client->trace_message = strdup (message);
+      return -2;
     }
+
+  client->sample_rates[level] = rate;
+
   return 0;
 }
 
-int
-mondemand_flush_trace (struct mondemand_client *client)
+static void
+mondemand_update_rate_limited (struct mondemand_client *client)
 {
-  if (client != NULL && client->trace_id != NULL && client->owner != NULL)
+  int i;
+
+  client->rate_limited = 0;
+  for (i = M_LOG_EMERG; i <= M_LOG_ALL; ++i)
     {
-      if (mondemand_dispatch_trace (client) != 0)
+      if (client->call_site_limits[i].rate > 0.0
+          || client->level_limits[i].rate > 0.0)
         {
-          return -1;
+          client->rate_limited = 1;
         }
     }
+}
+
+int
+mondemand_set_log_rate_limit (struct mondemand_client *client,
+                              const int level,
+                              const double per_second,
+                              const double burst)
+{
+  if (client == NULL || level < M_LOG_EMERG || level > M_LOG_ALL
+      || per_second < 0.0)
+    {
+      return -2;
+    }
+
+  mondemand_lock (client);
+  client->call_site_limits[level].rate = per_second;
+  client->call_site_limits[level].burst = burst < 1.0 ? 1.0 : burst;
+  /* existing buckets may have been sized for the old burst, so start them
+     over, keeping what they suppressed for the next message sent */
+  m_hash_table_foreach (client->log_limits, mondemand_log_limit_restart,
+                        NULL);
+  mondemand_update_rate_limited (client);
+  mondemand_unlock (client);
 
   return 0;
 }
 
-void
-mondemand_clear_trace (struct mondemand_client *client)
+int
+mondemand_set_log_level_rate_limit (struct mondemand_client *client,
+                                    const int level,
+                                    const double per_second,
+                                    const double burst)
 {
-  if (client != NULL)
+  if (client == NULL || level < M_LOG_EMERG || level > M_LOG_ALL
+      || per_second < 0.0)
     {
-      mondemand_remove_all_traces (client);
-      m_free (client->trace_id);
-      m_free (client->owner);
-      m_free (client->trace_message);
-      client->trace_id = NULL;
-      client->owner = NULL;
-      client->trace_message = NULL;
+      return -2;
     }
+
+  mondemand_lock (client);
+  client->level_limits[level].rate = per_second;
+  client->level_limits[level].burst = burst < 1.0 ? 1.0 : burst;
+  client->level_buckets[level].tokens = client->level_limits[level].burst;
+  client->level_buckets[level].last = 0;
+  mondemand_update_rate_limited (client);
+  mondemand_unlock (client);
+
+  return 0;
 }
 
+/* returns the value for a given key */
+const char *
+mondemand_get_context (struct mondemand_client *client, const char *key)
+{
+  const char *ret = NULL;
 
-int
-mondemand_initialize_performance_trace (struct mondemand_client *client,
-                                        const char *id,
-                                        const char *caller_label)
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      ret = m_hash_table_get (client->contexts, key);
+      mondemand_unlock (client);
+    }
+
+  return ret;
+}
+
+const char **
+mondemand_get_context_keys(struct mondemand_client *client)
 {
+  const char **ret = NULL;
+
   if (client != NULL)
     {
-      /* clear out any previous state */
-      mondemand_clear_performance_trace (client);
-      /* copy the id and caller label */
-      client->perf_id = strdup (id);
-      client->perf_caller_label = strdup (caller_label);
+      mondemand_lock (client);
+      ret = m_hash_table_keys (client->contexts);
+      mondemand_unlock (client);
     }
-  return 0;
+
+  return ret;
 }
 
+/* sets a context, overwriting it if it is already set */
 int
-mondemand_add_performance_trace_timing (struct mondemand_client *client,
-                                        const char *label,
-                                        const long long int start,
-                                        const long long int end)
+mondemand_set_context (struct mondemand_client *client,
+                       const char *key, const char *value)
 {
-  struct mondemand_timing *data = NULL;
+  char *k = NULL;
+  char *v = NULL;
+  int retval = 0;
 
-  if( client != NULL )
+  if (client != NULL && key != NULL && value != NULL)
     {
-      if (label != NULL && start > 0 && end > 0 )
+      if (client->contexts != NULL)
         {
-          data = (struct mondemand_timing *)
-            m_try_realloc (client->timings,
-                           (client->num_timings + 1) *
-                           sizeof (struct mondemand_timing));
+          k = strdup (key);
+          v = strdup (value);
 
-          if (data == NULL)
+          /* if we can't allocate memory for the values, bail out */
+          if (k == NULL || v == NULL)
             {
               return -3;
             }
 
-          data[client->num_timings].label = strdup (label);
-          data[client->num_timings].start = start;
-          data[client->num_timings].end = end;
-          client->num_timings++;
-          client->timings = data;
-        }
-      else
-        {
-          return -2;
+          mondemand_lock (client);
+          if (m_hash_table_set (client->contexts, k, v) != 0)
+            {
+              m_free (k);
+              m_free (v);
+              retval = -3;
+            }
+          else
+            {
+              mondemand_context_changed (client);
+            }
+          mondemand_unlock (client);
         }
     }
 
-  return 0;
+  return retval;
 }
 
-static void
-mondemand_remove_all_perf_timings (struct mondemand_client *client)
+/* remove a context */
+void
+mondemand_remove_context (struct mondemand_client *client, const char *key)
 {
-  int i = 0;
-  struct mondemand_timing timing;
-
-  if (client != NULL && client->timings != NULL)
+  if (client != NULL)
     {
-      /* destroy all the timings */
-      for(i=0; i < client->num_timings; i++)
-        {
-          timing = client->timings[i];
-          m_free (timing.label);
-        }
-      m_free (client->timings);
-      client->timings = NULL;
-      client->num_timings = 0;
+      mondemand_lock (client);
+      m_hash_table_remove (client->contexts, key);
+      mondemand_context_changed (client);
+      mondemand_unlock (client);
     }
 }
 
+/* remove all contexts */
 void
-mondemand_clear_performance_trace (struct mondemand_client *client)
+mondemand_remove_all_contexts (struct mondemand_client *client)
 {
-  if (client != NULL)
+  if( client != NULL )
     {
-      mondemand_remove_all_perf_timings (client);
-      m_free (client->perf_id);
-      m_free (client->perf_caller_label);
-      client->perf_id = NULL;
-      client->perf_caller_label = NULL;
+      mondemand_lock (client);
+      m_hash_table_remove_all (client->contexts);
+      mondemand_context_changed (client);
+      mondemand_unlock (client);
     }
 }
 
-int
-mondemand_flush_performance_trace(struct mondemand_client *client)
-{
-  return mondemand_dispatch_perf (client);
-}
-
-int mondemand_log_level_from_string (const char *level)
+/* returns the value for a given key */
+const char *
+mondemand_get_trace (struct mondemand_client *client, const char *key)
 {
-  unsigned int i;
-
-  if (level == NULL)
-    {
-      return -1;
-    }
+  const char *ret = NULL;
 
-  for (i = 0 ;
-       i < (sizeof (MonDemandLogLevelStrings)
-            / sizeof ((MonDemandLogLevelStrings)[0]));
-       ++i)
+  if( client != NULL)
     {
-      if (strcmp (level, MonDemandLogLevelStrings[i]) == 0)
-        {
-          return i;
-        }
+      mondemand_lock (client);
+      ret = m_hash_table_get (client->trace, key);
+      mondemand_unlock (client);
     }
 
-  return -1;
+  return ret;
 }
 
-MondemandStatType mondemand_stat_type_from_string (const char *type)
+const char **
+mondemand_get_trace_keys (struct mondemand_client *client)
 {
-  if (strcmp (type, MondemandStatTypeString[MONDEMAND_GAUGE]) == 0)
-    {
-      return MONDEMAND_GAUGE;
-    }
-  else if (strcmp (type, MondemandStatTypeString[MONDEMAND_COUNTER]) == 0)
-    {
-      return MONDEMAND_COUNTER;
-    }
-  else
+  const char **ret = NULL;
+
+  if (client != NULL)
     {
-      return MONDEMAND_UNKNOWN;
+      mondemand_lock (client);
+      ret = m_hash_table_keys (client->trace);
+      mondemand_unlock (client);
     }
-}
 
-/*========================================================================*/
-/* Semi-private functions                                                 */
-/*========================================================================*/
+  return ret;
+}
+
+/* sets a trace item, overwriting it if it is already set */
+int
+mondemand_set_trace (struct mondemand_client *client,
+                     const char *key, const char *value)
+{
+  char *k = NULL;
+  char *v = NULL;
+
+  if (client != NULL && key != NULL && value != NULL)
+    {
+      k = strdup (key);
+      if( k == NULL)
+        {
+          return -3;
+        }
+
+      v = strdup (value);
+      if (v == NULL)
+        {
+          m_free (k);
+          return -3;
+        }
+
+      mondemand_lock (client);
+      if (m_hash_table_set (client->trace, k, v) != 0)
+        {
+          mondemand_unlock (client);
+          m_free (k);
+          m_free (v);
+          return -3;
+        }
+      mondemand_unlock (client);
+    }
+
+  return 0;
+}
+
+/* remove a trace item */
+void
+mondemand_remove_trace (struct mondemand_client *client, const char *key)
+{
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      m_hash_table_remove (client->trace, key);
+      mondemand_unlock (client);
+    }
+}
+
+/* remove all trace items */
+void
+mondemand_remove_all_traces (struct mondemand_client *client)
+{
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      m_hash_table_remove_all (client->trace);
+      mondemand_unlock (client);
+    }
+}
+
+/* add a transport, by storing a reference to it */
+int
+mondemand_add_transport(struct mondemand_client *client,
+                        struct mondemand_transport *transport)
+{
+  struct mondemand_transport **data = NULL;
+  struct m_internal_transport *counters = NULL;
+
+  /* the I/O thread reads the array without locking */
+  if( client != NULL && client->async != NULL )
+    {
+      return -2;
+    }
+
+  if( client == NULL || transport == NULL )
+    {
+      return 0;
+    }
+  if( mondemand_transport_valid (transport) == 0 )
+    {
+      return -2;
+    }
+
+  /* under the lock, so mondemand_get_internal_stats sees the counters and
+     the transports grow together */
+  mondemand_lock (client);
+  if( client->internal != NULL )
+    {
+      counters = (struct m_internal_transport *)
+        m_try_realloc(client->internal->transports,
+                      (client->num_transports + 1) *
+                      sizeof(struct m_internal_transport));
+      if( counters == NULL )
+        {
+          mondemand_unlock (client);
+          return -3;
+        }
+      memset(&counters[client->num_transports], 0,
+             sizeof(struct m_internal_transport));
+      client->internal->transports = counters;
+    }
+
+  data = (struct mondemand_transport **)
+    m_try_realloc(client->transports,
+                  (client->num_transports + 1) *
+                  sizeof(struct mondemand_transport *));
+
+  if( data == NULL )
+    {
+      mondemand_unlock (client);
+      return -3;
+    }
+
+  data[client->num_transports] = transport;
+  client->num_transports++;
+  client->transports = data;
+  if( client->internal != NULL )
+    {
+      client->internal->transport_count = client->num_transports;
+    }
+  client->consumes |= mondemand_transport_capabilities (transport);
+  if( mondemand_transport_has_batch (transport) )
+    {
+      client->batch_transports++;
+    }
+  mondemand_unlock (client);
+
+  return 0;
+}
+
+/* check if a level is enabled */
+int
+mondemand_level_is_enabled(struct mondemand_client *client,
+                           const int log_level)
+{
+  if( client != NULL )
+    {
+      /* with a debug ring everything is worth logging */
+      return log_level < client->no_send_level || client->ring_size > 0;
+    }
+  else
+    {
+      return 0;
+    }
+}
+
+/* flush the logs to the transports */
+int
+mondemand_flush_logs (struct mondemand_client *client)
+{
+  int retval = 0;
+
+  if( client != NULL )
+    {
+      mondemand_lock (client);
+      if( (retval = mondemand_dispatch_logs (client)) == 0 )
+        {
+          m_hash_table_remove_all ( client->messages );
+          client->batch_bytes = 0;
+        }
+      mondemand_unlock (client);
+    }
+
+  return retval != 0 ? -1 : 0;
+}
+
+/* flush the stats to the transports */
+int
+mondemand_flush_stats (struct mondemand_client *client)
+{
+  int retval = 0;
+
+  if( client != NULL )
+    {
+      mondemand_lock (client);
+      retval = mondemand_dispatch_stats (client);
+      mondemand_unlock (client);
+    }
+
+  return retval != 0 ? -1 : 0;
+}
+
+int
+mondemand_reset_stats (struct mondemand_client *client)
+{
+  int i=0;
+  const char **keys = NULL;
+  struct m_stat_message *stat = NULL;
+
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      /* reset all the stats */
+      keys = m_hash_table_keys (client->stats);
+      if (keys != NULL)
+        {
+          for (i=0; keys[i] != NULL; ++i)
+            {
+              stat =
+                (struct m_stat_message *)
+                  m_hash_table_get (client->stats, keys[i]);
+              if (stat != NULL)
+                {
+                  __atomic_store_n (&stat->value, 0, __ATOMIC_RELAXED);
+                }
+            }
+          m_free (keys);
+        }
+      mondemand_unlock (client);
+    }
+
+  return 0;
+}
+
+/* flush everything */
+int
+mondemand_flush (struct mondemand_client *client)
+{
+  int retval = 0;
+
+  if (client != NULL && client->batch_transports > 0)
+    {
+      /* batch transports get everything below in one call */
+      mondemand_lock (client);
+      client->collecting = 1;
+    }
+
+  retval += mondemand_flush_logs (client);
+  retval += mondemand_flush_stats (client);
+  retval += mondemand_flush_trace (client);
+  retval += mondemand_flush_performance_trace (client);
+
+  if (client != NULL && client->collecting)
+    {
+      client->collecting = 0;
+      if (mondemand_job_batch (client) != 0)
+        {
+          retval--;
+        }
+      mondemand_unlock (client);
+    }
+
+  return retval;
+}
+
+int
+mondemand_initialize_trace (struct mondemand_client *client,
+                            const char *owner,
+                            const char *trace_id,
+                            const char *message)
+{
+  if( client != NULL )
+    {
+      mondemand_lock (client);
+      mondemand_clear_trace (client);
+      client->trace_id = strdup (trace_id);
+      client->owner = strdup (owner);
+      client->trace_message = strdup (message);
+      mondemand_unlock (client);
+    }
+  return 0;
+}
+
+int
+mondemand_flush_trace (struct mondemand_client *client)
+{
+  int retval = 0;
+
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      if (client->trace_id != NULL && client->owner != NULL
+          && mondemand_dispatch_trace (client) != 0)
+        {
+          retval = -1;
+        }
+      mondemand_unlock (client);
+    }
+
+  return retval;
+}
+
+void
+mondemand_clear_trace (struct mondemand_client *client)
+{
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      mondemand_remove_all_traces (client);
+      m_free (client->trace_id);
+      m_free (client->owner);
+      m_free (client->trace_message);
+      client->trace_id = NULL;
+      client->owner = NULL;
+      client->trace_message = NULL;
+      mondemand_unlock (client);
+    }
+}
+
+
+int
+mondemand_initialize_performance_trace (struct mondemand_client *client,
+                                        const char *id,
+                                        const char *caller_label)
+{
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      /* clear out any previous state */
+      mondemand_clear_performance_trace (client);
+      /* copy the id and caller label */
+      client->perf_id = strdup (id);
+      client->perf_caller_label = strdup (caller_label);
+      mondemand_unlock (client);
+    }
+  return 0;
+}
+
+int
+mondemand_add_performance_trace_timing (struct mondemand_client *client,
+                                        const char *label,
+                                        const long long int start,
+                                        const long long int end)
+{
+  struct mondemand_timing *data = NULL;
+
+  if( client != NULL )
+    {
+      if (label != NULL && start > 0 && end > 0 )
+        {
+          mondemand_lock (client);
+          data = (struct mondemand_timing *)
+            m_try_realloc (client->timings,
+                           (client->num_timings + 1) *
+                           sizeof (struct mondemand_timing));
+
+          if (data == NULL)
+            {
+              mondemand_unlock (client);
+              return -3;
+            }
+
+          data[client->num_timings].label = strdup (label);
+          data[client->num_timings].start = start;
+          data[client->num_timings].end = end;
+          client->num_timings++;
+          client->timings = data;
+          mondemand_unlock (client);
+        }
+      else
+        {
+          return -2;
+        }
+    }
+
+  return 0;
+}
+
+static void
+mondemand_remove_all_perf_timings (struct mondemand_client *client)
+{
+  int i = 0;
+  struct mondemand_timing timing;
+
+  if (client != NULL && client->timings != NULL)
+    {
+      /* destroy all the timings */
+      for(i=0; i < client->num_timings; i++)
+        {
+          timing = client->timings[i];
+          m_free (timing.label);
+        }
+      m_free (client->timings);
+      client->timings = NULL;
+      client->num_timings = 0;
+    }
+}
+
+void
+mondemand_clear_performance_trace (struct mondemand_client *client)
+{
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      mondemand_remove_all_perf_timings (client);
+      m_free (client->perf_id);
+      m_free (client->perf_caller_label);
+      client->perf_id = NULL;
+      client->perf_caller_label = NULL;
+      mondemand_unlock (client);
+    }
+}
+
+int
+mondemand_flush_performance_trace(struct mondemand_client *client)
+{
+  int retval = 0;
+
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      retval = mondemand_dispatch_perf (client);
+      mondemand_unlock (client);
+    }
+
+  return retval;
+}
+
+struct mondemand_log_field
+mondemand_field_int64 (const char *key, const long long value)
+{
+  struct mondemand_log_field field;
+  field.key = key;
+  field.type = MONDEMAND_FIELD_INT64;
+  field.value.i = value;
+  return field;
+}
+
+struct mondemand_log_field
+mondemand_field_double (const char *key, const double value)
+{
+  struct mondemand_log_field field;
+  field.key = key;
+  field.type = MONDEMAND_FIELD_DOUBLE;
+  field.value.d = value;
+  return field;
+}
+
+struct mondemand_log_field
+mondemand_field_string (const char *key, const char *value)
+{
+  struct mondemand_log_field field;
+  field.key = key;
+  field.type = MONDEMAND_FIELD_STRING;
+  field.value.s = value;
+  return field;
+}
+
+struct mondemand_log_field
+mondemand_field_bool (const char *key, const int value)
+{
+  struct mondemand_log_field field;
+  field.key = key;
+  field.type = MONDEMAND_FIELD_BOOL;
+  field.value.b = value != 0;
+  return field;
+}
+
+int mondemand_log_level_from_string (const char *level)
+{
+  unsigned int i;
+
+  if (level == NULL)
+    {
+      return -1;
+    }
+
+  for (i = 0 ;
+       i < (sizeof (MonDemandLogLevelStrings)
+            / sizeof ((MonDemandLogLevelStrings)[0]));
+       ++i)
+    {
+      if (strcmp (level, MonDemandLogLevelStrings[i]) == 0)
+        {
+          return i;
+        }
+    }
+
+  return -1;
+}
+
+MondemandStatType mondemand_stat_type_from_string (const char *type)
+{
+  if (strcmp (type, MondemandStatTypeString[MONDEMAND_GAUGE]) == 0)
+    {
+      return MONDEMAND_GAUGE;
+    }
+  else if (strcmp (type, MondemandStatTypeString[MONDEMAND_COUNTER]) == 0)
+    {
+      return MONDEMAND_COUNTER;
+    }
+  else
+    {
+      return MONDEMAND_UNKNOWN;
+    }
+}
+
+/*========================================================================*/
+/* Semi-private functions                                                 */
+/*========================================================================*/
 
 int
 mondemand_log_real(struct mondemand_client *client,
@@ -672,511 +1846,2862 @@ mondemand_log_real(struct mondemand_client *client,
                    const struct mondemand_trace_id trace_id,
                    const char *format, ...)
 {
-  int retval = 0;
-  va_list args;
-  va_start(args, format);
-  retval = mondemand_log_real_va(client, filename, line, level,
-                                 trace_id, format, args);
-  va_end(args);
-  return retval;
+  int retval = 0;
+  va_list args;
+  va_start(args, format);
+  retval = mondemand_log_real_va(client, filename, line, level,
+                                 trace_id, format, args);
+  va_end(args);
+  return retval;
+}
+
+/* the common logging path.  If args is NULL, text is the message itself,
+   otherwise it is a format for args */
+static int
+mondemand_log_internal(struct mondemand_client *client,
+                       const char *filename,
+                       const int line,
+                       const int level,
+                       const struct mondemand_trace_id trace_id,
+                       const char *text,
+                       va_list *args,
+                       const struct mondemand_log_field fields[],
+                       const int field_count)
+{
+  int retval = 0;
+
+  if( client != NULL )
+    {
+      mondemand_lock (client);
+      retval = mondemand_log_unlocked (client, filename, line, level,
+                                       trace_id, text, args,
+                                       fields, field_count);
+      mondemand_unlock (client);
+    }
+
+  return retval;
+}
+
+/* mondemand_log_internal with the client lock held */
+static int
+mondemand_log_unlocked(struct mondemand_client *client,
+                       const char *filename,
+                       const int line,
+                       const int level,
+                       const struct mondemand_trace_id trace_id,
+                       const char *text,
+                       va_list *args,
+                       const struct mondemand_log_field fields[],
+                       const int field_count)
+{
+  char key[(FILENAME_MAX * 3)];
+  struct m_log_message *message = NULL;
+  char *hash_key = NULL;
+  int suppressed = 0;
+  int repeat_count = 0;
+  int size = 0;
+  double sample_rate = 1.0;
+  struct mondemand_log_field format_args[M_FORMAT_MAX_ARGS];
+  int arg_count = -1;
+  va_list capture;
+
+  if( client != NULL && text != NULL )
+    {
+      /* don't hold on to a batch forever just because it never fills up */
+      mondemand_check_log_linger(client);
+
+      if( level >= M_LOG_EMERG && level <= M_LOG_ALL )
+        {
+          sample_rate = client->sample_rates[level];
+        }
+
+      if( client->ring_size > 0 )
+        {
+          /* keep messages we won't send in the ring, in case an error
+           * comes along which they might explain.  Traced ones are kept
+           * too, rather than sent at once, so a traced error can send
+           * the rest of its transaction */
+          if( level >= client->no_send_level )
+            {
+              mondemand_ring_capture(client, filename, line, level,
+                                     trace_id, text, args);
+              return 0;
+            }
+
+          if( level <= client->ring_trigger_level )
+            {
+              mondemand_ring_dump(client, trace_id);
+            }
+        }
+
+      /* no transport takes log messages, there's nothing to keep */
+      if( ! (client->consumes & MONDEMAND_TRANSPORT_LOGS) )
+        {
+          return 0;
+        }
+
+      /* if the trace ID is NULL or the no send level is too high,
+       * give up now */
+      if( mondemand_trace_id_compare(&trace_id, &MONDEMAND_NULL_TRACE_ID) != 0 
+          || level < client->no_send_level )
+        {
+          /* if we're supposed to send a trace, flush what we have now */
+          if( mondemand_trace_id_compare(&trace_id,
+                                         &MONDEMAND_NULL_TRACE_ID) != 0 )
+            {
+              mondemand_flush_logs(client);
+            }
+
+          /* drop messages which aren't part of the sample */
+          if( sample_rate < 1.0
+              && ! mondemand_log_sampled(&trace_id, sample_rate) )
+            {
+              M_INTERNAL_ADD (client, log_suppressed, 1);
+              return 0;
+            }
+
+          /* create a lookup key */
+          mondemand_call_site_key(key, sizeof(key), filename, line);
+
+          /* traced messages are never rate limited */
+          if( client->rate_limited
+              && mondemand_trace_id_compare(&trace_id,
+                                            &MONDEMAND_NULL_TRACE_ID) == 0
+              && ! mondemand_log_allowed(client, key, level, &suppressed) )
+            {
+              M_INTERNAL_ADD (client, log_suppressed, 1);
+              return 0;
+            }
+
+          /* see if there's a duplicate */
+          message =
+            (struct m_log_message *) m_hash_table_get(client->messages, key);
+
+          if( message != NULL)
+            {
+              /* found a duplicate, just increment the counter, including
+               * any messages the rate limiter dropped since the last one */
+              repeat_count = message->repeat_count;
+              message->repeat_count += 1 + suppressed;
+              M_INTERNAL_ADD (client, log_repeats, 1);
+
+              /* if the count passed a multiple of 999, force a flush since
+               * we might be caught in an infinite loop or tight inner loop */
+              if( repeat_count / 999 != message->repeat_count / 999 )
+                {
+                  mondemand_flush_logs(client);
+                }
+            }
+          else
+            {
+              /* there is no duplicate, create a new entry */
+              hash_key = strdup(key);
+              if( hash_key != NULL )
+                {
+                  /* keep the arguments as typed values so transports can
+                   * send the format and arguments instead of the text */
+                  if( args != NULL )
+                    {
+                      va_copy(capture, *args);
+                      arg_count = m_format_capture(text, &capture,
+                                                   format_args,
+                                                   M_FORMAT_MAX_ARGS);
+                      va_end(capture);
+                    }
+
+                  message = m_try_malloc0( sizeof(struct m_log_message)
+                                           + mondemand_log_extras_size
+                                               (fields, field_count, text,
+                                                format_args, arg_count) );
+
+                  if( message != NULL )
+                    {
+                      strncpy(message->filename, filename, FILENAME_MAX);
+                      message->line = line;
+                      message->level = level;
+                      message->repeat_count = 1 + suppressed;
+                      message->trace_id = trace_id;
+                      message->sample_rate = sample_rate;
+                      if( args != NULL )
+                        {
+                          vsnprintf( message->message, M_MESSAGE_MAX,
+                                     text, *args );
+                        }
+                      else
+                        {
+                          strncpy( message->message, text, M_MESSAGE_MAX );
+                        }
+                      mondemand_log_extras_copy( message,
+                                                 fields, field_count, text,
+                                                 format_args, arg_count );
+
+                      /* if this message would push the batch over its size
+                       * limit, send what we have first */
+                      size = mondemand_log_message_size( message );
+                      if( client->batch_max_bytes > 0
+                          && m_hash_table_num (client->messages) > 0
+                          && client->batch_bytes + size
+                               > client->batch_max_bytes )
+                        {
+                          mondemand_flush_logs(client);
+                        }
+                      if( m_hash_table_num (client->messages) == 0 )
+                        {
+                          client->batch_bytes =
+                            mondemand_log_batch_size (client);
+                          if( client->batch_max_linger > 0 )
+                            {
+                              client->batch_started = mondemand_now_us ();
+                            }
+                        }
+                      client->batch_bytes += size;
+
+                      m_hash_table_set( client->messages, hash_key, message );
+                    }
+                  else
+                    {
+                      m_free(hash_key);
+                      return -3;
+                    }
+                } /* if( hash_key != NULL ) */
+            } /* if( message != NULL ) */
+
+          /* if we're in the immediate send level, or the bundle has
+           * reached its message count or size limits, or if a trace ID is
+           * set, emit the messages.
+           */
+          if( level <= client->immediate_send_level
+              || m_hash_table_num (client->messages)
+                   >= client->batch_max_messages
+              || (client->batch_max_bytes > 0
+                  && client->batch_bytes >= client->batch_max_bytes)
+              || mondemand_trace_id_compare(&trace_id,
+                                            &MONDEMAND_NULL_TRACE_ID) != 0 )
+            {
+              mondemand_flush_logs(client);
+            }
+
+        } /* if( mondemand_trace_id_compare ... ) */
+    } /* if( client != NULL ... ) */
+
+  return 0;
+}
+
+int
+mondemand_log_real_va(struct mondemand_client *client,
+                      const char *filename,
+                      const int line,
+                      const int level,
+                      const struct mondemand_trace_id trace_id,
+                      const char *format,
+                      va_list args)
+{
+  int retval = 0;
+  va_list copy;
+
+  /* copy so we have a va_list we can take the address of */
+  va_copy(copy, args);
+  retval = mondemand_log_internal(client, filename, line, level, trace_id,
+                                  format, &copy, NULL, 0);
+  va_end(copy);
+  return retval;
+}
+
+int
+mondemand_log_kv_real(struct mondemand_client *client,
+                      const char *filename,
+                      const int line,
+                      const int level,
+                      const struct mondemand_trace_id trace_id,
+                      const char *message,
+                      const struct mondemand_log_field fields[],
+                      const int field_count)
+{
+  if( field_count < 0 || (field_count > 0 && fields == NULL) )
+    {
+      return -2;
+    }
+
+  return mondemand_log_internal(client, filename, line, level, trace_id,
+                                message, NULL, fields, field_count);
+}
+
+int
+mondemand_stats_perform_op (struct mondemand_client *client,
+                            const char *filename,
+                            const int line,
+                            const MondemandOp op,
+                            const MondemandStatType type,
+                            const char *key,
+                            const MondemandStatValue value)
+{
+  char buffer[FILENAME_MAX * 3];
+  const char *real_key = key;
+  char *new_key = NULL;
+  struct m_stat_message *stat = NULL;
+
+  /* the client must not be null, and either the filename or key must be set */
+  if( client != NULL &&
+      (filename != NULL || key != NULL) )
+    {
+      mondemand_lock (client);
+
+      /* if the key wasn't set, use the filename+line number */
+      if( real_key == NULL )
+        {
+          mondemand_call_site_key (buffer, FILENAME_MAX*2, filename, line);
+          real_key = buffer;
+        }
+
+      /* then get or create a stat */
+      stat =
+        (struct m_stat_message *) m_hash_table_get (client->stats, real_key);
+
+      if( stat == NULL )
+        {
+          /* create a new entry */
+          new_key = strdup (real_key);
+          stat =
+            (struct m_stat_message*)
+            m_try_malloc0( sizeof(struct m_stat_message) );
+          if( stat == NULL || new_key == NULL )
+            {
+              goto ERROR;
+            }
+          else
+            {
+              /* always start with a zeroed stat */
+              stat->type = type;
+              stat->value = 0;
+              /* attempt to add to hashtable */
+              if( m_hash_table_set( client->stats, new_key, stat ) != 0 )
+                {
+                  goto ERROR;
+                }
+              /* publish it, filled in, to the metrics endpoint */
+              stat->key = new_key;
+              stat->next = client->stat_list;
+              __atomic_store_n (&client->stat_list, stat, __ATOMIC_RELEASE);
+            }
+        }
+
+      /* FIXME: should I really reset the type? */
+      __atomic_store_n (&stat->type, type, __ATOMIC_RELAXED);
+      /* depending on operation change value */
+      switch (op)
+        {
+        case MONDEMAND_INC:
+          __atomic_store_n (&stat->value, stat->value + value,
+                            __ATOMIC_RELAXED);
+          break;
+        case MONDEMAND_DEC:
+          __atomic_store_n (&stat->value, stat->value - value,
+                            __ATOMIC_RELAXED);
+          break;
+        case MONDEMAND_SET:
+          __atomic_store_n (&stat->value, value, __ATOMIC_RELAXED);
+          break;
+        }
+      mondemand_unlock (client);
+    }
+
+  return 0;
+
+ERROR:
+  mondemand_unlock (client);
+  m_free (new_key);
+  m_free (stat);
+  return -3;
+}
+
+int
+mondemand_flush_annotation (const char* id,
+                            const long long int timestamp,
+                            const char* description,
+                            const char* text,
+                            const char** tags,
+                            const int num_tags,
+                            struct mondemand_client *client)
+{
+  int retval = 0;
+
+  if (client != NULL)
+    {
+      mondemand_lock (client);
+      retval = mondemand_dispatch_annotation (id,
+                                              timestamp,
+                                              description,
+                                              text,
+                                              tags,
+                                              num_tags,
+                                              client);
+      mondemand_unlock (client);
+    }
+
+  return retval;
+}
+
+/*========================================================================*/
+/* Private functions                                                      */
+/*========================================================================*/
+
+/* the lock is only needed once the scheduler thread is running */
+/* makes the entry points take the lock from now on, called before starting
+   a thread which uses the client */
+static void
+mondemand_start_locking (struct mondemand_client *client)
+{
+  pthread_mutexattr_t attributes;
+
+  if (client->locking == 0)
+    {
+      /* recursive since public functions which lock call each other */
+      pthread_mutexattr_init (&attributes);
+      pthread_mutexattr_settype (&attributes, PTHREAD_MUTEX_RECURSIVE);
+      pthread_mutex_init (&client->lock, &attributes);
+      pthread_mutexattr_destroy (&attributes);
+      client->locking = 1;
+    }
+}
+
+static void
+mondemand_lock (struct mondemand_client *client)
+{
+  if (client->locking)
+    {
+      pthread_mutex_lock (&client->lock);
+    }
+}
+
+static void
+mondemand_unlock (struct mondemand_client *client)
+{
+  if (client->locking)
+    {
+      pthread_mutex_unlock (&client->lock);
+    }
+}
+
+/* scheduler callbacks, run on the scheduler thread */
+static void
+mondemand_scheduled_stats (void *data)
+{
+  mondemand_flush_stats ((struct mondemand_client *) data);
+}
+
+static void
+mondemand_scheduled_logs (void *data)
+{
+  mondemand_flush_logs ((struct mondemand_client *) data);
+}
+
+/* sends the log batch once its oldest message has waited too long */
+static void
+mondemand_scheduled_linger (void *data)
+{
+  struct mondemand_client *client = (struct mondemand_client *) data;
+
+  mondemand_lock (client);
+  mondemand_check_log_linger (client);
+  mondemand_unlock (client);
+}
+
+/* sends the timings collected since the last flush */
+static void
+mondemand_scheduled_perf (void *data)
+{
+  struct mondemand_client *client = (struct mondemand_client *) data;
+
+  mondemand_lock (client);
+  if (mondemand_dispatch_perf (client) == 0)
+    {
+      mondemand_remove_all_perf_timings (client);
+    }
+  mondemand_unlock (client);
+}
+
+/* serves /metrics on the endpoint's thread without the client's lock, so
+   threads updating stats never wait for a scrape.  A stat being created
+   while the list is read is left for the next scrape, and values are each
+   read atomically but not all at the same instant */
+static int
+mondemand_prometheus_scrape (const char *path, struct m_buffer *body,
+                             const char **content_type, void *data)
+{
+  struct m_prometheus *prometheus = (struct m_prometheus *) data;
+  struct mondemand_client *client = prometheus->client;
+  struct mondemand_stats_message *snapshot = NULL;
+  const struct mondemand_stats_message *stat = NULL;
+  struct m_stat_message *head = NULL;
+  struct m_stat_message *item = NULL;
+  struct m_buffer *labels = &prometheus->scrape_labels;
+  char value[M_STATSD_INTEGER_MAX];
+  size_t length;
+  int count = 0;
+  int size;
+  int i;
+
+  if (strcmp (path, "/metrics") != 0)
+    {
+      m_buffer_printf (body, "not found\n");
+      return 404;
+    }
+
+  /* stats are only ever pushed on the front, so everything from head on
+     stays put while it's walked */
+  head = __atomic_load_n (&client->stat_list, __ATOMIC_ACQUIRE);
+  for (item = head; item != NULL; item = item->next)
+    {
+      ++count;
+    }
+  if (count > prometheus->snapshot_size)
+    {
+      size = count < 64 ? 64 : count * 2;
+      snapshot = (struct mondemand_stats_message *)
+        m_try_realloc (prometheus->snapshot,
+                       sizeof (struct mondemand_stats_message) * size);
+      if (snapshot == NULL)
+        {
+          return 503;
+        }
+      prometheus->snapshot = snapshot;
+      prometheus->snapshot_size = size;
+    }
+  /* keys stay in the table until the client is destroyed, so copying the
+     pointers is enough.  Filled from the back to list oldest first */
+  prometheus->snapshot_count = count;
+  for (item = head; item != NULL; item = item->next)
+    {
+      mondemand_prometheus_copy (item, &prometheus->snapshot[--count]);
+    }
+  /* stats new since the last scrape are named after the older ones */
+  for (i = prometheus->names_count; i < prometheus->snapshot_count; ++i)
+    {
+      if (mondemand_prometheus_unique (prometheus,
+                                       prometheus->snapshot[i].key) != 0)
+        {
+          return 503;
+        }
+    }
+
+  m_buffer_clear (labels);
+  pthread_mutex_lock (&prometheus->lock);
+  if (prometheus->labels.failed)
+    {
+      labels->failed = 1;
+    }
+  else
+    {
+      m_buffer_append (labels, prometheus->labels.data,
+                       prometheus->labels.length);
+    }
+  pthread_mutex_unlock (&prometheus->lock);
+  if (labels->failed)
+    {
+      return 503;
+    }
+
+  *content_type = "text/plain; version=0.0.4; charset=utf-8";
+  for (i = 0; i < prometheus->snapshot_count; ++i)
+    {
+      stat = &prometheus->snapshot[i];
+      length = strlen (prometheus->names[i]);
+      m_buffer_append (body, "# TYPE ", 7);
+      m_buffer_append (body, prometheus->names[i], length);
+      if (stat->type == MONDEMAND_COUNTER)
+        {
+          m_buffer_append (body, " counter\n", 9);
+        }
+      else
+        {
+          m_buffer_append (body, " gauge\n", 7);
+        }
+      m_buffer_append (body, prometheus->names[i], length);
+      m_buffer_append (body, "{", 1);
+      m_buffer_append (body, labels->data, labels->length);
+      m_buffer_append (body, "} ", 2);
+      length = m_statsd_format_integer (value, stat->value);
+      m_buffer_append (body, value, length);
+      m_buffer_append (body, "\n", 1);
+    }
+
+  return 200;
+}
+
+/* names the next stat in the snapshot, adding a suffix when its sanitized
+   key is already some other stat's name.  Returns 0, or -3 on allocation
+   failure, in which case the stat is named on the next scrape */
+static int
+mondemand_prometheus_unique (struct m_prometheus *prometheus,
+                             const char *key)
+{
+  struct m_buffer *name = &prometheus->name;
+  char **names = NULL;
+  char *taken = NULL;
+  char *value = NULL;
+  size_t length;
+  int size;
+  int suffix = 2;
+
+  if (prometheus->names_count == prometheus->names_size)
+    {
+      size = prometheus->names_size < 64 ? 64 : prometheus->names_size * 2;
+      names = (char **) m_try_realloc (prometheus->names,
+                                       sizeof (char *) * size);
+      if (names == NULL)
+        {
+          return -3;
+        }
+      prometheus->names = names;
+      prometheus->names_size = size;
+    }
+
+  m_buffer_clear (name);
+  mondemand_prometheus_name (name, key);
+  length = name->length;
+  m_buffer_append (name, "", 1);
+  while (! name->failed
+         && m_hash_table_get (prometheus->used_names, name->data) != NULL)
+    {
+      name->length = length;
+      m_buffer_printf (name, "_%d", suffix++);
+      m_buffer_append (name, "", 1);
+    }
+  if (name->failed)
+    {
+      return -3;
+    }
+
+  /* the table owns both, the value is the name handed out */
+  taken = strdup (name->data);
+  value = strdup (name->data);
+  if (taken == NULL || value == NULL
+      || m_hash_table_set (prometheus->used_names, taken, value) != 0)
+    {
+      free (taken);
+      free (value);
+      return -3;
+    }
+  prometheus->names[prometheus->names_count++] = value;
+
+  return 0;
+}
+
+/* copies a stat into the snapshot, the values with atomic loads */
+static void
+mondemand_prometheus_copy (struct m_stat_message *stat,
+                           struct mondemand_stats_message *copy)
+{
+  copy->key = stat->key;
+  copy->type = __atomic_load_n (&stat->type, __ATOMIC_RELAXED);
+  copy->value = __atomic_load_n (&stat->value, __ATOMIC_RELAXED);
+}
+
+/* renders the prog_id and contexts as labels, called with the client's
+   lock held when the endpoint starts and whenever the contexts change */
+static void
+mondemand_prometheus_labels (struct m_prometheus *prometheus)
+{
+  struct mondemand_client *client = prometheus->client;
+  const struct mondemand_context *contexts = NULL;
+  struct m_buffer *labels = &prometheus->labels;
+  int count = 0;
+  int i;
+
+  pthread_mutex_lock (&prometheus->lock);
+  m_buffer_clear (labels);
+  m_buffer_append (labels, "prog_id=\"", 9);
+  mondemand_prometheus_escape (labels, client->prog_id);
+  m_buffer_append (labels, "\"", 1);
+  contexts = mondemand_context_list (client, &count);
+  for (i = 0; i < count; ++i)
+    {
+      m_buffer_append (labels, ",", 1);
+      mondemand_prometheus_name (labels, contexts[i].key);
+      m_buffer_append (labels, "=\"", 2);
+      mondemand_prometheus_escape (labels, contexts[i].value);
+      m_buffer_append (labels, "\"", 1);
+    }
+  pthread_mutex_unlock (&prometheus->lock);
+}
+
+/* appends key as a metric or label name, anything but letters, digits and
+   underscores becoming an underscore and a leading digit getting one in
+   front */
+static void
+mondemand_prometheus_name (struct m_buffer *body, const char *key)
+{
+  size_t length = strlen (key);
+  char *out = NULL;
+  size_t i;
+  char c;
+
+  if (m_buffer_reserve (body, length + 1) != 0)
+    {
+      return;
+    }
+  out = body->data + body->length;
+  if (length == 0 || (key[0] >= '0' && key[0] <= '9'))
+    {
+      *out++ = '_';
+    }
+  for (i = 0; i < length; ++i)
+    {
+      c = key[i];
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+          || (c >= '0' && c <= '9'))
+        {
+          *out++ = c;
+        }
+      else
+        {
+          *out++ = '_';
+        }
+    }
+  body->length = (size_t) (out - body->data);
+}
+
+/* appends a label value with backslashes, quotes and newlines escaped */
+static void
+mondemand_prometheus_escape (struct m_buffer *buffer, const char *value)
+{
+  const char *start = value;
+
+  for (; *value != '\0'; ++value)
+    {
+      if (*value == '\\' || *value == '"' || *value == '\n')
+        {
+          m_buffer_append (buffer, start, (size_t) (value - start));
+          m_buffer_append (buffer, *value == '\n' ? "\\n"
+                                   : *value == '"' ? "\\\"" : "\\\\", 2);
+          start = value + 1;
+        }
+    }
+  m_buffer_append (buffer, start, (size_t) (value - start));
+}
+
+/* a monotonic clock in microseconds for the rate limits, the log linger
+   and queue latency, so none of them jump when the wall clock is set */
+static long long
+mondemand_now_us (void)
+{
+  return mondemand_now_ns () / 1000;
+}
+
+/* a monotonic clock for the internal counters' timings */
+static long long
+mondemand_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* builds the 'filename:line' key for a call site without using printf */
+static void
+mondemand_call_site_key (char *key, const size_t size,
+                         const char *filename, const int line)
+{
+  char digits[12];
+  unsigned int value = line < 0 ? - (unsigned int) line : (unsigned int) line;
+  size_t len = strlen (filename);
+  size_t n = 0;
+
+  do
+    {
+      digits[n++] = (char) ('0' + value % 10);
+      value /= 10;
+    }
+  while (value != 0);
+  if (line < 0)
+    {
+      digits[n++] = '-';
+    }
+
+  /* truncate the filename if it won't fit with the line number */
+  if (len + 1 + n + 1 > size)
+    {
+      len = size - 1 - n - 1;
+    }
+  memcpy (key, filename, len);
+  key[len++] = ':';
+  while (n > 0)
+    {
+      key[len++] = digits[--n];
+    }
+  key[len] = '\0';
+}
+
+/* bytes needed to keep a copy of structured fields with their strings */
+static size_t
+mondemand_log_fields_size (const struct mondemand_log_field fields[],
+                           const int field_count)
+{
+  size_t size = 0;
+  int i;
+
+  for (i = 0; i < field_count; ++i)
+    {
+      size += sizeof (struct mondemand_log_field)
+            + (fields[i].key != NULL ? strlen (fields[i].key) : 0) + 1;
+      if (fields[i].type == MONDEMAND_FIELD_STRING)
+        {
+          size += (fields[i].value.s != NULL ? strlen (fields[i].value.s) : 0)
+                + 1;
+        }
+    }
+
+  return size;
+}
+
+/* copies fields into dest, with their strings starting at strings, and
+   returns the end of the strings copied */
+static char *
+mondemand_log_fields_copy (struct mondemand_log_field dest[],
+                           const struct mondemand_log_field fields[],
+                           const int field_count, char *strings)
+{
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < field_count; ++i)
+    {
+      dest[i] = fields[i];
+
+      len = fields[i].key != NULL ? strlen (fields[i].key) : 0;
+      memcpy (strings, fields[i].key != NULL ? fields[i].key : "", len + 1);
+      dest[i].key = strings;
+      strings += len + 1;
+
+      if (fields[i].type == MONDEMAND_FIELD_STRING)
+        {
+          len = fields[i].value.s != NULL ? strlen (fields[i].value.s) : 0;
+          memcpy (strings, fields[i].value.s != NULL ? fields[i].value.s : "",
+                  len + 1);
+          dest[i].value.s = strings;
+          strings += len + 1;
+        }
+    }
+
+  return strings;
+}
+
+/* bytes needed after a message for its fields, format and format args */
+static size_t
+mondemand_log_extras_size (const struct mondemand_log_field fields[],
+                           const int field_count,
+                           const char *format,
+                           const struct mondemand_log_field args[],
+                           const int arg_count)
+{
+  size_t size = mondemand_log_fields_size (fields, field_count);
+
+  if (arg_count >= 0)
+    {
+      size += mondemand_log_fields_size (args, arg_count)
+            + strlen (format) + 1;
+    }
+
+  return size;
+}
+
+/* copies fields, format and format args into the space after a message,
+   which must have been allocated with mondemand_log_extras_size extra
+   bytes.  The arrays go first so they stay aligned. */
+static void
+mondemand_log_extras_copy (struct m_log_message *message,
+                           const struct mondemand_log_field fields[],
+                           const int field_count,
+                           const char *format,
+                           const struct mondemand_log_field args[],
+                           const int arg_count)
+{
+  char *strings = NULL;
+
+  message->field_count = field_count;
+  message->fields = (struct mondemand_log_field *) (message + 1);
+  message->arg_count = arg_count > 0 ? arg_count : 0;
+  message->args = message->fields + field_count;
+  strings = (char *) (message->args + message->arg_count);
+
+  strings = mondemand_log_fields_copy (message->fields, fields,
+                                       field_count, strings);
+  if (arg_count >= 0)
+    {
+      strings = mondemand_log_fields_copy (message->args, args,
+                                           arg_count, strings);
+      strcpy (strings, format);
+      message->format = strings;
+    }
+
+  if (field_count == 0)
+    {
+      message->fields = NULL;
+    }
+  if (message->arg_count == 0)
+    {
+      message->args = NULL;
+    }
+}
+
+/* estimated encoded size of the fixed part of a log event, the program id,
+   message count and contexts */
+static int
+mondemand_log_batch_size (struct mondemand_client *client)
+{
+  const struct mondemand_context *contexts = NULL;
+  int count = 0;
+  int size = 0;
+  int i;
+
+  /* event name, attribute count, prog_id and num */
+  size = 1 + 17 + 2
+       + 1 + 7 + 1 + 2 + (int) strlen (client->prog_id)
+       + 1 + 3 + 1 + 2;
+
+  contexts = mondemand_context_list (client, &count);
+  if (count > 0)
+    {
+      /* ctxt_num */
+      size += 1 + 8 + 1 + 2;
+      for (i = 0; i < count; ++i)
+        {
+          /* ctxt_kN and ctxt_vN */
+          size += 2 * (1 + 10 + 1 + 2) + (int) strlen (contexts[i].key)
+                + (int) strlen (contexts[i].value);
+        }
+    }
+
+  return size;
+}
+
+/* estimated encoded size of a single log message within a log event,
+   assuming attribute names with up to 3 digit indices */
+static int
+mondemand_log_message_size (const struct m_log_message *message)
+{
+  int i;
+  /* each attribute is a name length, name, type and value */
+  int size = (1 + 4 + 1 + 2) + (int) strlen (message->filename) /* f */
+           + (1 + 4 + 1 + 4)                                    /* l */
+           + (1 + 4 + 1 + 4)                                    /* p */
+           + (1 + 4 + 1 + 2) + (int) strlen (message->message)  /* m */
+           + (1 + 4 + 1 + 2);                                   /* r */
+
+  if (mondemand_trace_id_compare (&message->trace_id,
+                                  &MONDEMAND_NULL_TRACE_ID) != 0)
+    {
+      size += 1 + 11 + 1 + 8;
+    }
+  if (message->sample_rate < 1.0)
+    {
+      size += 1 + 4 + 1 + 8;
+    }
+  for (i = 0; i < message->field_count; ++i)
+    {
+      size += 1 + 6 + (int) strlen (message->fields[i].key) + 1;
+      switch (message->fields[i].type)
+        {
+        case MONDEMAND_FIELD_STRING:
+          size += 2 + (int) strlen (message->fields[i].value.s);
+          break;
+        case MONDEMAND_FIELD_BOOL:
+          size += 1;
+          break;
+        default:
+          size += 8;
+          break;
+        }
+    }
+
+  return size;
+}
+
+/* flushes the log batch if its oldest message has waited too long */
+static void
+mondemand_check_log_linger (struct mondemand_client *client)
+{
+  if (client->batch_max_linger > 0
+      && m_hash_table_num (client->messages) > 0
+      && mondemand_now_us () - client->batch_started
+           >= client->batch_max_linger)
+    {
+      mondemand_flush_logs (client);
+    }
+}
+
+/* mixes the bits of a 64 bit value, from splitmix64 */
+static unsigned long long
+m_mix64 (unsigned long long x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+#ifdef HAVE___THREAD
+/* per thread xorshift64* generator, so sampling needs no locks */
+static unsigned long long
+m_random64 (void)
+{
+  static __thread unsigned long long state = 0;
+
+  if (state == 0)
+    {
+      /* seed from the time and the address of this thread's state */
+      state = m_mix64 ((unsigned long long) mondemand_now_us ()
+                       ^ (unsigned long long) (size_t) &state);
+      if (state == 0)
+        {
+          state = 0x9e3779b97f4a7c15ULL;
+        }
+    }
+
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dULL;
+}
+#else
+/* without thread locals, a splitmix64 generator whose counter is stepped
+   atomically, so threads sampling at once still get distinct values.  The
+   counter's address differs between processes, which keeps them from all
+   sampling the same messages */
+static unsigned long long
+m_random64 (void)
+{
+  static unsigned long long weyl = 0;
+
+  return m_mix64 (__atomic_add_fetch (&weyl, 0x9e3779b97f4a7c15ULL,
+                                      __ATOMIC_RELAXED)
+                  ^ (unsigned long long) (size_t) &weyl);
+}
+#endif
+
+/* returns non-zero if a message should be kept given a sample rate.  Traced
+   messages are decided by a hash of the trace id, so every service keeps or
+   drops the same transactions */
+static int
+mondemand_log_sampled (const struct mondemand_trace_id *trace_id,
+                       const double rate)
+{
+  unsigned long long r;
+
+  if (rate <= 0.0)
+    {
+      return 0;
+    }
+
+  if (mondemand_trace_id_compare (trace_id, &MONDEMAND_NULL_TRACE_ID) != 0)
+    {
+      r = m_mix64 ((unsigned long long) trace_id->_id);
+    }
+  else
+    {
+      r = m_random64 ();
+    }
+
+  /* compare the top 53 bits as a fraction in [0, 1) */
+  return (double) (r >> 11) * (1.0 / 9007199254740992.0) < rate;
+}
+
+/* refills a bucket for the time elapsed and attempts to take a token from
+   it, returns non-zero if a token was taken */
+static int
+m_token_bucket_take (struct m_token_bucket *bucket,
+                     const struct m_rate_limit *limit,
+                     const long long now)
+{
+  if (limit->rate <= 0.0)
+    {
+      return 1;
+    }
+
+  if (now > bucket->last)
+    {
+      bucket->tokens += (double) (now - bucket->last) * limit->rate / 1e6;
+      if (bucket->tokens > limit->burst)
+        {
+          bucket->tokens = limit->burst;
+        }
+    }
+  bucket->last = now;
+
+  if (bucket->tokens < 1.0)
+    {
+      return 0;
+    }
+
+  bucket->tokens -= 1.0;
+  return 1;
+}
+
+/* checks the call site and level token buckets for a message.  If the
+   message may be sent, suppressed is set to the number of messages dropped
+   from this call site since the last one sent, and non-zero is returned */
+static int
+mondemand_log_allowed (struct mondemand_client *client,
+                       const char *key, const int level,
+                       int *suppressed)
+{
+  const struct m_rate_limit *site_limit = NULL;
+  const struct m_rate_limit *level_limit = NULL;
+  struct m_log_limit *limit = NULL;
+  char *limit_key = NULL;
+  long long now;
+
+  if (level < M_LOG_EMERG || level > M_LOG_ALL)
+    {
+      return 1;
+    }
+
+  site_limit = &client->call_site_limits[level];
+  level_limit = &client->level_limits[level];
+  if (site_limit->rate <= 0.0 && level_limit->rate <= 0.0)
+    {
+      return 1;
+    }
+
+  now = mondemand_now_us ();
+
+  limit = (struct m_log_limit *) m_hash_table_get (client->log_limits, key);
+  if (limit == NULL)
+    {
+      limit_key = strdup (key);
+      limit = (struct m_log_limit *) m_try_malloc0 (sizeof (struct m_log_limit));
+      if (limit_key == NULL || limit == NULL
+          || m_hash_table_set (client->log_limits, limit_key, limit) != 0)
+        {
+          /* if we can't track the call site, fail open */
+          m_free (limit_key);
+          m_free (limit);
+          return 1;
+        }
+    }
+  if (limit->bucket.last == 0)
+    {
+      limit->bucket.tokens = site_limit->burst;
+      limit->bucket.last = now;
+    }
+
+  if (! m_token_bucket_take (&limit->bucket, site_limit, now))
+    {
+      limit->suppressed++;
+      return 0;
+    }
+
+  if (! m_token_bucket_take (&client->level_buckets[level], level_limit, now))
+    {
+      /* give back the call site token since nothing was sent */
+      limit->bucket.tokens += 1.0;
+      limit->suppressed++;
+      return 0;
+    }
+
+  *suppressed = limit->suppressed;
+  limit->suppressed = 0;
+  return 1;
+}
+
+/* m_hash_table_foreach callback making a call site's bucket start full at
+   its next message */
+static void
+mondemand_log_limit_restart (const char *key, void *value, void *data)
+{
+  struct m_log_limit *limit = (struct m_log_limit *) value;
+
+  (void) key;
+  (void) data;
+  limit->bucket.last = 0;
+}
+
+/* dispatches log messages to the transports */
+static int
+mondemand_dispatch_logs(struct mondemand_client *client)
+{
+  int retval = 0;
+  int i = 0;
+  const char **message_keys = NULL;
+  struct m_log_message *message = NULL;
+  struct mondemand_log_message *messages = NULL;
+
+  if( client != NULL && (client->consumes & MONDEMAND_TRANSPORT_LOGS) )
+    {
+      if( client->messages != NULL && client->contexts != NULL )
+        {
+          /* fetch all the messages */
+          message_keys = m_hash_table_keys( client->messages );
+
+          /* allocate an array of structs */
+          messages = (struct mondemand_log_message *)
+            m_try_malloc0(sizeof(struct mondemand_log_message) *
+                          m_hash_table_num (client->messages));
+          for(i=0; i< m_hash_table_num (client->messages); ++i)
+            {
+              /* we copy the values from the hash table since we want an
+                 immutable const structure to pass to the transport */
+              message =
+                (struct m_log_message *) m_hash_table_get(client->messages,
+                                                          message_keys[i]);
+              messages[i].filename = message->filename;
+              messages[i].line = message->line;
+              messages[i].level = message->level;
+              messages[i].repeat_count = message->repeat_count;
+              messages[i].message = message->message;
+              messages[i].trace_id = message->trace_id;
+              messages[i].sample_rate = message->sample_rate;
+              messages[i].fields = message->fields;
+              messages[i].field_count = message->field_count;
+              messages[i].format = message->format;
+              messages[i].args = message->args;
+              messages[i].arg_count = message->arg_count;
+            }
+
+          retval = mondemand_send_logs (client, messages,
+                                        m_hash_table_num (client->messages));
+
+          /* clean up memory */
+          m_free(messages);
+          m_free(message_keys);
+        } /* if( client->messages != NULL && client->contexts != NULL ) */
+    } /* if( client != NULL ) */
+
+  return retval;
+}
+
+/* sends an array of log messages to each transport */
+static int
+mondemand_send_logs (struct mondemand_client *client,
+                     const struct mondemand_log_message messages[],
+                     const int message_count)
+{
+  int retval = 0;
+  struct m_job job;
+
+  if (! (client->consumes & MONDEMAND_TRANSPORT_LOGS))
+    {
+      return 0;
+    }
+
+  memset (&job, 0, sizeof (job));
+  job.type = M_JOB_LOGS;
+  job.items = messages;
+  job.count = message_count;
+  mondemand_job_contexts (client, &job);
+  retval = mondemand_job_deliver (client, &job);
+
+  return retval;
+}
+
+/* records a message in the debug ring, overwriting the oldest one */
+static void
+mondemand_ring_capture (struct mondemand_client *client,
+                        const char *filename, const int line,
+                        const int level,
+                        const struct mondemand_trace_id trace_id,
+                        const char *text, va_list *args)
+{
+  struct m_ring_record *record =
+    &client->ring[client->ring_written % client->ring_size];
+  size_t len = strlen (filename);
+
+  if (len > M_RING_FILENAME_MAX)
+    {
+      len = M_RING_FILENAME_MAX;
+    }
+  memcpy (record->filename, filename, len);
+  record->filename[len] = '\0';
+  record->line = line;
+  record->level = level;
+  record->trace_id = trace_id;
+  if (args != NULL)
+    {
+      vsnprintf (record->message, sizeof (record->message), text, *args);
+    }
+  else
+    {
+      strncpy (record->message, text, M_RING_MESSAGE_MAX);
+      record->message[M_RING_MESSAGE_MAX] = '\0';
+    }
+
+  client->ring_written++;
+}
+
+/* sends the debug ring, oldest first, then empties it.  If the trigger has
+   a trace id and only matching records were asked for, only those are sent
+   and removed */
+static int
+mondemand_ring_dump (struct mondemand_client *client,
+                     const struct mondemand_trace_id trace_id)
+{
+  struct m_ring_record *record = NULL;
+  unsigned long first = 0;
+  unsigned long i = 0;
+  int match = 0;
+  int count = 0;
+  int retval = 0;
+
+  match = client->ring_match_trace
+          && mondemand_trace_id_compare (&trace_id,
+                                         &MONDEMAND_NULL_TRACE_ID) != 0;
+
+  if (client->ring_written > (unsigned long) client->ring_size)
+    {
+      first = client->ring_written - client->ring_size;
+    }
+
+  for (i = first; i < client->ring_written; ++i)
+    {
+      record = &client->ring[i % client->ring_size];
+      if (record->level < 0
+          || (match && mondemand_trace_id_compare (&record->trace_id,
+                                                   &trace_id) != 0))
+        {
+          continue;
+        }
+      client->ring_messages[count].filename = record->filename;
+      client->ring_messages[count].line = record->line;
+      client->ring_messages[count].level = record->level;
+      client->ring_messages[count].repeat_count = 1;
+      client->ring_messages[count].message = record->message;
+      client->ring_messages[count].trace_id = record->trace_id;
+      client->ring_messages[count].sample_rate = 1.0;
+      client->ring_messages[count].fields = NULL;
+      client->ring_messages[count].field_count = 0;
+      client->ring_messages[count].format = NULL;
+      client->ring_messages[count].args = NULL;
+      client->ring_messages[count].arg_count = 0;
+      count++;
+    }
+
+  if (count > 0)
+    {
+      retval = mondemand_send_logs (client, client->ring_messages, count);
+    }
+
+  if (match)
+    {
+      /* mark what was sent so it isn't sent again */
+      for (i = first; i < client->ring_written; ++i)
+        {
+          record = &client->ring[i % client->ring_size];
+          if (mondemand_trace_id_compare (&record->trace_id, &trace_id) == 0)
+            {
+              record->level = -1;
+            }
+        }
+    }
+  else
+    {
+      client->ring_written = 0;
+    }
+
+  return retval;
+}
+
+/* the contexts as an array for the transports, only rebuilt from the
+   hashtable after they change.  If that fails they are sent without
+   contexts and the rebuild is tried again next time */
+static const struct mondemand_context *
+mondemand_context_list (struct mondemand_client *client, int *count)
+{
+  const char **context_keys = NULL;
+  struct mondemand_context *contexts = NULL;
+  int num_contexts = m_hash_table_num (client->contexts);
+  int i;
+
+  if (client->context_list_version != client->context_version)
+    {
+      m_free (client->context_list);
+      client->context_list = NULL;
+      client->context_list_count = 0;
+
+      if (num_contexts > 0)
+        {
+          /* fetch the keys to all the contexts */
+          context_keys = m_hash_table_keys (client->contexts);
+          contexts = (struct mondemand_context *)
+            m_try_malloc0 (sizeof (struct mondemand_context) * num_contexts);
+          if (context_keys == NULL || contexts == NULL)
+            {
+              m_free (context_keys);
+              m_free (contexts);
+              *count = 0;
+              return NULL;
+            }
+          for (i = 0; i < num_contexts; ++i)
+            {
+              /* copy the pointer to a const struct that the transport
+                 can copy from */
+              contexts[i].key = context_keys[i];
+              contexts[i].value = (char *) m_hash_table_get (client->contexts,
+                                                             context_keys[i]);
+            }
+          m_free (context_keys);
+        }
+
+      client->context_list = contexts;
+      client->context_list_count = num_contexts;
+      client->context_list_version = client->context_version;
+    }
+
+  *count = client->context_list_count;
+  return client->context_list;
+}
+
+/* notes that the contexts changed, so the array and any encoded copies are
+   rebuilt before they are next sent */
+static void
+mondemand_context_changed (struct mondemand_client *client)
+{
+  if (++client->context_version == 0)
+    {
+      client->context_version = 1;
+    }
+  if (client->prometheus != NULL)
+    {
+      mondemand_prometheus_labels (client->prometheus);
+    }
+}
+
+/* dispatches stats to the transports */
+static int
+mondemand_dispatch_stats(struct mondemand_client *client)
+{
+  int retval = 0;
+  int i=0;
+  int count=0;
+  int extra=0;
+  const char **message_keys = NULL;
+  struct mondemand_stats_message *messages = NULL;
+  char (*names)[M_INTERNAL_NAME_MAX] = NULL;
+  struct m_job job;
+
+  /* scrapes fail until labels which couldn't be rendered are */
+  if( client != NULL && client->prometheus != NULL
+      && client->prometheus->labels.failed )
+    {
+      mondemand_prometheus_labels (client->prometheus);
+    }
+
+  if( client != NULL
+      && (client->consumes & MONDEMAND_TRANSPORT_STATS)
+      && client->stats != NULL
+      && client->contexts != NULL )
+    {
+      /* fetch the stats */
+      message_keys = m_hash_table_keys( client->stats );
+      count = m_hash_table_num (client->stats);
+
+      /* room for the internal counters after them */
+      if( client->internal != NULL )
+        {
+          extra = M_INTERNAL_STATS
+                  + M_INTERNAL_TRANSPORT_STATS
+                    * client->internal->transport_count;
+          names = m_try_malloc (sizeof (*names) * extra);
+          if( names == NULL )
+            {
+              extra = 0;
+            }
+        }
+
+      /* allocate an array of structs */
+      messages = (struct mondemand_stats_message *)
+        m_try_malloc0(sizeof(struct mondemand_stats_message) *
+                      (count + extra));
+
+      for (i=0; i < count; ++i)
+        {
+          messages[i].key = message_keys[i];
+          struct m_stat_message *stat =
+            (struct m_stat_message *)
+              m_hash_table_get(client->stats, message_keys[i]);
+          messages[i].type = stat->type;
+          messages[i].value = stat->value;
+        }
+      if( extra > 0 )
+        {
+          count += mondemand_internal_messages (client, messages + count,
+                                                names);
+        }
+
+      memset (&job, 0, sizeof (job));
+      job.type = M_JOB_STATS;
+      job.items = messages;
+      job.count = count;
+      mondemand_job_contexts (client, &job);
+      retval = mondemand_job_deliver (client, &job);
+      m_free (messages);
+      m_free (message_keys);
+      m_free (names);
+    }
+
+  return retval;
+}
+
+/* fills in the internal counters as mondemand.internal.* stats, returning
+   how many.  names holds their keys */
+static int
+mondemand_internal_messages (struct mondemand_client *client,
+                             struct mondemand_stats_message messages[],
+                             char names[][M_INTERNAL_NAME_MAX])
+{
+  static const char *types[MONDEMAND_INTERNAL_TYPES] =
+    { ".logs", ".stats", ".trace", ".perf", ".annotation" };
+  struct mondemand_internal_stats stats;
+  struct mondemand_internal_transport_stats transport;
+  int n = 0;
+  int i;
+
+  if (mondemand_get_internal_stats (client, &stats) != 0)
+    {
+      return 0;
+    }
+
+#define M_INTERNAL_MESSAGE(prefix, index, suffix, type, value)             \
+  mondemand_internal_message (&messages[n], names[n], prefix, index,      \
+                              suffix, type, value);                       \
+  ++n
+
+  for (i = 0; i < MONDEMAND_INTERNAL_TYPES; ++i)
+    {
+      M_INTERNAL_MESSAGE ("flushes", -1, types[i], MONDEMAND_COUNTER,
+                          stats.flushes[i]);
+      M_INTERNAL_MESSAGE ("flush_ns", -1, types[i], MONDEMAND_COUNTER,
+                          stats.flush_ns[i]);
+    }
+  M_INTERNAL_MESSAGE ("encodes", -1, "", MONDEMAND_COUNTER, stats.encodes);
+  M_INTERNAL_MESSAGE ("encode_ns", -1, "", MONDEMAND_COUNTER,
+                      stats.encode_ns);
+  M_INTERNAL_MESSAGE ("datagrams", -1, "", MONDEMAND_COUNTER,
+                      stats.datagrams);
+  M_INTERNAL_MESSAGE ("bytes", -1, "", MONDEMAND_COUNTER, stats.bytes);
+  M_INTERNAL_MESSAGE ("sender_errors", -1, "", MONDEMAND_COUNTER,
+                      stats.sender_errors);
+  M_INTERNAL_MESSAGE ("log_repeats", -1, "", MONDEMAND_COUNTER,
+                      stats.log_repeats);
+  M_INTERNAL_MESSAGE ("log_suppressed", -1, "", MONDEMAND_COUNTER,
+                      stats.log_suppressed);
+  M_INTERNAL_MESSAGE ("stats_entries", -1, "", MONDEMAND_GAUGE,
+                      stats.stats_entries);
+  M_INTERNAL_MESSAGE ("stats_longest_chain", -1, "", MONDEMAND_GAUGE,
+                      stats.stats_longest_chain);
+  M_INTERNAL_MESSAGE ("log_entries", -1, "", MONDEMAND_GAUGE,
+                      stats.log_entries);
+  M_INTERNAL_MESSAGE ("log_longest_chain", -1, "", MONDEMAND_GAUGE,
+                      stats.log_longest_chain);
+
+  for (i = 0; i < client->internal->transport_count; ++i)
+    {
+      if (mondemand_get_internal_transport_stats (client,
+                                                  client->transports[i],
+                                                  &transport) != 0)
+        {
+          continue;
+        }
+      M_INTERNAL_MESSAGE ("transport", i, ".sends", MONDEMAND_COUNTER,
+                          transport.sends);
+      M_INTERNAL_MESSAGE ("transport", i, ".send_ns", MONDEMAND_COUNTER,
+                          transport.send_ns);
+      M_INTERNAL_MESSAGE ("transport", i, ".errors", MONDEMAND_COUNTER,
+                          transport.errors);
+    }
+
+#undef M_INTERNAL_MESSAGE
+
+  return n;
+}
+
+/* sets one internal stat, named mondemand.internal. followed by prefix,
+   index in decimal unless it's negative, and suffix */
+static void
+mondemand_internal_message (struct mondemand_stats_message *message,
+                            char *name, const char *prefix, int index,
+                            const char *suffix, MondemandStatType type,
+                            long long value)
+{
+  if (index >= 0)
+    {
+      snprintf (name, M_INTERNAL_NAME_MAX, "mondemand.internal.%s%d%s",
+                prefix, index, suffix);
+    }
+  else
+    {
+      snprintf (name, M_INTERNAL_NAME_MAX, "mondemand.internal.%s%s",
+                prefix, suffix);
+    }
+  message->key = name;
+  message->type = type;
+  message->value = value;
+}
+
+static int mondemand_dispatch_trace (struct mondemand_client *client)
+{
+  int retval = 0;
+  const char **trace_keys = NULL;
+  struct mondemand_trace *traces = NULL;
+  struct m_job job;
+  int i;
+
+  if( client != NULL && (client->consumes & MONDEMAND_TRANSPORT_TRACES) )
+    {
+      if (client->trace != NULL)
+        {
+          /* fetch the keys to all the contexts */
+          trace_keys = m_hash_table_keys (client->trace);
+
+          traces = (struct mondemand_trace *)
+            m_try_malloc0 (sizeof (struct mondemand_trace) *
+                           m_hash_table_num (client->trace));
+          for (i=0; i < m_hash_table_num (client->trace); ++i)
+            {
+              /* copy the pointer to a const struct that the transport
+                 can copy from */
+              traces[i].key = trace_keys[i];
+              traces[i].value = (char *) m_hash_table_get (client->trace,
+                                                           trace_keys[i]);
+            }
+
+          memset (&job, 0, sizeof (job));
+          job.type = M_JOB_TRACE;
+          job.items = traces;
+          job.count = m_hash_table_num (client->trace);
+          job.strings[0] = client->owner;
+          job.strings[1] = client->trace_id;
+          job.strings[2] = client->trace_message;
+          retval = mondemand_job_deliver (client, &job);
+
+          m_free (traces);
+          m_free (trace_keys);
+        }
+    }
+
+  return retval;
+}
+
+static int
+mondemand_dispatch_perf (struct mondemand_client *client)
+{
+  int retval = 0;
+  struct m_job job;
+
+  if ( client != NULL
+       && (client->consumes & MONDEMAND_TRANSPORT_PERF)
+       && client->perf_id != NULL
+       && client->perf_caller_label != NULL
+       && client->timings != NULL
+       && client->num_timings > 0
+       && client->contexts != NULL )
+    {
+      memset (&job, 0, sizeof (job));
+      job.type = M_JOB_PERF;
+      job.items = client->timings;
+      job.count = client->num_timings;
+      mondemand_job_contexts (client, &job);
+      job.strings[0] = client->perf_id;
+      job.strings[1] = client->perf_caller_label;
+      retval = mondemand_job_deliver (client, &job);
+    }
+
+  return retval;
+}
+
+static int
+mondemand_dispatch_annotation (const char* id,
+                               const long long int timestamp,
+                               const char* description,
+                               const char* text,
+                               const char** tags,
+                               const int num_tags,
+                               struct mondemand_client *client)
+{
+  int retval = 0;
+  struct m_job job;
+
+  if( client != NULL )
+    {
+      if ( id != NULL
+           && timestamp > 0
+           && description != NULL )
+        {
+          if (! (client->consumes & MONDEMAND_TRANSPORT_ANNOTATIONS))
+            {
+              return 0;
+            }
+          memset (&job, 0, sizeof (job));
+          job.type = M_JOB_ANNOTATION;
+          job.items = tags;
+          job.count = tags != NULL ? num_tags : 0;
+          mondemand_job_contexts (client, &job);
+          job.strings[0] = id;
+          job.strings[1] = description;
+          job.strings[2] = text;
+          job.timestamp = timestamp;
+          retval = mondemand_job_deliver (client, &job);
+        }
+      else
+        {
+          retval = -2;
+        }
+    }
+
+  return retval;
+}
+
+/* passes a flush to each transport.  Transports sharing an encoder are
+   handled together when the first of them is reached: the flush is encoded
+   once and the bytes handed to each */
+static int
+mondemand_job_run (struct mondemand_client *client, const struct m_job *job)
+{
+  int retval = 0;
+  int i, j;
+  int encoded = 0;
+  size_t length = 0;
+  long long start = 0;
+  long long encode_start = 0;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_transport *other = NULL;
+
+  if (client->internal != NULL)
+    {
+      start = mondemand_now_ns ();
+    }
+
+  for (i=0; i<client->num_transports; ++i)
+    {
+      transport = client->transports[i];
+      if (transport == NULL || ! mondemand_transport_wants (transport, job))
+        {
+          continue;
+        }
+      if (! mondemand_job_encodable (transport, job))
+        {
+          if (mondemand_job_send_to (client, i, job, NULL, 0) != 0)
+            {
+              retval = -1;
+            }
+          continue;
+        }
+
+      for (j=0; j<i; ++j)
+        {
+          if (mondemand_job_same_encoder (client->transports[j],
+                                          transport, job))
+            {
+              break;
+            }
+        }
+      if (j < i)
+        {
+          /* already sent with an earlier transport */
+          continue;
+        }
+
+      if (client->internal != NULL)
+        {
+          encode_start = mondemand_now_ns ();
+        }
+      encoded = (mondemand_job_encode (client, transport->encoding, job,
+                                       &length) == 0);
+      M_INTERNAL_ADD (client, encodes, 1);
+      M_INTERNAL_ADD (client, encode_ns, mondemand_now_ns () - encode_start);
+      for (j=i; j<client->num_transports; ++j)
+        {
+          other = client->transports[j];
+          if (! mondemand_job_same_encoder (transport, other, job))
+            {
+              continue;
+            }
+          if (! encoded)
+            {
+              /* couldn't be encoded, let each transport try */
+              if (mondemand_job_send_to (client, j, job, NULL, 0) != 0)
+                {
+                  retval = -1;
+                }
+            }
+          else if (length > 0
+                   && mondemand_job_send_to (client, j, job,
+                                             client->encode_buffer,
+                                             length) != 0)
+            {
+              retval = -1;
+            }
+        }
+    } /* for(i=0; i<client->num_transports; ++i) */
+
+  if (job->type != M_JOB_BATCH)
+    {
+      M_INTERNAL_ADD (client, flush_ns[job->type],
+                      mondemand_now_ns () - start);
+    }
+
+  return retval;
+}
+
+/* passes a flush to a single transport's sender */
+static int
+mondemand_job_send (struct mondemand_client *client,
+                    struct mondemand_transport *transport,
+                    const struct m_job *job)
+{
+  int ret = 0;
+
+  switch (job->type)
+    {
+      case M_JOB_LOGS:
+        if (transport->log_sender_function == NULL)
+          {
+            return mondemand_job_send_records (client, transport, job);
+          }
+        ret = transport->log_sender_function
+                (client->prog_id,
+                 (const struct mondemand_log_message *) job->items,
+                 job->count, job->contexts, job->context_count,
+                 transport->userdata);
+        break;
+      case M_JOB_STATS:
+        if (transport->stats_sender_function == NULL)
+          {
+            return mondemand_job_send_records (client, transport, job);
+          }
+        ret = transport->stats_sender_function
+                (client->prog_id,
+                 (const struct mondemand_stats_message *) job->items,
+                 job->count, job->contexts, job->context_count,
+                 transport->userdata);
+        break;
+      case M_JOB_TRACE:
+        if (transport->trace_sender_function == NULL)
+          {
+            return mondemand_job_send_records (client, transport, job);
+          }
+        ret = transport->trace_sender_function
+                (client->prog_id,
+                 job->strings[0], job->strings[1], job->strings[2],
+                 (const struct mondemand_trace *) job->items,
+                 job->count, transport->userdata);
+        break;
+      case M_JOB_PERF:
+        if (transport->perf_sender_function == NULL)
+          {
+            return mondemand_job_send_records (client, transport, job);
+          }
+        ret = transport->perf_sender_function
+                (job->strings[0], job->strings[1],
+                 (const struct mondemand_timing *) job->items,
+                 job->count, job->contexts, job->context_count,
+                 transport->userdata);
+        break;
+      case M_JOB_ANNOTATION:
+        if (transport->annotation_sender_function == NULL)
+          {
+            return mondemand_job_send_records (client, transport, job);
+          }
+        ret = transport->annotation_sender_function
+                (job->strings[0], job->timestamp,
+                 job->strings[1], job->strings[2],
+                 (const char **) job->items,
+                 job->count, job->contexts, job->context_count,
+                 transport->userdata);
+        break;
+      case M_JOB_BATCH:
+        ret = mondemand_job_send_records (client, transport, job);
+        break;
+    }
+
+  return ret;
+}
+
+/* sends a flush to the transport at index, the bytes if they are given or
+   else through its sender functions, counting the time taken and any error
+   when the internal counters are enabled */
+static int
+mondemand_job_send_to (struct mondemand_client *client,
+                       int index, const struct m_job *job,
+                       const unsigned char *bytes, size_t length)
+{
+  struct mondemand_transport *transport = client->transports[index];
+  struct m_internal_transport *counters = NULL;
+  long long start = 0;
+  int ret = 0;
+
+  if (client->internal != NULL)
+    {
+      start = mondemand_now_ns ();
+    }
+  if (bytes != NULL)
+    {
+      ret = transport->bytes_sender_function (bytes, length,
+                                              transport->userdata);
+    }
+  else
+    {
+      ret = mondemand_job_send (client, transport, job);
+    }
+  if (client->internal != NULL && index < client->internal->transport_count)
+    {
+      counters = &client->internal->transports[index];
+      __atomic_fetch_add (&counters->sends, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add (&counters->send_ns, mondemand_now_ns () - start,
+                          __ATOMIC_RELAXED);
+      if (ret != 0)
+        {
+          __atomic_fetch_add (&counters->errors, 1, __ATOMIC_RELAXED);
+        }
+      else if (bytes != NULL && length > 0)
+        {
+          __atomic_fetch_add (&counters->datagrams, 1, __ATOMIC_RELAXED);
+          __atomic_fetch_add (&counters->bytes, (long long) length,
+                              __ATOMIC_RELAXED);
+        }
+    }
+
+  return ret;
+}
+
+/* hands a batch, or a single flush the transport has no sender function
+   for, to its batch sender */
+static int
+mondemand_job_send_records (struct mondemand_client *client,
+                            struct mondemand_transport *transport,
+                            const struct m_job *job)
+{
+  struct mondemand_record records[M_BATCH_MAX];
+  const struct m_job *jobs = job;
+  int count = 1;
+  int i;
+
+  if (! mondemand_transport_has_batch (transport))
+    {
+      return 0;
+    }
+  if (job->type == M_JOB_BATCH)
+    {
+      jobs = job->items;
+      count = job->count;
+    }
+  for (i = 0; i < count; ++i)
+    {
+      mondemand_job_record (&jobs[i], &records[i]);
+    }
+
+  return transport->batch_sender_function (client->prog_id, records, count,
+                                           job->contexts, job->context_count,
+                                           transport->userdata);
+}
+
+/* describes a flush as a record for a batch sender */
+static void
+mondemand_job_record (const struct m_job *job,
+                      struct mondemand_record *record)
+{
+  int i;
+
+  memset (record, 0, sizeof (*record));
+  record->count = job->count;
+  switch (job->type)
+    {
+      case M_JOB_LOGS:
+        record->type = MONDEMAND_RECORD_LOGS;
+        record->logs = job->items;
+        break;
+      case M_JOB_STATS:
+        record->type = MONDEMAND_RECORD_STATS;
+        record->stats = job->items;
+        break;
+      case M_JOB_TRACE:
+        record->type = MONDEMAND_RECORD_TRACE;
+        record->traces = job->items;
+        break;
+      case M_JOB_PERF:
+        record->type = MONDEMAND_RECORD_PERF;
+        record->timings = job->items;
+        break;
+      case M_JOB_ANNOTATION:
+        record->type = MONDEMAND_RECORD_ANNOTATION;
+        record->tags = job->items;
+        break;
+      case M_JOB_BATCH:
+        break;
+    }
+  for (i = 0; i < 3; ++i)
+    {
+      record->strings[i] = job->strings[i];
+    }
+  record->timestamp = job->timestamp;
+}
+
+/* sets a flush's contexts, unless no transport wants them */
+static void
+mondemand_job_contexts (struct mondemand_client *client, struct m_job *job)
+{
+  if (client->consumes & MONDEMAND_TRANSPORT_CONTEXTS)
+    {
+      job->contexts = mondemand_context_list (client, &job->context_count);
+      job->context_version = client->context_version;
+    }
+}
+
+/* sends what mondemand_flush collected to the transports with a batch
+   sender, as a single batch, then frees the copies */
+static int
+mondemand_job_batch (struct mondemand_client *client)
+{
+  struct m_job nested[M_BATCH_MAX];
+  struct m_job job;
+  int retval = 0;
+  int i;
+
+  if (client->pending_count > 0)
+    {
+      for (i = 0; i < client->pending_count; ++i)
+        {
+          nested[i] = *client->pending[i];
+        }
+      memset (&job, 0, sizeof (job));
+      job.type = M_JOB_BATCH;
+      job.items = nested;
+      job.count = client->pending_count;
+      mondemand_job_contexts (client, &job);
+      retval = mondemand_job_deliver (client, &job);
+
+      for (i = 0; i < client->pending_count; ++i)
+        {
+          m_free (client->pending[i]);
+          client->pending[i] = NULL;
+        }
+      client->pending_count = 0;
+    }
+
+  return retval;
+}
+
+/* the struct version of a transport, set by mondemand_transport_init */
+static int
+mondemand_transport_version (const struct mondemand_transport *transport)
+{
+  return transport->version;
+}
+
+/* what a transport consumes, everything for transports before version 2 */
+static unsigned int
+mondemand_transport_capabilities (const struct mondemand_transport *transport)
+{
+  if (mondemand_transport_version (transport) < MONDEMAND_TRANSPORT_VERSION)
+    {
+      return MONDEMAND_TRANSPORT_ALL;
+    }
+  return transport->capabilities;
+}
+
+/* non-zero if a transport takes batches */
+static int
+mondemand_transport_has_batch (const struct mondemand_transport *transport)
+{
+  return mondemand_transport_version (transport) >= MONDEMAND_TRANSPORT_VERSION
+         && transport->batch_sender_function != NULL;
 }
 
-int
-mondemand_log_real_va(struct mondemand_client *client,
-                      const char *filename,
-                      const int line,
-                      const int level,
-                      const struct mondemand_trace_id trace_id,
-                      const char *format,
-                      va_list args)
+/* non-zero if everything a transport consumes can be sent to it */
+static int
+mondemand_transport_valid (const struct mondemand_transport *transport)
 {
-  char key[(FILENAME_MAX * 3)];
-  struct m_log_message *message = NULL;
-  char *hash_key = NULL;
+  unsigned int capabilities = mondemand_transport_capabilities (transport);
 
-  if( client != NULL && format != NULL )
+  if (mondemand_transport_version (transport) < MONDEMAND_TRANSPORT_VERSION
+      || mondemand_transport_has_batch (transport))
     {
-      /* if the trace ID is NULL or the no send level is too high,
-       * give up now */
-      if( mondemand_trace_id_compare(&trace_id, &MONDEMAND_NULL_TRACE_ID) != 0 
-          || level < client->no_send_level )
+      return 1;
+    }
+
+  return ! (((capabilities & MONDEMAND_TRANSPORT_LOGS)
+             && transport->log_sender_function == NULL)
+            || ((capabilities & MONDEMAND_TRANSPORT_STATS)
+                && transport->stats_sender_function == NULL)
+            || ((capabilities & MONDEMAND_TRANSPORT_TRACES)
+                && transport->trace_sender_function == NULL)
+            || ((capabilities & MONDEMAND_TRANSPORT_PERF)
+                && transport->perf_sender_function == NULL)
+            || ((capabilities & MONDEMAND_TRANSPORT_ANNOTATIONS)
+                && transport->annotation_sender_function == NULL));
+}
+
+/* non-zero if a flush should be passed to a transport.  A flush collected
+   for a batch skips the transports which get the batch */
+static int
+mondemand_transport_wants (const struct mondemand_transport *transport,
+                           const struct m_job *job)
+{
+  unsigned int capability = 0;
+
+  switch (job->type)
+    {
+      case M_JOB_LOGS:
+        capability = MONDEMAND_TRANSPORT_LOGS;
+        break;
+      case M_JOB_STATS:
+        capability = MONDEMAND_TRANSPORT_STATS;
+        break;
+      case M_JOB_TRACE:
+        capability = MONDEMAND_TRANSPORT_TRACES;
+        break;
+      case M_JOB_PERF:
+        capability = MONDEMAND_TRANSPORT_PERF;
+        break;
+      case M_JOB_ANNOTATION:
+        capability = MONDEMAND_TRANSPORT_ANNOTATIONS;
+        break;
+      case M_JOB_BATCH:
+        return mondemand_transport_has_batch (transport);
+    }
+  if (! (mondemand_transport_capabilities (transport) & capability))
+    {
+      return 0;
+    }
+
+  return ! (job->batched && mondemand_transport_has_batch (transport));
+}
+
+/* non-zero if a transport's encoding handles this kind of flush */
+static int
+mondemand_job_encodable (const struct mondemand_transport *transport,
+                         const struct m_job *job)
+{
+  const struct mondemand_encoding *encoding = NULL;
+
+  if (mondemand_transport_version (transport)
+        < MONDEMAND_TRANSPORT_VERSION_ENCODING)
+    {
+      return 0;
+    }
+  encoding = transport->encoding;
+  if (encoding == NULL || transport->bytes_sender_function == NULL)
+    {
+      return 0;
+    }
+  switch (job->type)
+    {
+      case M_JOB_LOGS:
+        return encoding->log_encoder != NULL;
+      case M_JOB_STATS:
+        return encoding->stats_encoder != NULL;
+      case M_JOB_PERF:
+        return encoding->perf_encoder != NULL;
+      default:
+        return 0;
+    }
+}
+
+/* non-zero if two transports encode this kind of flush the same way */
+static int
+mondemand_job_same_encoder (const struct mondemand_transport *a,
+                            const struct mondemand_transport *b,
+                            const struct m_job *job)
+{
+  if (a == NULL || b == NULL
+      || ! mondemand_transport_wants (a, job)
+      || ! mondemand_transport_wants (b, job)
+      || ! mondemand_job_encodable (a, job)
+      || ! mondemand_job_encodable (b, job))
+    {
+      return 0;
+    }
+  switch (job->type)
+    {
+      case M_JOB_LOGS:
+        return a->encoding->log_encoder == b->encoding->log_encoder;
+      case M_JOB_STATS:
+        return a->encoding->stats_encoder == b->encoding->stats_encoder;
+      case M_JOB_PERF:
+        return a->encoding->perf_encoder == b->encoding->perf_encoder;
+      default:
+        return 0;
+    }
+}
+
+/* encodes a flush into the client's buffer, allocating it the first time
+   and keeping it for later flushes.  Returns non-zero if the flush couldn't
+   be encoded, for example if it's too big for one datagram, in which case
+   the transports need to be called instead */
+static int
+mondemand_job_encode (struct mondemand_client *client,
+                      const struct mondemand_encoding *encoding,
+                      const struct m_job *job,
+                      size_t *length)
+{
+  int ret = -1;
+  const struct mondemand_context_block *block = NULL;
+
+  if (client->encode_buffer == NULL)
+    {
+      client->encode_buffer =
+        (unsigned char *) m_try_malloc (MONDEMAND_ENCODED_MAX);
+      if (client->encode_buffer == NULL)
         {
-          /* if we're supposed to send a trace, flush what we have now */
-          if( mondemand_trace_id_compare(&trace_id,
-                                         &MONDEMAND_NULL_TRACE_ID) != 0 )
-            {
-              mondemand_flush_logs(client);
-            }
+          return -3;
+        }
+    }
+  block = mondemand_job_context_block (client, encoding, job);
 
-          /* create a lookup key */
-          snprintf(key, sizeof(key)-1, "%s:%d", filename, line);
+  switch (job->type)
+    {
+      case M_JOB_LOGS:
+        ret = encoding->log_encoder
+                (client->prog_id,
+                 (const struct mondemand_log_message *) job->items,
+                 job->count, job->contexts, job->context_count, block,
+                 client->encode_buffer, MONDEMAND_ENCODED_MAX, length);
+        break;
+      case M_JOB_STATS:
+        ret = encoding->stats_encoder
+                (client->prog_id,
+                 (const struct mondemand_stats_message *) job->items,
+                 job->count, job->contexts, job->context_count, block,
+                 client->encode_buffer, MONDEMAND_ENCODED_MAX, length);
+        break;
+      case M_JOB_PERF:
+        ret = encoding->perf_encoder
+                (job->strings[0], job->strings[1],
+                 (const struct mondemand_timing *) job->items,
+                 job->count, job->contexts, job->context_count, block,
+                 client->encode_buffer, MONDEMAND_ENCODED_MAX, length);
+        break;
+      default:
+        break;
+    }
 
-          /* see if there's a duplicate */
-          message =
-            (struct m_log_message *) m_hash_table_get(client->messages, key);
+  return ret;
+}
 
-          if( message != NULL)
-            {
-              /* found a duplicate, just increment the counter */
-              message->repeat_count++;
+/* the job's contexts as encoded by an encoding's context_encoder, kept
+   until the contexts change.  Uses the encode buffer as scratch space, so
+   is called before a flush is encoded into it.  Returns NULL if the
+   encoding has no context encoder or encoding the contexts fails, in which
+   case the flush's encoder handles them itself */
+static const struct mondemand_context_block *
+mondemand_job_context_block (struct mondemand_client *client,
+                             const struct mondemand_encoding *encoding,
+                             const struct m_job *job)
+{
+  struct m_context_cache *cache = NULL;
+  size_t length = 0;
+  int count = 0;
+  int i;
 
-              /* if the count is a multiple of 999, force a flush since
-               * we might be caught in an infinite loop or tight inner loop */
-              if( message->repeat_count % 999 == 0 )
-                {
-                  mondemand_flush_logs(client);
-                }
-            }
-          else
-            {
-              /* there is no duplicate, create a new entry */
-              hash_key = strdup(key);
-              if( hash_key != NULL )
-                {
-                  message = m_try_malloc0( sizeof(struct m_log_message) );
+  if (encoding->context_encoder == NULL || job->context_count == 0)
+    {
+      return NULL;
+    }
 
-                  if( message != NULL )
-                    {
-                      strncpy(message->filename, filename, FILENAME_MAX);
-                      message->line = line;
-                      message->level = level;
-                      message->repeat_count = 1;
-                      message->trace_id = trace_id;
-                      vsnprintf( message->message, M_MESSAGE_MAX, format, args );
-                      m_hash_table_set( client->messages, hash_key, message );
-                    }
-                  else
-                    {
-                      m_free(hash_key);
-                      return -3;
-                    }
-                } /* if( hash_key != NULL ) */
-            } /* if( message != NULL ) */
+  for (i = 0; i < M_CONTEXT_BLOCKS; ++i)
+    {
+      if (client->context_caches[i].encoder == encoding->context_encoder)
+        {
+          cache = &client->context_caches[i];
+          break;
+        }
+    }
+  if (cache == NULL)
+    {
+      /* take over the slot used longest ago */
+      cache = &client->context_caches[client->context_cache_next];
+      client->context_cache_next =
+        (client->context_cache_next + 1) % M_CONTEXT_BLOCKS;
+      cache->encoder = encoding->context_encoder;
+      cache->version = 0;
+    }
 
-          /* if we're in the immediate send level, or the bundle is bigger
-           * than M_MAX_MESSAGES, or if a trace ID is set, emit the messages.
-           */
-          if( level <= client->immediate_send_level
-              || m_hash_table_num (client->messages) >= M_MAX_MESSAGES
-              || mondemand_trace_id_compare(&trace_id,
-                                            &MONDEMAND_NULL_TRACE_ID) != 0 )
+  if (cache->version != job->context_version)
+    {
+      m_free (cache->bytes);
+      cache->bytes = NULL;
+      cache->version = 0;
+      if (cache->encoder (job->contexts, job->context_count,
+                          client->encode_buffer, MONDEMAND_ENCODED_MAX,
+                          &length, &count) != 0)
+        {
+          return NULL;
+        }
+      cache->bytes = (unsigned char *) m_try_malloc (length > 0 ? length : 1);
+      if (cache->bytes == NULL)
+        {
+          return NULL;
+        }
+      memcpy (cache->bytes, client->encode_buffer, length);
+      cache->block.bytes = cache->bytes;
+      cache->block.length = length;
+      cache->block.count = count;
+      cache->version = job->context_version;
+    }
+
+  return &cache->block;
+}
+
+/* runs a flush now, or queues a copy of it for the I/O threads.  With
+   isolation every thread gets the same copy, the last to finish frees it.
+   While mondemand_flush is collecting, a copy is also kept for the batch */
+static int
+mondemand_job_deliver (struct mondemand_client *client,
+                       const struct m_job *job)
+{
+  struct m_job *copy = NULL;
+  struct m_job collected;
+  int i;
+
+  if (job->type != M_JOB_BATCH)
+    {
+      M_INTERNAL_ADD (client, flushes[job->type], 1);
+    }
+
+  if (client->collecting && job->type != M_JOB_BATCH
+      && client->pending_count < M_BATCH_MAX)
+    {
+      /* keep a copy for the batch, empty flushes are left out of it.  If
+         the copy fails the batch transports get the flush on its own */
+      if (job->count > 0)
+        {
+          copy = mondemand_job_copy (job);
+          if (copy != NULL)
             {
-              mondemand_flush_logs(client);
+              client->pending[client->pending_count++] = copy;
             }
+        }
+      if (copy != NULL || job->count == 0)
+        {
+          collected = *job;
+          collected.batched = 1;
+          job = &collected;
+        }
+    }
 
-        } /* if( mondemand_trace_id_compare ... ) */
-    } /* if( client != NULL ... ) */
+  if (client->async == NULL)
+    {
+      return mondemand_job_run (client, job);
+    }
+
+  copy = mondemand_job_copy (job);
+  if (copy == NULL)
+    {
+      return -3;
+    }
+  copy->references = client->async_count;
+  copy->queued_us = mondemand_now_us ();
+  for (i = 0; i < client->async_count; ++i)
+    {
+      mondemand_async_push (&client->async[i], copy);
+    }
 
   return 0;
 }
 
-int
-mondemand_stats_perform_op (struct mondemand_client *client,
-                            const char *filename,
-                            const int line,
-                            const MondemandOp op,
-                            const MondemandStatType type,
-                            const char *key,
-                            const MondemandStatValue value)
+/* reserves size bytes in an arena, aligned for any member of a job.  When
+   measuring (base is NULL) nothing is written and NULL is returned */
+static void *
+m_arena_alloc (struct m_arena *arena, size_t size)
 {
-  char buffer[FILENAME_MAX * 3];
-  const char *real_key = key;
-  char *new_key = NULL;
-  struct m_stat_message *stat = NULL;
+  void *ptr = NULL;
 
-  /* the client must not be null, and either the filename or key must be set */
-  if( client != NULL &&
-      (filename != NULL || key != NULL) )
+  arena->used = (arena->used + M_ARENA_ALIGN - 1) & ~(M_ARENA_ALIGN - 1);
+  if (arena->base != NULL)
     {
-      /* if the key wasn't set, use the filename+line number */
-      if( real_key == NULL )
+      ptr = arena->base + arena->used;
+    }
+  arena->used += size;
+
+  return ptr;
+}
+
+/* copies a string into an arena */
+static char *
+m_arena_strdup (struct m_arena *arena, const char *string)
+{
+  size_t len = 0;
+  char *copy = NULL;
+
+  if (string == NULL)
+    {
+      return NULL;
+    }
+  len = strlen (string) + 1;
+  if (arena->base != NULL)
+    {
+      copy = arena->base + arena->used;
+      memcpy (copy, string, len);
+    }
+  arena->used += len;
+
+  return copy;
+}
+
+/* copies typed fields (structured fields or format arguments) */
+static struct mondemand_log_field *
+m_arena_copy_fields (struct m_arena *arena,
+                     const struct mondemand_log_field fields[],
+                     const int count)
+{
+  struct mondemand_log_field *copy = NULL;
+  const char *key = NULL;
+  const char *value = NULL;
+  int i;
+
+  if (fields == NULL || count <= 0)
+    {
+      return NULL;
+    }
+  copy = m_arena_alloc (arena, sizeof (struct mondemand_log_field) * count);
+  for (i = 0; i < count; ++i)
+    {
+      key = m_arena_strdup (arena, fields[i].key);
+      if (fields[i].type == MONDEMAND_FIELD_STRING)
         {
-          snprintf(buffer, FILENAME_MAX*2, "%s:%d", (char *) filename, line);
-          real_key = buffer;
+          value = m_arena_strdup (arena, fields[i].value.s);
+        }
+      if (copy != NULL)
+        {
+          copy[i] = fields[i];
+          copy[i].key = key;
+          if (fields[i].type == MONDEMAND_FIELD_STRING)
+            {
+              copy[i].value.s = value;
+            }
         }
+    }
 
-      /* then get or create a stat */
-      stat =
-        (struct m_stat_message *) m_hash_table_get (client->stats, real_key);
+  return copy;
+}
 
-      if( stat == NULL )
+/* copies a job and everything it points to into an arena, the job is first
+   so freeing it frees everything */
+static struct m_job *
+mondemand_job_copy_into (struct m_arena *arena, const struct m_job *job)
+{
+  struct m_job *copy = m_arena_alloc (arena, sizeof (struct m_job));
+  struct mondemand_context *contexts = NULL;
+  void *items = NULL;
+  const char *strings[3];
+  int i;
+
+  if (job->context_count > 0)
+    {
+      contexts = m_arena_alloc (arena, sizeof (struct mondemand_context)
+                                         * job->context_count);
+      for (i = 0; i < job->context_count; ++i)
         {
-          /* create a new entry */
-          new_key = strdup (real_key);
-          stat =
-            (struct m_stat_message*)
-            m_try_malloc0( sizeof(struct m_stat_message) );
-          if( stat == NULL || new_key == NULL )
+          const char *key = m_arena_strdup (arena, job->contexts[i].key);
+          const char *value = m_arena_strdup (arena, job->contexts[i].value);
+          if (contexts != NULL)
             {
-              goto ERROR;
+              contexts[i].key = key;
+              contexts[i].value = value;
+            }
+        }
+    }
+  for (i = 0; i < 3; ++i)
+    {
+      strings[i] = m_arena_strdup (arena, job->strings[i]);
+    }
+
+  if (job->count > 0)
+    {
+      switch (job->type)
+        {
+          case M_JOB_LOGS:
+            {
+              const struct mondemand_log_message *from = job->items;
+              struct mondemand_log_message *to =
+                m_arena_alloc (arena, sizeof (*to) * job->count);
+              for (i = 0; i < job->count; ++i)
+                {
+                  struct mondemand_log_message message = from[i];
+                  message.filename = m_arena_strdup (arena, from[i].filename);
+                  message.message = m_arena_strdup (arena, from[i].message);
+                  message.fields = m_arena_copy_fields (arena, from[i].fields,
+                                                        from[i].field_count);
+                  message.format = m_arena_strdup (arena, from[i].format);
+                  message.args = m_arena_copy_fields (arena, from[i].args,
+                                                      from[i].arg_count);
+                  if (to != NULL)
+                    {
+                      to[i] = message;
+                    }
+                }
+              items = to;
+            }
+            break;
+          case M_JOB_STATS:
+            {
+              const struct mondemand_stats_message *from = job->items;
+              struct mondemand_stats_message *to =
+                m_arena_alloc (arena, sizeof (*to) * job->count);
+              for (i = 0; i < job->count; ++i)
+                {
+                  const char *key = m_arena_strdup (arena, from[i].key);
+                  if (to != NULL)
+                    {
+                      to[i] = from[i];
+                      to[i].key = key;
+                    }
+                }
+              items = to;
+            }
+            break;
+          case M_JOB_TRACE:
+            {
+              const struct mondemand_trace *from = job->items;
+              struct mondemand_trace *to =
+                m_arena_alloc (arena, sizeof (*to) * job->count);
+              for (i = 0; i < job->count; ++i)
+                {
+                  const char *key = m_arena_strdup (arena, from[i].key);
+                  const char *value = m_arena_strdup (arena, from[i].value);
+                  if (to != NULL)
+                    {
+                      to[i].key = key;
+                      to[i].value = value;
+                    }
+                }
+              items = to;
+            }
+            break;
+          case M_JOB_PERF:
+            {
+              const struct mondemand_timing *from = job->items;
+              struct mondemand_timing *to =
+                m_arena_alloc (arena, sizeof (*to) * job->count);
+              for (i = 0; i < job->count; ++i)
+                {
+                  char *label = m_arena_strdup (arena, from[i].label);
+                  if (to != NULL)
+                    {
+                      to[i] = from[i];
+                      to[i].label = label;
+                    }
+                }
+              items = to;
+            }
+            break;
+          case M_JOB_ANNOTATION:
+            {
+              const char * const *from = job->items;
+              const char **to =
+                m_arena_alloc (arena, sizeof (*to) * job->count);
+              for (i = 0; i < job->count; ++i)
+                {
+                  const char *tag = m_arena_strdup (arena, from[i]);
+                  if (to != NULL)
+                    {
+                      to[i] = tag;
+                    }
+                }
+              items = to;
             }
-          else
+            break;
+          case M_JOB_BATCH:
             {
-              /* always start with a zeroed stat */
-              stat->type = type;
-              stat->value = 0;
-              /* attempt to add to hashtable */
-              if( m_hash_table_set( client->stats, new_key, stat ) != 0 )
+              const struct m_job *from = job->items;
+              struct m_job *to =
+                m_arena_alloc (arena, sizeof (*to) * job->count);
+              for (i = 0; i < job->count; ++i)
                 {
-                  goto ERROR;
+                  struct m_job *nested =
+                    mondemand_job_copy_into (arena, &from[i]);
+                  if (to != NULL)
+                    {
+                      to[i] = *nested;
+                    }
                 }
+              items = to;
             }
+            break;
         }
+    }
 
-      /* FIXME: should I really reset the type? */
-      stat->type = type;
-      /* depending on operation change value */
-      switch (op)
+  if (copy != NULL)
+    {
+      *copy = *job;
+      copy->items = items;
+      copy->contexts = contexts;
+      for (i = 0; i < 3; ++i)
         {
-        case MONDEMAND_INC:
-          stat->value += value;
-          break;
-        case MONDEMAND_DEC:
-          stat->value -= value;
-          break;
-        case MONDEMAND_SET:
-          stat->value = value;
-          break;
+          copy->strings[i] = strings[i];
         }
     }
 
-  return 0;
-
-ERROR:
-  m_free (new_key);
-  m_free (stat);
-  return -3;
+  return copy;
 }
 
-int
-mondemand_flush_annotation (const char* id,
-                            const long long int timestamp,
-                            const char* description,
-                            const char* text,
-                            const char** tags,
-                            const int num_tags,
-                            struct mondemand_client *client)
+/* copies a job into a single allocation, measuring it first */
+static struct m_job *
+mondemand_job_copy (const struct m_job *job)
 {
-  return
-    mondemand_dispatch_annotation (id,
-                                   timestamp,
-                                   description,
-                                   text,
-                                   tags,
-                                   num_tags,
-                                   client);
-}
-
-/*========================================================================*/
-/* Private functions                                                      */
-/*========================================================================*/
+  struct m_arena arena;
 
-/* dispatches log messages to the transports */
-static int
-mondemand_dispatch_logs(struct mondemand_client *client)
-{
-  int retval = 0;
-  int i = 0;
-  struct mondemand_transport *transport = NULL;
-  const char **message_keys = NULL;
-  struct m_log_message *message = NULL;
-  struct mondemand_log_message *messages = NULL;
-  struct mondemand_context *contexts = NULL;
+  arena.base = NULL;
+  arena.used = 0;
+  mondemand_job_copy_into (&arena, job);
 
-  if( client != NULL )
+  arena.base = m_try_malloc (arena.used);
+  if (arena.base == NULL)
     {
-      if( client->messages != NULL && client->contexts != NULL )
-        {
-          /* fetch all the messages */
-          message_keys = m_hash_table_keys( client->messages );
-
-          /* allocate an array of structs */
-          messages = (struct mondemand_log_message *)
-            m_try_malloc0(sizeof(struct mondemand_log_message) *
-                          m_hash_table_num (client->messages));
-          for(i=0; i< m_hash_table_num (client->messages); ++i)
-            {
-              /* we copy the values from the hash table since we want an
-                 immutable const structure to pass to the transport */
-              message =
-                (struct m_log_message *) m_hash_table_get(client->messages,
-                                                          message_keys[i]);
-              messages[i].filename = message->filename;
-              messages[i].line = message->line;
-              messages[i].level = message->level;
-              messages[i].repeat_count = message->repeat_count;
-              messages[i].message = message->message;
-              messages[i].trace_id = message->trace_id;
-            }
-
-          contexts = context_array (client);
-
-          /* iterate through each transport */
-          for(i=0; i<client->num_transports; ++i)
-            {
-              transport = client->transports[i];
-              if( transport != NULL )
-                {
-                  if( transport->log_sender_function
-                        (client->prog_id,
-                         messages,
-                         m_hash_table_num (client->messages),
-                         contexts,
-                         m_hash_table_num (client->contexts),
-                         transport->userdata) != 0 )
-                    {
-                      retval = -1;
-                    }
-                }
-            } /* for(i=0; i<client->num_transports; ++i) */
+      return NULL;
+    }
+  arena.used = 0;
 
-          /* clean up memory */
-          m_free(messages);
-          m_free(message_keys);
-          m_free(contexts);
-        } /* if( client->messages != NULL && client->contexts != NULL ) */
-    } /* if( client != NULL ) */
+  return mondemand_job_copy_into (&arena, job);
+}
 
-  return retval;
+/* lets go of a queued copy, freeing it once no thread still needs it */
+static void
+mondemand_job_release (struct m_job *job)
+{
+  if (__atomic_sub_fetch (&job->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      m_free (job);
+    }
 }
 
-static struct mondemand_context *
-context_array (struct mondemand_client *client)
+/* starts one I/O thread, or with isolate one for each transport */
+static int
+mondemand_async_start (struct mondemand_client *client,
+                       const struct mondemand_async_options *opts,
+                       int isolate)
 {
-  const char **context_keys = NULL;
-  struct mondemand_context *contexts = NULL;
-  int num_contexts = m_hash_table_num (client->contexts);
+  struct m_async *threads = NULL;
+  struct m_async *async = NULL;
+  int queue_size = M_ASYNC_QUEUE_SIZE;
+  MondemandQueuePolicy policy = MONDEMAND_QUEUE_DROP_NEWEST;
+  int count = 1;
   int i;
 
-  /* fetch the keys to all the contexts */
-  context_keys = m_hash_table_keys( client->contexts );
+  if (opts != NULL)
+    {
+      queue_size = opts->queue_size;
+      policy = opts->policy;
+    }
+  if (client == NULL || client->async != NULL || queue_size < 1
+      || policy < MONDEMAND_QUEUE_BLOCK || policy > MONDEMAND_QUEUE_DROP_OLDEST)
+    {
+      return -2;
+    }
+  if (isolate)
+    {
+      if (client->num_transports < 1)
+        {
+          return -2;
+        }
+      count = client->num_transports;
+    }
 
-  contexts = (struct mondemand_context *)
-    m_try_malloc0(sizeof(struct mondemand_context) * num_contexts);
-  for ( i = 0; i < num_contexts; ++i)
+  threads = (struct m_async *) m_try_malloc0 (sizeof (struct m_async) * count);
+  if (threads == NULL)
+    {
+      return -3;
+    }
+  for (i = 0; i < count; ++i)
+    {
+      async = &threads[i];
+      async->client = client;
+      async->transport = isolate ? client->transports[i] : NULL;
+      async->queue = m_queue_create (queue_size);
+      if (async->queue == NULL)
+        {
+          break;
+        }
+      async->policy = policy;
+      sem_init (&async->items, 0, 0);
+      sem_init (&async->slots, 0,
+                (unsigned int) m_queue_capacity (async->queue));
+      if (pthread_create (&async->thread, NULL,
+                          mondemand_async_thread, async) != 0)
+        {
+          sem_destroy (&async->items);
+          sem_destroy (&async->slots);
+          m_queue_destroy (async->queue);
+          break;
+        }
+    }
+  if (i < count)
     {
-      /* copy the pointer to a const struct that the transport
-         can copy from */
-      contexts[i].key = context_keys[i];
-      contexts[i].value = (char *) m_hash_table_get(client->contexts,
-                                                    context_keys[i]);
+      /* stop the threads already running, nothing has been queued */
+      while (--i >= 0)
+        {
+          mondemand_async_destroy (&threads[i]);
+        }
+      m_free (threads);
+      return -3;
     }
 
-  m_free (context_keys);
+  client->async = threads;
+  client->async_count = count;
 
-  return contexts;
+  return 0;
 }
 
-/* dispatches stats to the transports */
-static int
-mondemand_dispatch_stats(struct mondemand_client *client)
+/* stops an I/O thread once everything queued has been sent */
+static void
+mondemand_async_destroy (struct m_async *async)
 {
-  int retval = 0;
-  int i=0;
-  struct mondemand_transport *transport = NULL;
-  const char **message_keys = NULL;
-  struct mondemand_stats_message *messages = NULL;
-  struct mondemand_context *contexts = NULL;
+  __atomic_store_n (&async->stopping, 1, __ATOMIC_RELEASE);
+  sem_post (&async->items);
+  pthread_join (async->thread, NULL);
 
-  if( client != NULL
-      && client->stats != NULL
-      && client->contexts != NULL )
-    {
-      /* fetch the stats */
-      message_keys = m_hash_table_keys( client->stats );
+  sem_destroy (&async->items);
+  sem_destroy (&async->slots);
+  m_queue_destroy (async->queue);
+}
 
-      /* allocate an array of structs */
-      messages = (struct mondemand_stats_message *)
-        m_try_malloc0(sizeof(struct mondemand_stats_message) *
-                      m_hash_table_num (client->stats));
+/* queues a copied job for the I/O thread, applying the full queue policy.
+   A dropped job is only counted, returning an error would make the caller
+   keep its messages for the next flush and the queue would never shed load */
+static int
+mondemand_async_push (struct m_async *async, struct m_job *job)
+{
+  struct m_job *oldest = NULL;
 
-      for (i=0; i < m_hash_table_num (client->stats); ++i)
+  if (async->policy == MONDEMAND_QUEUE_BLOCK)
+    {
+      while (sem_wait (&async->slots) != 0 && errno == EINTR)
         {
-          messages[i].key = message_keys[i];
-          struct m_stat_message *stat =
-            (struct m_stat_message *)
-              m_hash_table_get(client->stats, message_keys[i]);
-          messages[i].type = stat->type;
-          messages[i].value = stat->value;
         }
+    }
 
-      contexts = context_array (client);
-
-      /* iterate through each transport */
-      for (i=0; i<client->num_transports; ++i)
+  while (m_queue_push (async->queue, job) != 0)
+    {
+      if (async->policy == MONDEMAND_QUEUE_DROP_OLDEST)
         {
-          transport = client->transports[i];
-          if (transport != NULL)
+          oldest = m_queue_pop (async->queue);
+          if (oldest != NULL)
             {
-              if (transport->stats_sender_function
-                    (client->prog_id,
-                     messages,
-                     m_hash_table_num (client->stats),
-                     contexts,
-                     m_hash_table_num (client->contexts),
-                     transport->userdata) != 0)
-                {
-                  retval = -1;
-                }
+              mondemand_job_release (oldest);
+              __atomic_fetch_add (&async->dropped_oldest, 1,
+                                  __ATOMIC_RELAXED);
             }
         }
-
-      m_free (contexts);
-      m_free (messages);
-      m_free (message_keys);
+      else
+        {
+          mondemand_job_release (job);
+          __atomic_fetch_add (&async->dropped_newest, 1, __ATOMIC_RELAXED);
+          return 0;
+        }
     }
 
-  return retval;
+  __atomic_fetch_add (&async->queued, 1, __ATOMIC_RELAXED);
+  sem_post (&async->items);
+
+  return 0;
 }
 
-static int mondemand_dispatch_trace (struct mondemand_client *client)
+/* an I/O thread, sends queued jobs until stopped and the queue is empty */
+static void *
+mondemand_async_thread (void *arg)
 {
-  int retval = 0;
-  struct mondemand_transport *transport = NULL;
-  const char **trace_keys = NULL;
-  struct mondemand_trace *traces = NULL;
-  int i;
+  struct m_async *async = arg;
+  struct m_job *job = NULL;
+  long long latency = 0;
+  long long longest = 0;
+  int stopping = 0;
 
-  if( client != NULL )
+  while (! stopping)
     {
-      if (client->trace != NULL)
+      while (sem_wait (&async->items) != 0 && errno == EINTR)
         {
-          /* fetch the keys to all the contexts */
-          trace_keys = m_hash_table_keys (client->trace);
-
-          traces = (struct mondemand_trace *)
-            m_try_malloc0 (sizeof (struct mondemand_trace) *
-                           m_hash_table_num (client->trace));
-          for (i=0; i < m_hash_table_num (client->trace); ++i)
+        }
+      /* read the flag first, anything queued before it was set is then
+         seen by the drain below */
+      stopping = __atomic_load_n (&async->stopping, __ATOMIC_ACQUIRE);
+      while ((job = m_queue_pop (async->queue)) != NULL)
+        {
+          if (async->policy == MONDEMAND_QUEUE_BLOCK)
             {
-              /* copy the pointer to a const struct that the transport
-                 can copy from */
-              traces[i].key = trace_keys[i];
-              traces[i].value = (char *) m_hash_table_get (client->trace,
-                                                           trace_keys[i]);
+              sem_post (&async->slots);
             }
-
-          /* iterate through each transport */
-          for (i=0; i<client->num_transports; ++i)
+          if (async->transport == NULL)
             {
-              transport = client->transports[i];
-              if (transport != NULL)
-                {
-                  if (transport->trace_sender_function
-                        (client->prog_id,
-                         client->owner,
-                         client->trace_id,
-                         client->trace_message,
-                         traces,
-                         m_hash_table_num (client->trace),
-                         transport->userdata) != 0)
-                    {
-                      retval = -1;
-                    }
-                }
+              mondemand_job_run (async->client, job);
             }
-
-          m_free (traces);
-          m_free (trace_keys);
+          else if (mondemand_transport_wants (async->transport, job))
+            {
+              /* the client's encode buffer is shared, so each isolated
+                 transport sends with its own callbacks */
+              mondemand_job_isolated (async, job);
+            }
+          latency = mondemand_now_us () - job->queued_us;
+          mondemand_job_release (job);
+
+          __atomic_fetch_add (&async->latency_us_total, latency,
+                              __ATOMIC_RELAXED);
+          /* only this thread writes the maximum */
+          longest = __atomic_load_n (&async->latency_us_max,
+                                     __ATOMIC_RELAXED);
+          if (latency > longest)
+            {
+              __atomic_store_n (&async->latency_us_max, latency,
+                                __ATOMIC_RELAXED);
+            }
+          __atomic_fetch_add (&async->sent, 1, __ATOMIC_RELAXED);
         }
     }
 
-  return retval;
+  return NULL;
 }
 
-static int
-mondemand_dispatch_perf (struct mondemand_client *client)
+/* sends a job from an isolated thread to its transport, which is at the
+   same index as the thread */
+static void
+mondemand_job_isolated (struct m_async *async, const struct m_job *job)
 {
-  int retval = 0;
-  int i = 0;
-  struct mondemand_transport *transport = NULL;
-  struct mondemand_context *contexts = NULL;
+  struct mondemand_client *client = async->client;
+  long long start = 0;
 
-  if ( client != NULL
-       && client->perf_id != NULL
-       && client->perf_caller_label != NULL
-       && client->timings != NULL
-       && client->num_timings > 0
-       && client->contexts != NULL )
+  if (client->internal != NULL)
     {
-      contexts = context_array (client);
-      /* iterate through each transport */
-      for(i=0; i<client->num_transports; ++i)
-        {
-          transport = client->transports[i];
-          if( transport != NULL )
-            {
-              if ( transport->perf_sender_function
-                     (client->perf_id,
-                      client->perf_caller_label,
-                      client->timings,
-                      client->num_timings,
-                      contexts,
-                      m_hash_table_num (client->contexts),
-                      transport->userdata)
-                   != 0 )
-                {
-                  retval = -1;
-                }
-            }
-        } /* for(i=0; i<client->num_transports; ++i) */
-      m_free (contexts);
+      start = mondemand_now_ns ();
+    }
+  mondemand_job_send_to (client, (int) (async - client->async), job,
+                         NULL, 0);
+  if (job->type != M_JOB_BATCH)
+    {
+      M_INTERNAL_ADD (client, flush_ns[job->type],
+                      mondemand_now_ns () - start);
     }
+}
 
-  return retval;
+/* reads the counters of one I/O thread */
+static void
+mondemand_async_read (struct m_async *async,
+                      struct mondemand_async_stats *stats)
+{
+  stats->queued = __atomic_load_n (&async->queued, __ATOMIC_RELAXED);
+  stats->sent = __atomic_load_n (&async->sent, __ATOMIC_RELAXED);
+  stats->dropped_newest = __atomic_load_n (&async->dropped_newest,
+                                           __ATOMIC_RELAXED);
+  stats->dropped_oldest = __atomic_load_n (&async->dropped_oldest,
+                                           __ATOMIC_RELAXED);
+  stats->latency_us_total = __atomic_load_n (&async->latency_us_total,
+                                             __ATOMIC_RELAXED);
+  stats->latency_us_max = __atomic_load_n (&async->latency_us_max,
+                                           __ATOMIC_RELAXED);
+  stats->depth = m_queue_depth (async->queue);
 }
 
-static int
-mondemand_dispatch_annotation (const char* id,
-                               const long long int timestamp,
-                               const char* description,
-                               const char* text,
-                               const char** tags,
-                               const int num_tags,
-                               struct mondemand_client *client)
+/* stops the I/O threads once everything queued has been sent */
+static void
+mondemand_async_stop (struct mondemand_client *client)
 {
-  int retval = 0;
-  struct mondemand_transport *transport = NULL;
+  int i;
 
-  if( client != NULL )
+  if (client->async != NULL)
     {
-      if ( id != NULL
-           && timestamp > 0
-           && description != NULL )
-        {
-          int i;
-          struct mondemand_context *contexts = NULL;
-          contexts = context_array (client);
-          /* iterate through each transport */
-          for (i=0; i<client->num_transports; ++i)
-            {
-              transport = client->transports[i];
-              if (transport != NULL)
-                {
-                  if (transport->annotation_sender_function
-                        (id,
-                         timestamp,
-                         description,
-                         text,
-                         tags,
-                         num_tags,
-                         contexts,
-                         m_hash_table_num (client->contexts),
-                         transport->userdata)
-                      != 0)
-                    {
-                      retval = -1;
-                    }
-                }
-            } /* for(i=0; i<client->num_transports; ++i) */
-          m_free (contexts);
-        }
-      else
+      for (i = 0; i < client->async_count; ++i)
         {
-          retval = -2;
+          mondemand_async_destroy (&client->async[i]);
         }
+      m_free (client->async);
+      client->async = NULL;
+      client->async_count = 0;
     }
-
-  return retval;
 }
-
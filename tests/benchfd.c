@@ -0,0 +1,133 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mondemandlib.h"
+
+/* writes stats lines to /dev/null, formatting them the way the stderr
+   transport used to with an unbuffered fprintf per fragment, and with the
+   file descriptor transport in line and block modes, and reports the time
+   per line and throughput of each */
+
+#define STATS 100
+#define FLUSHES 2000
+
+static double
+elapsed (const struct timespec *start)
+{
+  struct timespec end;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  return (double) (end.tv_sec - start->tv_sec) * 1e9
+         + (double) (end.tv_nsec - start->tv_nsec);
+}
+
+static void
+report (const char *name, double ns, long long bytes)
+{
+  printf ("%-8s %8.1f ns/line %8.1f MB/s\n", name,
+          ns / ((double) STATS * FLUSHES),
+          (double) bytes / (ns / 1e9) / (1024.0 * 1024.0));
+}
+
+/* the old stderr stats sender, one write per fprintf */
+static long long
+unbuffered (FILE *out)
+{
+  struct timespec start;
+  char key[32];
+  long long bytes = 0;
+  int f, i;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (f = 0; f < FLUSHES; ++f)
+    {
+      for (i = 0; i < STATS; ++i)
+        {
+          snprintf (key, sizeof (key), "bench.stat.%d", i);
+          bytes += fprintf (out, "[%s]", "bench");
+          bytes += fprintf (out, " %s : %s : %lld", "counter", key,
+                            (long long) i);
+          bytes += fprintf (out, " : %s=%s", "host", "bench");
+          bytes += fprintf (out, "\n");
+        }
+    }
+  report ("fprintf", elapsed (&start), bytes);
+
+  return bytes;
+}
+
+static void
+run (const char *name, int fd, MondemandFdMode mode, long long bytes)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct timespec start;
+  char key[32];
+  int f, i;
+
+  client = mondemand_client_create ("bench");
+  assert (client != NULL);
+  transport = mondemand_transport_fd_create (fd, mode, 0);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "bench") == 0);
+  for (i = 0; i < STATS; ++i)
+    {
+      snprintf (key, sizeof (key), "bench.stat.%d", i);
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_SET, MONDEMAND_COUNTER,
+                                          key, i) == 0);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (f = 0; f < FLUSHES; ++f)
+    {
+      mondemand_flush_stats (client);
+    }
+  report (name, elapsed (&start), bytes);
+
+  mondemand_client_destroy (client);
+}
+
+int
+main (void)
+{
+  FILE *out = NULL;
+  long long bytes = 0;
+  int fd = open ("/dev/null", O_WRONLY);
+
+  assert (fd >= 0);
+  out = fdopen (dup (fd), "w");
+  assert (out != NULL);
+  setvbuf (out, NULL, _IONBF, 0);
+
+  printf ("%d flushes of %d stats lines to /dev/null\n", FLUSHES, STATS);
+  bytes = unbuffered (out);
+  run ("line", fd, MONDEMAND_FD_LINE, bytes);
+  run ("block", fd, MONDEMAND_FD_BLOCK, bytes);
+
+  fclose (out);
+  close (fd);
+
+  return 0;
+}
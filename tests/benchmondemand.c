@@ -0,0 +1,396 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "m_mem.h"
+#include "mondemandlib.h"
+
+/* times the library's own work, with transports that send nothing, and
+   reports the time and number of allocations each operation takes.
+   Allocations are the ones made through m_mem, the few strdup calls for
+   contexts and trace ids aren't counted.  Run with --json for output to
+   keep and compare between versions */
+
+struct result
+{
+  const char *name;
+  long long ops;
+  double ns;
+  unsigned long long allocations;
+};
+
+static struct result results[32];
+static int result_count = 0;
+static struct timespec start;
+static unsigned long long start_allocations = 0;
+
+static void
+begin (void)
+{
+  start_allocations = m_mem_allocations ();
+  clock_gettime (CLOCK_MONOTONIC, &start);
+}
+
+static void
+end (const char *name, long long ops)
+{
+  struct timespec now;
+  struct result *result = &results[result_count++];
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (result_count <= (int) (sizeof (results) / sizeof (results[0])));
+  result->name = name;
+  result->ops = ops;
+  result->ns = (double) (now.tv_sec - start.tv_sec) * 1e9
+               + (double) (now.tv_nsec - start.tv_nsec);
+  result->allocations = m_mem_allocations () - start_allocations;
+}
+
+/* a transport which takes everything and does nothing with it */
+static int
+null_log_sender (const char *program_identifier,
+                 const struct mondemand_log_message messages[],
+                 const int message_count,
+                 const struct mondemand_context contexts[],
+                 const int context_count,
+                 void *userdata)
+{
+  (void) program_identifier;
+  (void) messages;
+  (void) message_count;
+  (void) contexts;
+  (void) context_count;
+  (void) userdata;
+  return 0;
+}
+
+static int
+null_stats_sender (const char *program_identifier,
+                   const struct mondemand_stats_message messages[],
+                   const int message_count,
+                   const struct mondemand_context contexts[],
+                   const int context_count,
+                   void *userdata)
+{
+  (void) program_identifier;
+  (void) messages;
+  (void) message_count;
+  (void) contexts;
+  (void) context_count;
+  (void) userdata;
+  return 0;
+}
+
+static int
+null_trace_sender (const char *program_identifier,
+                   const char *owner,
+                   const char *trace_id,
+                   const char *message,
+                   const struct mondemand_trace traces[],
+                   const int trace_count,
+                   void *userdata)
+{
+  (void) program_identifier;
+  (void) owner;
+  (void) trace_id;
+  (void) message;
+  (void) traces;
+  (void) trace_count;
+  (void) userdata;
+  return 0;
+}
+
+static int
+null_perf_sender (const char *id,
+                  const char *caller_label,
+                  const struct mondemand_timing timings[],
+                  const int timings_count,
+                  const struct mondemand_context contexts[],
+                  const int context_count,
+                  void *userdata)
+{
+  (void) id;
+  (void) caller_label;
+  (void) timings;
+  (void) timings_count;
+  (void) contexts;
+  (void) context_count;
+  (void) userdata;
+  return 0;
+}
+
+static int
+null_annotation_sender (const char *id,
+                        const long long int timestamp,
+                        const char *description,
+                        const char *text,
+                        const char *tags[],
+                        const int tag_count,
+                        const struct mondemand_context contexts[],
+                        const int context_count,
+                        void *userdata)
+{
+  (void) id;
+  (void) timestamp;
+  (void) description;
+  (void) text;
+  (void) tags;
+  (void) tag_count;
+  (void) contexts;
+  (void) context_count;
+  (void) userdata;
+  return 0;
+}
+
+/* for the encoded transport, the bytes are dropped */
+static int
+null_bytes_sender (const unsigned char *bytes, const size_t length,
+                   void *userdata)
+{
+  (void) bytes;
+  (void) length;
+  (void) userdata;
+  return 0;
+}
+
+static struct mondemand_transport null_transport;
+static struct mondemand_transport encoded_transport;
+
+static void
+make_transports (void)
+{
+  mondemand_transport_init (&null_transport, MONDEMAND_TRANSPORT_VERSION);
+  null_transport.log_sender_function = &null_log_sender;
+  null_transport.stats_sender_function = &null_stats_sender;
+  null_transport.trace_sender_function = &null_trace_sender;
+  null_transport.perf_sender_function = &null_perf_sender;
+  null_transport.annotation_sender_function = &null_annotation_sender;
+  null_transport.capabilities = MONDEMAND_TRANSPORT_ALL;
+
+  /* the same, but flushes are encoded as lwes events first */
+  encoded_transport = null_transport;
+  encoded_transport.encoding = &mondemand_encoding_lwes;
+  encoded_transport.bytes_sender_function = &null_bytes_sender;
+}
+
+static struct mondemand_client *
+client_with (struct mondemand_transport *transport)
+{
+  struct mondemand_client *client = mondemand_client_create ("bench");
+
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "bench") == 0);
+  return client;
+}
+
+static void
+fill (struct mondemand_client *client, int stats)
+{
+  char key[32];
+  int i;
+
+  for (i = 0; i < stats; ++i)
+    {
+      snprintf (key, sizeof (key), "bench.stat.%d", i);
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_INC, MONDEMAND_COUNTER,
+                                          key, i + 1) == 0);
+    }
+}
+
+static void
+bench_increment (void)
+{
+  struct mondemand_client *client = client_with (&null_transport);
+  long long i;
+  long long n = 1000000;
+
+  begin ();
+  for (i = 0; i < n; ++i)
+    {
+      mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                  MONDEMAND_INC, MONDEMAND_COUNTER,
+                                  "bench.key", 1);
+    }
+  end ("increment_key", n);
+
+  /* no key, the file and line name the counter */
+  begin ();
+  for (i = 0; i < n; ++i)
+    {
+      mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                  MONDEMAND_INC, MONDEMAND_COUNTER,
+                                  NULL, 1);
+    }
+  end ("increment_call_site", n);
+
+  mondemand_client_destroy (client);
+}
+
+static void
+bench_log (void)
+{
+  struct mondemand_client *client = client_with (&null_transport);
+  long long i;
+  long long n;
+
+  /* below the no send level */
+  mondemand_set_no_send_level (client, M_LOG_ERR);
+  n = 1000000;
+  begin ();
+  for (i = 0; i < n; ++i)
+    {
+      mondemand_log_real (client, __FILE__, __LINE__, M_LOG_DEBUG,
+                          MONDEMAND_NULL_TRACE_ID, "bench %lld", i);
+    }
+  end ("log_disabled", n);
+
+  /* held back for the next flush, repeats only bump a count */
+  mondemand_set_no_send_level (client, M_LOG_ALL);
+  mondemand_set_immediate_send_level (client, M_LOG_EMERG);
+  n = 1000000;
+  begin ();
+  for (i = 0; i < n; ++i)
+    {
+      mondemand_log_real (client, __FILE__, __LINE__, M_LOG_INFO,
+                          MONDEMAND_NULL_TRACE_ID, "bench %lld", i);
+    }
+  mondemand_flush_logs (client);
+  end ("log_buffered", n);
+
+  /* each one sent as it's logged */
+  mondemand_set_immediate_send_level (client, M_LOG_ERR);
+  n = 100000;
+  begin ();
+  for (i = 0; i < n; ++i)
+    {
+      mondemand_log_real (client, __FILE__, __LINE__, M_LOG_ERR,
+                          MONDEMAND_NULL_TRACE_ID, "bench %lld", i);
+    }
+  end ("log_immediate", n);
+
+  mondemand_client_destroy (client);
+}
+
+static void
+bench_flush (const char *name, struct mondemand_transport *transport,
+             int stats, int contexts, long long n)
+{
+  struct mondemand_client *client = client_with (transport);
+  char key[32];
+  long long i;
+
+  for (i = 0; i < contexts; ++i)
+    {
+      snprintf (key, sizeof (key), "context.%lld", i);
+      assert (mondemand_set_context (client, key, "bench-context-value")
+                == 0);
+    }
+  fill (client, stats);
+
+  begin ();
+  for (i = 0; i < n; ++i)
+    {
+      mondemand_flush_stats (client);
+    }
+  end (name, n);
+
+  mondemand_client_destroy (client);
+}
+
+static void
+bench_annotation (void)
+{
+  struct mondemand_client *client = client_with (&null_transport);
+  const char *tags[] = { "deploy", "bench" };
+  long long i;
+  long long n = 100000;
+
+  begin ();
+  for (i = 0; i < n; ++i)
+    {
+      mondemand_flush_annotation ("bench", 1234567, "something happened",
+                                  "with details here", tags, 2, client);
+    }
+  end ("annotation", n);
+
+  mondemand_client_destroy (client);
+}
+
+static void
+print_text (void)
+{
+  int i;
+
+  for (i = 0; i < result_count; ++i)
+    {
+      printf ("%-22s %10lld ops %12.1f ns/op %8.2f allocs/op\n",
+              results[i].name, results[i].ops,
+              results[i].ns / (double) results[i].ops,
+              (double) results[i].allocations / (double) results[i].ops);
+    }
+}
+
+static void
+print_json (void)
+{
+  int i;
+
+  printf ("{\"benchmarks\":[");
+  for (i = 0; i < result_count; ++i)
+    {
+      printf ("%s\n  {\"name\":\"%s\",\"ops\":%lld,\"ns_per_op\":%.1f,"
+              "\"allocs_per_op\":%.2f}", i > 0 ? "," : "",
+              results[i].name, results[i].ops,
+              results[i].ns / (double) results[i].ops,
+              (double) results[i].allocations / (double) results[i].ops);
+    }
+  printf ("\n]}\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  int json = (argc > 1 && strcmp (argv[1], "--json") == 0);
+
+  make_transports ();
+  m_mem_count_allocations (1);
+
+  bench_increment ();
+  bench_log ();
+  bench_flush ("flush_10", &null_transport, 10, 0, 100000);
+  bench_flush ("flush_1k", &null_transport, 1000, 0, 1000);
+  bench_flush ("flush_100k", &null_transport, 100000, 0, 3);
+  bench_flush ("flush_10_64_contexts", &null_transport, 10, 64, 100000);
+  bench_annotation ();
+  bench_flush ("encode_lwes_1k", &encoded_transport, 1000, 1, 20);
+
+  if (json)
+    {
+      print_json ();
+    }
+  else
+    {
+      print_text ();
+    }
+
+  return 0;
+}
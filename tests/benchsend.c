@@ -0,0 +1,192 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "mondemandlib.h"
+
+/* flushes a stats set over loopback, through the lwes transport and
+   native transports sending each datagram with sendto, with sendmmsg and,
+   when built in, with io_uring, and reports the system calls and time
+   each flush takes.  The stats fit in a single 64K lwes event, the native
+   transports split them into MTU sized datagrams.  A thread reads the port
+   the whole time, so the datagrams are delivered to a socket, and what it
+   received is reported next to what was sent */
+
+#define STATS 1000
+#define FLUSHES 200
+#define PORT 20590
+
+static int receiver_fd = -1;
+static long long received = 0;
+static long long received_bytes = 0;
+
+/* counts what arrives on the port until the socket is shut down */
+static void *
+receive (void *arg)
+{
+  static char datagram[65536];
+  ssize_t n;
+
+  (void) arg;
+  while ((n = recv (receiver_fd, datagram, sizeof (datagram), 0)) > 0)
+    {
+      __atomic_fetch_add (&received, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add (&received_bytes, (long long) n, __ATOMIC_RELAXED);
+    }
+  return NULL;
+}
+
+/* waits until nothing more has arrived for 50ms */
+static void
+settle (void)
+{
+  long long last = -1;
+  long long now = 0;
+
+  while ((now = __atomic_load_n (&received, __ATOMIC_RELAXED)) != last)
+    {
+      last = now;
+      usleep (50000);
+    }
+}
+
+static void
+run (const char *name, struct mondemand_transport *transport, int native)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_native_stats stats;
+  struct timespec start, end;
+  char key[32];
+  double ns = 0.0;
+  long long before = 0;
+  int i;
+
+  assert (transport != NULL);
+  client = mondemand_client_create ("bench");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "bench") == 0);
+  for (i = 0; i < STATS; ++i)
+    {
+      snprintf (key, sizeof (key), "bench.stat.%d", i);
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_INC, MONDEMAND_COUNTER,
+                                          key, i) == 0);
+    }
+
+  settle ();
+  before = __atomic_load_n (&received, __ATOMIC_RELAXED);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < FLUSHES; ++i)
+    {
+      mondemand_flush_stats (client);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  ns = (double) (end.tv_sec - start.tv_sec) * 1e9
+       + (double) (end.tv_nsec - start.tv_nsec);
+  settle ();
+
+  if (native)
+    {
+      assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                         &stats) == 0);
+      printf ("%-8s %6.1f datagrams/flush %6.1f syscalls/flush "
+              "%9.1f us/flush %6.1f received/flush\n", name,
+              (double) stats.datagrams / (double) stats.flushes,
+              (double) stats.syscalls / (double) stats.flushes,
+              ns / 1000.0 / FLUSHES,
+              (double) (__atomic_load_n (&received, __ATOMIC_RELAXED)
+                        - before) / FLUSHES);
+    }
+  else
+    {
+      /* liblwes emits each flush as one event with one sendto */
+      printf ("%-8s %6.1f datagrams/flush %6.1f syscalls/flush "
+              "%9.1f us/flush %6.1f received/flush\n", name, 1.0, 1.0,
+              ns / 1000.0 / FLUSHES,
+              (double) (__atomic_load_n (&received, __ATOMIC_RELAXED)
+                        - before) / FLUSHES);
+    }
+
+  mondemand_client_destroy (client);
+}
+
+static struct mondemand_transport *
+native (int batch, int uring)
+{
+  struct mondemand_native_options opts;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.ttl = 3;
+  opts.max_datagram = 1472;
+  opts.batch = batch;
+  opts.uring = uring;
+
+  return mondemand_transport_lwes_native_create_with_options
+           ("127.0.0.1", PORT, NULL, &opts);
+}
+
+int
+main (void)
+{
+  struct mondemand_transport *uring = NULL;
+  struct sockaddr_in address;
+  pthread_t thread;
+  int size = 8 << 20;
+
+  receiver_fd = socket (AF_INET, SOCK_DGRAM, 0);
+  assert (receiver_fd >= 0);
+  /* a large buffer so the reader keeping up matters less than the sends */
+  setsockopt (receiver_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+  memset (&address, 0, sizeof (address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons (PORT);
+  address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  assert (bind (receiver_fd, (struct sockaddr *) &address,
+                sizeof (address)) == 0);
+  assert (pthread_create (&thread, NULL, receive, NULL) == 0);
+
+  printf ("%d stats, %d flushes, native datagrams of up to 1472 bytes\n",
+          STATS, FLUSHES);
+  run ("lwes", mondemand_transport_lwes_create ("127.0.0.1", PORT,
+                                                NULL, 0, 60), 0);
+  run ("sendto", native (1, 0), 1);
+  run ("sendmmsg", native (0, 0), 1);
+  uring = native (0, 1);
+  if (uring != NULL)
+    {
+      run ("io_uring", uring, 1);
+    }
+  else
+    {
+      printf ("io_uring not built in\n");
+    }
+
+  shutdown (receiver_fd, SHUT_RDWR);
+  pthread_join (thread, NULL);
+  close (receiver_fd);
+
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "mondemandlib.h"
+
+/* flushes a stats set through statsd transports to a local udp sink,
+   which reads every datagram back, and reports the lines sent per second
+   and how many fit in a datagram */
+
+#define STATS 1000
+#define FLUSHES 200
+
+static int sink = -1;
+
+/* reads whatever has arrived, counting lines */
+static long long
+drain (void)
+{
+  char datagram[65536];
+  long long lines = 0;
+  ssize_t n;
+  ssize_t i;
+
+  while ((n = recv (sink, datagram, sizeof (datagram), MSG_DONTWAIT)) > 0)
+    {
+      lines++;
+      for (i = 0; i < n; ++i)
+        {
+          lines += (datagram[i] == '\n');
+        }
+    }
+  return lines;
+}
+
+static void
+run (const char *name, int port, int plain, int max_datagram)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_statsd_options opts;
+  struct mondemand_native_stats stats;
+  struct timespec start, end;
+  long long lines = 0;
+  char key[32];
+  double ns = 0.0;
+  int i;
+  int j;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.plain = plain;
+  opts.max_datagram = max_datagram;
+  transport = mondemand_transport_statsd_create ("127.0.0.1", port, &opts);
+  assert (transport != NULL);
+  client = mondemand_client_create ("bench");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "bench") == 0);
+  assert (mondemand_set_context (client, "dc", "local") == 0);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < FLUSHES; ++i)
+    {
+      /* every counter changes, so every flush sends every line */
+      for (j = 0; j < STATS; ++j)
+        {
+          snprintf (key, sizeof (key), "bench.stat.%d", j);
+          mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      key, j + 1);
+        }
+      mondemand_flush_stats (client);
+      lines += drain ();
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  ns = (double) (end.tv_sec - start.tv_sec) * 1e9
+       + (double) (end.tv_nsec - start.tv_nsec);
+
+  assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                     &stats) == 0);
+  printf ("%-16s %10.0f lines/s %6.1f lines/datagram %5.1f%% received\n",
+          name, (double) STATS * FLUSHES / (ns / 1e9),
+          (double) STATS * FLUSHES / (double) stats.datagrams,
+          100.0 * (double) lines / ((double) STATS * FLUSHES));
+
+  mondemand_client_destroy (client);
+}
+
+int
+main (void)
+{
+  struct sockaddr_in in;
+  socklen_t length = sizeof (in);
+  int size = 8 * 1024 * 1024;
+
+  sink = socket (AF_INET, SOCK_DGRAM, 0);
+  assert (sink >= 0);
+  setsockopt (sink, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+  memset (&in, 0, sizeof (in));
+  in.sin_family = AF_INET;
+  in.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  assert (bind (sink, (struct sockaddr *) &in, sizeof (in)) == 0);
+  assert (getsockname (sink, (struct sockaddr *) &in, &length) == 0);
+
+  printf ("%d stats, %d flushes, incrementing each stat every flush\n",
+          STATS, FLUSHES);
+  run ("statsd", ntohs (in.sin_port), 1, 0);
+  run ("dogstatsd", ntohs (in.sin_port), 0, 0);
+  run ("dogstatsd 8932", ntohs (in.sin_port), 0, 8932);
+
+  close (sink);
+  return 0;
+}
@@ -0,0 +1,74 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m_buffer.h"
+
+int
+main (void)
+{
+  struct m_buffer buffer;
+  char expected[2048];
+  char *data = NULL;
+  int i;
+
+  memset (&buffer, 0, sizeof (buffer));
+
+  m_buffer_printf (&buffer, "[%s] %d", "prog", 42);
+  m_buffer_append (&buffer, " : ", 3);
+  m_buffer_printf (&buffer, "%lld\n", 1234567890123LL);
+  assert (buffer.length == strlen ("[prog] 42 : 1234567890123\n"));
+  assert (memcmp (buffer.data, "[prog] 42 : 1234567890123\n",
+                  buffer.length) == 0);
+
+  /* text bigger than the buffer grows it */
+  memset (expected, 'x', sizeof (expected) - 1);
+  expected[sizeof (expected) - 1] = '\0';
+  m_buffer_clear (&buffer);
+  m_buffer_printf (&buffer, "%s%s", expected, "!");
+  assert (buffer.length == sizeof (expected));
+  assert (buffer.data[buffer.length - 1] == '!');
+  assert (buffer.size >= buffer.length);
+
+  /* clearing keeps the memory for the next round */
+  data = buffer.data;
+  m_buffer_clear (&buffer);
+  assert (buffer.length == 0 && buffer.data == data);
+  for (i = 0; i < 100; ++i)
+    {
+      m_buffer_printf (&buffer, "line %d\n", i);
+    }
+  assert (buffer.data == data);
+  assert (memcmp (buffer.data + buffer.length - 8, "line 99\n", 8) == 0);
+
+  /* an impossible size fails the buffer until it's cleared */
+  assert (m_buffer_reserve (&buffer, (size_t) -1) == -1);
+  assert (buffer.failed);
+  i = (int) buffer.length;
+  m_buffer_printf (&buffer, "ignored");
+  assert ((int) buffer.length == i);
+  m_buffer_clear (&buffer);
+  m_buffer_printf (&buffer, "ok");
+  assert (buffer.length == 2 && ! buffer.failed);
+
+  m_buffer_free (&buffer);
+  assert (buffer.data == NULL && buffer.size == 0);
+
+  return 0;
+}
@@ -0,0 +1,130 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m_format.h"
+
+static struct mondemand_log_field values[M_FORMAT_MAX_ARGS];
+
+/* captures the arguments for a format, returning the count */
+static int
+capture (const char *format, ...)
+{
+  va_list args;
+  int count;
+
+  va_start (args, format);
+  count = m_format_capture (format, &args, values, M_FORMAT_MAX_ARGS);
+  va_end (args);
+
+  return count;
+}
+
+/* checks that capturing and rendering gives the same text as printf */
+static void
+round_trip (const char *format, ...)
+{
+  va_list args;
+  va_list copy;
+  char expected[256];
+  char actual[256];
+  int count;
+
+  va_start (args, format);
+  va_copy (copy, args);
+  vsnprintf (expected, sizeof (expected), format, args);
+  count = m_format_capture (format, &copy, values, M_FORMAT_MAX_ARGS);
+  va_end (copy);
+  va_end (args);
+
+  assert (count >= 0);
+  assert (m_format_render (format, values, count,
+                           actual, sizeof (actual)) == 0);
+  if (strcmp (expected, actual) != 0)
+    {
+      fprintf (stderr, "'%s' != '%s'\n", expected, actual);
+      assert (0);
+    }
+}
+
+int
+main (void)
+{
+  MondemandFieldType types[M_FORMAT_MAX_ARGS];
+  char buffer[16];
+  short s = -3;
+  int x = 5;
+
+  round_trip ("no arguments");
+  round_trip ("100%% done");
+  round_trip ("%d %i %5d %-5d| %+d %05d", 1, -2, 3, 4, 5, -6);
+  round_trip ("%hhd %hd %ld %lld %zu %jd", (char) -1, s, -7L,
+              -1234567890123LL, (size_t) 42, (long long) -9);
+  round_trip ("%u %o %x %X %#x %hhu %hu %lu %llu", 4000000000U, 8, 255, 255,
+              255, (unsigned char) 200, (unsigned short) 65000, 123UL,
+              18446744073709551615ULL);
+  round_trip ("%c%c %p", 'o', 'k', (void *) &x);
+  round_trip ("%f %.2f %e %g %10.3g %a %Lf", 1.5, 3.14159, 12345.678, 0.0001,
+              2.0 / 3.0, 1.0, (long double) 2.5);
+  round_trip ("[%s] [%10s] [%-4s] [%.2s] [%s]", "str", "right", "l",
+              "truncated", (char *) NULL);
+  round_trip ("%s:%d %s=%f", __FILE__, __LINE__, "ratio", 0.25);
+
+  /* types are reported in order */
+  assert (m_format_arg_types ("%s %d %f %c", types, M_FORMAT_MAX_ARGS) == 4);
+  assert (types[0] == MONDEMAND_FIELD_STRING);
+  assert (types[1] == MONDEMAND_FIELD_INT64);
+  assert (types[2] == MONDEMAND_FIELD_DOUBLE);
+  assert (types[3] == MONDEMAND_FIELD_INT64);
+  assert (m_format_arg_types ("%d %d", types, 1) == -1);
+
+  /* unsupported formats aren't captured */
+  assert (capture ("%*d", 5, 1) == -1);
+  assert (capture ("%1$d", 1) == -1);
+  assert (capture ("%n", &x) == -1);
+  assert (capture ("%ls", L"wide") == -1);
+  assert (capture ("trailing %") == -1);
+  assert (capture ("%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d",
+                   1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                   11, 12, 13, 14, 15, 16, 17) == -1);
+
+  /* values which don't match the format are refused */
+  assert (capture ("%d %s", 1, "a") == 2);
+  assert (m_format_render ("%s %s", values, 2, buffer, sizeof (buffer)) == -1);
+  assert (m_format_render ("%d", values, 2, buffer, sizeof (buffer)) == -1);
+  assert (m_format_render ("%d %s %d", values, 2,
+                           buffer, sizeof (buffer)) == -1);
+
+  /* output is truncated but terminated */
+  assert (capture ("%s and %d more", "a long string", 12345) == 2);
+  assert (m_format_render ("%s and %d more", values, 2,
+                           buffer, sizeof (buffer)) == 0);
+  assert (strcmp (buffer, "a long string a") == 0);
+  assert (m_format_render ("%s and %d more", values, 2, buffer, 1) == 0);
+  assert (buffer[0] == '\0');
+
+  /* ids are stable and depend on filename, line and format */
+  assert (m_format_id ("a.c", 1, "%d") == m_format_id ("a.c", 1, "%d"));
+  assert (m_format_id ("a.c", 1, "%d") != m_format_id ("a.c", 2, "%d"));
+  assert (m_format_id ("a.c", 1, "%d") != m_format_id ("b.c", 1, "%d"));
+  assert (m_format_id ("a.c", 1, "%d") != m_format_id ("a.c", 1, "%u"));
+
+  return 0;
+}
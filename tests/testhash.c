@@ -37,11 +37,19 @@ static void *my_malloc(size_t size)
 #include "m_hash.c"
 #undef m_try_malloc0
 
+/* counts entries seen by m_hash_table_foreach */
+static void count_entry(const char *key, void *value, void *data)
+{
+  assert( key != NULL && value != NULL );
+  ++*(int *) data;
+}
+
 int
 main(void)
 {
   struct m_hash_table *hash_table;
   int i = 0;
+  int count = 0;
   char *key = NULL;
   char *value = NULL;
   char *test_value = NULL;
@@ -163,6 +171,17 @@ main(void)
   free(keys);
   assert( m_hash_table_num (hash_table) == 1000);
 
+  /* 1000 entries in fewer buckets share some of them */
+  assert( m_hash_table_longest_chain (NULL) == 0 );
+  assert( m_hash_table_longest_chain (hash_table) > 1 );
+  assert( m_hash_table_longest_chain (hash_table) <= 1000 );
+
+  /* visit every entry without allocating */
+  count = 0;
+  m_hash_table_foreach(NULL, &count_entry, &count);
+  m_hash_table_foreach(hash_table, &count_entry, &count);
+  assert( count == 1000 );
+
   /* start a little higher so the bucket search finds nothing */
   for( i=1010; i>=0; --i )
   {
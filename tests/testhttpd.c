@@ -0,0 +1,177 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "m_httpd.h"
+#include "mondemandlib.h"
+
+static char response[8192];
+static int calls = 0;
+
+static int
+handler (const char *path, struct m_buffer *body,
+         const char **content_type, void *data)
+{
+  assert (data == &calls);
+  ++calls;
+  if (strcmp (path, "/hello") == 0)
+    {
+      *content_type = "text/x-test";
+      m_buffer_printf (body, "hello %d\n", calls);
+      return 200;
+    }
+  return 404;
+}
+
+/* sends request to the server and reads the whole response */
+static const char *
+fetch (int port, const char *request)
+{
+  struct sockaddr_in address;
+  size_t used = 0;
+  ssize_t n;
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+
+  assert (fd >= 0);
+  memset (&address, 0, sizeof (address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons ((unsigned short) port);
+  address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  assert (connect (fd, (struct sockaddr *) &address, sizeof (address)) == 0);
+  assert (write (fd, request, strlen (request)) == (ssize_t) strlen (request));
+  while ((n = read (fd, response + used, sizeof (response) - 1 - used)) > 0)
+    {
+      used += (size_t) n;
+    }
+  response[used] = '\0';
+  close (fd);
+  return response;
+}
+
+/* keys which sanitize to the same metric name are served as distinct
+   series, named the same way on every scrape */
+static void
+prometheus_names (void)
+{
+  struct mondemand_client *client = NULL;
+  const char *keys[] = { "a.b", "a_b", "a_b_2", "a-b" };
+  const char *r = NULL;
+  char request[64];
+  int port;
+  int i;
+
+  client = mondemand_client_create ("app");
+  assert (client != NULL);
+  for (i = 0; i < 4; ++i)
+    {
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_SET, MONDEMAND_GAUGE,
+                                          keys[i], i + 1) == 0);
+    }
+  assert (mondemand_prometheus_start (client, "127.0.0.1:0") == 0);
+  port = mondemand_prometheus_port (client);
+  snprintf (request, sizeof (request), "GET /metrics HTTP/1.1\r\n\r\n");
+  for (i = 0; i < 2; ++i)
+    {
+      r = fetch (port, request);
+      assert (strncmp (r, "HTTP/1.1 200 OK\r\n", 17) == 0);
+      assert (strstr (r, "\na_b{prog_id=\"app\"} 1\n") != NULL);
+      assert (strstr (r, "\na_b_2{prog_id=\"app\"} 2\n") != NULL);
+      assert (strstr (r, "\na_b_2_2{prog_id=\"app\"} 3\n") != NULL);
+      assert (strstr (r, "\na_b_3{prog_id=\"app\"} 4\n") != NULL);
+      assert (strstr (r, "# TYPE a_b_3 gauge\n") != NULL);
+    }
+
+  /* a stat added later is named after the ones already served */
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_SET, MONDEMAND_GAUGE,
+                                      "a b", 5) == 0);
+  r = fetch (port, request);
+  assert (strstr (r, "\na_b_4{prog_id=\"app\"} 5\n") != NULL);
+  assert (strstr (r, "\na_b{prog_id=\"app\"} 1\n") != NULL);
+
+  mondemand_client_destroy (client);
+}
+
+int
+main (void)
+{
+  struct m_httpd *httpd = NULL;
+  const char *r = NULL;
+  char big[M_HTTPD_REQUEST_MAX + 1];
+  int port;
+
+  /* bad addresses */
+  assert (m_httpd_create (NULL, handler, &calls) == NULL);
+  assert (m_httpd_create ("127.0.0.1:0", NULL, &calls) == NULL);
+  assert (m_httpd_create ("127.0.0.1", handler, &calls) == NULL);
+  assert (m_httpd_create (":80", handler, &calls) == NULL);
+  assert (m_httpd_create ("127.0.0.1:", handler, &calls) == NULL);
+  assert (m_httpd_create ("not a host:0", handler, &calls) == NULL);
+  m_httpd_destroy (NULL);
+
+  httpd = m_httpd_create ("127.0.0.1:0", handler, &calls);
+  assert (httpd != NULL);
+  port = m_httpd_port (httpd);
+  assert (port > 0);
+
+  /* the query string is dropped, the body is sized and typed */
+  r = fetch (port, "GET /hello?x=1 HTTP/1.1\r\nHost: a\r\n\r\n");
+  assert (strncmp (r, "HTTP/1.1 200 OK\r\n", 17) == 0);
+  assert (strstr (r, "Content-Type: text/x-test\r\n") != NULL);
+  assert (strstr (r, "Content-Length: 8\r\n") != NULL);
+  assert (strstr (r, "Connection: close\r\n") != NULL);
+  assert (strcmp (strstr (r, "\r\n\r\n"), "\r\n\r\nhello 1\n") == 0);
+
+  /* the body buffer is cleared between requests, HEAD has no body */
+  r = fetch (port, "HEAD /hello HTTP/1.1\r\n\r\n");
+  assert (strstr (r, "Content-Length: 8\r\n") != NULL);
+  assert (strcmp (strstr (r, "\r\n\r\n"), "\r\n\r\n") == 0);
+
+  r = fetch (port, "GET /other HTTP/1.0\r\n\r\n");
+  assert (strncmp (r, "HTTP/1.1 404 Not Found\r\n", 24) == 0);
+  assert (calls == 3);
+
+  /* only GET and HEAD reach the handler */
+  r = fetch (port, "POST /hello HTTP/1.1\r\nContent-Length: 0\r\n\r\n");
+  assert (strncmp (r, "HTTP/1.1 405 ", 13) == 0);
+
+  /* a head which doesn't end by the limit is refused, sent whole so the
+     server has read it all when it closes */
+  memset (big, 'x', sizeof (big) - 1);
+  big[sizeof (big) - 1] = '\0';
+  memcpy (big, "GET /", 5);
+  r = fetch (port, big);
+  assert (strncmp (r, "HTTP/1.1 431 ", 13) == 0);
+  assert (calls == 3);
+
+  /* the port is taken while listening */
+  snprintf (big, sizeof (big), "127.0.0.1:%d", port);
+  assert (m_httpd_create (big, handler, &calls) == NULL);
+
+  m_httpd_destroy (httpd);
+
+  prometheus_names ();
+
+  return 0;
+}
@@ -0,0 +1,243 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwes.h"
+#include "m_lwes.h"
+
+static unsigned char buffer[65535];
+static unsigned char expected[65535];
+
+/* reads an event written by the writer back with liblwes */
+static struct lwes_event *
+decode (size_t length)
+{
+  struct lwes_event_deserialize_tmp tmp;
+  struct lwes_event *event = lwes_event_create_no_name (NULL);
+
+  assert (event != NULL);
+  assert (lwes_event_from_bytes (event, (LWES_BYTE_P) buffer, length, 0,
+                                 &tmp) == (int) length);
+  return event;
+}
+
+/* the length of the serialized attribute at bytes, its key, type and value */
+static size_t
+attribute_length (const unsigned char *bytes)
+{
+  size_t key = bytes[0];
+  const unsigned char *value = bytes + 1 + key + 1;
+
+  switch (bytes[1 + key])
+    {
+      case M_LWES_TYPE_U_INT_16:
+        return 1 + key + 1 + 2;
+      case M_LWES_TYPE_U_INT_32:
+        return 1 + key + 1 + 4;
+      case M_LWES_TYPE_STRING:
+        return 1 + key + 1 + 2 + (((size_t) value[0] << 8) | value[1]);
+      case M_LWES_TYPE_INT_64:
+      case M_LWES_TYPE_U_INT_64:
+      case M_LWES_TYPE_DOUBLE:
+        return 1 + key + 1 + 8;
+      case M_LWES_TYPE_BOOLEAN:
+        return 1 + key + 1 + 1;
+    }
+  assert (0);
+  return 0;
+}
+
+/* checks two serialized events have the same name, the same number of
+   attributes and the same bytes for each attribute.  liblwes writes them
+   in its hash table's order, so they're matched up by their bytes */
+static void
+same_event (const unsigned char *event, const unsigned char *reference,
+            size_t length)
+{
+  size_t header = 1 + (size_t) event[0] + 2;
+  size_t count = ((size_t) event[header - 2] << 8) | event[header - 1];
+  size_t offset;
+  size_t other;
+  size_t size;
+  size_t n = 0;
+
+  assert (memcmp (event, reference, header) == 0);
+  for (offset = header; offset < length; offset += size, ++n)
+    {
+      size = attribute_length (event + offset);
+      for (other = header; other < length;
+           other += attribute_length (reference + other))
+        {
+          if (memcmp (event + offset, reference + other, size) == 0)
+            {
+              break;
+            }
+        }
+      assert (other < length);
+    }
+  assert (offset == length && n == count);
+}
+
+int
+main (void)
+{
+  struct m_lwes_writer writer;
+  struct lwes_event *event = NULL;
+  struct lwes_event *reference = NULL;
+  unsigned char attributes[256];
+  char long_key[300];
+  char *name = NULL;
+  char *string = NULL;
+  LWES_U_INT_16 u16 = 0;
+  LWES_U_INT_32 u32 = 0;
+  LWES_INT_64 i64 = 0;
+  LWES_U_INT_64 u64 = 0;
+  LWES_DOUBLE d = 0.0;
+  LWES_BOOLEAN b = 0;
+  size_t length = 0;
+  size_t attributes_length = 0;
+  int ret;
+
+  /* every type round trips through liblwes */
+  m_lwes_begin (&writer, buffer, sizeof (buffer), "MonDemand::StatsMsg");
+  m_lwes_key (&writer, "prog_id", -1);
+  m_lwes_string (&writer, "test");
+  m_lwes_key (&writer, "num", -1);
+  m_lwes_u_int_16 (&writer, 65535);
+  m_lwes_key (&writer, "l", 12);
+  m_lwes_u_int_32 (&writer, 4000000000UL);
+  m_lwes_key (&writer, "v", 0);
+  m_lwes_int_64 (&writer, -1234567890123LL);
+  m_lwes_key (&writer, "trace_id", 7);
+  m_lwes_u_int_64 (&writer, 18446744073709551615ULL);
+  m_lwes_key (&writer, "s", 100);
+  m_lwes_double (&writer, 0.25);
+  m_lwes_key (&writer, "kv", 3);
+  m_lwes_key_suffix (&writer, ".");
+  m_lwes_key_suffix (&writer, "flag");
+  m_lwes_boolean (&writer, 1);
+  m_lwes_key (&writer, "empty", -1);
+  m_lwes_string (&writer, "");
+  /* NULL strings are left out like liblwes does */
+  m_lwes_key (&writer, "missing", -1);
+  m_lwes_string (&writer, NULL);
+  assert (m_lwes_end (&writer, &length) == 0);
+  assert (writer.count == 8);
+
+  event = decode (length);
+  assert (lwes_event_get_name (event, &name) == 0);
+  assert (strcmp (name, "MonDemand::StatsMsg") == 0);
+  assert (lwes_event_get_number_of_attributes (event, &u16) == 0);
+  assert (u16 == 8);
+  assert (lwes_event_get_STRING (event, "prog_id", &string) == 0);
+  assert (strcmp (string, "test") == 0);
+  assert (lwes_event_get_U_INT_16 (event, "num", &u16) == 0);
+  assert (u16 == 65535);
+  assert (lwes_event_get_U_INT_32 (event, "l12", &u32) == 0);
+  assert (u32 == 4000000000UL);
+  assert (lwes_event_get_INT_64 (event, "v0", &i64) == 0);
+  assert (i64 == -1234567890123LL);
+  assert (lwes_event_get_U_INT_64 (event, "trace_id7", &u64) == 0);
+  assert (u64 == 18446744073709551615ULL);
+  assert (lwes_event_get_DOUBLE (event, "s100", &d) == 0);
+  assert (d == 0.25);
+  assert (lwes_event_get_BOOLEAN (event, "kv3.flag", &b) == 0);
+  assert (b);
+  assert (lwes_event_get_STRING (event, "empty", &string) == 0);
+  assert (strcmp (string, "") == 0);
+  assert (lwes_event_get_STRING (event, "missing", &string) != 0);
+
+  /* liblwes serializes the same event to the same bytes */
+  reference = lwes_event_create (NULL, "MonDemand::StatsMsg");
+  lwes_event_set_STRING (reference, "prog_id", "test");
+  lwes_event_set_U_INT_16 (reference, "num", 65535);
+  lwes_event_set_U_INT_32 (reference, "l12", 4000000000UL);
+  lwes_event_set_INT_64 (reference, "v0", -1234567890123LL);
+  lwes_event_set_U_INT_64 (reference, "trace_id7", 18446744073709551615ULL);
+  lwes_event_set_DOUBLE (reference, "s100", 0.25);
+  lwes_event_set_BOOLEAN (reference, "kv3.flag", 1);
+  lwes_event_set_STRING (reference, "empty", "");
+  ret = lwes_event_to_bytes (reference, (LWES_BYTE_P) expected,
+                             sizeof (expected), 0);
+  assert (ret == (int) length);
+  same_event (buffer, expected, length);
+  lwes_event_destroy (reference);
+  lwes_event_destroy (event);
+
+  /* counts can be filled in once they're known */
+  m_lwes_begin (&writer, buffer, sizeof (buffer), "E");
+  m_lwes_key (&writer, "num", -1);
+  m_lwes_u_int_16 (&writer, 0);
+  m_lwes_patch_u_int_16 (&writer, writer.used - 2, 513);
+  assert (m_lwes_end (&writer, &length) == 0);
+  event = decode (length);
+  assert (lwes_event_get_U_INT_16 (event, "num", &u16) == 0);
+  assert (u16 == 513);
+  lwes_event_destroy (event);
+
+  /* a run of attributes can be appended to later events */
+  m_lwes_begin_attributes (&writer, attributes, sizeof (attributes));
+  m_lwes_key (&writer, "ctxt_num", -1);
+  m_lwes_u_int_16 (&writer, 1);
+  m_lwes_key (&writer, "ctxt_k", 0);
+  m_lwes_string (&writer, "host");
+  m_lwes_key (&writer, "ctxt_v", 0);
+  m_lwes_string (&writer, "h1");
+  assert (m_lwes_end (&writer, &attributes_length) == 0);
+  assert (writer.count == 3);
+
+  m_lwes_begin (&writer, buffer, sizeof (buffer), "E");
+  m_lwes_key (&writer, "a", -1);
+  m_lwes_string (&writer, "b");
+  m_lwes_append (&writer, attributes, attributes_length, 3);
+  assert (m_lwes_end (&writer, &length) == 0);
+  event = decode (length);
+  assert (lwes_event_get_number_of_attributes (event, &u16) == 0);
+  assert (u16 == 4);
+  assert (lwes_event_get_STRING (event, "ctxt_v0", &string) == 0);
+  assert (strcmp (string, "h1") == 0);
+  lwes_event_destroy (event);
+
+  /* anything which doesn't fit fails the whole event */
+  m_lwes_begin (&writer, buffer, 16, "MonDemand::StatsMsg");
+  m_lwes_key (&writer, "k", 0);
+  m_lwes_string (&writer, "value");
+  assert (m_lwes_end (&writer, &length) == -1);
+
+  m_lwes_begin (&writer, buffer, 24, "E");
+  m_lwes_key (&writer, "k", 0);
+  m_lwes_string (&writer, "12345678901234567890");
+  assert (m_lwes_end (&writer, &length) == -1);
+
+  memset (long_key, 'x', sizeof (long_key) - 1);
+  long_key[sizeof (long_key) - 1] = '\0';
+  m_lwes_begin (&writer, buffer, sizeof (buffer), "E");
+  m_lwes_key (&writer, long_key, -1);
+  m_lwes_int_64 (&writer, 1);
+  assert (m_lwes_end (&writer, &length) == -1);
+
+  long_key[250] = '\0';
+  m_lwes_begin (&writer, buffer, sizeof (buffer), "E");
+  m_lwes_key (&writer, long_key, -1);
+  m_lwes_key_suffix (&writer, "123456");
+  m_lwes_int_64 (&writer, 1);
+  assert (m_lwes_end (&writer, &length) == -1);
+
+  return 0;
+}
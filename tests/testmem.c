@@ -50,6 +50,18 @@ main(void)
   ptr = m_try_realloc(ptr, 10255);
   m_free(ptr);
 
+  /* allocations are only counted when asked for */
+  assert (m_mem_allocations() == 0);
+  m_mem_count_allocations(1);
+  ptr = m_try_malloc0(16);
+  ptr = m_try_realloc(ptr, 32);
+  m_free(ptr);
+  assert (m_mem_allocations() == 2);
+  m_mem_count_allocations(0);
+  ptr = m_try_malloc(16);
+  m_free(ptr);
+  assert (m_mem_allocations() == 2);
+
   return 0;
 }
 
@@ -14,12 +14,23 @@
 #endif
 
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
+#include "lwes.h"
 #include "m_hash.h"
 #include "m_mem.h"
+#include "m_ring.h"
+#include "m_spool.h"
 #include "mondemand_transport.h"
 
 /* wrap malloc to cause memory problems */
@@ -94,6 +105,16 @@ static int fail_trace_callback = 0;
 static int fail_perf_callback = 0;
 static int fail_annotation_callback = 0;
 
+/* totals seen by the log callback */
+static int log_flushes = 0;
+static int log_messages_sent = 0;
+static int log_repeats_sent = 0;
+static int log_fields_sent = 0;
+static int log_args_sent = 0;
+static int log_formats_sent = 0;
+static long long log_last_int_field = 0;
+static char log_last_string_field[64];
+
 static int
 log_sender_callback(const char *prog_id,
                     const struct mondemand_log_message messages[],
@@ -103,10 +124,31 @@ log_sender_callback(const char *prog_id,
                     void *userdata)
 {
   int i=0;
+  int j=0;
 
+  log_flushes++;
   for(i=0; i<message_count; ++i)
   {
-    (void) messages[i];
+    log_messages_sent++;
+    log_repeats_sent += messages[i].repeat_count;
+    if( messages[i].format != NULL )
+    {
+      log_formats_sent++;
+      log_args_sent += messages[i].arg_count;
+    }
+    for(j=0; j<messages[i].field_count; ++j)
+    {
+      log_fields_sent++;
+      if( messages[i].fields[j].type == MONDEMAND_FIELD_INT64 )
+      {
+        log_last_int_field = messages[i].fields[j].value.i;
+      }
+      else if( messages[i].fields[j].type == MONDEMAND_FIELD_STRING )
+      {
+        strncpy(log_last_string_field, messages[i].fields[j].value.s,
+                sizeof(log_last_string_field) - 1);
+      }
+    }
   }
 
   for(i=0; i<context_count; ++i)
@@ -125,6 +167,11 @@ log_sender_callback(const char *prog_id,
   return 0;
 }
 
+/* flushes seen by the stats and perf callbacks, which may run on the
+   scheduler thread */
+static int stats_flushes = 0;
+static int perf_flushes = 0;
+
 static int
 stats_sender_callback(const char *prog_id,
                       const struct mondemand_stats_message stats[],
@@ -135,6 +182,7 @@ stats_sender_callback(const char *prog_id,
 {
   int i=0;
 
+  __atomic_fetch_add (&stats_flushes, 1, __ATOMIC_RELAXED);
   for(i=0; i<message_count; ++i)
   {
     (void) stats[i];
@@ -195,6 +243,7 @@ static int perf_sender_callback (
 {
   int i=0;
 
+  __atomic_fetch_add (&perf_flushes, 1, __ATOMIC_RELAXED);
   for(i=0; i<timings_count; ++i)
   {
     (void) timings[i];
@@ -264,6 +313,7 @@ make_test_transport (void)
   struct mondemand_transport *transport = NULL;
   transport = (struct mondemand_transport *) 
                 malloc(sizeof(struct mondemand_transport));
+  assert (mondemand_transport_init (transport, 0) == 0);
 
   transport->log_sender_function = &log_sender_callback;
   transport->stats_sender_function = &stats_sender_callback;
@@ -495,203 +545,2964 @@ static void annotation_test (void)
   mondemand_client_destroy (client);
 }
 
-static void other_test (void)
+static void rate_limit_test (void)
 {
+  struct mondemand_client *client = NULL;
+  struct m_log_limit *limit = NULL;
+  char key[FILENAME_MAX * 3];
+  int line = 0;
   int i;
-  for (i=0; i < 8; i++)
+
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  mondemand_set_immediate_send_level (client, M_LOG_ERR);
+
+  /* bogus arguments */
+  assert (mondemand_set_log_rate_limit (NULL, M_LOG_ERR, 1.0, 1.0) != 0);
+  assert (mondemand_set_log_rate_limit (client, -1, 1.0, 1.0) != 0);
+  assert (mondemand_set_log_rate_limit (client, M_LOG_ERR, -1.0, 1.0) != 0);
+  assert (client->rate_limited == 0);
+
+  /* refill so slowly that only the burst gets through */
+  assert (mondemand_set_log_rate_limit (client, M_LOG_ERR, 0.001, 2.0) == 0);
+  assert (client->rate_limited != 0);
+
+  log_messages_sent = 0;
+  log_repeats_sent = 0;
+  line = __LINE__;
+  for (i = 0; i < 100; ++i)
     {
-      assert (
-        mondemand_log_level_from_string (MonDemandLogLevelStrings[i]) == i
-      );
+      mondemand_log_real (client, __FILE__, line, M_LOG_ERR,
+                          MONDEMAND_NULL_TRACE_ID, "storm");
     }
-  assert (mondemand_log_level_from_string (NULL) == -1);
-  assert (mondemand_log_level_from_string ("unknown") == -1);
+  assert (log_messages_sent == 2);
+  assert (log_repeats_sent == 2);
+
+  /* traced messages go through regardless */
+  mondemand_log_real (client, __FILE__, line, M_LOG_ERR,
+                      mondemand_trace_id (5), "traced");
+  assert (log_messages_sent == 3);
+
+  /* pretend a token was refilled, the next message carries the drops */
+  snprintf (key, sizeof (key) - 1, "%s:%d", __FILE__, line);
+  limit = (struct m_log_limit *) m_hash_table_get (client->log_limits, key);
+  assert (limit != NULL);
+  assert (limit->suppressed == 98);
+  limit->bucket.tokens = 1.0;
+  mondemand_log_real (client, __FILE__, line, M_LOG_ERR,
+                      MONDEMAND_NULL_TRACE_ID, "storm");
+  assert (log_messages_sent == 4);
+  assert (log_repeats_sent == 2 + 1 + 99);
+  assert (limit->suppressed == 0);
+
+  /* changing the limit keeps what was suppressed for the next message, and
+     a repeat count jumping past a multiple of 999 still forces a flush */
+  line = __LINE__;
+  for (i = 0; i < 997; ++i)
+    {
+      mondemand_log_real (client, __FILE__, line, M_LOG_WARNING,
+                          MONDEMAND_NULL_TRACE_ID, "batched");
+    }
+  assert (mondemand_set_log_rate_limit (client, M_LOG_WARNING,
+                                        0.001, 1.0) == 0);
+  for (i = 0; i < 6; ++i)
+    {
+      mondemand_log_real (client, __FILE__, line, M_LOG_WARNING,
+                          MONDEMAND_NULL_TRACE_ID, "batched");
+    }
+  snprintf (key, sizeof (key) - 1, "%s:%d", __FILE__, line);
+  limit = (struct m_log_limit *) m_hash_table_get (client->log_limits, key);
+  assert (limit != NULL);
+  assert (limit->suppressed == 5);
+  assert (mondemand_set_log_rate_limit (client, M_LOG_WARNING,
+                                        0.001, 1.0) == 0);
+  assert (limit->suppressed == 5);
+  log_messages_sent = 0;
+  log_repeats_sent = 0;
+  mondemand_log_real (client, __FILE__, line, M_LOG_WARNING,
+                      MONDEMAND_NULL_TRACE_ID, "batched");
+  assert (log_messages_sent == 1);
+  assert (log_repeats_sent == 998 + 1 + 5);
+  assert (mondemand_set_log_rate_limit (client, M_LOG_WARNING,
+                                        0.0, 0.0) == 0);
+
+  /* a shared level limit applies across call sites */
+  assert (mondemand_set_log_rate_limit (client, M_LOG_ERR, 0.0, 0.0) == 0);
+  assert (mondemand_set_log_level_rate_limit (client, M_LOG_ERR,
+                                              0.001, 1.0) == 0);
+  log_messages_sent = 0;
+  for (i = 0; i < 10; ++i)
+    {
+      mondemand_log_real (client, __FILE__, line + i, M_LOG_ERR,
+                          MONDEMAND_NULL_TRACE_ID, "storm");
+    }
+  assert (log_messages_sent == 1);
 
-  assert (MONDEMAND_GAUGE == mondemand_stat_type_from_string ("gauge"));
-  assert (MONDEMAND_COUNTER == mondemand_stat_type_from_string ("counter"));
-  assert (MONDEMAND_UNKNOWN == mondemand_stat_type_from_string ("unknown"));
+  /* and can be removed again */
+  assert (mondemand_set_log_level_rate_limit (client, M_LOG_ERR,
+                                              0.0, 0.0) == 0);
+  assert (client->rate_limited == 0);
+
+  mondemand_client_destroy (client);
 }
 
-int
-main(void)
+static void sample_test (void)
 {
-  int i=0;
-  const char *data = NULL;
-  const char **list = NULL;
   struct mondemand_client *client = NULL;
-  struct mondemand_trace_id trace_id, trace_id2;
-  struct mondemand_transport *transport = NULL;
-  struct mondemand_transport *stderr_transport = NULL;
-  char buf[512];
+  struct mondemand_trace_id trace_id;
+  int line = 0;
+  int kept = 0;
+  int i;
 
-  /* test NULL parameter */
-  client = mondemand_client_create(NULL);
-  assert( client == NULL );
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  mondemand_set_immediate_send_level (client, M_LOG_DEBUG);
+  mondemand_set_no_send_level (client, M_LOG_ALL);
+
+  assert (mondemand_set_log_sample_rate (NULL, M_LOG_INFO, 0.5) != 0);
+  assert (mondemand_set_log_sample_rate (client, 99, 0.5) != 0);
+  assert (mondemand_set_log_sample_rate (client, M_LOG_INFO, 1.5) != 0);
+  assert (mondemand_set_log_sample_rate (client, M_LOG_INFO, -0.5) != 0);
+
+  /* nothing kept at a rate of zero */
+  assert (mondemand_set_log_sample_rate (client, M_LOG_INFO, 0.0) == 0);
+  log_messages_sent = 0;
+  line = __LINE__;
+  for (i = 0; i < 100; ++i)
+    {
+      mondemand_log_real (client, __FILE__, line + i, M_LOG_INFO,
+                          MONDEMAND_NULL_TRACE_ID, "sampled");
+    }
+  assert (log_messages_sent == 0);
 
-  /* this should work fine */
-  client = mondemand_client_create("test1234");
-  assert( client != NULL );
+  /* roughly half kept at a rate of one half */
+  assert (mondemand_set_log_sample_rate (client, M_LOG_INFO, 0.5) == 0);
+  for (i = 0; i < 1000; ++i)
+    {
+      mondemand_log_real (client, __FILE__, line + i, M_LOG_INFO,
+                          MONDEMAND_NULL_TRACE_ID, "sampled");
+    }
+  assert (log_messages_sent > 350 && log_messages_sent < 650);
 
-  /* set a valid send level then some bogus ones */
-  mondemand_set_immediate_send_level(client, M_LOG_ALERT);
-  mondemand_set_immediate_send_level(client, -1);
-  mondemand_set_immediate_send_level(client, 100000);
-  assert( client->immediate_send_level == M_LOG_ALERT );
+  /* traced messages are all kept or all dropped */
+  for (i = 1; i < 50; ++i)
+    {
+      trace_id = mondemand_trace_id (i);
+      kept = mondemand_log_sampled (&trace_id, 0.5);
+      log_messages_sent = 0;
+      mondemand_log_real (client, __FILE__, line, M_LOG_INFO, trace_id,
+                          "traced");
+      mondemand_log_real (client, __FILE__, line + 1, M_LOG_INFO, trace_id,
+                          "traced");
+      assert (log_messages_sent == (kept ? 2 : 0));
+    }
 
-  /* set a valid send level then some bogus ones */
-  mondemand_set_no_send_level(client, M_LOG_NOTICE);
-  mondemand_set_no_send_level(client, -100);
-  mondemand_set_no_send_level(client, 56494949);
-  assert( client->no_send_level == M_LOG_NOTICE );
+  /* other levels are untouched */
+  log_messages_sent = 0;
+  mondemand_log_real (client, __FILE__, line, M_LOG_WARNING,
+                      MONDEMAND_NULL_TRACE_ID, "unsampled");
+  assert (log_messages_sent == 1);
 
-  /* destroy it */
-  mondemand_client_destroy(client);
+  mondemand_client_destroy (client);
+}
 
-  /* create a new one, but with memory allocation problems */
-  strdup_fail = 1;
-  client = mondemand_client_create("this_should_fail");
-  assert( client == NULL );
-  strdup_fail = 0;
+static void batching_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct m_log_message message;
+  int line = __LINE__;
+  int size = 0;
+
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  mondemand_set_immediate_send_level (client, M_LOG_EMERG);
+  mondemand_set_no_send_level (client, M_LOG_ALL);
+
+  assert (mondemand_set_log_batching (NULL, 3, 0, 0) != 0);
+  assert (mondemand_set_log_batching (client, 0, 0, 0) != 0);
+  assert (mondemand_set_log_batching (client, 3, -1, 0) != 0);
+  assert (mondemand_set_log_batching (client, 3, 0, -1) != 0);
+
+  /* count limit */
+  assert (mondemand_set_log_batching (client, 3, 0, 0) == 0);
+  log_flushes = 0;
+  log_messages_sent = 0;
+  mondemand_log_real (client, __FILE__, line, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "one");
+  mondemand_log_real (client, __FILE__, line + 1, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "two");
+  assert (log_flushes == 0);
+  mondemand_log_real (client, __FILE__, line + 2, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "three");
+  assert (log_flushes == 1 && log_messages_sent == 3);
+  assert (client->batch_bytes == 0);
+
+  /* size limit, room for two messages but not three */
+  memset (&message, 0, sizeof (message));
+  strcpy (message.filename, __FILE__);
+  strcpy (message.message, "one");
+  message.sample_rate = 1.0;
+  size = mondemand_log_message_size (&message);
+  assert (mondemand_set_log_batching
+            (client, 100,
+             mondemand_log_batch_size (client) + 2 * size + size / 2,
+             0) == 0);
+  log_flushes = 0;
+  log_messages_sent = 0;
+  mondemand_log_real (client, __FILE__, line, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "one");
+  mondemand_log_real (client, __FILE__, line + 1, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "two");
+  assert (log_flushes == 0);
+  mondemand_log_real (client, __FILE__, line + 2, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "six");
+  assert (log_flushes == 1 && log_messages_sent == 2);
+  assert (m_hash_table_num (client->messages) == 1);
+  assert (mondemand_flush_logs (client) == 0);
+
+  /* linger limit, pretend the batch was started long ago */
+  assert (mondemand_set_log_batching (client, 100, 0, 1000) == 0);
+  log_flushes = 0;
+  mondemand_log_real (client, __FILE__, line, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "old");
+  assert (log_flushes == 0);
+  mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                              MONDEMAND_INC, MONDEMAND_COUNTER, "c", 1);
+  assert (log_flushes == 0);
+  client->batch_started -= 2000000;
+  /* updating a stat doesn't look at the batch, the next log line does */
+  mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                              MONDEMAND_INC, MONDEMAND_COUNTER, "c", 1);
+  assert (log_flushes == 0);
+  log_messages_sent = 0;
+  mondemand_log_real (client, __FILE__, line + 1, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "new");
+  assert (log_flushes == 1 && log_messages_sent == 1);
+
+  mondemand_client_destroy (client);
+}
+
+static void kv_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_log_field fields[4];
+  char user[16];
 
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  mondemand_set_no_send_level (client, M_LOG_DEBUG);
+  mondemand_set_immediate_send_level (client, M_LOG_CRIT);
+
+  strcpy (user, "alice");
+  fields[0] = mondemand_field_int64 ("bytes", 1234567890123LL);
+  fields[1] = mondemand_field_double ("ratio", 0.5);
+  fields[2] = mondemand_field_string ("user", user);
+  fields[3] = mondemand_field_bool ("cached", 7);
+  assert (fields[3].value.b == 1);
+
+  assert (mondemand_log_kv (client, M_LOG_ERR, MONDEMAND_NULL_TRACE_ID,
+                            "request", NULL, 2) != 0);
+  assert (mondemand_log_kv (client, M_LOG_ERR, MONDEMAND_NULL_TRACE_ID,
+                            "request", fields, -1) != 0);
+
+  /* fields are copied, so the caller's strings can change before a flush */
+  log_fields_sent = 0;
+  log_messages_sent = 0;
+  assert (mondemand_log_kv (client, M_LOG_ERR, MONDEMAND_NULL_TRACE_ID,
+                            "request %s", fields, 4) == 0);
+  strcpy (user, "mallory");
+  assert (log_messages_sent == 0);
+  mondemand_flush_logs (client);
+  assert (log_messages_sent == 1);
+  assert (log_fields_sent == 4);
+  assert (log_last_int_field == 1234567890123LL);
+  assert (strcmp (log_last_string_field, "alice") == 0);
+
+  /* the message is not a format */
+  assert (mondemand_log_kv (client, M_LOG_CRIT, MONDEMAND_NULL_TRACE_ID,
+                            "100%s done", NULL, 0) == 0);
+  assert (log_messages_sent == 2);
+
+  /* failing to allocate the message drops it */
   malloc_fail = 1;
-  client = mondemand_client_create("this_also_should_fail");
-  assert( client == NULL );
+  assert (mondemand_log_kv (client, M_LOG_ERR, MONDEMAND_NULL_TRACE_ID,
+                            "other", fields, 4) == -3);
   malloc_fail = 0;
 
-  /* this should do nothing since the client is NULL */
-  mondemand_client_destroy(client);
-
-  /* now create a valid one */
-  client = mondemand_client_create("test1234");
-  assert( client != NULL );
+  mondemand_client_destroy (client);
+}
 
-  /* add some transports */
-  transport = make_test_transport ();
-  mondemand_add_transport(client, transport); 
+static void dictionary_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct lwes_listener *listener = NULL;
+  struct lwes_event *event = NULL;
+  char *name = NULL;
+  char *format = NULL;
+  LWES_U_INT_32 id = 0;
+  LWES_U_INT_32 id2 = 0;
+  LWES_INT_64 int_value = 0;
+  char *string_value = NULL;
 
-  realloc_fail = 1;
-  mondemand_add_transport(client, transport);
-  realloc_fail = 0;
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  mondemand_set_no_send_level (client, M_LOG_DEBUG);
+  mondemand_set_immediate_send_level (client, M_LOG_ERR);
+
+  /* arguments are captured for transports */
+  log_formats_sent = 0;
+  log_args_sent = 0;
+  mondemand_log_real (client, __FILE__, __LINE__, M_LOG_ERR,
+                      MONDEMAND_NULL_TRACE_ID, "%s has %d", "foo", 5);
+  assert (log_formats_sent == 1);
+  assert (log_args_sent == 2);
+  mondemand_log_real (client, __FILE__, __LINE__, M_LOG_ERR,
+                      MONDEMAND_NULL_TRACE_ID, "%*d", 5, 5);
+  assert (log_formats_sent == 1);
+  assert (mondemand_log_kv (client, M_LOG_ERR, MONDEMAND_NULL_TRACE_ID,
+                            "%d", NULL, 0) == 0);
+  assert (log_formats_sent == 1);
+
+  assert (mondemand_transport_lwes_dictionary_create
+            ("127.0.0.1", 20503, NULL, 0, 60, 3, -1) == NULL);
+  listener = lwes_listener_create ((LWES_SHORT_STRING) "127.0.0.1", NULL,
+                                   20503);
+  assert (listener != NULL);
+  transport = mondemand_transport_lwes_dictionary_create
+                ("127.0.0.1", 20503, NULL, 0, 60, 3, 0);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
 
-  /* set some contexts */
-  assert (mondemand_set_context(client, "context-key-1", "context-value-1") == 0);
+  /* the first message from a call site sends the dictionary entry first */
+  mondemand_log_real (client, __FILE__, 1234, M_LOG_ERR,
+                      MONDEMAND_NULL_TRACE_ID, "%s has %lld", "foo", 5LL);
+  event = lwes_event_create_no_name (NULL);
+  assert (lwes_listener_recv_by (listener, event, 1000) > 0);
+  assert (lwes_event_get_name (event, &name) == 0);
+  assert (strcmp (name, "MonDemand::LogDict") == 0);
+  assert (lwes_event_get_U_INT_32 (event, "id0", &id) == 0);
+  assert (id == m_format_id (__FILE__, 1234, "%s has %lld"));
+  assert (lwes_event_get_STRING (event, "t0", &format) == 0);
+  assert (strcmp (format, "%s has %lld") == 0);
+  lwes_event_destroy (event);
+
+  event = lwes_event_create_no_name (NULL);
+  assert (lwes_listener_recv_by (listener, event, 1000) > 0);
+  assert (lwes_event_get_name (event, &name) == 0);
+  assert (strcmp (name, "MonDemand::DictLogMsg") == 0);
+  assert (lwes_event_get_U_INT_32 (event, "d0", &id2) == 0);
+  assert (id2 == id);
+  assert (lwes_event_get_STRING (event, "a0.0", &string_value) == 0);
+  assert (strcmp (string_value, "foo") == 0);
+  assert (lwes_event_get_INT_64 (event, "a0.1", &int_value) == 0);
+  assert (int_value == 5);
+  assert (lwes_event_get_STRING (event, "m0", &string_value) != 0);
+  lwes_event_destroy (event);
+
+  /* after that only the id and arguments are sent */
+  mondemand_log_real (client, __FILE__, 1234, M_LOG_ERR,
+                      MONDEMAND_NULL_TRACE_ID, "%s has %lld", "bar", 6LL);
+  event = lwes_event_create_no_name (NULL);
+  assert (lwes_listener_recv_by (listener, event, 1000) > 0);
+  assert (lwes_event_get_name (event, &name) == 0);
+  assert (strcmp (name, "MonDemand::DictLogMsg") == 0);
+  assert (lwes_event_get_INT_64 (event, "a0.1", &int_value) == 0);
+  assert (int_value == 6);
+  lwes_event_destroy (event);
+
+  /* messages without a captured format are sent as text */
+  mondemand_log_real (client, __FILE__, 1235, M_LOG_ERR,
+                      MONDEMAND_NULL_TRACE_ID, "%*d", 3, 7);
+  event = lwes_event_create_no_name (NULL);
+  assert (lwes_listener_recv_by (listener, event, 1000) > 0);
+  assert (lwes_event_get_name (event, &name) == 0);
+  assert (strcmp (name, "MonDemand::DictLogMsg") == 0);
+  assert (lwes_event_get_STRING (event, "m0", &string_value) == 0);
+  assert (strcmp (string_value, "  7") == 0);
+  lwes_event_destroy (event);
 
-  /* try it with strdup errors */
-  strdup_fail = 1;
-  mondemand_set_context(client, "abc", "123");
-  strdup_fail = 0;
+  mondemand_client_destroy (client);
+  lwes_listener_destroy (listener);
+}
 
-  /* create a grip of contexts */
-  for( i=0; i<1000; ++i )
-  {
-    sprintf(buf, "grip-%d", i);
-    mondemand_set_context(client, buf, "this is a grip of data");
-  }
+static void ring_test (void)
+{
+  struct mondemand_client *client = NULL;
+  int line = __LINE__;
+  int i;
 
-  /* fetch some of them */
-  data = mondemand_get_context(client, "grip-100");
-  assert( strcmp(data, "this is a grip of data") == 0 );
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  mondemand_set_no_send_level (client, M_LOG_INFO);
+  mondemand_set_immediate_send_level (client, M_LOG_ERR);
+
+  assert (mondemand_set_log_ring (NULL, 10, M_LOG_ERR, 0) != 0);
+  assert (mondemand_set_log_ring (client, -1, M_LOG_ERR, 0) != 0);
+  assert (mondemand_set_log_ring (client, 10, 99, 0) != 0);
+  assert (mondemand_level_is_enabled (client, M_LOG_DEBUG) == 0);
+
+  assert (mondemand_set_log_ring (client, 10, M_LOG_ERR, 0) == 0);
+  assert (mondemand_level_is_enabled (client, M_LOG_DEBUG) != 0);
+
+  /* debug messages are held, and only the last 10 are kept */
+  log_messages_sent = 0;
+  for (i = 0; i < 25; ++i)
+    {
+      mondemand_log_real (client, __FILE__, line + i, M_LOG_DEBUG,
+                          MONDEMAND_NULL_TRACE_ID, "debug %d", i);
+    }
+  assert (log_messages_sent == 0);
+  assert (strcmp (client->ring[24 % 10].message, "debug 24") == 0);
+
+  /* warnings don't trigger a dump */
+  mondemand_log_real (client, __FILE__, line, M_LOG_WARNING,
+                      MONDEMAND_NULL_TRACE_ID, "warning");
+  assert (log_messages_sent == 0);
+
+  /* but errors do, along with the buffered warning */
+  mondemand_log_real (client, __FILE__, line + 1, M_LOG_ERR,
+                      MONDEMAND_NULL_TRACE_ID, "error");
+  assert (log_messages_sent == 10 + 2);
+  assert (client->ring_written == 0);
+
+  /* a second error has nothing new to explain it */
+  log_messages_sent = 0;
+  mondemand_log_real (client, __FILE__, line + 2, M_LOG_ERR,
+                      MONDEMAND_NULL_TRACE_ID, "error");
+  assert (log_messages_sent == 1);
+
+  /* only send the records for the transaction which failed */
+  assert (mondemand_set_log_ring (client, 10, M_LOG_ERR, 1) == 0);
+  log_messages_sent = 0;
+  for (i = 0; i < 6; ++i)
+    {
+      mondemand_log_real (client, __FILE__, line + i, M_LOG_DEBUG,
+                          i == 1 || i == 4 ? mondemand_trace_id (77)
+                                           : MONDEMAND_NULL_TRACE_ID,
+                          "debug %d", i);
+    }
+  /* traced debug messages wait in the ring like the rest */
+  assert (log_messages_sent == 0);
+  mondemand_log_real (client, __FILE__, line, M_LOG_ERR,
+                      mondemand_trace_id (77), "traced error");
+  assert (log_messages_sent == 2 + 1);
+  assert (client->ring[1].level == -1 && client->ring[4].level == -1);
+  assert (client->ring[0].level == M_LOG_DEBUG);
+
+  /* an untraced error sends the rest */
+  log_messages_sent = 0;
+  mondemand_log_real (client, __FILE__, line + 1, M_LOG_ERR,
+                      MONDEMAND_NULL_TRACE_ID, "error");
+  assert (log_messages_sent == 4 + 1);
+
+  assert (mondemand_set_log_ring (client, 0, M_LOG_ERR, 0) == 0);
+  assert (client->ring == NULL);
 
-  /* remove some of them */
-  mondemand_remove_context(client, "grip-101");
-  mondemand_remove_context(client, "grip-381");
+  mondemand_client_destroy (client);
+}
 
-  /* get some of the data that isn't there */
-  data = mondemand_get_context(client, "grip-101");
-  assert( data == NULL );
+/* the async log callback runs on the I/O thread, while async_hold is set
+   it signals async_entered and waits for async_gate before recording */
+static int async_hold = 0;
+static sem_t async_entered;
+static sem_t async_gate;
+static char async_seen[16][32];
+static int async_seen_count = 0;
+static int async_contexts_ok = 0;
 
-  /* get a list of keys */
-  list = mondemand_get_context_keys(client); 
-  free(list);
+static int
+async_log_callback (const char *prog_id,
+                    const struct mondemand_log_message messages[],
+                    const int message_count,
+                    const struct mondemand_context contexts[],
+                    const int context_count,
+                    void *userdata)
+{
+  int i=0;
 
-  /* overwrite some of it */
-  mondemand_set_context(client, "grip-200", "new value");
-  data = mondemand_get_context(client, "grip-200");
-  assert( strcmp(data, "new value") == 0 ); 
+  (void) prog_id;
+  (void) userdata;
 
-  /* set some contexts where the hash table fails */
-  m_hash_fail = 1; 
-  assert( mondemand_set_context(client, "bogus123", "silly345") != 0 );
-  m_hash_fail = 0;
+  if (__atomic_load_n (&async_hold, __ATOMIC_ACQUIRE))
+    {
+      sem_post (&async_entered);
+      sem_wait (&async_gate);
+    }
+  for (i=0; i<message_count && async_seen_count < 16; ++i)
+    {
+      strncpy (async_seen[async_seen_count++], messages[i].message,
+               sizeof (async_seen[0]) - 1);
+    }
+  if (context_count == 1 && strcmp (contexts[0].key, "host") == 0
+      && strcmp (contexts[0].value, "h1") == 0)
+    {
+      async_contexts_ok++;
+    }
 
-  /* remove the rest */
-  mondemand_remove_all_contexts(client);
-  assert( m_hash_table_num (client->contexts) == 0 );
+  return 0;
+}
 
-  /* leave some dangling contexts for destroy to clean up */
-  for( i=0; i<1000; ++i )
-  {
-    sprintf(buf, "test-%d", i);
-    mondemand_set_context(client, buf, "hi there");
-  }
+/* opens the gate after the main thread has had time to block */
+static void *
+async_release (void *arg)
+{
+  (void) arg;
+  usleep (50000);
+  __atomic_store_n (&async_hold, 0, __ATOMIC_RELEASE);
+  sem_post (&async_gate);
+  return NULL;
+}
 
-  /* make sure we've got data */
-  list = mondemand_get_context_keys(client);
-  for( i=0; list[i] != NULL; ++i );
-  assert( i > 999 );
-  free(list);
+/* holds the I/O thread in the first message so the queue (of 2) can be
+   filled, then logs a fourth message with the given policy */
+static struct mondemand_client *
+async_fill (MondemandQueuePolicy policy, struct mondemand_async_stats *stats)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_async_options opts;
+  struct mondemand_async_stats drained;
+  pthread_t releaser;
+  const char *text[] = { "1", "2", "3", "4" };
+  int i;
 
-  /* create a trace ID */
-  trace_id = mondemand_trace_id(12345);  
-  trace_id2 = mondemand_trace_id(34567);
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  transport = make_test_transport ();
+  transport->log_sender_function = &async_log_callback;
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
 
-  /* compare them */
-  assert( mondemand_trace_id_compare(&trace_id, &trace_id2) == -1 );
-  assert( mondemand_trace_id_compare(&trace_id2, &trace_id) == 1 );
-  assert( mondemand_trace_id_compare(&trace_id, &trace_id) == 0 );
-  assert( mondemand_trace_id_compare(&MONDEMAND_NULL_TRACE_ID,
-                                     &MONDEMAND_NULL_TRACE_ID) == 0 );
+  opts.queue_size = 2;
+  opts.policy = policy;
+  assert (mondemand_client_start_async (client, &opts) == 0);
 
-  /* log some stuff */
-  mondemand_log_real(client, __FILE__, __LINE__, M_LOG_EMERG, trace_id,
-                     "this is a test");
-  mondemand_log_real(client, __FILE__, __LINE__, M_LOG_ERR,
-                     MONDEMAND_NULL_TRACE_ID, "another test");
+  async_seen_count = 0;
+  async_contexts_ok = 0;
+  __atomic_store_n (&async_hold, 1, __ATOMIC_RELEASE);
+  if (policy == MONDEMAND_QUEUE_BLOCK)
+    {
+      assert (pthread_create (&releaser, NULL, async_release, NULL) == 0);
+    }
+  for (i = 0; i < 4; ++i)
+    {
+      mondemand_log_real (client, __FILE__, __LINE__ + i, M_LOG_EMERG,
+                          MONDEMAND_NULL_TRACE_ID, text[i]);
+      if (i == 0)
+        {
+          /* the thread has taken the first one off the queue */
+          sem_wait (&async_entered);
+        }
+    }
+  if (policy == MONDEMAND_QUEUE_BLOCK)
+    {
+      pthread_join (releaser, NULL);
+    }
 
+  assert (mondemand_get_async_stats (client, stats) == 0);
+  __atomic_store_n (&async_hold, 0, __ATOMIC_RELEASE);
+  if (policy != MONDEMAND_QUEUE_BLOCK)
+    {
+      sem_post (&async_gate);
+    }
+  /* let the queue drain, so the caller's next flush isn't dropped */
+  for (i = 0; i < 2000; ++i)
+    {
+      assert (mondemand_get_async_stats (client, &drained) == 0);
+      if (drained.depth == 0
+          && drained.sent + drained.dropped_oldest == drained.queued)
+        {
+          break;
+        }
+      usleep (1000);
+    }
 
-  /* lower the no send threshold */
-  mondemand_set_no_send_level(client, M_LOG_DEBUG);
+  return client;
+}
 
-  /* check the log levels */
-  assert( mondemand_level_is_enabled(client, M_LOG_INFO) > 0 );
-  mondemand_level_is_enabled(NULL, -5);
+static void async_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_async_options opts;
+  struct mondemand_async_stats stats;
 
-  /* log a lot of stuff, as if we were in an inner loop */
-  for( i=0; i<1000; ++i )
-  {
-    mondemand_log_real(client, __FILE__, __LINE__, M_LOG_INFO,
-                       MONDEMAND_NULL_TRACE_ID, "spamspamspam");
-  }
+  sem_init (&async_entered, 0, 0);
+  sem_init (&async_gate, 0, 0);
 
-  /* this should fail since we're unable to allocate the message */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_client_start_async (NULL, NULL) == -2);
+  assert (mondemand_get_async_stats (client, &stats) == -2);
+  opts.queue_size = 0;
+  opts.policy = MONDEMAND_QUEUE_BLOCK;
+  assert (mondemand_client_start_async (client, &opts) == -2);
+  opts.queue_size = 4;
+  opts.policy = (MondemandQueuePolicy) 7;
+  assert (mondemand_client_start_async (client, &opts) == -2);
   malloc_fail = 1;
-  mondemand_log_real(client, __FILE__, __LINE__, M_LOG_INFO,
-                     MONDEMAND_NULL_TRACE_ID, "memoryerrors");
+  assert (mondemand_client_start_async (client, NULL) == -3);
   malloc_fail = 0;
 
-  /* change some stats */
-  mondemand_stats_perform_op (client, __FILE__, __LINE__,
-                              MONDEMAND_INC, MONDEMAND_COUNTER,
-                              "speed", 999999);
-  mondemand_stats_perform_op (client, __FILE__, __LINE__,
-                              MONDEMAND_INC, MONDEMAND_COUNTER,
-                              NULL, 11111);
-  mondemand_stats_perform_op (client, __FILE__, __LINE__,
-                              MONDEMAND_INC, MONDEMAND_COUNTER,
-                              "speed", 111111);
-  mondemand_stats_perform_op (client, __FILE__, __LINE__,
-                              MONDEMAND_DEC, MONDEMAND_COUNTER,
-                              "speed", 111111);
-  mondemand_stats_perform_op (client, __FILE__, __LINE__,
-                              MONDEMAND_SET, MONDEMAND_COUNTER,
-                              "speed", 888888);
-  mondemand_stats_perform_op (client, __FILE__, __LINE__,
-                              MONDEMAND_SET, MONDEMAND_COUNTER,
-                              NULL, 101010);
+  /* defaults, and transports can't be added once started */
+  assert (mondemand_client_start_async (client, NULL) == 0);
+  assert (mondemand_client_start_async (client, NULL) == -2);
+  assert (m_queue_capacity (client->async->queue) == M_ASYNC_QUEUE_SIZE);
+  assert (client->async->policy == MONDEMAND_QUEUE_DROP_NEWEST);
+  transport = make_test_transport ();
+  assert (mondemand_add_transport (client, transport) == -2);
+  free (transport);
+  mondemand_client_destroy (client);
 
-  malloc_fail = 1;
-  mondemand_stats_perform_op (client, __FILE__, __LINE__,
-                              MONDEMAND_INC, MONDEMAND_COUNTER,
+  /* the newest is dropped */
+  client = async_fill (MONDEMAND_QUEUE_DROP_NEWEST, &stats);
+  assert (stats.queued == 3 && stats.dropped_newest == 1
+          && stats.dropped_oldest == 0 && stats.depth == 2);
+  /* batched messages are sent by destroy, after everything queued */
+  mondemand_set_no_send_level (client, M_LOG_ALL);
+  mondemand_log_real (client, __FILE__, __LINE__, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "batched");
+  mondemand_client_destroy (client);
+  assert (async_seen_count == 4);
+  assert (strcmp (async_seen[0], "1") == 0);
+  assert (strcmp (async_seen[1], "2") == 0);
+  assert (strcmp (async_seen[2], "3") == 0);
+  assert (strcmp (async_seen[3], "batched") == 0);
+  assert (async_contexts_ok == 4);
+
+  /* the oldest waiting is dropped */
+  client = async_fill (MONDEMAND_QUEUE_DROP_OLDEST, &stats);
+  assert (stats.queued == 4 && stats.dropped_newest == 0
+          && stats.dropped_oldest == 1);
+  mondemand_client_destroy (client);
+  assert (async_seen_count == 3);
+  assert (strcmp (async_seen[0], "1") == 0);
+  assert (strcmp (async_seen[1], "3") == 0);
+  assert (strcmp (async_seen[2], "4") == 0);
+
+  /* the caller waits, so nothing is dropped */
+  client = async_fill (MONDEMAND_QUEUE_BLOCK, &stats);
+  assert (stats.queued == 4 && stats.dropped_newest == 0
+          && stats.dropped_oldest == 0);
+  mondemand_client_destroy (client);
+  assert (async_seen_count == 4);
+  assert (strcmp (async_seen[3], "4") == 0);
+
+  sem_destroy (&async_entered);
+  sem_destroy (&async_gate);
+}
+
+/* waits up to two seconds for a counter bumped by another thread */
+static int
+wait_for (int *counter, int value)
+{
+  int i;
+
+  for (i = 0; i < 200 && __atomic_load_n (counter, __ATOMIC_RELAXED) < value;
+       ++i)
+    {
+      usleep (10000);
+    }
+  return __atomic_load_n (counter, __ATOMIC_RELAXED) >= value;
+}
+
+static void scheduler_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_schedule_options opts;
+  int timings = 0;
+
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+
+  memset (&opts, 0, sizeof (opts));
+  assert (mondemand_client_start_scheduler (NULL, &opts) == -2);
+  assert (mondemand_client_start_scheduler (client, NULL) == -2);
+  assert (mondemand_client_start_scheduler (client, &opts) == -2);
+  opts.stats_interval_ms = -1;
+  assert (mondemand_client_start_scheduler (client, &opts) == -2);
+
+  opts.stats_interval_ms = 10;
+  opts.logs_interval_ms = 10;
+  opts.perf_interval_ms = 10;
+  opts.spread = 1;
+  assert (mondemand_client_start_scheduler (client, &opts) == 0);
+  assert (mondemand_client_start_scheduler (client, &opts) == -2);
+
+  /* logs sit in the batch until the scheduler flushes them */
+  mondemand_set_no_send_level (client, M_LOG_ALL);
+  assert (mondemand_set_log_batching (client, 100, 0, 0) == 0);
+  log_flushes = 0;
+  mondemand_log_real (client, __FILE__, __LINE__, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "scheduled");
+  assert (wait_for (&log_flushes, 1));
+
+  /* stats keep being sent, timings only until they have been sent */
+  stats_flushes = 0;
+  perf_flushes = 0;
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "scheduled", 1) == 0);
+  assert (mondemand_initialize_performance_trace (client, "id", "caller")
+            == 0);
+  assert (mondemand_add_performance_trace_timing (client, "step", 1, 2)
+            == 0);
+  assert (wait_for (&stats_flushes, 3));
+  assert (wait_for (&perf_flushes, 1));
+  pthread_mutex_lock (&client->lock);
+  timings = client->num_timings;
+  pthread_mutex_unlock (&client->lock);
+  assert (timings == 0);
+
+  /* destroy stops the scheduler before flushing */
+  mondemand_client_destroy (client);
+
+  /* aligned to wall-clock boundaries */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  memset (&opts, 0, sizeof (opts));
+  opts.stats_interval_ms = 20;
+  opts.align = 1;
+  opts.spread = 1;
+  opts.phase_key = "host-a";
+  assert (mondemand_client_start_scheduler (client, &opts) == 0);
+  stats_flushes = 0;
+  assert (wait_for (&stats_flushes, 2));
+  mondemand_client_destroy (client);
+
+  /* a linger limit alone is enough, and is enforced while idle */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  mondemand_set_no_send_level (client, M_LOG_ALL);
+  assert (mondemand_set_log_batching (client, 100, 0, 20) == 0);
+  memset (&opts, 0, sizeof (opts));
+  assert (mondemand_client_start_scheduler (client, &opts) == 0);
+  log_flushes = 0;
+  mondemand_log_real (client, __FILE__, __LINE__, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "lingering");
+  assert (wait_for (&log_flushes, 1));
+  mondemand_client_destroy (client);
+}
+
+/* counts the stats flushes reaching an isolated transport, the slow one
+   signals async_entered and waits for async_gate on its first flush */
+static int isolated_flushes[2];
+
+static int
+isolated_stats_callback (const char *prog_id,
+                         const struct mondemand_stats_message stats[],
+                         const int message_count,
+                         const struct mondemand_context contexts[],
+                         const int context_count,
+                         void *userdata)
+{
+  int *flushes = userdata;
+
+  (void) prog_id;
+  (void) stats;
+  (void) message_count;
+  (void) contexts;
+  (void) context_count;
+
+  if (flushes == &isolated_flushes[0]
+      && __atomic_load_n (flushes, __ATOMIC_RELAXED) == 0)
+    {
+      sem_post (&async_entered);
+      sem_wait (&async_gate);
+    }
+  __atomic_fetch_add (flushes, 1, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+/* waits up to 2 seconds for a transport's I/O thread to have finished
+   sending sent flushes */
+static int
+wait_async_sent (struct mondemand_client *client,
+                 struct mondemand_transport *transport, long long sent)
+{
+  struct mondemand_async_stats stats;
+  int i;
+
+  for (i = 0; i < 200; ++i)
+    {
+      assert (mondemand_get_transport_async_stats (client, transport,
+                                                   &stats) == 0);
+      if (stats.sent >= sent)
+        {
+          return 1;
+        }
+      usleep (10000);
+    }
+  return 0;
+}
+
+static void isolated_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *slow = NULL;
+  struct mondemand_transport *fast = NULL;
+  struct mondemand_transport *other = NULL;
+  struct mondemand_async_options opts;
+  struct mondemand_async_stats stats;
+  int i;
+
+  sem_init (&async_entered, 0, 0);
+  sem_init (&async_gate, 0, 0);
+  isolated_flushes[0] = 0;
+  isolated_flushes[1] = 0;
+
+  /* there has to be something to isolate */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_client_start_isolated (client, NULL) == -2);
+  other = make_test_transport ();
+  assert (mondemand_add_transport (client, other) == 0);
+  assert (mondemand_client_start_async (client, NULL) == 0);
+  /* with one I/O thread every transport shares its counters */
+  assert (mondemand_get_transport_async_stats (client, other, &stats) == 0);
+  mondemand_client_destroy (client);
+
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  slow = make_test_transport ();
+  slow->stats_sender_function = &isolated_stats_callback;
+  slow->userdata = &isolated_flushes[0];
+  fast = make_test_transport ();
+  fast->stats_sender_function = &isolated_stats_callback;
+  fast->userdata = &isolated_flushes[1];
+  assert (mondemand_add_transport (client, slow) == 0);
+  assert (mondemand_add_transport (client, fast) == 0);
+  opts.queue_size = 2;
+  opts.policy = MONDEMAND_QUEUE_DROP_NEWEST;
+  malloc_fail = 1;
+  assert (mondemand_client_start_isolated (client, &opts) == -3);
+  malloc_fail = 0;
+  assert (mondemand_client_start_isolated (client, &opts) == 0);
+  assert (mondemand_client_start_isolated (client, &opts) == -2);
+  assert (client->async_count == 2);
+  other = make_test_transport ();
+  assert (mondemand_get_transport_async_stats (client, other, &stats) == -2);
+  free (other);
+
+  /* the slow transport holds its first flush while the fast one gets all
+     of them.  Each flush waits for the fast one to be sent so its short
+     queue never fills, while the slow one's does */
+  for (i = 0; i < 5; ++i)
+    {
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_INC, MONDEMAND_COUNTER,
+                                          "k", 1) == 0);
+      assert (mondemand_flush_stats (client) == 0);
+      if (i == 0)
+        {
+          sem_wait (&async_entered);
+        }
+      assert (wait_async_sent (client, fast, i + 1));
+    }
+  assert (isolated_flushes[1] == 5);
+
+  assert (mondemand_get_transport_async_stats (client, fast, &stats) == 0);
+  assert (stats.queued == 5 && stats.sent == 5 && stats.depth == 0
+          && stats.dropped_newest == 0 && stats.dropped_oldest == 0);
+  assert (stats.latency_us_max >= 0
+          && stats.latency_us_total >= stats.latency_us_max);
+  assert (mondemand_get_transport_async_stats (client, slow, &stats) == 0);
+  assert (stats.queued == 3 && stats.sent == 0 && stats.depth == 2
+          && stats.dropped_newest == 2);
+  assert (mondemand_get_async_stats (client, &stats) == 0);
+  assert (stats.queued == 8 && stats.sent == 5 && stats.dropped_newest == 2);
+
+  /* the slow transport catches up once released, its first flush having
+     waited at least 20ms */
+  usleep (20000);
+  sem_post (&async_gate);
+  assert (wait_async_sent (client, slow, 3));
+  assert (isolated_flushes[0] == 3);
+  assert (mondemand_get_transport_async_stats (client, slow, &stats) == 0);
+  assert (stats.sent == 3 && stats.latency_us_max >= 20000);
+  /* destroy's own flush reaches both before the threads stop */
+  mondemand_client_destroy (client);
+  assert (isolated_flushes[0] == 4 && isolated_flushes[1] == 6);
+
+  sem_destroy (&async_entered);
+  sem_destroy (&async_gate);
+}
+
+/* what the version 2 transports were handed */
+static int v2_stats_calls = 0;
+static int v2_stats_contexts = 0;
+static int v2_batch_calls = 0;
+static int v2_batch_records = 0;
+static int v2_batch_contexts = 0;
+static int v2_batch_types[16];
+
+static int
+v2_stats_callback (const char *prog_id,
+                   const struct mondemand_stats_message stats[],
+                   const int message_count,
+                   const struct mondemand_context contexts[],
+                   const int context_count,
+                   void *userdata)
+{
+  (void) prog_id;
+  (void) stats;
+  (void) message_count;
+  (void) contexts;
+  (void) userdata;
+
+  v2_stats_calls++;
+  v2_stats_contexts = context_count;
+
+  return 0;
+}
+
+static int
+v2_batch_callback (const char *prog_id,
+                   const struct mondemand_record records[],
+                   const int record_count,
+                   const struct mondemand_context contexts[],
+                   const int context_count,
+                   void *userdata)
+{
+  int i;
+
+  (void) contexts;
+  (void) userdata;
+  assert (strcmp (prog_id, "test1234") == 0);
+
+  for (i = 0; i < record_count && v2_batch_records < 16; ++i)
+    {
+      v2_batch_types[v2_batch_records++] = records[i].type;
+      switch (records[i].type)
+        {
+          case MONDEMAND_RECORD_LOGS:
+            assert (records[i].count == 1 && records[i].logs != NULL);
+            assert (strcmp (records[i].logs[0].message, "batched") == 0);
+            break;
+          case MONDEMAND_RECORD_STATS:
+            assert (records[i].count == 1);
+            assert (strcmp (records[i].stats[0].key, "k") == 0);
+            break;
+          case MONDEMAND_RECORD_PERF:
+            assert (records[i].count == 1);
+            assert (strcmp (records[i].timings[0].label, "step") == 0);
+            assert (strcmp (records[i].strings[0], "id") == 0);
+            break;
+          case MONDEMAND_RECORD_ANNOTATION:
+            assert (records[i].count == 1);
+            assert (strcmp (records[i].tags[0], "t") == 0);
+            assert (records[i].timestamp == 5);
+            break;
+          default:
+            break;
+        }
+    }
+  v2_batch_calls++;
+  v2_batch_contexts = context_count;
+
+  return 0;
+}
+
+/* logs a buffered message, counts a stat and times a step so a flush
+   has three kinds to send */
+static void
+v2_fill (struct mondemand_client *client)
+{
+  mondemand_log_real (client, __FILE__, __LINE__, M_LOG_INFO,
+                      MONDEMAND_NULL_TRACE_ID, "batched");
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "k", 1) == 0);
+  assert (mondemand_initialize_performance_trace (client, "id", "caller")
+            == 0);
+  assert (mondemand_add_performance_trace_timing (client, "step", 1, 2)
+            == 0);
+}
+
+static void transport_v2_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *legacy = NULL;
+  struct mondemand_transport stats_only;
+  struct mondemand_transport batch;
+  const char *tags[] = { "t" };
+
+  assert (mondemand_transport_init (NULL, 0) == -2);
+  assert (mondemand_transport_init (&stats_only, -1) == -2);
+  assert (mondemand_transport_init (&stats_only,
+                                    MONDEMAND_TRANSPORT_VERSION + 1) == -2);
+  assert (mondemand_transport_init (&stats_only,
+                                    MONDEMAND_TRANSPORT_VERSION) == 0);
+  assert (stats_only.version == MONDEMAND_TRANSPORT_VERSION);
+  stats_only.capabilities = MONDEMAND_TRANSPORT_STATS;
+  stats_only.stats_sender_function = &v2_stats_callback;
+  assert (mondemand_transport_init (&batch, MONDEMAND_TRANSPORT_VERSION)
+            == 0);
+  batch.capabilities = MONDEMAND_TRANSPORT_ALL;
+  batch.batch_sender_function = &v2_batch_callback;
+
+  /* the later fields of a version 0 transport are never read */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  legacy = make_test_transport ();
+  legacy->capabilities = MONDEMAND_TRANSPORT_STATS;
+  legacy->batch_sender_function = &v2_batch_callback;
+  assert (mondemand_add_transport (client, legacy) == 0);
+  assert (client->consumes == MONDEMAND_TRANSPORT_ALL);
+  assert (client->batch_transports == 0);
+  mondemand_client_destroy (client);
+
+  /* everything claimed needs a sender */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  stats_only.capabilities |= MONDEMAND_TRANSPORT_LOGS;
+  assert (mondemand_add_transport (client, &stats_only) == -2);
+  stats_only.capabilities = MONDEMAND_TRANSPORT_STATS;
+  assert (mondemand_add_transport (client, &stats_only) == 0);
+  assert (client->consumes == MONDEMAND_TRANSPORT_STATS);
+
+  /* only stats are built, without the contexts */
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  mondemand_set_no_send_level (client, M_LOG_ALL);
+  v2_fill (client);
+  v2_stats_calls = 0;
+  v2_stats_contexts = -1;
+  assert (mondemand_flush (client) == 0);
+  assert (v2_stats_calls == 1 && v2_stats_contexts == 0);
+  assert (client->context_list == NULL);
+  assert (mondemand_flush_annotation ("a", 5, "d", NULL, tags, 1, client)
+            == 0);
+  mondemand_client_destroy (client);
+
+  /* a flush reaches the batch transport in one call, and the legacy one
+     kind at a time */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  legacy = make_test_transport ();
+  legacy->stats_sender_function = &v2_stats_callback;
+  assert (mondemand_add_transport (client, legacy) == 0);
+  assert (mondemand_add_transport (client, &batch) == 0);
+  assert (client->batch_transports == 1);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  mondemand_set_no_send_level (client, M_LOG_ALL);
+  v2_fill (client);
+  v2_stats_calls = 0;
+  v2_batch_calls = 0;
+  v2_batch_records = 0;
+  assert (mondemand_flush (client) == 0);
+  assert (v2_stats_calls == 1 && v2_stats_contexts == 1);
+  assert (v2_batch_calls == 1 && v2_batch_records == 3);
+  assert (v2_batch_types[0] == MONDEMAND_RECORD_LOGS);
+  assert (v2_batch_types[1] == MONDEMAND_RECORD_STATS);
+  assert (v2_batch_types[2] == MONDEMAND_RECORD_PERF);
+  assert (v2_batch_contexts == 1);
+  assert (client->pending_count == 0);
+
+  /* outside a flush the batch sender gets single records */
+  assert (mondemand_flush_stats (client) == 0);
+  assert (v2_stats_calls == 2 && v2_batch_calls == 2);
+  assert (v2_batch_types[3] == MONDEMAND_RECORD_STATS);
+  assert (mondemand_flush_annotation ("a", 5, "d", NULL, tags, 1, client)
+            == 0);
+  assert (v2_batch_calls == 3);
+  assert (v2_batch_types[4] == MONDEMAND_RECORD_ANNOTATION);
+  mondemand_client_destroy (client);
+
+  /* the batch is copied whole for the I/O thread */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, &batch) == 0);
+  assert (mondemand_client_start_async (client, NULL) == 0);
+  mondemand_set_no_send_level (client, M_LOG_ALL);
+  v2_fill (client);
+  v2_batch_calls = 0;
+  v2_batch_records = 0;
+  assert (mondemand_flush (client) == 0);
+  mondemand_client_destroy (client);
+  /* destroy flushes the counter and timings once more, the empty logs
+     are left out */
+  assert (v2_batch_calls == 2 && v2_batch_records == 5);
+  assert (v2_batch_types[2] == MONDEMAND_RECORD_PERF);
+  assert (v2_batch_types[3] == MONDEMAND_RECORD_STATS);
+  assert (v2_batch_types[4] == MONDEMAND_RECORD_PERF);
+}
+
+/* what the internal stats looked like to a transport */
+static int internal_stats_seen = 0;
+static int internal_transport_seen = 0;
+static long long internal_flushes = -1;
+static int internal_fail = 0;
+
+static int
+internal_stats_callback (const char *prog_id,
+                         const struct mondemand_stats_message stats[],
+                         const int message_count,
+                         const struct mondemand_context contexts[],
+                         const int context_count,
+                         void *userdata)
+{
+  int i;
+  (void) prog_id;
+  (void) contexts;
+  (void) context_count;
+  (void) userdata;
+
+  internal_stats_seen = 0;
+  internal_transport_seen = 0;
+  for (i = 0; i < message_count; ++i)
+    {
+      if (strncmp (stats[i].key, "mondemand.internal.", 19) == 0)
+        {
+          internal_stats_seen++;
+        }
+      if (strcmp (stats[i].key, "mondemand.internal.flushes.stats") == 0)
+        {
+          assert (stats[i].type == MONDEMAND_COUNTER);
+          internal_flushes = stats[i].value;
+        }
+      if (strcmp (stats[i].key, "mondemand.internal.transport0.errors") == 0)
+        {
+          internal_transport_seen = 1;
+        }
+    }
+
+  return internal_fail ? -1 : 0;
+}
+
+static void internal_stats_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_transport *other = NULL;
+  struct mondemand_transport *native = NULL;
+  struct mondemand_internal_stats stats;
+  struct mondemand_internal_transport_stats transport_stats;
+  struct mondemand_native_stats native_stats;
+  int i;
+
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  transport = make_test_transport ();
+  transport->stats_sender_function = &internal_stats_callback;
+  assert (mondemand_add_transport (client, transport) == 0);
+
+  /* nothing is kept until asked for */
+  assert (mondemand_get_internal_stats (client, &stats) == -2);
+  assert (mondemand_get_internal_stats (NULL, &stats) == -2);
+  assert (mondemand_enable_internal_stats (NULL) == -2);
+  internal_stats_seen = -1;
+  mondemand_stats_perform_op (client, __FILE__, __LINE__, MONDEMAND_INC,
+                              MONDEMAND_COUNTER, "k", 1);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (internal_stats_seen == 0);
+
+  assert (mondemand_enable_internal_stats (client) == 0);
+  assert (mondemand_enable_internal_stats (client) == -2);
+  assert (mondemand_get_internal_stats (client, &stats) == 0);
+  assert (stats.flushes[MONDEMAND_INTERNAL_STATS] == 0);
+  assert (stats.stats_entries == 1 && stats.stats_longest_chain == 1);
+
+  /* flushes are counted and timed, and sent along with the stats */
+  assert (mondemand_flush_stats (client) == 0);
+  assert (internal_stats_seen > 0 && internal_transport_seen);
+  assert (internal_flushes == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (internal_flushes == 1);
+  assert (mondemand_get_internal_stats (client, &stats) == 0);
+  assert (stats.flushes[MONDEMAND_INTERNAL_STATS] == 2);
+  assert (stats.flushes[MONDEMAND_INTERNAL_LOGS] == 0);
+  assert (stats.sender_errors == 0);
+  assert (mondemand_get_internal_transport_stats (client, transport,
+                                                  &transport_stats) == 0);
+  assert (transport_stats.sends == 2 && transport_stats.errors == 0);
+
+  /* failed sends */
+  internal_fail = 1;
+  assert (mondemand_flush_stats (client) != 0);
+  internal_fail = 0;
+  assert (mondemand_get_internal_stats (client, &stats) == 0);
+  assert (stats.sender_errors == 1);
+  assert (mondemand_get_internal_transport_stats (client, transport,
+                                                  &transport_stats) == 0);
+  assert (transport_stats.sends == 3 && transport_stats.errors == 1);
+
+  /* transports added later get their own counters */
+  other = make_test_transport ();
+  assert (mondemand_get_internal_transport_stats (client, other,
+                                                  &transport_stats) == -2);
+  assert (mondemand_add_transport (client, other) == 0);
+  assert (mondemand_get_internal_transport_stats (client, other,
+                                                  &transport_stats) == 0);
+  assert (transport_stats.sends == 0);
+
+  /* bytes are counted as they're handed to a transport sharing an
+     encoding, the test transports send through their callbacks */
+  assert (mondemand_get_internal_stats (client, &stats) == 0);
+  assert (stats.datagrams == 0 && stats.bytes == 0);
+  native = mondemand_transport_lwes_native_create ("127.0.0.1", 20509, NULL,
+                                                   1);
+  assert (native != NULL);
+  assert (mondemand_add_transport (client, native) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (mondemand_get_internal_stats (client, &stats) == 0);
+  assert (mondemand_transport_lwes_native_get_stats (native,
+                                                     &native_stats) == 0);
+  assert (stats.datagrams == 1 && native_stats.datagrams == 1);
+  assert (stats.bytes == native_stats.bytes && stats.bytes > 0);
+
+  /* repeated and dropped log lines */
+  mondemand_set_immediate_send_level (client, M_LOG_EMERG);
+  for (i = 0; i < 3; ++i)
+    {
+      mondemand_log_real (client, __FILE__, 1, M_LOG_ERR,
+                          MONDEMAND_NULL_TRACE_ID, "again");
+    }
+  assert (mondemand_set_log_rate_limit (client, M_LOG_ERR, 0.001, 1.0)
+            == 0);
+  for (i = 0; i < 3; ++i)
+    {
+      mondemand_log_real (client, __FILE__, 2, M_LOG_ERR,
+                          MONDEMAND_NULL_TRACE_ID, "storm");
+    }
+  assert (mondemand_get_internal_stats (client, &stats) == 0);
+  assert (stats.log_repeats == 2);
+  assert (stats.log_suppressed == 2);
+  assert (stats.log_entries == 2);
+  assert (mondemand_flush_logs (client) == 0);
+  assert (mondemand_get_internal_stats (client, &stats) == 0);
+  assert (stats.flushes[MONDEMAND_INTERNAL_LOGS] == 1);
+  assert (stats.log_entries == 0);
+
+  mondemand_client_destroy (client);
+
+  /* they have to be enabled before the I/O thread starts */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, make_test_transport ()) == 0);
+  assert (mondemand_client_start_async (client, NULL) == 0);
+  assert (mondemand_enable_internal_stats (client) == -2);
+  mondemand_client_destroy (client);
+}
+
+/* a shared encoding which counts how often it is used */
+static int encoder_calls = 0;
+static int encoder_fail = 0;
+static int context_encoder_calls = 0;
+static const struct mondemand_context_block *encoder_block = NULL;
+
+static int
+counting_stats_encoder (const char *program_identifier,
+                        const struct mondemand_stats_message stats[],
+                        const int message_count,
+                        const struct mondemand_context contexts[],
+                        const int context_count,
+                        const struct mondemand_context_block *block,
+                        unsigned char *buffer, size_t size, size_t *length)
+{
+  (void) program_identifier;
+  (void) stats;
+  (void) contexts;
+  (void) context_count;
+
+  encoder_calls++;
+  encoder_block = block;
+  if (encoder_fail)
+    {
+      return -1;
+    }
+  assert (size >= 16);
+  *length = (size_t) sprintf ((char *) buffer, "stats:%d", message_count);
+  return 0;
+}
+
+static int
+counting_context_encoder (const struct mondemand_context contexts[],
+                          const int context_count,
+                          unsigned char *buffer, size_t size, size_t *length,
+                          int *count)
+{
+  (void) contexts;
+
+  context_encoder_calls++;
+  assert (size >= 16);
+  *length = (size_t) sprintf ((char *) buffer, "ctx:%d", context_count);
+  *count = context_count;
+  return 0;
+}
+
+static const struct mondemand_encoding counting_encoding =
+{
+  "counting", NULL, counting_stats_encoder, NULL, counting_context_encoder
+};
+
+/* counts the bytes sent, userdata points at the transport's counter */
+static int
+counting_bytes_sender (const unsigned char *bytes, const size_t length,
+                       void *userdata)
+{
+  assert (length == 7 && memcmp (bytes, "stats:1", 7) == 0);
+  ++*(int *) userdata;
+  return 0;
+}
+
+static void encoding_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct lwes_listener *listeners[2];
+  struct lwes_event *event = NULL;
+  char *name = NULL;
+  char *key = NULL;
+  LWES_U_INT_16 num = 0;
+  int received[2] = { 0, 0 };
+  int i;
+
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  for (i = 0; i < 2; ++i)
+    {
+      transport = (struct mondemand_transport *)
+                    malloc (sizeof (struct mondemand_transport));
+      assert (mondemand_transport_init
+                (transport, MONDEMAND_TRANSPORT_VERSION_ENCODING) == 0);
+      transport->log_sender_function = &log_sender_callback;
+      transport->stats_sender_function = &stats_sender_callback;
+      transport->trace_sender_function = &trace_sender_callback;
+      transport->perf_sender_function = &perf_sender_callback;
+      transport->annotation_sender_function = &annotation_sender_callback;
+      transport->destroy_function = &destroy_callback;
+      transport->encoding = &counting_encoding;
+      transport->bytes_sender_function = &counting_bytes_sender;
+      transport->userdata = &received[i];
+      assert (mondemand_add_transport (client, transport) == 0);
+    }
+  /* the encoding of a version 0 transport is never looked at */
+  transport = make_test_transport ();
+  transport->encoding = &counting_encoding;
+  transport->bytes_sender_function = &counting_bytes_sender;
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "shared", 1) == 0);
+
+  /* encoded once, sent to both, and the plain transport uses its sender */
+  encoder_calls = 0;
+  stats_flushes = 0;
+  assert (mondemand_flush_stats (client) == 0);
+  assert (encoder_calls == 1);
+  assert (received[0] == 1 && received[1] == 1);
+  assert (stats_flushes == 1);
+  assert (context_encoder_calls == 0 && encoder_block == NULL);
+
+  /* contexts are encoded once and reused until they change */
+  assert (mondemand_set_context (client, "a", "1") == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (context_encoder_calls == 1);
+  assert (encoder_block != NULL && encoder_block->count == 1);
+  assert (encoder_block->length == 5
+          && memcmp (encoder_block->bytes, "ctx:1", 5) == 0);
+  assert (mondemand_set_context (client, "b", "2") == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (context_encoder_calls == 2 && encoder_block->count == 2);
+  mondemand_remove_context (client, "a");
+  assert (mondemand_flush_stats (client) == 0);
+  assert (context_encoder_calls == 3 && encoder_block->count == 1);
+  mondemand_remove_all_contexts (client);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (context_encoder_calls == 3 && encoder_block == NULL);
+  assert (received[0] == 6 && received[1] == 6);
+
+  /* if encoding fails each transport sends for itself */
+  encoder_fail = 1;
+  encoder_calls = 0;
+  stats_flushes = 0;
+  assert (mondemand_flush_stats (client) == 0);
+  assert (encoder_calls == 1);
+  assert (received[0] == 6 && received[1] == 6);
+  assert (stats_flushes == 3);
+  encoder_fail = 0;
+
+  /* kinds of flush without an encoder go to the senders */
+  log_flushes = 0;
+  mondemand_log_real (client, __FILE__, __LINE__, M_LOG_EMERG,
+                      MONDEMAND_NULL_TRACE_ID, "not encoded");
+  assert (log_flushes == 3);
+  mondemand_client_destroy (client);
+
+  /* lwes transports share the encoding, each gets the same event */
+  client = mondemand_client_create ("test1234");
+  assert (client != NULL);
+  for (i = 0; i < 2; ++i)
+    {
+      listeners[i] = lwes_listener_create ((LWES_SHORT_STRING) "127.0.0.1",
+                                           NULL, 20504 + i);
+      assert (listeners[i] != NULL);
+      transport = mondemand_transport_lwes_create ("127.0.0.1", 20504 + i,
+                                                   NULL, 0, 60);
+      assert (transport != NULL);
+      assert (transport->encoding == &mondemand_encoding_lwes);
+      assert (mondemand_add_transport (client, transport) == 0);
+    }
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "shared", 1) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (client->encode_buffer != NULL);
+  for (i = 0; i < 4; ++i)
+    {
+      if (i == 2)
+        {
+          /* the cached contexts follow a change */
+          assert (mondemand_set_context (client, "host", "h2") == 0);
+          assert (mondemand_flush_stats (client) == 0);
+        }
+      event = lwes_event_create_no_name (NULL);
+      assert (lwes_listener_recv_by (listeners[i % 2], event, 1000) > 0);
+      assert (lwes_event_get_name (event, &name) == 0);
+      assert (strcmp (name, "MonDemand::StatsMsg") == 0);
+      assert (lwes_event_get_STRING (event, "k0", &key) == 0);
+      assert (strcmp (key, "shared") == 0);
+      assert (lwes_event_get_U_INT_16 (event, "ctxt_num", &num) == 0);
+      assert (num == 1);
+      assert (lwes_event_get_STRING (event, "ctxt_k0", &key) == 0);
+      assert (strcmp (key, "host") == 0);
+      assert (lwes_event_get_STRING (event, "ctxt_v0", &key) == 0);
+      assert (strcmp (key, i < 2 ? "h1" : "h2") == 0);
+      lwes_event_destroy (event);
+    }
+  mondemand_client_destroy (client);
+  for (i = 0; i < 2; ++i)
+    {
+      lwes_listener_destroy (listeners[i]);
+    }
+}
+
+/* receives the same event from two listeners and checks it's identical:
+   the same name, size and attributes, comparing the given string keys */
+static void
+expect_same_event (struct lwes_listener *a, struct lwes_listener *b,
+                   const char *expected_name, const char *keys[])
+{
+  struct lwes_event *events[2];
+  LWES_U_INT_16 counts[2];
+  int lengths[2];
+  char *name = NULL;
+  char *values[2];
+  int i;
+
+  events[0] = lwes_event_create_no_name (NULL);
+  events[1] = lwes_event_create_no_name (NULL);
+  lengths[0] = lwes_listener_recv_by (a, events[0], 1000);
+  lengths[1] = lwes_listener_recv_by (b, events[1], 1000);
+  assert (lengths[0] > 0 && lengths[0] == lengths[1]);
+  for (i = 0; i < 2; ++i)
+    {
+      assert (lwes_event_get_name (events[i], &name) == 0);
+      assert (strcmp (name, expected_name) == 0);
+      assert (lwes_event_get_number_of_attributes (events[i],
+                                                   &counts[i]) == 0);
+    }
+  assert (counts[0] == counts[1]);
+  for (i = 0; keys[i] != NULL; ++i)
+    {
+      assert (lwes_event_get_STRING (events[0], keys[i], &values[0]) == 0);
+      assert (lwes_event_get_STRING (events[1], keys[i], &values[1]) == 0);
+      assert (strcmp (values[0], values[1]) == 0);
+    }
+  lwes_event_destroy (events[0]);
+  lwes_event_destroy (events[1]);
+}
+
+/* the native lwes transport sends what the liblwes one does */
+static void native_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct lwes_listener *listeners[2];
+  struct mondemand_log_field fields[2];
+  const char *tags[] = { "t1", "t2" };
+  const char *stats_keys[] = { "prog_id", "t0", "k0", "t1", "k1",
+                               "ctxt_k0", "ctxt_v0", "ctxt_k1", "ctxt_v1",
+                               NULL };
+  const char *log_keys[] = { "prog_id", "f0", "m0", "kv0.user", NULL };
+  const char *trace_keys[] = { "mondemand.prog_id", "mondemand.trace_id",
+                               "mondemand.owner", "mondemand.src_host",
+                               "mondemand.message", "extra", NULL };
+  const char *perf_keys[] = { "id", "caller_label", "label0", "label1",
+                              "ctxt_v0", NULL };
+  const char *annotation_keys[] = { "id", "description", "text", "tag0",
+                                    "tag1", "ctxt_v1", NULL };
+
+  assert (mondemand_transport_lwes_native_create ("not an ip", 20508,
+                                                  NULL, 3) == NULL);
+
+  client = mondemand_client_create ("native");
+  assert (client != NULL);
+  listeners[0] = lwes_listener_create ((LWES_SHORT_STRING) "127.0.0.1",
+                                       NULL, 20506);
+  listeners[1] = lwes_listener_create ((LWES_SHORT_STRING) "127.0.0.1",
+                                       NULL, 20507);
+  assert (listeners[0] != NULL && listeners[1] != NULL);
+  transport = mondemand_transport_lwes_create ("127.0.0.1", 20506,
+                                               NULL, 0, 60);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  transport = mondemand_transport_lwes_native_create ("127.0.0.1", 20507,
+                                                      NULL, 3);
+  assert (transport != NULL);
+  assert (transport->encoding == &mondemand_encoding_lwes_native);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  assert (mondemand_set_context (client, "cluster", "c1") == 0);
+
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "requests", 42) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_SET, MONDEMAND_GAUGE,
+                                      "depth", -7) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  expect_same_event (listeners[0], listeners[1], "MonDemand::StatsMsg",
+                     stats_keys);
+
+  fields[0].key = "user";
+  fields[0].type = MONDEMAND_FIELD_STRING;
+  fields[0].value.s = "someone";
+  fields[1].key = "ok";
+  fields[1].type = MONDEMAND_FIELD_BOOL;
+  fields[1].value.b = 1;
+  assert (mondemand_log_kv_real (client, __FILE__, __LINE__, M_LOG_EMERG,
+                                 MONDEMAND_NULL_TRACE_ID, "native log",
+                                 fields, 2) == 0);
+  expect_same_event (listeners[0], listeners[1], "MonDemand::LogMsg",
+                     log_keys);
+
+  assert (mondemand_initialize_trace (client, "owner", "trace", "msg") == 0);
+  assert (mondemand_set_trace (client, "extra", "value") == 0);
+  assert (mondemand_flush_trace (client) == 0);
+  expect_same_event (listeners[0], listeners[1], "MonDemand::TraceMsg",
+                     trace_keys);
+  mondemand_clear_trace (client);
+
+  assert (mondemand_initialize_performance_trace (client, "id",
+                                                  "caller") == 0);
+  assert (mondemand_add_performance_trace_timing (client, "a", 1, 2) == 0);
+  assert (mondemand_add_performance_trace_timing (client, "b", 3, 5) == 0);
+  assert (mondemand_flush_performance_trace (client) == 0);
+  expect_same_event (listeners[0], listeners[1], "MonDemand::PerfMsg",
+                     perf_keys);
+
+  assert (mondemand_flush_annotation ("note", 1234567, "description",
+                                      "text", tags, 2, client) == 0);
+  expect_same_event (listeners[0], listeners[1], "MonDemand::AnnotationMsg",
+                     annotation_keys);
+
+  mondemand_client_destroy (client);
+  lwes_listener_destroy (listeners[0]);
+  lwes_listener_destroy (listeners[1]);
+}
+
+/* receives the events a split flush was sent as, checking each fits in
+   max bytes and has its own num and the contexts.  Marks the keys seen in
+   seen, returns the number of datagrams */
+static int
+receive_split (struct lwes_listener *listener, const char *expected_name,
+               const char *prefix, int max, int datagrams,
+               char seen[], int count, long long *bytes)
+{
+  struct lwes_event *event = NULL;
+  LWES_U_INT_16 num = 0;
+  LWES_U_INT_16 contexts = 0;
+  char *name = NULL;
+  char *value = NULL;
+  char key[32];
+  int length = 0;
+  int received = 0;
+  int i, n;
+
+  *bytes = 0;
+  for (received = 0; received < datagrams; ++received)
+    {
+      event = lwes_event_create_no_name (NULL);
+      length = lwes_listener_recv_by (listener, event, 1000);
+      assert (length > 0 && length <= max);
+      *bytes += length;
+      assert (lwes_event_get_name (event, &name) == 0);
+      assert (strcmp (name, expected_name) == 0);
+      assert (lwes_event_get_U_INT_16 (event, "num", &num) == 0);
+      assert (num > 0);
+      assert (lwes_event_get_U_INT_16 (event, "ctxt_num", &contexts) == 0);
+      assert (contexts == 2);
+      for (i = 0; i < (int) num; ++i)
+        {
+          snprintf (key, sizeof (key), "%s%d", prefix, i);
+          assert (lwes_event_get_STRING (event, key, &value) == 0);
+          assert (sscanf (value, "item%d", &n) == 1);
+          assert (n >= 0 && n < count && ! seen[n]);
+          seen[n] = 1;
+        }
+      snprintf (key, sizeof (key), "%s%d", prefix, (int) num);
+      assert (lwes_event_get_STRING (event, key, &value) != 0);
+      lwes_event_destroy (event);
+    }
+
+  return received;
+}
+
+#if defined(HAVE_LIBURING) && defined(HAVE_SENDMMSG)
+/* flushes bigger than the 64 submissions an io_uring transport's ring
+   holds go out in several submissions, every datagram arriving once, and
+   the ring is reused by later flushes */
+static void uring_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_native_options opts;
+  struct mondemand_native_stats stats;
+  struct lwes_listener *listener = NULL;
+  char seen[800];
+  char key[32];
+  long long bytes = 0;
+  long long flushes = 0;
+  int round;
+  int i;
+
+  listener = lwes_listener_create ((LWES_SHORT_STRING) "127.0.0.1",
+                                   NULL, 20512);
+  assert (listener != NULL);
+  memset (&opts, 0, sizeof (opts));
+  opts.max_datagram = 512;
+  opts.uring = 1;
+  transport = mondemand_transport_lwes_native_create_with_options
+                ("127.0.0.1", 20512, NULL, &opts);
+  assert (transport != NULL);
+  client = mondemand_client_create ("uring");
+  assert (client != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  assert (mondemand_set_context (client, "cluster", "c1") == 0);
+  for (i = 0; i < 800; ++i)
+    {
+      snprintf (key, sizeof (key), "item%d", i);
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_INC, MONDEMAND_COUNTER,
+                                          key, i) == 0);
+    }
+
+  for (round = 0; round < 3; ++round)
+    {
+      assert (mondemand_flush_stats (client) == 0);
+      assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                         &stats) == 0);
+      assert (stats.flushes == ++flushes);
+      assert (stats.last_datagrams > 64);
+      assert (stats.last_syscalls == (stats.last_datagrams + 63) / 64);
+      assert (stats.errors == 0 && stats.would_block == 0);
+      memset (seen, 0, sizeof (seen));
+      assert (receive_split (listener, "MonDemand::StatsMsg", "k", 512,
+                             stats.last_datagrams, seen, 800, &bytes)
+              == stats.last_datagrams);
+      assert (bytes == stats.last_bytes);
+      for (i = 0; i < 800; ++i)
+        {
+          assert (seen[i]);
+        }
+    }
+
+  mondemand_client_destroy (client);
+  lwes_listener_destroy (listener);
+}
+#endif
+
+/* native lwes transports split flushes which don't fit in a datagram */
+static void split_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_native_options opts;
+  struct mondemand_native_stats stats;
+  struct mondemand_native_stats others;
+  struct mondemand_client *other_client = NULL;
+  struct mondemand_transport *other = NULL;
+  struct lwes_listener *listener = NULL;
+  char seen[100];
+  char key[32];
+  char long_key[700];
+  long long bytes = 0;
+  int variant;
+  int i;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.ttl = 3;
+  opts.max_datagram = -1;
+  assert (mondemand_transport_lwes_native_create_with_options
+            ("127.0.0.1", 20508, NULL, &opts) == NULL);
+  assert (mondemand_transport_lwes_native_create_with_options
+            ("127.0.0.1", 20508, NULL, NULL) == NULL);
+  assert (mondemand_transport_lwes_native_get_stats (NULL, &stats) == -2);
+
+  listener = lwes_listener_create ((LWES_SHORT_STRING) "127.0.0.1",
+                                   NULL, 20508);
+  assert (listener != NULL);
+  client = mondemand_client_create ("split");
+  assert (client != NULL);
+  opts.max_datagram = 512;
+  transport = mondemand_transport_lwes_native_create_with_options
+                ("127.0.0.1", 20508, NULL, &opts);
+  assert (transport != NULL);
+  /* small datagrams are packed by the transport itself */
+  assert (transport->encoding == NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  assert (mondemand_set_context (client, "cluster", "c1") == 0);
+
+  for (i = 0; i < 100; ++i)
+    {
+      snprintf (key, sizeof (key), "item%d", i);
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_INC, MONDEMAND_COUNTER,
+                                          key, i) == 0);
+    }
+  assert (mondemand_flush_stats (client) == 0);
+  assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                     &stats) == 0);
+  assert (stats.flushes == 1);
+  assert (stats.last_datagrams > 1);
+  assert (stats.datagrams == stats.last_datagrams);
+  assert (stats.dropped == 0 && stats.errors == 0);
+#ifdef HAVE_SENDMMSG
+  /* the whole flush went in one call */
+  assert (stats.last_syscalls == 1);
+#endif
+  memset (seen, 0, sizeof (seen));
+  assert (receive_split (listener, "MonDemand::StatsMsg", "k", 512,
+                         stats.last_datagrams, seen, 100, &bytes)
+          == stats.last_datagrams);
+  assert (bytes == stats.last_bytes);
+  for (i = 0; i < 100; ++i)
+    {
+      assert (seen[i]);
+    }
+
+  /* the same arrives sending one datagram per sendto on a non-blocking
+     socket, and through io_uring when it's built in */
+  for (variant = 0; variant < 2; ++variant)
+    {
+      memset (&opts, 0, sizeof (opts));
+      opts.max_datagram = 512;
+      if (variant == 0)
+        {
+          opts.batch = 1;
+          opts.nonblocking = 1;
+          opts.sndbuf = 65536;
+        }
+      else
+        {
+          opts.uring = 1;
+        }
+      other = mondemand_transport_lwes_native_create_with_options
+                ("127.0.0.1", 20508, NULL, &opts);
+#ifndef HAVE_LIBURING
+      if (variant == 1)
+        {
+          assert (other == NULL);
+          break;
+        }
+#endif
+      assert (other != NULL);
+      other_client = mondemand_client_create ("split");
+      assert (other_client != NULL);
+      assert (mondemand_add_transport (other_client, other) == 0);
+      assert (mondemand_set_context (other_client, "host", "h1") == 0);
+      assert (mondemand_set_context (other_client, "cluster", "c1") == 0);
+      for (i = 0; i < 100; ++i)
+        {
+          snprintf (key, sizeof (key), "item%d", i);
+          assert (mondemand_stats_perform_op (other_client,
+                                              __FILE__, __LINE__,
+                                              MONDEMAND_INC,
+                                              MONDEMAND_COUNTER,
+                                              key, i) == 0);
+        }
+      assert (mondemand_flush_stats (other_client) == 0);
+      assert (mondemand_transport_lwes_native_get_stats (other,
+                                                         &others) == 0);
+      assert (others.last_datagrams == stats.last_datagrams);
+      assert (others.last_syscalls
+              == (variant == 0 ? others.last_datagrams : 1));
+      assert (others.would_block == 0);
+      memset (seen, 0, sizeof (seen));
+      assert (receive_split (listener, "MonDemand::StatsMsg", "k", 512,
+                             others.last_datagrams, seen, 100, &bytes)
+              == others.last_datagrams);
+      assert (bytes == stats.last_bytes);
+      /* destroying the client flushes the same again */
+      mondemand_client_destroy (other_client);
+      memset (seen, 0, sizeof (seen));
+      assert (receive_split (listener, "MonDemand::StatsMsg", "k", 512,
+                             others.last_datagrams, seen, 100, &bytes)
+              == others.last_datagrams);
+    }
+  memset (&opts, 0, sizeof (opts));
+  opts.max_datagram = 512;
+
+  assert (mondemand_initialize_performance_trace (client, "id",
+                                                  "caller") == 0);
+  for (i = 0; i < 30; ++i)
+    {
+      snprintf (key, sizeof (key), "item%d", i);
+      assert (mondemand_add_performance_trace_timing (client, key,
+                                                      i + 1, i + 2) == 0);
+    }
+  assert (mondemand_flush_performance_trace (client) == 0);
+  assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                     &stats) == 0);
+  assert (stats.flushes == 2 && stats.last_datagrams > 1);
+  memset (seen, 0, sizeof (seen));
+  assert (receive_split (listener, "MonDemand::PerfMsg", "label", 512,
+                         stats.last_datagrams, seen, 30, &bytes)
+          == stats.last_datagrams);
+  for (i = 0; i < 30; ++i)
+    {
+      assert (seen[i]);
+    }
+
+  /* a stat too big for a datagram on its own is dropped, the rest sent */
+  assert (mondemand_reset_stats (client) == 0);
+  memset (long_key, 'x', sizeof (long_key) - 1);
+  long_key[sizeof (long_key) - 1] = '\0';
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      long_key, 1) == 0);
+  assert (mondemand_flush_stats (client) != 0);
+  assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                     &stats) == 0);
+  assert (stats.flushes == 3 && stats.dropped == 1);
+  memset (seen, 0, sizeof (seen));
+  assert (receive_split (listener, "MonDemand::StatsMsg", "k", 512,
+                         stats.last_datagrams, seen, 100, &bytes)
+          == stats.last_datagrams);
+  for (i = 0; i < 100; ++i)
+    {
+      assert (seen[i]);
+    }
+
+  mondemand_client_destroy (client);
+  lwes_listener_destroy (listener);
+}
+
+/* reads what's waiting in a non-blocking pipe into buffer */
+static int
+read_pipe (int fd, char *buffer, size_t size)
+{
+  int n = (int) read (fd, buffer, size - 1);
+
+  buffer[n > 0 ? n : 0] = '\0';
+  return n;
+}
+
+/* file descriptor transports write whole flushes at once */
+static void fd_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  char path[] = "/tmp/testmondemandXXXXXX";
+  char buffer[4096];
+  int fds[2];
+  int fd;
+
+  assert (mondemand_transport_fd_create (-1, MONDEMAND_FD_LINE, 0) == NULL);
+  assert (mondemand_transport_fd_create (1, MONDEMAND_FD_LINE, -1) == NULL);
+  assert (mondemand_transport_file_create ("/nonexistent/file",
+                                           MONDEMAND_FD_LINE, 0) == NULL);
+
+  assert (pipe (fds) == 0);
+  assert (fcntl (fds[0], F_SETFL, O_NONBLOCK) == 0);
+
+  /* line mode writes each flush as it happens */
+  client = mondemand_client_create ("fd");
+  assert (client != NULL);
+  transport = mondemand_transport_fd_create (fds[1], MONDEMAND_FD_LINE, 0);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_SET, MONDEMAND_GAUGE,
+                                      "a", 1) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_SET, MONDEMAND_COUNTER,
+                                      "b", 2) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (read_pipe (fds[0], buffer, sizeof (buffer)) > 0);
+  assert (strstr (buffer, "[fd] gauge : a : 1 : host=h1\n") != NULL);
+  assert (strstr (buffer, "[fd] counter : b : 2 : host=h1\n") != NULL);
+
+  assert (mondemand_initialize_trace (client, "owner", "id", "msg") == 0);
+  assert (mondemand_set_trace (client, "k", "v") == 0);
+  assert (mondemand_flush_trace (client) == 0);
+  assert (read_pipe (fds[0], buffer, sizeof (buffer)) > 0);
+  assert (strcmp (buffer, "[fd] owner:id : msg : k=v\n") == 0);
+  mondemand_clear_trace (client);
+  mondemand_client_destroy (client);
+  assert (read_pipe (fds[0], buffer, sizeof (buffer)) > 0);
+
+  /* block mode holds flushes until the block fills or it's destroyed */
+  client = mondemand_client_create ("fd");
+  assert (client != NULL);
+  transport = mondemand_transport_fd_create (fds[1], MONDEMAND_FD_BLOCK,
+                                             64);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_SET, MONDEMAND_GAUGE,
+                                      "a", 1) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (read_pipe (fds[0], buffer, sizeof (buffer)) < 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (read_pipe (fds[0], buffer, sizeof (buffer)) > 0);
+  assert (strcmp (buffer, "[fd] gauge : a : 1\n[fd] gauge : a : 1\n"
+                          "[fd] gauge : a : 1\n[fd] gauge : a : 1\n") == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (read_pipe (fds[0], buffer, sizeof (buffer)) < 0);
+  mondemand_client_destroy (client);
+  assert (read_pipe (fds[0], buffer, sizeof (buffer)) > 0);
+  assert (strncmp (buffer, "[fd] gauge : a : 1\n", 19) == 0);
+
+  /* the pipe is left open */
+  assert (write (fds[1], "x", 1) == 1);
+  close (fds[0]);
+  close (fds[1]);
+
+  /* file transports append */
+  fd = mkstemp (path);
+  assert (fd >= 0);
+  assert (write (fd, "first\n", 6) == 6);
+  client = mondemand_client_create ("fd");
+  assert (client != NULL);
+  transport = mondemand_transport_file_create (path, MONDEMAND_FD_LINE, 0);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_SET, MONDEMAND_GAUGE,
+                                      "a", 1) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  mondemand_client_destroy (client);
+  assert (lseek (fd, 0, SEEK_SET) == 0);
+  memset (buffer, 0, sizeof (buffer));
+  assert (read (fd, buffer, sizeof (buffer) - 1) > 0);
+  assert (strncmp (buffer, "first\n[fd] gauge : a : 1\n", 25) == 0);
+  close (fd);
+  unlink (path);
+}
+
+/* spool transports keep each flush as a record, which can be sent on
+   later through a transport taking encoded bytes */
+static void spool_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_transport *native = NULL;
+  struct mondemand_spool_options opts;
+  struct mondemand_native_stats stats;
+  struct m_spool_reader reader;
+  struct lwes_listener *listener = NULL;
+  struct lwes_event *event = NULL;
+  struct lwes_event_deserialize_tmp tmp;
+  const unsigned char *bytes = NULL;
+  char directory[] = "/tmp/testmondemandXXXXXX";
+  char base[64];
+  char **paths = NULL;
+  char *name = NULL;
+  size_t length = 0;
+  long long timestamp = 0;
+  int count = 0;
+  int records = 0;
+  int i;
+
+  assert (mkdtemp (directory) != NULL);
+  snprintf (base, sizeof (base), "%s/md", directory);
+  memset (&opts, 0, sizeof (opts));
+  opts.segment_size = -1;
+  assert (mondemand_transport_spool_create (base, &opts) == NULL);
+  assert (mondemand_transport_spool_create (NULL, NULL) == NULL);
+  assert (mondemand_transport_spool_create ("/nonexistent/md", NULL)
+          == NULL);
+
+  opts.segment_size = 1024 * 1024;
+  client = mondemand_client_create ("spool");
+  assert (client != NULL);
+  transport = mondemand_transport_spool_create (base, &opts);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  for (i = 0; i < 3; ++i)
+    {
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_INC, MONDEMAND_COUNTER,
+                                          "hits", 1) == 0);
+      assert (mondemand_flush_stats (client) == 0);
+    }
+  assert (mondemand_initialize_trace (client, "owner", "id", "msg") == 0);
+  assert (mondemand_flush_trace (client) == 0);
+  mondemand_clear_trace (client);
+  assert (mondemand_transport_lwes_native_get_stats (transport, &stats) == 0);
+  assert (stats.flushes == 4 && stats.datagrams == 4);
+  assert (stats.syscalls == 0 && stats.errors == 0);
+  mondemand_client_destroy (client);
+
+  listener = lwes_listener_create ((LWES_SHORT_STRING) "127.0.0.1",
+                                   NULL, 20509);
+  assert (listener != NULL);
+  native = mondemand_transport_lwes_native_create ("127.0.0.1", 20509,
+                                                   NULL, 0);
+  assert (native != NULL && native->bytes_sender_function != NULL);
+
+  assert (m_spool_segments (base, &paths, &count) == 0 && count == 1);
+  assert (m_spool_reader_open (&reader, paths[0]) == 0);
+  while (m_spool_reader_next (&reader, &bytes, &length, &timestamp) == 1)
+    {
+      assert (timestamp > 0);
+      assert (native->bytes_sender_function (bytes, length,
+                                             native->userdata) == 0);
+      event = lwes_event_create_no_name (NULL);
+      assert (lwes_listener_recv_by (listener, event, 1000)
+              == (int) length);
+      assert (lwes_event_get_name (event, &name) == 0);
+      /* three flushes, the trace, then the flush on destroy */
+      assert (strcmp (name, records == 3 ? "MonDemand::TraceMsg"
+                                         : "MonDemand::StatsMsg") == 0);
+      lwes_event_destroy (event);
+
+      event = lwes_event_create_no_name (NULL);
+      assert (lwes_event_from_bytes (event, (LWES_BYTE_P) bytes, length, 0,
+                                     &tmp) == (int) length);
+      lwes_event_destroy (event);
+      ++records;
+    }
+  assert (records == 5);
+  m_spool_reader_close (&reader);
+  assert (unlink (paths[0]) == 0);
+  m_spool_segments_free (paths, count);
+  assert (rmdir (directory) == 0);
+
+  mondemand_transport_lwes_native_destroy (native);
+  lwes_listener_destroy (listener);
+}
+
+/* shared memory transports copy each flush into the ring, and drop what
+   doesn't fit while nothing reads it */
+static void shm_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_native_stats stats;
+  struct m_ring *ring = NULL;
+  struct lwes_event *event = NULL;
+  struct lwes_event_deserialize_tmp tmp;
+  const unsigned char *bytes = NULL;
+  char path[] = "/dev/shm/testmondemandXXXXXX";
+  char key[32];
+  char *name = NULL;
+  size_t length = 0;
+  int fd;
+  int i;
+
+  assert (mondemand_transport_shm_create (NULL, 0) == NULL);
+  assert (mondemand_transport_shm_create ("/dev/shm", -1) == NULL);
+  assert (mondemand_transport_shm_create ("/nonexistent/ring", 0) == NULL);
+
+  fd = mkstemp (path);
+  assert (fd >= 0);
+  close (fd);
+  client = mondemand_client_create ("shm");
+  assert (client != NULL);
+  transport = mondemand_transport_shm_create (path, 16384);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "hits", 1) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (mondemand_transport_lwes_native_get_stats (transport, &stats) == 0);
+  assert (stats.datagrams == 1 && stats.syscalls == 0);
+
+  ring = m_ring_open (path, 0);
+  assert (ring != NULL);
+  assert (m_ring_peek (ring, &bytes, &length) == 1);
+  assert ((long long) length == stats.bytes);
+  event = lwes_event_create_no_name (NULL);
+  assert (lwes_event_from_bytes (event, (LWES_BYTE_P) bytes, length, 0,
+                                 &tmp) == (int) length);
+  assert (lwes_event_get_name (event, &name) == 0);
+  assert (strcmp (name, "MonDemand::StatsMsg") == 0);
+  lwes_event_destroy (event);
+  m_ring_release (ring);
+  assert (m_ring_peek (ring, &bytes, &length) == 0);
+
+  /* with the reader stalled the ring fills and flushes are dropped */
+  for (i = 0; i < 40; ++i)
+    {
+      snprintf (key, sizeof (key), "key%d", i);
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_INC, MONDEMAND_COUNTER,
+                                          key, 1) == 0);
+    }
+  for (i = 0; i < 100; ++i)
+    {
+      mondemand_flush_stats (client);
+    }
+  assert (mondemand_transport_lwes_native_get_stats (transport, &stats) == 0);
+  assert (stats.would_block > 0);
+  assert (stats.would_block == m_ring_drops (ring));
+  assert (m_ring_peek (ring, &bytes, &length) == 1);
+
+  mondemand_client_destroy (client);
+  m_ring_close (ring);
+  unlink (path);
+}
+
+/* stream transports write each event as a length prefixed frame to
+   whatever is listening */
+static void stream_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_stream_options opts;
+  struct mondemand_stream_stats stats;
+  struct mondemand_native_stats native;
+  struct lwes_event *event = NULL;
+  struct lwes_event_deserialize_tmp tmp;
+  struct sockaddr_un un;
+  unsigned char frame[65536];
+  char directory[] = "/tmp/testmondemandXXXXXX";
+  char address[160];
+  char *name = NULL;
+  size_t length;
+  size_t got;
+  ssize_t n;
+  int listener;
+  int fd;
+
+  assert (mondemand_transport_stream_create (NULL) == NULL);
+  assert (mondemand_transport_stream_create ("udp:localhost:2000") == NULL);
+  memset (&opts, 0, sizeof (opts));
+  opts.policy = (MondemandQueuePolicy) 3;
+  assert (mondemand_transport_stream_create_with_options (
+            "unix:/tmp/x", &opts) == NULL);
+
+  assert (mkdtemp (directory) != NULL);
+  memset (&un, 0, sizeof (un));
+  un.sun_family = AF_UNIX;
+  snprintf (un.sun_path, sizeof (un.sun_path), "%s/sock", directory);
+  snprintf (address, sizeof (address), "unix:%s", un.sun_path);
+  listener = socket (AF_UNIX, SOCK_STREAM, 0);
+  assert (listener >= 0);
+  assert (bind (listener, (struct sockaddr *) &un, sizeof (un)) == 0);
+  assert (listen (listener, 1) == 0);
+
+  client = mondemand_client_create ("stream");
+  assert (client != NULL);
+  opts.policy = MONDEMAND_QUEUE_DROP_NEWEST;
+  transport = mondemand_transport_stream_create_with_options (address, &opts);
+  assert (transport != NULL);
+  assert (mondemand_transport_stream_get_stats (NULL, &stats) == -2);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "hits", 1) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                     &native) == 0);
+  assert (native.datagrams == 1);
+
+  fd = accept (listener, NULL, NULL);
+  assert (fd >= 0);
+  for (got = 0; got < 4; got += (size_t) n)
+    {
+      n = read (fd, frame + got, 4 - got);
+      assert (n > 0);
+    }
+  length = ((size_t) frame[0] << 24) | ((size_t) frame[1] << 16)
+           | ((size_t) frame[2] << 8) | frame[3];
+  assert ((long long) length == native.bytes);
+  for (got = 0; got < length; got += (size_t) n)
+    {
+      n = read (fd, frame + got, length - got);
+      assert (n > 0);
+    }
+  event = lwes_event_create_no_name (NULL);
+  assert (lwes_event_from_bytes (event, (LWES_BYTE_P) frame, length, 0,
+                                 &tmp) == (int) length);
+  assert (lwes_event_get_name (event, &name) == 0);
+  assert (strcmp (name, "MonDemand::StatsMsg") == 0);
+  lwes_event_destroy (event);
+
+  assert (mondemand_transport_stream_get_stats (transport, &stats) == 0);
+  assert (stats.queued == 1);
+  assert (stats.queued_bytes == native.bytes + 4);
+  assert (stats.connects == 1);
+  mondemand_client_destroy (client);
+
+  /* frames the stream drops aren't counted as sent */
+  client = mondemand_client_create ("stream");
+  assert (client != NULL);
+  opts.buffer_size = 8;
+  transport = mondemand_transport_stream_create_with_options (address, &opts);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "hits", 1) == 0);
+  assert (mondemand_flush_stats (client) != 0);
+  assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                     &native) == 0);
+  assert (native.datagrams == 0 && native.bytes == 0);
+  assert (native.last_datagrams == 0 && native.would_block == 1);
+  mondemand_client_destroy (client);
+
+  close (fd);
+  close (listener);
+  unlink (un.sun_path);
+  rmdir (directory);
+}
+
+/* binds a udp socket to a free loopback port, returning it and the port */
+static int udp_sink (int *port)
+{
+  struct sockaddr_in in;
+  socklen_t length = sizeof (in);
+  int fd = socket (AF_INET, SOCK_DGRAM, 0);
+
+  assert (fd >= 0);
+  memset (&in, 0, sizeof (in));
+  in.sin_family = AF_INET;
+  in.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  assert (bind (fd, (struct sockaddr *) &in, sizeof (in)) == 0);
+  assert (getsockname (fd, (struct sockaddr *) &in, &length) == 0);
+  *port = ntohs (in.sin_port);
+  return fd;
+}
+
+/* reads the next datagram, NUL terminated, or returns -1 if there isn't
+   one */
+static int udp_read (int fd, char *buffer, size_t size)
+{
+  ssize_t n = recv (fd, buffer, size - 1, MSG_DONTWAIT);
+
+  if (n < 0)
+    {
+      return -1;
+    }
+  buffer[n] = '\0';
+  return (int) n;
+}
+
+/* statsd transports send counters as what they went up by and pack lines
+   into datagrams */
+static void statsd_test (void)
+{
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_statsd_options opts;
+  struct mondemand_native_stats stats;
+  char datagram[2048];
+  char key[32];
+  char *line = NULL;
+  char *save = NULL;
+  int lines = 0;
+  int port;
+  int fd;
+  int n;
+  int i;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.max_datagram = -1;
+  assert (mondemand_transport_statsd_create ("127.0.0.1", 8125,
+                                             &opts) == NULL);
+  assert (mondemand_transport_statsd_create ("not an ip", 8125,
+                                             NULL) == NULL);
+
+  fd = udp_sink (&port);
+  client = mondemand_client_create ("app");
+  assert (client != NULL);
+  transport = mondemand_transport_statsd_create ("127.0.0.1", port, NULL);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "h1,x") == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "hits", 5) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_SET, MONDEMAND_GAUGE,
+                                      "temp:c", -3) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  n = udp_read (fd, datagram, sizeof (datagram));
+  assert (n > 0);
+  assert (strstr (datagram, "hits:5|c|#prog_id:app,host:h1_x") != NULL);
+  /* a negative gauge is set to 0 first */
+  assert (strstr (datagram, "temp_c:0|g|#prog_id:app,host:h1_x\n"
+                            "temp_c:-3|g|#prog_id:app,host:h1_x") != NULL);
+  assert (udp_read (fd, datagram, sizeof (datagram)) == -1);
+  assert (mondemand_transport_lwes_native_get_stats (transport, &stats) == 0);
+  assert (stats.datagrams == 1 && stats.bytes == n);
+
+  /* counters are sent as what was added since the last flush, and not at
+     all when nothing was */
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "hits", 2) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (udp_read (fd, datagram, sizeof (datagram)) > 0);
+  assert (strstr (datagram, "hits:2|c|") != NULL);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (udp_read (fd, datagram, sizeof (datagram)) > 0);
+  assert (strstr (datagram, "hits:") == NULL);
+  assert (strstr (datagram, "temp_c:-3|g") != NULL);
+  /* destroying flushes once more */
+  mondemand_client_destroy (client);
+  while (udp_read (fd, datagram, sizeof (datagram)) > 0)
+    {
+    }
+
+  /* plain lines are packed into as few datagrams as fit */
+  client = mondemand_client_create ("app");
+  assert (client != NULL);
+  opts.max_datagram = 100;
+  opts.plain = 1;
+  transport = mondemand_transport_statsd_create ("127.0.0.1", port, &opts);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  for (i = 0; i < 20; ++i)
+    {
+      snprintf (key, sizeof (key), "key%d", i);
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_INC, MONDEMAND_COUNTER,
+                                          key, i + 1) == 0);
+    }
+  assert (mondemand_flush_stats (client) == 0);
+  assert (mondemand_transport_lwes_native_get_stats (transport, &stats) == 0);
+  for (i = 0; (n = udp_read (fd, datagram, sizeof (datagram))) > 0; ++i)
+    {
+      assert (n <= 100);
+      for (line = strtok_r (datagram, "\n", &save); line != NULL;
+           line = strtok_r (NULL, "\n", &save))
+        {
+          assert (strncmp (line, "app.key", 7) == 0);
+          assert (strstr (line, "|c") != NULL);
+          assert (strchr (line, '#') == NULL);
+          ++lines;
+        }
+    }
+  assert (lines == 20);
+  /* 20 lines of 12 to 14 bytes, 6 or 7 to a datagram */
+  assert (i >= 3 && i <= 4 && stats.datagrams == i);
+
+  mondemand_client_destroy (client);
+  close (fd);
+}
+
+/* fetches path from the metrics endpoint, returning the whole response */
+static const char *http_get (int port, const char *path)
+{
+  static char response[65536];
+  struct sockaddr_in in;
+  char request[256];
+  size_t used = 0;
+  ssize_t n;
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+
+  assert (fd >= 0);
+  memset (&in, 0, sizeof (in));
+  in.sin_family = AF_INET;
+  in.sin_port = htons ((unsigned short) port);
+  in.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  assert (connect (fd, (struct sockaddr *) &in, sizeof (in)) == 0);
+  snprintf (request, sizeof (request), "GET %s HTTP/1.1\r\n\r\n", path);
+  assert (write (fd, request, strlen (request))
+          == (ssize_t) strlen (request));
+  while ((n = read (fd, response + used, sizeof (response) - 1 - used)) > 0)
+    {
+      used += (size_t) n;
+    }
+  response[used] = '\0';
+  close (fd);
+  return response;
+}
+
+static void *prometheus_incrementer (void *arg)
+{
+  struct mondemand_client *client = (struct mondemand_client *) arg;
+  int i;
+
+  for (i = 0; i < 10000; ++i)
+    {
+      mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                  MONDEMAND_INC, MONDEMAND_COUNTER,
+                                  "busy", 1);
+    }
+  return NULL;
+}
+
+/* the metrics endpoint renders the stats with the contexts as labels */
+static void prometheus_test (void)
+{
+  struct mondemand_client *client = NULL;
+  pthread_t thread;
+  const char *r = NULL;
+  char line[64];
+  int port;
+  int i;
+
+  client = mondemand_client_create ("app");
+  assert (client != NULL);
+  assert (mondemand_prometheus_port (client) == -1);
+  assert (mondemand_prometheus_start (NULL, "127.0.0.1:0") == -2);
+  assert (mondemand_prometheus_start (client, NULL) == -2);
+  assert (mondemand_prometheus_start (client, "127.0.0.1") == -1);
+  assert (mondemand_prometheus_start (client, "127.0.0.1:0") == 0);
+  assert (mondemand_prometheus_start (client, "127.0.0.1:0") == -2);
+  port = mondemand_prometheus_port (client);
+  assert (port > 0);
+
+  /* nothing yet */
+  r = http_get (port, "/metrics");
+  assert (strncmp (r, "HTTP/1.1 200 OK\r\n", 17) == 0);
+  assert (strstr (r, "Content-Type: text/plain; version=0.0.4") != NULL);
+  assert (strcmp (strstr (r, "\r\n\r\n"), "\r\n\r\n") == 0);
+  r = http_get (port, "/");
+  assert (strncmp (r, "HTTP/1.1 404 ", 13) == 0);
+
+  assert (mondemand_set_context (client, "host", "h\"1\\") == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "hits.total", 5) == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_SET, MONDEMAND_GAUGE,
+                                      "9temp", -3) == 0);
+  r = http_get (port, "/metrics?x");
+  assert (strstr (r, "# TYPE hits_total counter\n"
+                     "hits_total{prog_id=\"app\",host=\"h\\\"1\\\\\"} 5\n")
+          != NULL);
+  assert (strstr (r, "# TYPE _9temp gauge\n"
+                     "_9temp{prog_id=\"app\",host=\"h\\\"1\\\\\"} -3\n")
+          != NULL);
+
+  /* labels follow the contexts */
+  mondemand_remove_all_contexts (client);
+  r = http_get (port, "/metrics");
+  assert (strstr (r, "hits_total{prog_id=\"app\"} 5\n") != NULL);
+
+  /* scrapes while another thread increments see a growing total, and
+     snapshots grow with the table */
+  for (i = 0; i < 100; ++i)
+    {
+      snprintf (line, sizeof (line), "key%d", i);
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_INC, MONDEMAND_COUNTER,
+                                          line, i) == 0);
+    }
+  assert (pthread_create (&thread, NULL, prometheus_incrementer,
+                          client) == 0);
+  for (i = 0; i < 5; ++i)
+    {
+      r = http_get (port, "/metrics");
+      assert (strstr (r, "key99{prog_id=\"app\"} 99\n") != NULL);
+    }
+  pthread_join (thread, NULL);
+  r = http_get (port, "/metrics");
+  assert (strstr (r, "busy{prog_id=\"app\"} 10000\n") != NULL);
+
+  mondemand_prometheus_stop (client);
+  assert (mondemand_prometheus_port (client) == -1);
+  assert (mondemand_prometheus_start (client, "127.0.0.1:0") == 0);
+  mondemand_client_destroy (client);
+}
+
+/* finds the nth occurrence of field in a protobuf message, setting *bytes
+   and *length for a length delimited field and *number for the others.
+   Returns the wire type or -1 if it isn't there */
+static int pb_field (const unsigned char *message, size_t size, int field,
+                     int nth, const unsigned char **bytes, size_t *length,
+                     unsigned long long *number)
+{
+  size_t at = 0;
+  unsigned long long key;
+  unsigned long long value;
+  int shift;
+  int i;
+
+  while (at < size)
+    {
+      for (key = 0, shift = 0; message[at] & 0x80; shift += 7)
+        {
+          key |= (unsigned long long) (message[at++] & 0x7f) << shift;
+        }
+      key |= (unsigned long long) message[at++] << shift;
+      value = 0;
+      switch (key & 7)
+        {
+        case 0:
+        case 2:
+          for (shift = 0; message[at] & 0x80; shift += 7)
+            {
+              value |= (unsigned long long) (message[at++] & 0x7f) << shift;
+            }
+          value |= (unsigned long long) message[at++] << shift;
+          break;
+        case 1:
+          for (i = 0; i < 8; ++i)
+            {
+              value |= (unsigned long long) message[at++] << (8 * i);
+            }
+          break;
+        default:
+          assert (0);
+        }
+      if ((int) (key >> 3) == field && nth-- == 0)
+        {
+          *bytes = message + at;
+          *length = (key & 7) == 2 ? (size_t) value : 0;
+          *number = value;
+          return (int) (key & 7);
+        }
+      if ((key & 7) == 2)
+        {
+          at += (size_t) value;
+        }
+    }
+  assert (at == size);
+  return -1;
+}
+
+/* a length delimited field, asserting it's there */
+static const unsigned char *pb_message (const unsigned char *message,
+                                        size_t size, int field, int nth,
+                                        size_t *length)
+{
+  const unsigned char *bytes = NULL;
+  unsigned long long number;
+
+  assert (pb_field (message, size, field, nth, &bytes, length,
+                    &number) == 2);
+  return bytes;
+}
+
+/* a numeric field, asserting it's there */
+static unsigned long long pb_number (const unsigned char *message,
+                                     size_t size, int field)
+{
+  const unsigned char *bytes = NULL;
+  unsigned long long number = 0;
+  size_t length;
+
+  assert (pb_field (message, size, field, 0, &bytes, &length,
+                    &number) == 0
+          || pb_field (message, size, field, 0, &bytes, &length,
+                       &number) == 1);
+  return number;
+}
+
+/* whether a string field is value */
+static int pb_string_is (const unsigned char *message, size_t size,
+                         int field, const char *value)
+{
+  size_t length;
+  const unsigned char *bytes = pb_message (message, size, field, 0,
+                                           &length);
+
+  return length == strlen (value) && memcmp (bytes, value, length) == 0;
+}
+
+/* reads the next frame written by an otlp file transport, returning the
+   request's length or 0 at the end */
+static size_t otlp_frame (FILE *file, unsigned char *request, int *kind)
+{
+  unsigned char header[5];
+  size_t length;
+
+  if (fread (header, 1, 5, file) != 5)
+    {
+      return 0;
+    }
+  length = ((size_t) header[0] << 24) | ((size_t) header[1] << 16)
+           | ((size_t) header[2] << 8) | header[3];
+  assert (length > 1 && length <= 65535);
+  *kind = header[4];
+  assert (fread (request, 1, length - 1, file) == length - 1);
+  return length - 1;
+}
+
+/* otlp transports write stats as metrics and timings as spans */
+static void otlp_test (void)
+{
+  static unsigned char request[65536];
+  struct mondemand_client *client = NULL;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_native_stats stats;
+  char directory[] = "/tmp/testotlpXXXXXX";
+  char path[64];
+  char key[32];
+  const unsigned char *resource = NULL;
+  const unsigned char *scope = NULL;
+  const unsigned char *item = NULL;
+  const unsigned char *data = NULL;
+  const unsigned char *point = NULL;
+  const unsigned char *root_id = NULL;
+  const unsigned char *trace_id = NULL;
+  size_t resource_length, scope_length, item_length, data_length;
+  size_t point_length, length, id_length;
+  unsigned long long number;
+  FILE *file = NULL;
+  int metrics = 0;
+  int frames = 0;
+  int kind = 0;
+  int i;
+
+  assert (mondemand_transport_otlp_create (NULL, NULL) == NULL);
+  assert (mondemand_transport_otlp_create ("udp:nowhere", NULL) == NULL);
+  assert (mondemand_transport_otlp_file_create (NULL) == NULL);
+  assert (mondemand_transport_otlp_file_create ("/nonexistent/x") == NULL);
+
+  assert (mkdtemp (directory) != NULL);
+  snprintf (path, sizeof (path), "%s/otlp", directory);
+  client = mondemand_client_create ("app");
+  assert (client != NULL);
+  transport = mondemand_transport_otlp_file_create (path);
+  assert (transport != NULL);
+  assert (mondemand_add_transport (client, transport) == 0);
+  assert (mondemand_set_context (client, "host", "h1") == 0);
+  assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                      MONDEMAND_INC, MONDEMAND_COUNTER,
+                                      "hits", 5) == 0);
+  assert (mondemand_flush_stats (client) == 0);
+  assert (mondemand_initialize_performance_trace (client, "id1",
+                                                  "caller") == 0);
+  assert (mondemand_add_performance_trace_timing (client, "a",
+                                                  1000, 1005) == 0);
+  assert (mondemand_add_performance_trace_timing (client, "b",
+                                                  1002, 1010) == 0);
+  assert (mondemand_flush_performance_trace (client) == 0);
+  assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                     &stats) == 0);
+  assert (stats.datagrams == 2 && stats.dropped == 0);
+
+  file = fopen (path, "rb");
+  assert (file != NULL);
+
+  /* the counter is a cumulative monotonic sum of a resource named after
+     the program, with the contexts as attributes */
+  length = otlp_frame (file, request, &kind);
+  assert (length > 0);
+  assert (kind == MONDEMAND_OTLP_METRICS);
+  data = pb_message (request, length, 1, 0, &data_length);
+  assert (pb_field (request, length, 1, 1, &item, &item_length,
+                    &number) == -1);
+  resource = pb_message (data, data_length, 1, 0, &resource_length);
+  item = pb_message (resource, resource_length, 1, 0, &item_length);
+  assert (pb_string_is (item, item_length, 1, "service.name"));
+  point = pb_message (item, item_length, 2, 0, &point_length);
+  assert (pb_string_is (point, point_length, 1, "app"));
+  item = pb_message (resource, resource_length, 1, 1, &item_length);
+  assert (pb_string_is (item, item_length, 1, "host"));
+  scope = pb_message (data, data_length, 2, 0, &scope_length);
+  item = pb_message (scope, scope_length, 1, 0, &item_length);
+  assert (pb_string_is (item, item_length, 1, "mondemand"));
+  item = pb_message (scope, scope_length, 2, 0, &item_length);
+  assert (pb_string_is (item, item_length, 1, "hits"));
+  data = pb_message (item, item_length, 7, 0, &data_length);
+  assert (pb_number (data, data_length, 2) == 2);
+  assert (pb_number (data, data_length, 3) == 1);
+  point = pb_message (data, data_length, 1, 0, &point_length);
+  assert (pb_number (point, point_length, 6) == 5);
+  assert (pb_number (point, point_length, 2)
+          < pb_number (point, point_length, 3));
+
+  /* the timings are children of a span covering them all, the resource
+     named after the caller label */
+  length = otlp_frame (file, request, &kind);
+  assert (kind == MONDEMAND_OTLP_TRACES);
+  data = pb_message (request, length, 1, 0, &data_length);
+  resource = pb_message (data, data_length, 1, 0, &resource_length);
+  item = pb_message (resource, resource_length, 1, 0, &item_length);
+  point = pb_message (item, item_length, 2, 0, &point_length);
+  assert (pb_string_is (point, point_length, 1, "caller"));
+  scope = pb_message (data, data_length, 2, 0, &scope_length);
+  item = pb_message (scope, scope_length, 2, 0, &item_length);
+  assert (pb_string_is (item, item_length, 5, "caller"));
+  trace_id = pb_message (item, item_length, 1, 0, &id_length);
+  assert (id_length == 16);
+  root_id = pb_message (item, item_length, 2, 0, &id_length);
+  assert (id_length == 8);
+  assert (pb_number (item, item_length, 7) == 1000000000ULL);
+  assert (pb_number (item, item_length, 8) == 1010000000ULL);
+  for (i = 1; i <= 2; ++i)
+    {
+      item = pb_message (scope, scope_length, 2, i, &item_length);
+      assert (pb_string_is (item, item_length, 5, i == 1 ? "a" : "b"));
+      assert (memcmp (pb_message (item, item_length, 1, 0, &id_length),
+                      trace_id, 16) == 0);
+      assert (memcmp (pb_message (item, item_length, 4, 0, &id_length),
+                      root_id, 8) == 0);
+      assert (memcmp (pb_message (item, item_length, 2, 0, &id_length),
+                      root_id, 8) != 0);
+    }
+  assert (pb_number (item, item_length, 7) == 1002000000ULL);
+  assert (otlp_frame (file, request, &kind) == 0);
+
+  /* big flushes are split into requests which each have the resource */
+  for (i = 0; i < 3000; ++i)
+    {
+      snprintf (key, sizeof (key), "gauge%d", i);
+      assert (mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                                          MONDEMAND_SET, MONDEMAND_GAUGE,
+                                          key, -i) == 0);
+    }
+  assert (mondemand_flush_stats (client) == 0);
+  clearerr (file);
+  while ((length = otlp_frame (file, request, &kind)) > 0)
+    {
+      ++frames;
+      data = pb_message (request, length, 1, 0, &data_length);
+      resource = pb_message (data, data_length, 1, 0, &resource_length);
+      scope = pb_message (data, data_length, 2, 0, &scope_length);
+      for (i = 0; pb_field (scope, scope_length, 2, i, &item, &item_length,
+                            &number) == 2; ++i)
+        {
+          ++metrics;
+          if (pb_string_is (item, item_length, 1, "gauge7"))
+            {
+              data = pb_message (item, item_length, 5, 0, &data_length);
+              point = pb_message (data, data_length, 1, 0, &point_length);
+              assert ((long long) pb_number (point, point_length, 6) == -7);
+            }
+        }
+    }
+  assert (metrics == 3001);
+  assert (frames > 1);
+  assert (mondemand_transport_lwes_native_get_stats (transport,
+                                                     &stats) == 0);
+  assert (stats.datagrams == 2 + frames && stats.dropped == 0);
+
+  fclose (file);
+  mondemand_client_destroy (client);
+  unlink (path);
+  rmdir (directory);
+}
+
+static void other_test (void)
+{
+  int i;
+  for (i=0; i < 8; i++)
+    {
+      assert (
+        mondemand_log_level_from_string (MonDemandLogLevelStrings[i]) == i
+      );
+    }
+  assert (mondemand_log_level_from_string (NULL) == -1);
+  assert (mondemand_log_level_from_string ("unknown") == -1);
+
+  assert (MONDEMAND_GAUGE == mondemand_stat_type_from_string ("gauge"));
+  assert (MONDEMAND_COUNTER == mondemand_stat_type_from_string ("counter"));
+  assert (MONDEMAND_UNKNOWN == mondemand_stat_type_from_string ("unknown"));
+}
+
+int
+main(void)
+{
+  int i=0;
+  const char *data = NULL;
+  const char **list = NULL;
+  struct mondemand_client *client = NULL;
+  struct mondemand_trace_id trace_id, trace_id2;
+  struct mondemand_transport *transport = NULL;
+  struct mondemand_transport *stderr_transport = NULL;
+  char buf[512];
+
+  /* test NULL parameter */
+  client = mondemand_client_create(NULL);
+  assert( client == NULL );
+
+  /* this should work fine */
+  client = mondemand_client_create("test1234");
+  assert( client != NULL );
+
+  /* set a valid send level then some bogus ones */
+  mondemand_set_immediate_send_level(client, M_LOG_ALERT);
+  mondemand_set_immediate_send_level(client, -1);
+  mondemand_set_immediate_send_level(client, 100000);
+  assert( client->immediate_send_level == M_LOG_ALERT );
+
+  /* set a valid send level then some bogus ones */
+  mondemand_set_no_send_level(client, M_LOG_NOTICE);
+  mondemand_set_no_send_level(client, -100);
+  mondemand_set_no_send_level(client, 56494949);
+  assert( client->no_send_level == M_LOG_NOTICE );
+
+  /* destroy it */
+  mondemand_client_destroy(client);
+
+  /* create a new one, but with memory allocation problems */
+  strdup_fail = 1;
+  client = mondemand_client_create("this_should_fail");
+  assert( client == NULL );
+  strdup_fail = 0;
+
+  malloc_fail = 1;
+  client = mondemand_client_create("this_also_should_fail");
+  assert( client == NULL );
+  malloc_fail = 0;
+
+  /* this should do nothing since the client is NULL */
+  mondemand_client_destroy(client);
+
+  /* now create a valid one */
+  client = mondemand_client_create("test1234");
+  assert( client != NULL );
+
+  /* add some transports */
+  transport = make_test_transport ();
+  mondemand_add_transport(client, transport); 
+
+  realloc_fail = 1;
+  mondemand_add_transport(client, transport);
+  realloc_fail = 0;
+
+  /* set some contexts */
+  assert (mondemand_set_context(client, "context-key-1", "context-value-1") == 0);
+
+  /* try it with strdup errors */
+  strdup_fail = 1;
+  mondemand_set_context(client, "abc", "123");
+  strdup_fail = 0;
+
+  /* create a grip of contexts */
+  for( i=0; i<1000; ++i )
+  {
+    sprintf(buf, "grip-%d", i);
+    mondemand_set_context(client, buf, "this is a grip of data");
+  }
+
+  /* fetch some of them */
+  data = mondemand_get_context(client, "grip-100");
+  assert( strcmp(data, "this is a grip of data") == 0 );
+
+  /* remove some of them */
+  mondemand_remove_context(client, "grip-101");
+  mondemand_remove_context(client, "grip-381");
+
+  /* get some of the data that isn't there */
+  data = mondemand_get_context(client, "grip-101");
+  assert( data == NULL );
+
+  /* get a list of keys */
+  list = mondemand_get_context_keys(client); 
+  free(list);
+
+  /* overwrite some of it */
+  mondemand_set_context(client, "grip-200", "new value");
+  data = mondemand_get_context(client, "grip-200");
+  assert( strcmp(data, "new value") == 0 ); 
+
+  /* set some contexts where the hash table fails */
+  m_hash_fail = 1; 
+  assert( mondemand_set_context(client, "bogus123", "silly345") != 0 );
+  m_hash_fail = 0;
+
+  /* remove the rest */
+  mondemand_remove_all_contexts(client);
+  assert( m_hash_table_num (client->contexts) == 0 );
+
+  /* leave some dangling contexts for destroy to clean up */
+  for( i=0; i<1000; ++i )
+  {
+    sprintf(buf, "test-%d", i);
+    mondemand_set_context(client, buf, "hi there");
+  }
+
+  /* make sure we've got data */
+  list = mondemand_get_context_keys(client);
+  for( i=0; list[i] != NULL; ++i );
+  assert( i > 999 );
+  free(list);
+
+  /* create a trace ID */
+  trace_id = mondemand_trace_id(12345);  
+  trace_id2 = mondemand_trace_id(34567);
+
+  /* compare them */
+  assert( mondemand_trace_id_compare(&trace_id, &trace_id2) == -1 );
+  assert( mondemand_trace_id_compare(&trace_id2, &trace_id) == 1 );
+  assert( mondemand_trace_id_compare(&trace_id, &trace_id) == 0 );
+  assert( mondemand_trace_id_compare(&MONDEMAND_NULL_TRACE_ID,
+                                     &MONDEMAND_NULL_TRACE_ID) == 0 );
+
+  /* log some stuff */
+  mondemand_log_real(client, __FILE__, __LINE__, M_LOG_EMERG, trace_id,
+                     "this is a test");
+  mondemand_log_real(client, __FILE__, __LINE__, M_LOG_ERR,
+                     MONDEMAND_NULL_TRACE_ID, "another test");
+
+
+  /* lower the no send threshold */
+  mondemand_set_no_send_level(client, M_LOG_DEBUG);
+
+  /* check the log levels */
+  assert( mondemand_level_is_enabled(client, M_LOG_INFO) > 0 );
+  mondemand_level_is_enabled(NULL, -5);
+
+  /* log a lot of stuff, as if we were in an inner loop */
+  for( i=0; i<1000; ++i )
+  {
+    mondemand_log_real(client, __FILE__, __LINE__, M_LOG_INFO,
+                       MONDEMAND_NULL_TRACE_ID, "spamspamspam");
+  }
+
+  /* this should fail since we're unable to allocate the message */
+  malloc_fail = 1;
+  mondemand_log_real(client, __FILE__, __LINE__, M_LOG_INFO,
+                     MONDEMAND_NULL_TRACE_ID, "memoryerrors");
+  malloc_fail = 0;
+
+  /* change some stats */
+  mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                              MONDEMAND_INC, MONDEMAND_COUNTER,
+                              "speed", 999999);
+  mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                              MONDEMAND_INC, MONDEMAND_COUNTER,
+                              NULL, 11111);
+  mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                              MONDEMAND_INC, MONDEMAND_COUNTER,
+                              "speed", 111111);
+  mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                              MONDEMAND_DEC, MONDEMAND_COUNTER,
+                              "speed", 111111);
+  mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                              MONDEMAND_SET, MONDEMAND_COUNTER,
+                              "speed", 888888);
+  mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                              MONDEMAND_SET, MONDEMAND_COUNTER,
+                              NULL, 101010);
+
+  malloc_fail = 1;
+  mondemand_stats_perform_op (client, __FILE__, __LINE__,
+                              MONDEMAND_INC, MONDEMAND_COUNTER,
                               "failboat", 101);
   mondemand_stats_perform_op (client, __FILE__, __LINE__,
                               MONDEMAND_SET, MONDEMAND_COUNTER,
@@ -751,6 +3562,30 @@ main(void)
   trace_test ();
   perf_test ();
   annotation_test ();
+  rate_limit_test ();
+  sample_test ();
+  batching_test ();
+  ring_test ();
+  kv_test ();
+  dictionary_test ();
+  async_test ();
+  isolated_test ();
+  transport_v2_test ();
+  internal_stats_test ();
+  scheduler_test ();
+  encoding_test ();
+  native_test ();
+  split_test ();
+#if defined(HAVE_LIBURING) && defined(HAVE_SENDMMSG)
+  uring_test ();
+#endif
+  fd_test ();
+  spool_test ();
+  shm_test ();
+  stream_test ();
+  statsd_test ();
+  prometheus_test ();
+  otlp_test ();
   other_test ();
 
   return 0;
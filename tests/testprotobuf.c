@@ -0,0 +1,122 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m_protobuf.h"
+
+static unsigned char buffer[4096];
+
+int
+main (void)
+{
+  struct m_protobuf_writer writer;
+  struct m_protobuf_mark mark;
+  unsigned char payload[300];
+  size_t length = 0;
+  int i;
+
+  assert (m_protobuf_varint_size (0) == 1);
+  assert (m_protobuf_varint_size (127) == 1);
+  assert (m_protobuf_varint_size (128) == 2);
+  assert (m_protobuf_varint_size (16383) == 2);
+  assert (m_protobuf_varint_size (16384) == 3);
+  assert (m_protobuf_varint_size (~0ULL) == 10);
+  assert (M_PROTOBUF_TAG (1, M_PROTOBUF_VARINT) == 0x08);
+  assert (M_PROTOBUF_TAG (15, M_PROTOBUF_BYTES) == 0x7a);
+
+  /* the examples from the protobuf encoding guide */
+  m_protobuf_begin (&writer, buffer, sizeof (buffer));
+  m_protobuf_varint (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_VARINT), 150);
+  m_protobuf_string (&writer, M_PROTOBUF_TAG (2, M_PROTOBUF_BYTES),
+                     "testing");
+  m_protobuf_string (&writer, M_PROTOBUF_TAG (3, M_PROTOBUF_BYTES), NULL);
+  m_protobuf_open (&writer, M_PROTOBUF_TAG (3, M_PROTOBUF_BYTES));
+  m_protobuf_varint (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_VARINT), 150);
+  m_protobuf_close (&writer);
+  m_protobuf_fixed64 (&writer, M_PROTOBUF_TAG (4, M_PROTOBUF_FIXED64),
+                      0x0102030405060708ULL);
+  m_protobuf_varint (&writer, M_PROTOBUF_TAG (5, M_PROTOBUF_VARINT),
+                     (unsigned long long) -1LL);
+  assert (m_protobuf_end (&writer, &length) == 0);
+  assert (length == 3 + 9 + 5 + 9 + 11);
+  assert (memcmp (buffer,
+                  "\x08\x96\x01"
+                  "\x12\x07testing"
+                  "\x1a\x03\x08\x96\x01"
+                  "\x21\x08\x07\x06\x05\x04\x03\x02\x01"
+                  "\x28\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01",
+                  length) == 0);
+
+  /* a message longer than 127 bytes is moved along for its length */
+  memset (payload, 'x', sizeof (payload));
+  m_protobuf_begin (&writer, buffer, sizeof (buffer));
+  m_protobuf_open (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_BYTES));
+  m_protobuf_open (&writer, M_PROTOBUF_TAG (2, M_PROTOBUF_BYTES));
+  m_protobuf_bytes (&writer, M_PROTOBUF_TAG (3, M_PROTOBUF_BYTES),
+                    payload, sizeof (payload));
+  m_protobuf_close (&writer);
+  m_protobuf_close (&writer);
+  assert (m_protobuf_end (&writer, &length) == 0);
+  /* 303 bytes of field 3, 306 of field 2 */
+  assert (length == 1 + 2 + 1 + 2 + 1 + 2 + 300);
+  assert (memcmp (buffer, "\x0a\xb2\x02\x12\xaf\x02\x1a\xac\x02", 9) == 0);
+  assert (buffer[9] == 'x' && buffer[length - 1] == 'x');
+
+  /* messages must be closed, and not closed too often */
+  m_protobuf_begin (&writer, buffer, sizeof (buffer));
+  m_protobuf_open (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_BYTES));
+  assert (m_protobuf_end (&writer, &length) == -1);
+  m_protobuf_close (&writer);
+  m_protobuf_close (&writer);
+  assert (m_protobuf_end (&writer, &length) == -1);
+
+  /* nesting is limited */
+  m_protobuf_begin (&writer, buffer, sizeof (buffer));
+  for (i = 0; i <= M_PROTOBUF_DEPTH; ++i)
+    {
+      m_protobuf_open (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_BYTES));
+    }
+  assert (writer.overflow);
+
+  /* what doesn't fit can be rewound, leaving what came before */
+  m_protobuf_begin (&writer, buffer, 20);
+  m_protobuf_open (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_BYTES));
+  m_protobuf_varint (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_VARINT), 1);
+  m_protobuf_mark (&writer, &mark);
+  m_protobuf_open (&writer, M_PROTOBUF_TAG (2, M_PROTOBUF_BYTES));
+  m_protobuf_bytes (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_BYTES),
+                    payload, 30);
+  assert (writer.overflow);
+  m_protobuf_rewind (&writer, &mark);
+  m_protobuf_close (&writer);
+  assert (m_protobuf_end (&writer, &length) == 0);
+  assert (length == 4);
+  assert (memcmp (buffer, "\x0a\x02\x08\x01", 4) == 0);
+
+  /* a length which no longer fits after growing overflows */
+  m_protobuf_begin (&writer, buffer, 130);
+  m_protobuf_open (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_BYTES));
+  m_protobuf_bytes (&writer, M_PROTOBUF_TAG (1, M_PROTOBUF_BYTES),
+                    payload, 126);
+  assert (! writer.overflow);
+  m_protobuf_close (&writer);
+  assert (m_protobuf_end (&writer, &length) == -1);
+
+  return 0;
+}
@@ -0,0 +1,122 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "m_queue.h"
+
+#define PRODUCERS 4
+#define PER_PRODUCER 100000
+
+static struct m_queue *shared = NULL;
+
+/* pushes PER_PRODUCER values tagged with the producer, spinning when full */
+static void *
+producer (void *arg)
+{
+  uintptr_t id = (uintptr_t) arg;
+  uintptr_t i;
+
+  for (i = 1; i <= PER_PRODUCER; ++i)
+    {
+      while (m_queue_push (shared, (void *) (id * PER_PRODUCER + i)) != 0)
+        {
+          sched_yield ();
+        }
+    }
+
+  return NULL;
+}
+
+int
+main (void)
+{
+  struct m_queue *queue = NULL;
+  pthread_t threads[PRODUCERS];
+  uintptr_t last[PRODUCERS];
+  uintptr_t value;
+  uintptr_t id;
+  int received = 0;
+  int i;
+
+  /* sizes are rounded up to a power of two */
+  assert (m_queue_create (0) == NULL);
+  queue = m_queue_create (3);
+  assert (queue != NULL);
+  assert (m_queue_capacity (queue) == 4);
+  assert (m_queue_depth (queue) == 0);
+  assert (m_queue_pop (queue) == NULL);
+
+  /* values come out in order, and pushes fail when full */
+  for (i = 1; i <= 4; ++i)
+    {
+      assert (m_queue_push (queue, (void *) (uintptr_t) i) == 0);
+    }
+  assert (m_queue_depth (queue) == 4);
+  assert (m_queue_push (queue, (void *) 5) == -1);
+  assert (m_queue_pop (queue) == (void *) 1);
+  assert (m_queue_push (queue, (void *) 5) == 0);
+  for (i = 2; i <= 5; ++i)
+    {
+      assert (m_queue_pop (queue) == (void *) (uintptr_t) i);
+    }
+  assert (m_queue_pop (queue) == NULL);
+
+  /* wrap around many times */
+  for (i = 1; i <= 1000; ++i)
+    {
+      assert (m_queue_push (queue, (void *) (uintptr_t) i) == 0);
+      assert (m_queue_pop (queue) == (void *) (uintptr_t) i);
+    }
+  m_queue_destroy (queue);
+
+  /* several producers and one consumer, nothing is lost or duplicated and
+     each producer's values arrive in order */
+  shared = m_queue_create (64);
+  assert (shared != NULL);
+  for (i = 0; i < PRODUCERS; ++i)
+    {
+      last[i] = 0;
+      assert (pthread_create (&threads[i], NULL, producer,
+                              (void *) (uintptr_t) i) == 0);
+    }
+  while (received < PRODUCERS * PER_PRODUCER)
+    {
+      value = (uintptr_t) m_queue_pop (shared);
+      if (value == 0)
+        {
+          sched_yield ();
+          continue;
+        }
+      id = (value - 1) / PER_PRODUCER;
+      assert (id < PRODUCERS);
+      assert (value - id * PER_PRODUCER == last[id] + 1);
+      last[id] = value - id * PER_PRODUCER;
+      ++received;
+    }
+  for (i = 0; i < PRODUCERS; ++i)
+    {
+      pthread_join (threads[i], NULL);
+      assert (last[i] == PER_PRODUCER);
+    }
+  assert (m_queue_pop (shared) == NULL);
+  m_queue_destroy (shared);
+
+  return 0;
+}
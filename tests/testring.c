@@ -0,0 +1,237 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "m_ring.h"
+
+#define PRODUCERS 4
+#define PER_PRODUCER 50000
+#define TOTAL (PRODUCERS * PER_PRODUCER)
+
+static char path[] = "/dev/shm/testringXXXXXX";
+static struct m_ring *shared = NULL;
+
+/* a record is the producer, its sequence number and up to 200 bytes of
+   filler so records are all sizes */
+static size_t
+make_record (unsigned char *record, unsigned int id, unsigned int sequence)
+{
+  size_t length = 8 + sequence % 200;
+
+  memcpy (record, &id, 4);
+  memcpy (record + 4, &sequence, 4);
+  memset (record + 8, (int) (sequence & 0xff), length - 8);
+  return length;
+}
+
+static void
+check_record (const unsigned char *record, size_t length,
+              unsigned int *id, unsigned int *sequence)
+{
+  size_t i;
+
+  assert (length >= 8);
+  memcpy (id, record, 4);
+  memcpy (sequence, record + 4, 4);
+  assert (*id < PRODUCERS);
+  assert (length == 8 + *sequence % 200);
+  for (i = 8; i < length; ++i)
+    {
+      assert (record[i] == (*sequence & 0xff));
+    }
+}
+
+static void *
+producer (void *arg)
+{
+  unsigned char record[256];
+  unsigned int id = (unsigned int) (size_t) arg;
+  unsigned int i;
+  size_t length;
+
+  for (i = 1; i <= PER_PRODUCER; ++i)
+    {
+      length = make_record (record, id, i);
+      while (m_ring_push (shared, record, length) != 0)
+        {
+          sched_yield ();
+        }
+    }
+
+  return NULL;
+}
+
+/* a reader in another process, which opens the ring itself and reads count
+   records.  Each producer's records must follow on from the last one seen,
+   from the first when first is set */
+static pid_t
+reader (int count, int first)
+{
+  struct m_ring *ring = NULL;
+  const unsigned char *bytes = NULL;
+  unsigned int last[PRODUCERS];
+  unsigned int id;
+  unsigned int sequence;
+  size_t length;
+  pid_t pid = fork ();
+  int received = 0;
+
+  assert (pid >= 0);
+  if (pid > 0)
+    {
+      return pid;
+    }
+
+  memset (last, 0, sizeof (last));
+  ring = m_ring_open (path, 0);
+  assert (ring != NULL);
+  while (received < count)
+    {
+      if (m_ring_peek (ring, &bytes, &length) == 0)
+        {
+          m_ring_wait (ring, 1000);
+          continue;
+        }
+      check_record (bytes, length, &id, &sequence);
+      assert (sequence == last[id] + 1 || (! first && last[id] == 0));
+      last[id] = sequence;
+      m_ring_release (ring);
+      ++received;
+    }
+  m_ring_close (ring);
+  _exit (0);
+}
+
+static void
+wait_for (pid_t pid)
+{
+  int status = 0;
+
+  assert (waitpid (pid, &status, 0) == pid);
+  assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+}
+
+int
+main (void)
+{
+  struct m_ring *ring = NULL;
+  const unsigned char *bytes = NULL;
+  unsigned char record[4096];
+  pthread_t threads[PRODUCERS];
+  unsigned int id;
+  unsigned int sequence;
+  unsigned int next = 1;
+  size_t length;
+  pid_t pid;
+  int fd;
+  int pushed = 0;
+  int i;
+
+  fd = mkstemp (path);
+  assert (fd >= 0);
+  close (fd);
+
+  assert (m_ring_open (NULL, 0) == NULL);
+  assert (m_ring_open ("/nonexistent/ring", 0) == NULL);
+
+  /* capacity is rounded up to a power of two, later opens keep it */
+  ring = m_ring_open (path, 5000);
+  assert (ring != NULL && ring->capacity == 8192);
+  m_ring_close (ring);
+  ring = m_ring_open (path, 65536);
+  assert (ring != NULL && ring->capacity == 8192);
+
+  assert (m_ring_peek (ring, &bytes, &length) == 0);
+  assert (m_ring_wait (ring, 1) == 0);
+  assert (m_ring_push (ring, record, 2048) == -2);
+
+  /* producers drop what doesn't fit */
+  while (m_ring_push (ring, record, make_record (record, 0, next)) == 0)
+    {
+      ++next;
+      ++pushed;
+    }
+  assert (pushed > 8 && m_ring_drops (ring) == 1);
+
+  /* a reader which goes away leaves what it didn't release for the next,
+     including a record it had only peeked at */
+  assert (m_ring_peek (ring, &bytes, &length) == 1);
+  check_record (bytes, length, &id, &sequence);
+  assert (sequence == 1);
+  m_ring_release (ring);
+  assert (m_ring_peek (ring, &bytes, &length) == 1);
+  m_ring_close (ring);
+  ring = m_ring_open (path, 0);
+  assert (ring != NULL);
+  for (i = 2; i <= pushed; ++i)
+    {
+      assert (m_ring_peek (ring, &bytes, &length) == 1);
+      check_record (bytes, length, &id, &sequence);
+      assert (sequence == (unsigned int) i);
+      m_ring_release (ring);
+    }
+  assert (m_ring_peek (ring, &bytes, &length) == 0);
+
+  /* records keep their contents as the ring wraps many times */
+  for (i = 0; i < 10000; ++i)
+    {
+      length = make_record (record, 1, next + (unsigned int) i);
+      assert (m_ring_push (ring, record, length) == 0);
+      assert (m_ring_push (ring, record, length) == 0);
+      assert (m_ring_peek (ring, &bytes, &length) == 1);
+      check_record (bytes, length, &id, &sequence);
+      assert (sequence == next + (unsigned int) i);
+      m_ring_release (ring);
+      assert (m_ring_peek (ring, &bytes, &length) == 1);
+      m_ring_release (ring);
+    }
+  assert (m_ring_drops (ring) == 1);
+  m_ring_close (ring);
+  assert (unlink (path) == 0);
+
+  /* producer threads here, readers in other processes woken through the
+     futex.  The first reader stops half way and a new one carries on */
+  strcpy (path + strlen (path) - 6, "XXXXXX");
+  fd = mkstemp (path);
+  assert (fd >= 0);
+  close (fd);
+  shared = m_ring_open (path, 65536);
+  assert (shared != NULL);
+  pid = reader (TOTAL / 2, 1);
+  for (i = 0; i < PRODUCERS; ++i)
+    {
+      assert (pthread_create (&threads[i], NULL, &producer,
+                              (void *) (size_t) i) == 0);
+    }
+  wait_for (pid);
+  pid = reader (TOTAL - TOTAL / 2, 0);
+  for (i = 0; i < PRODUCERS; ++i)
+    {
+      assert (pthread_join (threads[i], NULL) == 0);
+    }
+  wait_for (pid);
+  assert (m_ring_peek (shared, &bytes, &length) == 0);
+  m_ring_close (shared);
+  assert (unlink (path) == 0);
+
+  return 0;
+}
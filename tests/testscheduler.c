@@ -0,0 +1,97 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "m_scheduler.h"
+
+static int fast_count = 0;
+static int slow_count = 0;
+static long long aligned_at = -1;
+
+static void
+count (void *data)
+{
+  ++*(int *) data;
+}
+
+/* records the wall-clock time of the first call */
+static void
+record (void *data)
+{
+  struct timespec now;
+
+  (void) data;
+  if (aligned_at < 0)
+    {
+      clock_gettime (CLOCK_REALTIME, &now);
+      aligned_at = (long long) now.tv_sec * 1000LL + now.tv_nsec / 1000000L;
+    }
+}
+
+int
+main (void)
+{
+  struct m_scheduler *scheduler = NULL;
+  long long phase = 0;
+
+  /* unaligned timers start an interval from now */
+  assert (m_scheduler_first_deadline (1000, 60000, 0, 123) == 61000);
+
+  /* aligned timers fire on the next multiple, shifted by the offset */
+  assert (m_scheduler_first_deadline (125000, 60000, 1, 0) == 180000);
+  assert (m_scheduler_first_deadline (120000, 60000, 1, 0) == 180000);
+  assert (m_scheduler_first_deadline (125000, 60000, 1, 7000) == 127000);
+  assert (m_scheduler_first_deadline (127000, 60000, 1, 7000) == 187000);
+  assert (m_scheduler_first_deadline (5, 60000, 1, 7000) == 7000);
+
+  /* phases are stable, in range and differ between keys */
+  phase = m_scheduler_phase ("host1", 60000);
+  assert (phase >= 0 && phase < 60000);
+  assert (phase == m_scheduler_phase ("host1", 60000));
+  assert (phase != m_scheduler_phase ("host2", 60000));
+  assert (m_scheduler_phase (NULL, 60000) == 0);
+  assert (m_scheduler_phase ("host1", 0) == 0);
+
+  scheduler = m_scheduler_create ();
+  assert (scheduler != NULL);
+  assert (m_scheduler_add (scheduler, 0, 0, 0, count, &fast_count) != 0);
+  assert (m_scheduler_add (scheduler, 10, 0, 0, NULL, NULL) != 0);
+  assert (m_scheduler_add (scheduler, 10, 0, 0, count, &fast_count) == 0);
+  assert (m_scheduler_add (scheduler, 40, 0, 0, count, &slow_count) == 0);
+  assert (m_scheduler_add (scheduler, 100, 1, 37, record, NULL) == 0);
+  assert (m_scheduler_start (scheduler) == 0);
+  assert (m_scheduler_start (scheduler) != 0);
+  assert (m_scheduler_add (scheduler, 10, 0, 0, count, &fast_count) != 0);
+  usleep (250000);
+  m_scheduler_destroy (scheduler);
+
+  /* each timer fired on its own schedule, the aligned one near its
+     boundary */
+  assert (fast_count >= 5);
+  assert (slow_count >= 2 && slow_count < fast_count);
+  assert (aligned_at >= 0);
+  assert ((aligned_at - 37) % 100 < 50);
+
+  /* destroying a scheduler which never started */
+  scheduler = m_scheduler_create ();
+  assert (scheduler != NULL);
+  m_scheduler_destroy (scheduler);
+
+  return 0;
+}
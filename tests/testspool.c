@@ -0,0 +1,191 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "m_spool.h"
+
+/* how many records the large spool holds */
+#define RECORDS 10000000LL
+
+static char directory[] = "/tmp/testspoolXXXXXX";
+
+/* removes every segment of base */
+static void
+remove_segments (const char *base)
+{
+  char **paths = NULL;
+  int count = 0;
+  int i;
+
+  assert (m_spool_segments (base, &paths, &count) == 0);
+  for (i = 0; i < count; ++i)
+    {
+      assert (unlink (paths[i]) == 0);
+    }
+  m_spool_segments_free (paths, count);
+}
+
+/* reads back every record of base in order, checking each holds its own
+   index and timestamp, and returns how many there were */
+static long long
+replay (const char *base, int *segments)
+{
+  struct m_spool_reader reader;
+  const unsigned char *bytes = NULL;
+  char **paths = NULL;
+  size_t length = 0;
+  long long timestamp = 0;
+  long long value = 0;
+  long long n = 0;
+  int count = 0;
+  int ret;
+  int i;
+
+  assert (m_spool_segments (base, &paths, &count) == 0);
+  for (i = 0; i < count; ++i)
+    {
+      assert (m_spool_reader_open (&reader, paths[i]) == 0);
+      while ((ret = m_spool_reader_next (&reader, &bytes, &length,
+                                         &timestamp)) == 1)
+        {
+          assert (length == sizeof (value));
+          memcpy (&value, bytes, sizeof (value));
+          assert (value == n);
+          assert (timestamp == n * 10);
+          ++n;
+        }
+      assert (ret == 0);
+      m_spool_reader_close (&reader);
+    }
+  m_spool_segments_free (paths, count);
+  *segments = count;
+
+  return n;
+}
+
+int
+main (void)
+{
+  struct m_spool_writer *writer = NULL;
+  struct m_spool_reader reader;
+  const unsigned char *bytes = NULL;
+  char base[256];
+  char path[300];
+  char **paths = NULL;
+  unsigned char big[4096];
+  struct stat st;
+  size_t length = 0;
+  long long timestamp = 0;
+  long long i;
+  int segments = 0;
+  int count = 0;
+  FILE *file = NULL;
+
+  assert (mkdtemp (directory) != NULL);
+  snprintf (base, sizeof (base), "%s/spool", directory);
+
+  /* bad arguments */
+  assert (m_spool_writer_open (NULL, 4096, 0) == NULL);
+  assert (m_spool_writer_open (base, 16, 0) == NULL);
+  assert (m_spool_writer_open (base, 4096, -1) == NULL);
+  assert (m_spool_writer_open ("/nonexistent/spool", 4096, 0) == NULL);
+  assert (m_spool_reader_open (&reader, "/nonexistent/spool.000001") != 0);
+  assert (m_spool_segments (base, &paths, &count) == 0 && count == 0);
+
+  /* a record too big for any segment is refused, the rest fill segments
+     and move on to the next, then are truncated to what they hold */
+  writer = m_spool_writer_open (base, 4096, 0);
+  assert (writer != NULL);
+  memset (big, 'x', sizeof (big));
+  assert (m_spool_writer_append (writer, big, sizeof (big), 0) == -2);
+  for (i = 0; i < 3; ++i)
+    {
+      assert (m_spool_writer_append (writer, big, 2000, i) == 0);
+    }
+  assert (writer->segments == 2 && writer->records == 3);
+  m_spool_writer_close (writer);
+  assert (m_spool_segments (base, &paths, &count) == 0 && count == 2);
+  assert (strcmp (paths[1] + strlen (base), ".000002") == 0);
+  assert (stat (paths[0], &st) == 0);
+  assert (st.st_size == M_SPOOL_HEADER_SIZE
+                        + 2 * (M_SPOOL_RECORD_HEADER_SIZE + 2000));
+  assert (m_spool_reader_open (&reader, paths[1]) == 0);
+  assert (m_spool_reader_next (&reader, &bytes, &length, &timestamp) == 1);
+  assert (length == 2000 && timestamp == 2 && bytes[1999] == 'x');
+  assert (m_spool_reader_next (&reader, &bytes, &length, &timestamp) == 0);
+  m_spool_reader_close (&reader);
+  m_spool_segments_free (paths, count);
+
+  /* a new writer carries on after the existing segments, and moves on once
+     its segment is older than rotate_seconds */
+  writer = m_spool_writer_open (base, 4096, 2);
+  assert (writer != NULL && writer->sequence == 3);
+  assert (m_spool_writer_append (writer, big, 10, 1000000) == 0);
+  assert (m_spool_writer_append (writer, big, 10, 2999999) == 0);
+  assert (writer->segments == 1);
+  assert (m_spool_writer_append (writer, big, 10, 3000000) == 0);
+  assert (writer->segments == 2 && writer->sequence == 4);
+  m_spool_writer_close (writer);
+
+  /* a writer closed without records leaves no segment behind */
+  writer = m_spool_writer_open (base, 4096, 0);
+  assert (writer != NULL);
+  m_spool_writer_close (writer);
+  assert (m_spool_segments (base, &paths, &count) == 0 && count == 4);
+  m_spool_segments_free (paths, count);
+
+  /* corrupt segments are noticed */
+  snprintf (path, sizeof (path), "%s.000004", base);
+  file = fopen (path, "r+b");
+  assert (file != NULL);
+  assert (fseek (file, M_SPOOL_HEADER_SIZE + 4, SEEK_SET) == 0);
+  assert (fputc ('!', file) != EOF);
+  fclose (file);
+  assert (m_spool_reader_open (&reader, path) == 0);
+  assert (m_spool_reader_next (&reader, &bytes, &length, &timestamp) == -1);
+  m_spool_reader_close (&reader);
+  file = fopen (path, "r+b");
+  assert (file != NULL);
+  assert (fputc ('X', file) != EOF);
+  fclose (file);
+  assert (m_spool_reader_open (&reader, path) != 0);
+  remove_segments (base);
+
+  /* ten million records are written and replayed in order */
+  writer = m_spool_writer_open (base, 0, 0);
+  assert (writer == NULL);
+  writer = m_spool_writer_open (base, 64 * 1024 * 1024, 0);
+  assert (writer != NULL);
+  for (i = 0; i < RECORDS; ++i)
+    {
+      assert (m_spool_writer_append (writer, (const unsigned char *) &i,
+                                     sizeof (i), i * 10) == 0);
+    }
+  assert (writer->records == RECORDS);
+  m_spool_writer_close (writer);
+  assert (replay (base, &segments) == RECORDS);
+  assert (segments == 4);
+  remove_segments (base);
+
+  assert (rmdir (directory) == 0);
+
+  return 0;
+}
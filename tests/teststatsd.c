@@ -0,0 +1,95 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "m_statsd.h"
+
+/* formats value by hand and checks it against printf */
+static void
+check_integer (long long value)
+{
+  char out[M_STATSD_INTEGER_MAX + 1];
+  char expected[32];
+  size_t length;
+
+  length = m_statsd_format_integer (out, value);
+  out[length] = '\0';
+  snprintf (expected, sizeof (expected), "%lld", value);
+  assert (strcmp (out, expected) == 0);
+}
+
+int
+main (void)
+{
+  struct m_statsd_writer writer;
+  char buffer[256];
+  size_t length = 0;
+  long long value;
+  int i;
+
+  check_integer (0);
+  check_integer (7);
+  check_integer (-7);
+  check_integer (10);
+  check_integer (1234567890123LL);
+  check_integer (LLONG_MAX);
+  check_integer (LLONG_MIN);
+  for (value = 1, i = 0; i < 18; ++i, value *= 10)
+    {
+      check_integer (value - 1);
+      check_integer (value);
+      check_integer (-value);
+    }
+
+  /* a line with tags, reserved characters replaced */
+  m_statsd_begin (&writer, buffer, sizeof (buffer));
+  m_statsd_name (&writer, "requests:total|x@y", M_STATSD_NAME_RESERVED);
+  m_statsd_bytes (&writer, ":", 1);
+  m_statsd_integer (&writer, -42);
+  m_statsd_bytes (&writer, "|g|#", 4);
+  m_statsd_name (&writer, "host", M_STATSD_TAG_RESERVED);
+  m_statsd_bytes (&writer, ":", 1);
+  m_statsd_name (&writer, "a,b|c", M_STATSD_TAG_RESERVED);
+  assert (m_statsd_end (&writer, &length) == 0);
+  assert (length == strlen ("requests_total_x_y:-42|g|#host:a_b_c"));
+  assert (memcmp (buffer, "requests_total_x_y:-42|g|#host:a_b_c",
+                  length) == 0);
+
+  /* an integer fits exactly at the end of the buffer */
+  m_statsd_begin (&writer, buffer, 6);
+  m_statsd_bytes (&writer, "k:", 2);
+  m_statsd_integer (&writer, 1234);
+  assert (m_statsd_end (&writer, &length) == 0);
+  assert (length == 6 && memcmp (buffer, "k:1234", 6) == 0);
+
+  /* anything which doesn't fit fails the whole datagram */
+  m_statsd_begin (&writer, buffer, 6);
+  m_statsd_bytes (&writer, "k:", 2);
+  m_statsd_integer (&writer, 12345);
+  m_statsd_bytes (&writer, "", 0);
+  assert (writer.overflow);
+  assert (m_statsd_end (&writer, &length) == -1);
+
+  m_statsd_begin (&writer, buffer, 4);
+  m_statsd_name (&writer, "longer", M_STATSD_NAME_RESERVED);
+  m_statsd_bytes (&writer, "k", 1);
+  assert (m_statsd_end (&writer, &length) == -1);
+
+  return 0;
+}
@@ -0,0 +1,331 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "m_stream.h"
+
+static char directory[] = "/tmp/teststreamXXXXXX";
+static char path[256];
+static char address[300];
+
+/* listens on the unix socket at path */
+static int
+listen_unix (void)
+{
+  struct sockaddr_un un;
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  assert (fd >= 0);
+  memset (&un, 0, sizeof (un));
+  un.sun_family = AF_UNIX;
+  strcpy (un.sun_path, path);
+  unlink (path);
+  assert (bind (fd, (struct sockaddr *) &un, sizeof (un)) == 0);
+  assert (listen (fd, 4) == 0);
+  return fd;
+}
+
+static void
+read_exactly (int fd, void *buffer, size_t length)
+{
+  ssize_t n;
+
+  while (length > 0)
+    {
+      n = read (fd, buffer, length);
+      assert (n > 0);
+      buffer = (char *) buffer + n;
+      length -= (size_t) n;
+    }
+}
+
+/* reads count frames, checking they hold first, first + 1, ... */
+static void
+read_frames (int fd, int first, int count)
+{
+  unsigned char header[4];
+  int value;
+  int i;
+
+  for (i = 0; i < count; ++i)
+    {
+      read_exactly (fd, header, sizeof (header));
+      assert (header[0] == 0 && header[1] == 0 && header[2] == 0
+              && header[3] == sizeof (value));
+      read_exactly (fd, &value, sizeof (value));
+      assert (value == first + i);
+    }
+}
+
+/* queues frames holding first, first + 1, ... one call each */
+static int
+send_frames (struct m_stream *stream, int first, int count)
+{
+  struct iovec iov;
+  int dropped = 0;
+  int value;
+  int i;
+
+  for (i = 0; i < count; ++i)
+    {
+      value = first + i;
+      iov.iov_base = &value;
+      iov.iov_len = sizeof (value);
+      dropped += m_stream_send (stream, &iov, 1, NULL);
+    }
+  return dropped;
+}
+
+/* waits up to 5 seconds for the stream to have sent count frames */
+static void
+wait_sent (struct m_stream *stream, long long count)
+{
+  struct m_stream_stats stats;
+  int i;
+
+  for (i = 0; i < 5000; ++i)
+    {
+      m_stream_get_stats (stream, &stats);
+      if (stats.sent_frames >= count)
+        {
+          assert (stats.sent_frames == count);
+          return;
+        }
+      usleep (1000);
+    }
+  assert (0);
+}
+
+struct drain
+{
+  int listener;
+  int count;
+};
+
+/* accepts a connection and reads a run of frames slowly */
+static void *
+drain_thread (void *arg)
+{
+  struct drain *drain = (struct drain *) arg;
+  int fd = accept (drain->listener, NULL, NULL);
+  int i;
+
+  assert (fd >= 0);
+  for (i = 0; i < drain->count; i += 10)
+    {
+      read_frames (fd, i, 10);
+      usleep (100);
+    }
+  close (fd);
+  return NULL;
+}
+
+int
+main (void)
+{
+  struct m_stream *stream = NULL;
+  struct m_stream_stats stats;
+  struct sockaddr_in in;
+  struct iovec iov[100];
+  struct drain drain;
+  struct timespec start;
+  struct timespec end;
+  pthread_t thread;
+  socklen_t length = sizeof (in);
+  size_t queued = 0;
+  int values[100];
+  static char big[65536];
+  int listener;
+  int fd;
+  int i;
+
+  assert (mkdtemp (directory) != NULL);
+  sprintf (path, "%s/sock", directory);
+  sprintf (address, "unix:%s", path);
+
+  /* bad arguments */
+  assert (m_stream_create ("udp:127.0.0.1:80", 1024, 0, 1, 1) == NULL);
+  assert (m_stream_create ("unix:", 1024, 0, 1, 1) == NULL);
+  assert (m_stream_create ("tcp:127.0.0.1", 1024, 0, 1, 1) == NULL);
+  assert (m_stream_create ("tcp::80", 1024, 0, 1, 1) == NULL);
+  assert (m_stream_create (address, 0, 0, 1, 1) == NULL);
+  assert (m_stream_create (address, 1024, 3, 1, 1) == NULL);
+  assert (m_stream_create (address, 1024, 0, 0, 1) == NULL);
+  assert (m_stream_create (address, 1024, 0, 10, 5) == NULL);
+
+  /* frames queued before anything is listening are kept, then written in
+     batches once it connects */
+  stream = m_stream_create (address, 65536, M_STREAM_DROP_NEWEST, 5, 20);
+  assert (stream != NULL);
+  for (i = 0; i < 100; ++i)
+    {
+      values[i] = i;
+      iov[i].iov_base = &values[i];
+      iov[i].iov_len = sizeof (values[i]);
+    }
+  assert (m_stream_send (stream, iov, 100, &queued) == 0);
+  assert (queued == 100 * sizeof (values[0]));
+  usleep (50000);
+  m_stream_get_stats (stream, &stats);
+  assert (stats.connected == 0);
+  assert (stats.depth == 100);
+  assert (stats.depth_bytes == 800);
+  assert (stats.queued_frames == 100);
+
+  listener = listen_unix ();
+  fd = accept (listener, NULL, NULL);
+  assert (fd >= 0);
+  read_frames (fd, 0, 100);
+  wait_sent (stream, 100);
+  m_stream_get_stats (stream, &stats);
+  assert (stats.connected == 1);
+  assert (stats.connects == 1);
+  assert (stats.depth == 0);
+  assert (stats.sent_bytes == 800);
+  assert (stats.writes < 100);
+
+  /* when the other end goes away the stream reconnects and carries on */
+  close (fd);
+  assert (send_frames (stream, 100, 10) == 0);
+  fd = accept (listener, NULL, NULL);
+  assert (fd >= 0);
+  read_frames (fd, 100, 10);
+  wait_sent (stream, 110);
+  m_stream_get_stats (stream, &stats);
+  assert (stats.connects == 2);
+
+  /* destroying writes what's queued */
+  assert (send_frames (stream, 110, 50) == 0);
+  m_stream_destroy (stream);
+  read_frames (fd, 110, 50);
+  close (fd);
+  close (listener);
+  unlink (path);
+
+  /* with nothing listening only limit bytes are kept, the newest or the
+     oldest frames are dropped */
+  stream = m_stream_create (address, 100, M_STREAM_DROP_NEWEST, 5, 20);
+  assert (stream != NULL);
+  assert (send_frames (stream, 0, 20) == 8);
+  iov[0].iov_len = 100;
+  assert (m_stream_send (stream, iov, 1, &queued) == 1);
+  assert (queued == 0);
+  m_stream_get_stats (stream, &stats);
+  assert (stats.depth == 12);
+  assert (stats.dropped_newest == 9);
+  assert (stats.dropped_oldest == 0);
+  listener = listen_unix ();
+  fd = accept (listener, NULL, NULL);
+  assert (fd >= 0);
+  read_frames (fd, 0, 12);
+  m_stream_destroy (stream);
+  close (fd);
+  close (listener);
+  unlink (path);
+
+  stream = m_stream_create (address, 100, M_STREAM_DROP_OLDEST, 5, 20);
+  assert (stream != NULL);
+  assert (send_frames (stream, 0, 20) == 0);
+  m_stream_get_stats (stream, &stats);
+  assert (stats.depth == 12);
+  assert (stats.dropped_newest == 0);
+  assert (stats.dropped_oldest == 8);
+  listener = listen_unix ();
+  fd = accept (listener, NULL, NULL);
+  assert (fd >= 0);
+  read_frames (fd, 8, 12);
+  m_stream_destroy (stream);
+  close (fd);
+
+  /* blocking waits for a slow reader rather than dropping */
+  stream = m_stream_create (address, 100, M_STREAM_BLOCK, 5, 20);
+  assert (stream != NULL);
+  drain.listener = listener;
+  drain.count = 2000;
+  assert (pthread_create (&thread, NULL, &drain_thread, &drain) == 0);
+  assert (send_frames (stream, 0, 2000) == 0);
+  assert (pthread_join (thread, NULL) == 0);
+  m_stream_get_stats (stream, &stats);
+  assert (stats.sent_frames == 2000);
+  assert (stats.dropped_newest == 0 && stats.dropped_oldest == 0);
+  m_stream_destroy (stream);
+
+  /* destroying doesn't wait on a peer which stopped reading for longer
+     than M_STREAM_STOP_MS */
+  stream = m_stream_create (address, 4 << 20, M_STREAM_DROP_NEWEST, 5, 20);
+  assert (stream != NULL);
+  memset (big, 0, sizeof (big));
+  iov[0].iov_base = big;
+  iov[0].iov_len = sizeof (big);
+  for (i = 0; i < 32; ++i)
+    {
+      assert (m_stream_send (stream, iov, 1, NULL) == 0);
+    }
+  for (i = 0; i < 5000; ++i)
+    {
+      m_stream_get_stats (stream, &stats);
+      if (stats.writes > 0)
+        {
+          break;
+        }
+      usleep (1000);
+    }
+  assert (stats.connected);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  m_stream_destroy (stream);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  assert ((end.tv_sec - start.tv_sec) * 1000
+          + (end.tv_nsec - start.tv_nsec) / 1000000
+          < M_STREAM_STOP_MS + 1000);
+  close (listener);
+  unlink (path);
+
+  /* tcp on loopback */
+  listener = socket (AF_INET, SOCK_STREAM, 0);
+  assert (listener >= 0);
+  memset (&in, 0, sizeof (in));
+  in.sin_family = AF_INET;
+  in.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  assert (bind (listener, (struct sockaddr *) &in, sizeof (in)) == 0);
+  assert (listen (listener, 4) == 0);
+  assert (getsockname (listener, (struct sockaddr *) &in, &length) == 0);
+  sprintf (address, "tcp:127.0.0.1:%d", ntohs (in.sin_port));
+  stream = m_stream_create (address, 65536, M_STREAM_DROP_OLDEST, 5, 20);
+  assert (stream != NULL);
+  assert (send_frames (stream, 0, 1000) == 0);
+  fd = accept (listener, NULL, NULL);
+  assert (fd >= 0);
+  read_frames (fd, 0, 1000);
+  wait_sent (stream, 1000);
+  m_stream_destroy (stream);
+  close (fd);
+  close (listener);
+
+  assert (rmdir (directory) == 0);
+
+  return 0;
+}